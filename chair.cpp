@@ -1,64 +1,394 @@
-void legs() {
-    for (int x = -1; x <= 1; x += 2) {
-        for (int z = -1; z <= 1; z += 2) {
-            glPushMatrix();
-            glTranslatef(x * 0.6f, 0.7f, z * 0.6f);
-            glColor3f(0.5f, 0.5f, 0.5f);
-            glScalef(0.1f, 1.2f, 0.1f);
-            glutSolidCube(1.0f);
-            glPopMatrix();
-        }
-    }
+// GLEW has to come before GLUT; the retained path needs GL 3.3 entry points
+#include <GL/glew.h>
+#include <GL/glut.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "scene_graph.h"
+
+// Showroom: chairs in a square grid, drawn either immediate-mode or from a retained VBO/VAO
+int chairCount = 1;
+bool useRetained = true;
+const float CHAIR_SPACING = 3.0f;
+
+// One glutSolidCube(1.0f) of the chair, as translate + scale
+struct ChairPart {
+    float center[3];
+    float size[3];
+    float color[3];
+};
+
+const ChairPart CHAIR_PARTS[] = {
+    { {  0.6f, 0.7f,  0.6f }, { 0.1f, 1.2f, 0.1f }, { 0.5f, 0.5f, 0.5f } }, // legs
+    { {  0.6f, 0.7f, -0.6f }, { 0.1f, 1.2f, 0.1f }, { 0.5f, 0.5f, 0.5f } },
+    { { -0.6f, 0.7f,  0.6f }, { 0.1f, 1.2f, 0.1f }, { 0.5f, 0.5f, 0.5f } },
+    { { -0.6f, 0.7f, -0.6f }, { 0.1f, 1.2f, 0.1f }, { 0.5f, 0.5f, 0.5f } },
+    { {  0.0f, 1.4f,  0.0f }, { 1.5f, 0.2f, 1.5f }, { 0.5f, 0.5f, 0.5f } }, // seat
+    { {  0.0f, 3.0f, -0.6f }, { 1.2f, 0.8f, 0.2f }, { 0.5f, 0.5f, 0.5f } }, // backrest
+    { {  0.5f, 2.1f, -0.6f }, { 0.1f, 1.5f, 0.1f }, { 0.5f, 0.5f, 0.5f } }, // backrest legs
+    { { -0.5f, 2.1f, -0.6f }, { 0.1f, 1.5f, 0.1f }, { 0.5f, 0.5f, 0.5f } },
+};
+const int CHAIR_PART_COUNT = sizeof(CHAIR_PARTS) / sizeof(CHAIR_PARTS[0]);
+
+int gridSide() {
+    return (int)std::ceil(std::sqrt((double)chairCount));
 }
 
-void display() {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    camera();
-    //axes();
+// Chairs fill the grid row by row around the origin
+void chairOffset(int index, float& x, float& z) {
+    int side = gridSide();
+    x = (index % side - (side - 1) * 0.5f) * CHAIR_SPACING;
+    z = (index / side - (side - 1) * 0.5f) * CHAIR_SPACING;
+}
 
-    legs();
+// The original base plate is 18 x 18; it grows to stay under the whole grid
+float baseScale() {
+    return std::fmax(1.0f, gridSide() * CHAIR_SPACING / 18.0f);
+}
 
-    //base
-    glPushMatrix();
-    glTranslatef(0.0f, 0.0f, 0.0f);
-    glColor3f(0.8f, 0.8f, 0.8f);
-    glScalef(12.0f, 0.05f, 12.0f);
-    glutSolidCube(1.5f);
-    glPopMatrix();
+glm::mat4 partMatrix(const ChairPart& part) {
+    glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(part.center[0], part.center[1], part.center[2]));
+    return glm::scale(model, glm::vec3(part.size[0], part.size[1], part.size[2]));
+}
 
-    //seat
-    glPushMatrix();
-    glTranslatef(0.0f, 1.4f, 0.0f);
-    glColor3f(0.5f, 0.5f, 0.5f);
-    glScalef(1.5f, 0.2f, 1.5f);
-    glutSolidCube(1.0f);
-    glPopMatrix();
+// Showroom graph: the base plate, then each chair followed by its parts. Nothing in it moves,
+// so after the first update every frame finds it clean and recomputes no matrices.
+SceneGraph showroom;
+SceneGraph::Node baseNode;
+std::vector<SceneGraph::Node> chairNodes; // parts of chair c are chairNodes[c] + 1 onwards
+int showroomChairs = 0;
 
-    // Backrest
-    glPushMatrix();
-    glTranslatef(0.0f, 3.0f, -0.6f);
-    glColor3f(0.5f, 0.5f, 0.5f);
-    glScalef(1.2f, 0.8f, 0.2f);
-    glutSolidCube(1.0f);
-    glPopMatrix();
+void buildShowroom() {
+    showroom.clear();
+    chairNodes.clear();
+    showroom.reserve(1 + chairCount * (1 + CHAIR_PART_COUNT));
+    float scale = baseScale();
+    baseNode = showroom.add(glm::scale(glm::mat4(1.0f), glm::vec3(18.0f * scale, 0.075f, 18.0f * scale)));
+    for (int i = 0; i < chairCount; i++) {
+        float x, z;
+        chairOffset(i, x, z);
+        SceneGraph::Node chair = showroom.add(glm::translate(glm::mat4(1.0f), glm::vec3(x, 0.0f, z)));
+        chairNodes.push_back(chair);
+        for (int part = 0; part < CHAIR_PART_COUNT; part++)
+            showroom.add(partMatrix(CHAIR_PARTS[part]), chair);
+    }
+    showroomChairs = chairCount;
+}
 
-    //BackrestLegs1
-    glPushMatrix();
-    glTranslatef(0.5f,2.1f, -0.6f);
-    glColor3f(0.5f, 0.5f, 0.5f);
-    glScalef(0.1f, 1.5f, 0.1f);
-    glutSolidCube(1.0f);
-    glPopMatrix();
+void updateShowroom() {
+    if (showroomChairs != chairCount)
+        buildShowroom();
+    showroom.update();
+}
 
-    //BackrestLegs2
+void solidCube(SceneGraph::Node node) {
     glPushMatrix();
-    glTranslatef(-0.5f, 2.1f, -0.6f);
-    glColor3f(0.5f, 0.5f, 0.5f);
-    glScalef(0.1f, 1.5f, 0.1f);
+    glMultMatrixf(glm::value_ptr(showroom.world(node)));
     glutSolidCube(1.0f);
     glPopMatrix();
+}
+
+// Immediate mode: nine glutSolidCube calls per chair, every frame, at cached world matrices
+void displayImmediate() {
+    //base
+    glColor3f(0.8f, 0.8f, 0.8f);
+    solidCube(baseNode);
+
+    for (int i = 0; i < chairCount; i++) {
+        for (int part = 0; part < CHAIR_PART_COUNT; part++) {
+            const float* color = CHAIR_PARTS[part].color;
+            glColor3f(color[0], color[1], color[2]);
+            solidCube(chairNodes[i] + 1 + part);
+        }
+    }
+}
+
+// Retained mode: the chair is baked once into a VBO and drawn with one instanced call.
+// Only core-profile calls and a GLSL 330 core program are used on this path.
+const char* chairVertexShader = R"(
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aColor;
+layout (location = 2) in vec2 aOffset; // per chair; the base has no instance data and gets 0
 
+uniform mat4 viewProjection;
+
+out vec3 color;
+
+void main() {
+    color = aColor;
+    gl_Position = viewProjection * vec4(aPos + vec3(aOffset.x, 0.0, aOffset.y), 1.0);
+}
+)";
+
+const char* chairFragmentShader = R"(
+#version 330 core
+in vec3 color;
+out vec4 FragColor;
+
+void main() {
+    FragColor = vec4(color, 1.0);
+}
+)";
+
+struct ChairVertex {
+    float position[3];
+    float color[3];
+};
+
+struct RetainedChairs {
+    GLuint program;
+    GLint viewProjectionLoc;
+    GLuint chairVAO, baseVAO;
+    GLuint vertexBuffer, indexBuffer, offsetBuffer;
+    GLsizei chairIndices, baseIndices;
+    int uploadedChairs;   // chairs in offsetBuffer
+    float uploadedBase;   // base scale baked into the vertices
+};
+RetainedChairs retained;
+bool retainedReady = false;
+
+// A unit cube under transform: eight corners and twelve triangles. Colours are flat, so
+// corners can be shared.
+void appendBox(const glm::mat4& transform, const float color[3],
+               std::vector<ChairVertex>& vertices, std::vector<GLuint>& indices) {
+    static const GLuint boxIndices[] = {
+        0, 1, 3, 0, 3, 2,  4, 6, 7, 4, 7, 5,  0, 4, 5, 0, 5, 1,
+        2, 3, 7, 2, 7, 6,  0, 2, 6, 0, 6, 4,  1, 5, 7, 1, 7, 3,
+    };
+    GLuint first = (GLuint)vertices.size();
+    for (int corner = 0; corner < 8; corner++) {
+        glm::vec4 position = transform * glm::vec4(corner & 4 ? 0.5f : -0.5f, corner & 2 ? 0.5f : -0.5f,
+                                                   corner & 1 ? 0.5f : -0.5f, 1.0f);
+        ChairVertex vertex;
+        for (int axis = 0; axis < 3; axis++) {
+            vertex.position[axis] = position[axis];
+            vertex.color[axis] = color[axis];
+        }
+        vertices.push_back(vertex);
+    }
+    for (GLuint index : boxIndices)
+        indices.push_back(first + index);
+}
 
+// Whole info logs; their length is queried, so nothing is cut off
+std::string shaderInfoLog(GLuint shader) {
+    GLint length = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+    std::string log(std::max(length, 1), '\0');
+    glGetShaderInfoLog(shader, (GLsizei)log.size(), NULL, &log[0]);
+    log.resize(strlen(log.c_str()));
+    return log;
+}
+
+std::string programInfoLog(GLuint program) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+    std::string log(std::max(length, 1), '\0');
+    glGetProgramInfoLog(program, (GLsizei)log.size(), NULL, &log[0]);
+    log.resize(strlen(log.c_str()));
+    return log;
+}
+
+GLuint compileChairShader(const char* source, GLenum type) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint success;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (!success)
+        printf("Chair shader compilation failed:\n%s\n", shaderInfoLog(shader).c_str());
+    return shader;
+}
+
+// Chair parts (relative to their chair) first, then the base plate; rebuilt only when the
+// grid outgrows the base
+void bakeChairMesh() {
+    std::vector<ChairVertex> vertices;
+    std::vector<GLuint> indices;
+    for (int part = 0; part < CHAIR_PART_COUNT; part++)
+        appendBox(showroom.local(chairNodes[0] + 1 + part), CHAIR_PARTS[part].color, vertices, indices);
+    retained.chairIndices = (GLsizei)indices.size();
+
+    const float baseColor[3] = { 0.8f, 0.8f, 0.8f };
+    appendBox(showroom.world(baseNode), baseColor, vertices, indices);
+    retained.baseIndices = (GLsizei)indices.size() - retained.chairIndices;
+    retained.uploadedBase = baseScale();
+
+    glBindBuffer(GL_ARRAY_BUFFER, retained.vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(ChairVertex), vertices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, retained.indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+}
+
+// Chair positions straight from their world matrices
+void uploadChairOffsets() {
+    std::vector<float> offsets(chairCount * 2);
+    for (int i = 0; i < chairCount; i++) {
+        const glm::mat4& world = showroom.world(chairNodes[i]);
+        offsets[i * 2] = world[3][0];
+        offsets[i * 2 + 1] = world[3][2];
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, retained.offsetBuffer);
+    glBufferData(GL_ARRAY_BUFFER, offsets.size() * sizeof(float), offsets.data(), GL_STATIC_DRAW);
+    retained.uploadedChairs = chairCount;
+}
+
+bool initRetained() {
+    if (glewInit() != GLEW_OK || !GLEW_VERSION_3_3) {
+        printf("OpenGL 3.3 is not available; only the immediate-mode path can run\n");
+        return false;
+    }
+
+    retained.program = glCreateProgram();
+    GLuint vertexShader = compileChairShader(chairVertexShader, GL_VERTEX_SHADER);
+    GLuint fragmentShader = compileChairShader(chairFragmentShader, GL_FRAGMENT_SHADER);
+    glAttachShader(retained.program, vertexShader);
+    glAttachShader(retained.program, fragmentShader);
+    glLinkProgram(retained.program);
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+
+    // A program that failed to link draws nothing; fall back to immediate mode instead
+    GLint linked;
+    glGetProgramiv(retained.program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        printf("Chair program link failed; only the immediate-mode path can run:\n%s\n",
+               programInfoLog(retained.program).c_str());
+        glDeleteProgram(retained.program);
+        retained.program = 0;
+        return false;
+    }
+    retained.viewProjectionLoc = glGetUniformLocation(retained.program, "viewProjection");
+
+    glGenBuffers(1, &retained.vertexBuffer);
+    glGenBuffers(1, &retained.indexBuffer);
+    glGenBuffers(1, &retained.offsetBuffer);
+    glGenVertexArrays(1, &retained.chairVAO);
+    glGenVertexArrays(1, &retained.baseVAO);
+    updateShowroom();
+    bakeChairMesh();
+    uploadChairOffsets();
+
+    // Both VAOs share the baked mesh; only the chair VAO has per-instance offsets
+    GLuint vaos[] = { retained.chairVAO, retained.baseVAO };
+    for (GLuint vao : vaos) {
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, retained.vertexBuffer);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(ChairVertex), (void*)offsetof(ChairVertex, position));
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(ChairVertex), (void*)offsetof(ChairVertex, color));
+        glEnableVertexAttribArray(1);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, retained.indexBuffer);
+    }
+    glBindVertexArray(retained.chairVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, retained.offsetBuffer);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(2);
+    glVertexAttribDivisor(2, 1);
+    glBindVertexArray(0);
+    glVertexAttrib2f(2, 0.0f, 0.0f);
+    return true;
+}
+
+void displayRetained() {
+    if (retained.uploadedChairs != chairCount)
+        uploadChairOffsets();
+    if (retained.uploadedBase != baseScale())
+        bakeChairMesh();
+
+    // camera() and reshape() still own the view; their matrices are read back once per frame
+    glm::mat4 view, projection;
+    glGetFloatv(GL_MODELVIEW_MATRIX, glm::value_ptr(view));
+    glGetFloatv(GL_PROJECTION_MATRIX, glm::value_ptr(projection));
+    glm::mat4 viewProjection = projection * view;
+
+    glUseProgram(retained.program);
+    glUniformMatrix4fv(retained.viewProjectionLoc, 1, GL_FALSE, glm::value_ptr(viewProjection));
+
+    glBindVertexArray(retained.baseVAO);
+    glDrawElements(GL_TRIANGLES, retained.baseIndices, GL_UNSIGNED_INT,
+                   (void*)(retained.chairIndices * sizeof(GLuint)));
+    glBindVertexArray(retained.chairVAO);
+    glDrawElementsInstanced(GL_TRIANGLES, retained.chairIndices, GL_UNSIGNED_INT, (void*)0, chairCount);
+    glBindVertexArray(0);
+    glUseProgram(0);
+}
+
+// Frame-time counter: CPU time from the start of display() until the GPU has finished the
+// frame (glFinish, so swap-interval waits are not counted), averaged over one second
+double frameMsTotal = 0.0;
+int framesTimed = 0;
+auto frameWindowStart = std::chrono::steady_clock::now();
+
+// --sweep: time both paths at growing chair counts, print a table and exit
+const int SWEEP_COUNTS[] = { 1, 16, 256, 1024, 4096, 16384, 65536 };
+const int SWEEP_STEPS = sizeof(SWEEP_COUNTS) / sizeof(SWEEP_COUNTS[0]);
+const int SWEEP_WARMUP = 10, SWEEP_FRAMES = 60;
+bool sweeping = false;
+int sweepStep = 0, sweepFrame = 0;
+double sweepMs[2];
+
+void reportFrameTime(double frameMs) {
+    if (sweeping) {
+        if (sweepFrame++ >= SWEEP_WARMUP)
+            sweepMs[useRetained] += frameMs;
+        if (sweepFrame < SWEEP_WARMUP + SWEEP_FRAMES)
+            return;
+        sweepFrame = 0;
+        if (!useRetained && retainedReady) {
+            useRetained = true;
+            return;
+        }
+        printf("%8d chairs  immediate %9.3f ms  retained %9.3f ms\n", chairCount, sweepMs[0] / SWEEP_FRAMES,
+               retainedReady ? sweepMs[1] / SWEEP_FRAMES : 0.0);
+        if (++sweepStep == SWEEP_STEPS)
+            exit(0);
+        chairCount = SWEEP_COUNTS[sweepStep];
+        useRetained = false;
+        sweepMs[0] = sweepMs[1] = 0.0;
+        return;
+    }
+
+    frameMsTotal += frameMs;
+    framesTimed++;
+    auto now = std::chrono::steady_clock::now();
+    if (now - frameWindowStart < std::chrono::seconds(1))
+        return;
+    char title[128];
+    snprintf(title, sizeof(title), "%s: %d chairs, %.3f ms/frame", useRetained ? "Retained" : "Immediate",
+             chairCount, frameMsTotal / framesTimed);
+    printf("%s\n", title);
+    glutSetWindowTitle(title);
+    frameMsTotal = 0.0;
+    framesTimed = 0;
+    frameWindowStart = now;
+}
+
+void display() {
+    auto start = std::chrono::steady_clock::now();
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    camera();
+    //axes();
+
+    updateShowroom();
+    if (useRetained && retainedReady)
+        displayRetained();
+    else
+        displayImmediate();
+
+    glFinish();
+    reportFrameTime(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
     glutSwapBuffers();
 }
 
@@ -76,20 +406,58 @@ void reshape(int width, int height) {
 void init() {
     glClearColor(0.0, 0.0, 0.0, 0.0);
     glEnable(GL_DEPTH_TEST);
+    retainedReady = initRetained();
+    if (!retainedReady)
+        useRetained = false;
+}
+
+// Redraw continuously so the frame-time counter keeps running
+void idle() {
+    glutPostRedisplay();
 }
 
+// M switches immediate/retained, ] and [ double and halve the chair count; the rest goes to keyboard()
+void showroomKeyboard(unsigned char key, int x, int y) {
+    if (key == 'm' || key == 'M') {
+        useRetained = !useRetained && retainedReady;
+        printf("Rendering: %s\n", useRetained ? "retained" : "immediate");
+    } else if (key == ']') {
+        chairCount = chairCount < 65536 ? chairCount * 2 : chairCount;
+    } else if (key == '[') {
+        chairCount = chairCount > 1 ? chairCount / 2 : 1;
+    } else {
+        keyboard(key, x, y);
+    }
+}
+
+// Usage: chair [--immediate] [--chairs N] [--sweep]
 int main(int argc, char** argv) {
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_DEPTH | GLUT_RGBA);
 
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--immediate") == 0)
+            useRetained = false;
+        else if (strcmp(argv[i], "--chairs") == 0 && i + 1 < argc)
+            chairCount = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--sweep") == 0)
+            sweeping = true;
+    }
+    if (sweeping) {
+        chairCount = SWEEP_COUNTS[0];
+        useRetained = false;
+        printf("Frame time (ms, CPU submit until glFinish), %d frames each:\n", SWEEP_FRAMES);
+    }
+
     glutInitWindowPosition(win_posx, win_posy);
     glutInitWindowSize(win_width, win_height);
     glutCreateWindow("3D Graphics Starter");
 
     glutDisplayFunc(display);
     glutReshapeFunc(reshape);
-    glutKeyboardFunc(keyboard);
+    glutKeyboardFunc(showroomKeyboard);
     glutSpecialFunc(keyboardSpecial);
+    glutIdleFunc(idle);
     init();
     glutMainLoop();
     return 0;
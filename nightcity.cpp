@@ -3,10 +3,56 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include "scene_graph.h"
 #include <iostream>
 #include <vector>
 #include <cmath>
 #include <random>
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <unordered_map>
+#include <utility>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <atomic>
+#include <map>
+#include <cerrno>
+#include <cstdio>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+// Headless benchmark mode creates its context through EGL (e.g. Mesa llvmpipe); link with -lEGL
+#if defined(__linux__) && !defined(NIGHTCITY_NO_EGL)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define NIGHTCITY_EGL 1
+#endif
+
+// Scene files are memory-mapped where POSIX mmap exists and read into memory elsewhere
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define NIGHTCITY_MMAP 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define NIGHTCITY_SSE 1
+#endif
 
 // Window dimensions
 const GLuint WIDTH = 1200, HEIGHT = 800;
@@ -18,6 +64,88 @@ glm::vec3 cameraUp = glm::vec3(0.0f, 1.0f, 0.0f);
 float yaw = -90.0f, pitch = 0.0f;
 float cameraSpeed = 10.0f;
 
+// Rendering mode (toggle with I): one instanced draw per category, or one draw per object
+bool useInstancing = true;
+// Frustum culling against the spatial index (toggle with C)
+bool useCulling = true;
+// Packed normals (2_10_10_10) and half-float UVs instead of plain floats (--float-vertices to disable)
+bool useCompactVertices = true;
+// Animate vehicles and billboards in the vertex shader from a time uniform (toggle with G)
+bool useGpuAnimation = false;
+// Vehicles fly lane-following traffic instead of orbits (--traffic); it runs on the CPU every
+// frame, so GPU animation and the simulation thread do not apply to them
+bool useTraffic = false;
+// Draw buildings from per-tile pre-transformed vertex buffers, one call per tile (toggle with B)
+bool useStaticBatches = false;
+// Linked program binaries are kept here between runs; empty disables it (--shader-cache DIR, --no-shader-cache)
+std::string shaderCacheDirectory = "shader_cache";
+// Map the streaming ring persistently when GL 4.4 / ARB_buffer_storage allows (--no-persistent to orphan instead)
+bool usePersistentMapping = true;
+// Level of detail for buildings by projected size (toggle with L, --no-lod to disable)
+bool useLod = true;
+// Vehicles and billboards light their surroundings through clustered forward shading (toggle with K, --clustered)
+bool useClusteredLighting = false;
+// Hide objects behind large nearby buildings with a CPU depth buffer (toggle with O, --occlusion)
+bool useOcclusion = false;
+// Record, sort and submit draws through the render queue (toggle with Q, --no-render-queue)
+bool useRenderQueue = true;
+// Moonlight shadows from cached per-tile maps plus the moving objects (toggle with H, --no-shadows);
+// --shadow-rebuild redraws every cached map each frame, to measure what the cache saves
+bool useShadows = true;
+bool rebuildShadows = false;
+// Render the window offscreen at a scale that holds the GPU frame time to a budget (toggle with R,
+// --fixed-resolution to disable, --budget MS)
+bool useDynamicResolution = true;
+float frameBudgetMs = 16.6f;
+// Far clip distance; tiles are streamed in out to it (--far DIST)
+float farPlane = 200.0f;
+
+// Procedural generation settings (see parseArguments)
+struct CityConfig {
+    uint64_t seed = 1337;
+    float tileSize = 100.0f;
+    float buildingDensity = 0.005f; // buildings per square unit
+    int loadRadius = 3;             // tiles kept around the camera
+    int evictRadius = 4;            // tiles further than this are dropped
+    int vehicleCount = 8;
+    int billboardCount = 15;
+    int threads = 0;                // 0 = one per core, minus the render thread
+    int tickRate = 60;              // simulation thread rate in the window; 0 = update once per frame
+};
+CityConfig cityConfig;
+
+// Headless benchmark settings (--benchmark)
+struct BenchmarkConfig {
+    bool enabled = false;
+    int frames = 600;
+    int warmup = 30; // rendered but left out of the statistics (shader and driver warm-up)
+    int simulationObjects = 0; // --sim-benchmark: vehicle count for the update kernel benchmark
+    int trafficVehicles = 0;   // --traffic-benchmark: vehicle count for the traffic simulator benchmark
+    bool shaders = false;      // --shader-benchmark: cold vs warm program cache
+    std::string softwarePath;  // --software: render on the CPU and write the last frame here
+    int softwareFrames = 60;
+    std::string csvPath = "bench_frames.csv";
+    std::string jsonPath = "bench_summary.json";
+};
+BenchmarkConfig benchmarkConfig;
+
+// Chrome trace capture (--trace PATH, --trace-frames N; P in the window)
+struct ProfileConfig {
+    std::string tracePath;
+    int traceFrames = 300;
+};
+ProfileConfig profileConfig;
+
+// Binary scene files (--scene, --save-scene, --scene-benchmark)
+struct SceneConfig {
+    std::string loadPath;
+    std::string savePath;
+    int saveRadius = 8;     // tiles around the origin written by --save-scene
+    bool benchmark = false;
+    std::string benchmarkPath = "bench_scene.bin";
+};
+SceneConfig sceneConfig;
+
 // Time variables
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
@@ -27,8 +155,12 @@ float animationTime = 0.0f;
 bool keys[1024];
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mode);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
+void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow* window);
 
+// Window framebuffer size in pixels, updated on resize
+int framebufferWidth = WIDTH, framebufferHeight = HEIGHT;
+
 // Mouse variables
 float lastX = WIDTH / 2.0f;
 float lastY = HEIGHT / 2.0f;
@@ -40,22 +172,107 @@ const char* vertexShaderSource = R"(
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoord;
+#if defined(INSTANCED) && !defined(ANIMATED)
+layout (location = 3) in mat4 aModel;
+#ifndef AXIS_ALIGNED
+layout (location = 10) in mat3 aNormalMatrix;
+#endif
+#endif
+#ifdef ANIMATED
+// Motion parameters; the model matrix is a function of these and time alone
+layout (location = 3) in vec3 aOrigin;
+layout (location = 4) in vec4 aAnimation; // orbit radius, start angle, rate (rad/s), spin (0 or 1)
+
+uniform float time;
+uniform vec3 animatedScale;
+#endif
+#if defined(INSTANCED) || defined(BATCHED)
+layout (location = 7) in vec3 aObjectColor;
+layout (location = 8) in float aEmissionStrength;
+layout (location = 9) in vec3 aEmissionColor;
+
+flat out vec3 ObjectColor;
+flat out float EmissionStrength;
+flat out vec3 EmissionColor;
+#endif
 
 out vec3 FragPos;
 out vec3 Normal;
 out vec2 TexCoord;
 
+#if defined(ANIMATED)
+// Orbit about aOrigin, then spin about Y by the same angle (scaled by aAnimation.w).
+// The normal matrix of a rotation times a scale is the rotation times the reciprocal scale.
+mat4 animatedModel(out mat3 normalMatrix)
+{
+    float angle = aAnimation.y + aAnimation.z * time;
+    vec3 position = aOrigin + aAnimation.x * vec3(cos(angle), 0.0, sin(angle));
+    float spin = aAnimation.w * angle;
+    float c = cos(spin), s = sin(spin);
+    vec3 inverseScale = 1.0 / animatedScale;
+    normalMatrix = mat3(vec3(c * inverseScale.x, 0.0, -s * inverseScale.x),
+                        vec3(0.0, inverseScale.y, 0.0),
+                        vec3(s * inverseScale.z, 0.0, c * inverseScale.z));
+    return mat4(vec4(c * animatedScale.x, 0.0, -s * animatedScale.x, 0.0),
+                vec4(0.0, animatedScale.y, 0.0, 0.0),
+                vec4(s * animatedScale.z, 0.0, c * animatedScale.z, 0.0),
+                vec4(position, 1.0));
+}
+#elif defined(INSTANCED)
+#define model aModel
+#define normalMatrix aNormalMatrix
+#elif defined(BATCHED)
+// Static batches are baked in world space: no model matrix
+#else
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+uniform mat3 normalMatrix; // inverse transpose of mat3(model), computed on the CPU
+#endif
+#ifdef SHADOW_CASTER
+uniform mat4 shadowMatrix; // world to the light's clip space
+#endif
+
+layout (std140) uniform FrameUniforms {
+    mat4 view;
+    mat4 projection;
+    vec3 viewPos;
+    vec3 lightDir; // towards the moon
+    vec3 lightColor;
+    vec4 clusterScale;  // pixels to tiles (xy), view depth to slice: log(depth) * z + w
+    uvec4 clusterCounts; // tiles x, y, depth slices, point lights (0: clustered lighting off)
+    mat4 dynamicShadow;  // world to texture coordinates and depth of the moving objects' shadow map
+    vec4 shadowGrid;     // first tile x and z of shadowTiles, 1 / tile size, normal offset
+    uvec4 shadowCounts;  // shadowTiles side, shadows on
+};
 
 void main()
 {
+#ifdef ANIMATED
+    mat3 normalMatrix;
+    mat4 model = animatedModel(normalMatrix);
+#endif
+#if defined(INSTANCED) || defined(BATCHED)
+    ObjectColor = aObjectColor;
+    EmissionStrength = aEmissionStrength;
+    EmissionColor = aEmissionColor;
+#endif
+#if defined(BATCHED)
+    FragPos = aPos;
+    Normal = aNormal;
+#elif defined(AXIS_ALIGNED)
+    FragPos = vec3(model * vec4(aPos, 1.0));
+    // Translate and scale only: the normal matrix is the reciprocal scale
+    Normal = aNormal / vec3(model[0][0], model[1][1], model[2][2]);
+#else
     FragPos = vec3(model * vec4(aPos, 1.0));
-    Normal = mat3(transpose(inverse(model))) * aNormal;
+    Normal = normalMatrix * aNormal;
+#endif
     TexCoord = aTexCoord;
     
+#ifdef SHADOW_CASTER
+    gl_Position = shadowMatrix * vec4(FragPos, 1.0);
+#else
     gl_Position = projection * view * vec4(FragPos, 1.0);
+#endif
 }
 )";
 
@@ -67,13 +284,96 @@ in vec3 FragPos;
 in vec3 Normal;
 in vec2 TexCoord;
 
-uniform vec3 viewPos;
-uniform vec3 lightPos;
-uniform vec3 lightColor;
+layout (std140) uniform FrameUniforms {
+    mat4 view;
+    mat4 projection;
+    vec3 viewPos;
+    vec3 lightDir; // towards the moon
+    vec3 lightColor;
+    vec4 clusterScale;  // pixels to tiles (xy), view depth to slice: log(depth) * z + w
+    uvec4 clusterCounts; // tiles x, y, depth slices, point lights (0: clustered lighting off)
+    mat4 dynamicShadow;  // world to texture coordinates and depth of the moving objects' shadow map
+    vec4 shadowGrid;     // first tile x and z of shadowTiles, 1 / tile size, normal offset
+    uvec4 shadowCounts;  // shadowTiles side, shadows on
+};
+
+#if defined(INSTANCED) || defined(BATCHED)
+flat in vec3 ObjectColor;
+flat in float EmissionStrength;
+flat in vec3 EmissionColor;
+#define objectColor ObjectColor
+#define emissionStrength EmissionStrength
+#define emissionColor EmissionColor
+#else
 uniform vec3 objectColor;
 uniform float emissionStrength;
 uniform vec3 emissionColor;
+#endif
+
+// Clustered point lights: per cluster an (offset, count) range of lightIndices, and per
+// light two texels of lightData, position and radius then colour
+uniform samplerBuffer lightData;
+uniform usamplerBuffer clusterRanges;
+uniform usamplerBuffer lightIndices;
+
+// Shadows: a cached map per tile (the layer of tileShadows that shadowTiles names, with three
+// rows of shadowLayers taking world space to it), and one map of the moving objects
+uniform sampler2DArrayShadow tileShadows;
+uniform sampler2DShadow dynamicShadows;
+uniform usamplerBuffer shadowTiles;
+uniform samplerBuffer shadowLayers;
+
+vec3 clusteredLighting(vec3 norm, vec3 viewDir)
+{
+    float depth = -(view * vec4(FragPos, 1.0)).z;
+    uvec3 cell = uvec3(uvec2(gl_FragCoord.xy * clusterScale.xy),
+                       uint(max(log(depth) * clusterScale.z + clusterScale.w, 0.0)));
+    cell = min(cell, clusterCounts.xyz - 1u);
+    uvec2 range = texelFetch(clusterRanges, int((cell.z * clusterCounts.y + cell.y) * clusterCounts.x + cell.x)).xy;
+    
+    vec3 result = vec3(0.0);
+    for (uint i = 0u; i < range.y; i++) {
+        int light = int(texelFetch(lightIndices, int(range.x + i)).r);
+        vec4 positionRadius = texelFetch(lightData, light * 2);
+        vec3 toLight = positionRadius.xyz - FragPos;
+        float distanceSquared = dot(toLight, toLight);
+        
+        // Smooth window that reaches zero at the radius the light was clustered with
+        float window = clamp(1.0 - distanceSquared / (positionRadius.w * positionRadius.w), 0.0, 1.0);
+        vec3 lightDir = toLight * inversesqrt(max(distanceSquared, 1e-4));
+        float diff = max(dot(norm, lightDir), 0.0);
+        float spec = pow(max(dot(viewDir, reflect(-lightDir, norm)), 0.0), 32);
+        result += (diff + 0.5 * spec) * window * window * texelFetch(lightData, light * 2 + 1).rgb;
+    }
+    return result;
+}
+
+// 1 where the moon reaches the fragment, 0 in shadow; lookups outside a map are lit
+float shadowVisibility(vec3 norm)
+{
+    vec4 position = vec4(FragPos + norm * shadowGrid.w, 1.0);
+    float visibility = 1.0;
+    int side = int(shadowCounts.x);
+    ivec2 cell = ivec2(floor(position.xz * shadowGrid.z - shadowGrid.xy));
+    if (all(greaterThanEqual(cell, ivec2(0))) && all(lessThan(cell, ivec2(side)))) {
+        uint layer = texelFetch(shadowTiles, cell.y * side + cell.x).r;
+        if (layer > 0u) {
+            int row = int(layer - 1u) * 3;
+            vec3 coord = vec3(dot(texelFetch(shadowLayers, row), position), dot(texelFetch(shadowLayers, row + 1), position),
+                              dot(texelFetch(shadowLayers, row + 2), position));
+            visibility = texture(tileShadows, vec4(coord.xy, float(layer - 1u), min(coord.z, 1.0)));
+        }
+    }
+    vec3 coord = (dynamicShadow * position).xyz;
+    return min(visibility, texture(dynamicShadows, vec3(coord.xy, min(coord.z, 1.0))));
+}
 
+#ifdef SHADOW_CASTER
+// Depth only
+void main()
+{
+}
+#else
 void main()
 {
     // Ambient lighting
@@ -82,7 +382,6 @@ void main()
     
     // Diffuse lighting
     vec3 norm = normalize(Normal);
-    vec3 lightDir = normalize(lightPos - FragPos);
     float diff = max(dot(norm, lightDir), 0.0);
     vec3 diffuse = diff * lightColor;
     
@@ -96,375 +395,8057 @@ void main()
     // Emission (for glowing effects)
     vec3 emission = emissionStrength * emissionColor;
     
-    vec3 result = (ambient + diffuse + specular) * objectColor + emission;
+    float shadow = shadowCounts.y > 0u && diff > 0.0 ? shadowVisibility(norm) : 1.0;
+    vec3 lighting = ambient + shadow * (diffuse + specular);
+    if (clusterCounts.w > 0u)
+        lighting += clusteredLighting(norm, viewDir);
+    
+    vec3 result = lighting * objectColor + emission;
     FragColor = vec4(result, 1.0);
 }
+#endif
 )";
 
 // Utility functions
-GLuint compileShader(const char* source, GLenum type) {
+// FNV-1a over 64-bit words: not cryptographic; used for cache keys and to reject stale or damaged files
+uint64_t checksum64(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+    const char* bytes = (const char*)data;
+    size_t words = size / 8;
+    for (size_t i = 0; i < words; i++) {
+        uint64_t word;
+        memcpy(&word, bytes + i * 8, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+    for (size_t i = words * 8; i < size; i++)
+        hash = (hash ^ (unsigned char)bytes[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+// Creates a directory if it is missing (one level)
+bool makeDirectory(const std::string& path) {
+#ifdef _WIN32
+    return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Whole info logs; their length is queried, so nothing is cut off
+std::string shaderInfoLog(GLuint shader) {
+    GLint length = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+    std::string log(std::max(length, 1), '\0');
+    glGetShaderInfoLog(shader, (GLsizei)log.size(), NULL, &log[0]);
+    log.resize(strlen(log.c_str()));
+    return log;
+}
+
+std::string programInfoLog(GLuint program) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+    std::string log(std::max(length, 1), '\0');
+    glGetProgramInfoLog(program, (GLsizei)log.size(), NULL, &log[0]);
+    log.resize(strlen(log.c_str()));
+    return log;
+}
+
+// Creates and compiles source with extra #define lines spliced in right after its #version
+// line. The status is left to checkShader, so several compiles can be in flight at once.
+GLuint startCompile(const char* source, GLenum type, const char* defines) {
+    const char* body = strchr(strstr(source, "#version"), '\n') + 1;
+    std::string header(source, body - source);
+    const char* sources[] = { header.c_str(), defines, body };
+    
     GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, NULL);
+    glShaderSource(shader, 3, sources, NULL);
     glCompileShader(shader);
-    
+    return shader;
+}
+
+bool checkShader(GLuint shader, const char* defines) {
     GLint success;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        char infoLog[512];
-        glGetShaderInfoLog(shader, 512, NULL, infoLog);
-        std::cout << "Shader compilation failed: " << infoLog << std::endl;
-    }
-    return shader;
+    if (!success)
+        std::cout << "Shader compilation failed (defines: " << defines << "):\n" << shaderInfoLog(shader) << std::endl;
+    return success == GL_TRUE;
 }
 
-GLuint createShaderProgram() {
-    GLuint vertexShader = compileShader(vertexShaderSource, GL_VERTEX_SHADER);
-    GLuint fragmentShader = compileShader(fragmentShaderSource, GL_FRAGMENT_SHADER);
-    
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-    
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
-    
-    return shaderProgram;
+bool checkProgram(GLuint program, const char* defines) {
+    GLint success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success)
+        std::cout << "Program link failed (defines: " << defines << "):\n" << programInfoLog(program) << std::endl;
+    return success == GL_TRUE;
 }
 
-// 3D Object classes
-struct Building {
-    glm::vec3 position;
-    glm::vec3 scale;
-    glm::vec3 color;
-    float emissionStrength;
-    glm::vec3 emissionColor;
-    
-    Building(glm::vec3 pos, glm::vec3 sc, glm::vec3 col, float emission = 0.0f, glm::vec3 emCol = glm::vec3(0.0f)) 
-        : position(pos), scale(sc), color(col), emissionStrength(emission), emissionColor(emCol) {}
+// Every program variant the city draws with; buildShaderVariants returns them in this order
+const char* const SHADER_VARIANTS[] = {
+    "",                                           // per-object, rotated (billboards)
+    "#define AXIS_ALIGNED\n",                     // per-object, translate + scale
+    "#define INSTANCED\n",
+    "#define INSTANCED\n#define AXIS_ALIGNED\n",
+    "#define BATCHED\n",
+    "#define INSTANCED\n#define ANIMATED\n",
+    "#define SHADOW_CASTER\n#define INSTANCED\n#define AXIS_ALIGNED\n", // depth only, for the shadow maps
+    "#define SHADOW_CASTER\n#define INSTANCED\n",
+    "#define SHADOW_CASTER\n#define INSTANCED\n#define ANIMATED\n",
 };
+const int SHADER_VARIANT_COUNT = sizeof(SHADER_VARIANTS) / sizeof(SHADER_VARIANTS[0]);
 
-struct Vehicle {
-    glm::vec3 position;
-    glm::vec3 direction;
-    float speed;
-    glm::vec3 color;
-    float pathRadius;
-    float pathAngle;
+struct ShaderCacheStats {
+    int loaded;   // linked straight from a cached binary
+    int compiled; // built from source
+    int rejected; // cached binaries the driver refused (driver update, other GPU); recompiled
+    int saved;
+    double ms;
+};
+
+// Builds a set of program variants together. Each is keyed by a hash of both sources, its
+// defines and the GL vendor/renderer/version, and its linked binary is kept on disk. Hits go
+// through glProgramBinary; misses are all submitted before any status is read, so a driver with
+// KHR_parallel_shader_compile (or any threaded compiler) builds them in parallel.
+class ShaderCache {
+private:
+    struct Pending {
+        GLuint program;
+        GLuint shaders[2];
+        const char* defines;
+        uint64_t key;
+        bool fromBinary;
+    };
     
-    Vehicle(glm::vec3 pos, glm::vec3 dir, float sp, glm::vec3 col, float radius = 30.0f) 
-        : position(pos), direction(dir), speed(sp), color(col), pathRadius(radius), pathAngle(0.0f) {}
+    struct BinaryHeader {
+        char magic[4];
+        uint32_t format;
+        uint64_t key;
+    };
     
-    void update(float deltaTime) {
-        pathAngle += speed * deltaTime;
-        position.x = pathRadius * cos(pathAngle);
-        position.z = pathRadius * sin(pathAngle);
+    std::string directory;
+    bool binaries;
+    std::string driver;
+    std::vector<Pending> pending;
+    ShaderCacheStats stats;
+    std::chrono::steady_clock::time_point start;
+    
+    uint64_t keyFor(const char* defines) const {
+        uint64_t key = checksum64(vertexShaderSource, strlen(vertexShaderSource));
+        key = checksum64(fragmentShaderSource, strlen(fragmentShaderSource), key);
+        key = checksum64(defines, strlen(defines), key);
+        return checksum64(driver.data(), driver.size(), key);
     }
-};
-
-struct Billboard {
-    glm::vec3 position;
-    float rotation;
-    float rotationSpeed;
-    glm::vec3 color;
     
-    Billboard(glm::vec3 pos, float rotSpeed, glm::vec3 col) 
-        : position(pos), rotation(0.0f), rotationSpeed(rotSpeed), color(col) {}
+    std::string pathFor(uint64_t key) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+        return directory + "/" + name;
+    }
     
-    void update(float deltaTime) {
-        rotation += rotationSpeed * deltaTime;
+    void compile(Pending& request) {
+        request.shaders[0] = startCompile(vertexShaderSource, GL_VERTEX_SHADER, request.defines);
+        request.shaders[1] = startCompile(fragmentShaderSource, GL_FRAGMENT_SHADER, request.defines);
+        glAttachShader(request.program, request.shaders[0]);
+        glAttachShader(request.program, request.shaders[1]);
+        if (binaries)
+            glProgramParameteri(request.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(request.program);
+        request.fromBinary = false;
     }
-};
-
-// Cube vertices with normals and texture coordinates
-float cubeVertices[] = {
-    // positions          // normals           // texture coords
-    -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-     0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
-     0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-     0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-    -0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
-    -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-
-    -0.5f, -0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   0.0f, 0.0f,
-     0.5f, -0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   1.0f, 0.0f,
-     0.5f,  0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   1.0f, 1.0f,
-     0.5f,  0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   1.0f, 1.0f,
-    -0.5f,  0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   0.0f, 1.0f,
-    -0.5f, -0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   0.0f, 0.0f,
-
-    -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-    -0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-    -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-    -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-    -0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-    -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-
-     0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-     0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-     0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-     0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-     0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-     0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-
-    -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-     0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
-     0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-     0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-    -0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
-    -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-
-    -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-     0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
-     0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-     0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-    -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
-    -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
-};
-
-class FuturisticCity {
-private:
-    GLuint VBO, VAO;
-    GLuint shaderProgram;
-    std::vector<Building> buildings;
-    std::vector<Vehicle> vehicles;
-    std::vector<Billboard> billboards;
-    std::random_device rd;
-    std::mt19937 gen;
     
-public:
-    FuturisticCity() : gen(rd()) {
-        setupBuffers();
-        shaderProgram = createShaderProgram();
-        generateCity();
+    bool loadBinary(Pending& request) {
+        std::ifstream file(pathFor(request.key), std::ios::binary | std::ios::ate);
+        if (!file)
+            return false;
+        size_t size = (size_t)file.tellg();
+        BinaryHeader header;
+        if (size <= sizeof(header))
+            return false;
+        std::vector<char> binary(size - sizeof(header));
+        file.seekg(0);
+        file.read((char*)&header, sizeof(header));
+        file.read(binary.data(), binary.size());
+        if (!file || memcmp(header.magic, "NCPB", 4) != 0 || header.key != request.key)
+            return false;
+        glProgramBinary(request.program, header.format, binary.data(), (GLsizei)binary.size());
+        request.fromBinary = true;
+        return true;
     }
     
-    void setupBuffers() {
-        glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &VBO);
-        
-        glBindVertexArray(VAO);
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(cubeVertices), cubeVertices, GL_STATIC_DRAW);
+    void saveBinary(const Pending& request) {
+        GLint length = 0;
+        glGetProgramiv(request.program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+            return;
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(request.program, length, NULL, &format, binary.data());
         
-        // Position attribute
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
-        glEnableVertexAttribArray(0);
+        BinaryHeader header = { { 'N', 'C', 'P', 'B' }, format, request.key };
+        std::ofstream file(pathFor(request.key), std::ios::binary | std::ios::trunc);
+        file.write((const char*)&header, sizeof(header));
+        file.write(binary.data(), binary.size());
+        if (file)
+            stats.saved++;
+    }
+    
+public:
+    // An empty directory disables the binary cache; variants are still compiled in parallel
+    explicit ShaderCache(const std::string& cacheDirectory) : directory(cacheDirectory), binaries(false) {
+        stats = ShaderCacheStats();
+        start = std::chrono::steady_clock::now();
         
-        // Normal attribute
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
-        glEnableVertexAttribArray(1);
+        driver = std::string((const char*)glGetString(GL_VENDOR)) + "|" + (const char*)glGetString(GL_RENDERER) + "|" +
+                 (const char*)glGetString(GL_VERSION);
+        GLint formats = 0;
+        if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        binaries = !directory.empty() && formats > 0 && makeDirectory(directory);
         
-        // Texture coordinate attribute
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
-        glEnableVertexAttribArray(2);
+        // Let the driver use as many compiler threads as it likes
+        if (GLEW_KHR_parallel_shader_compile)
+            glMaxShaderCompilerThreadsKHR(0xffffffff);
+        else if (GLEW_ARB_parallel_shader_compile)
+            glMaxShaderCompilerThreadsARB(0xffffffff);
     }
     
-    void generateCity() {
-        std::uniform_real_distribution<float> posDist(-50.0f, 50.0f);
-        std::uniform_real_distribution<float> heightDist(5.0f, 40.0f);
-        std::uniform_real_distribution<float> widthDist(2.0f, 8.0f);
-        std::uniform_real_distribution<float> colorDist(0.1f, 0.9f);
-        
-        // Generate buildings
-        for (int i = 0; i < 50; i++) {
-            float x = posDist(gen);
-            float z = posDist(gen);
-            float height = heightDist(gen);
-            float width = widthDist(gen);
-            
-            glm::vec3 pos(x, height / 2.0f, z);
-            glm::vec3 scale(width, height, width);
-            
-            // Cyberpunk color palette
-            glm::vec3 color;
-            float colorChoice = colorDist(gen);
-            if (colorChoice < 0.3f) {
-                color = glm::vec3(0.2f, 0.2f, 0.8f); // Blue
-            } else if (colorChoice < 0.6f) {
-                color = glm::vec3(0.8f, 0.2f, 0.8f); // Magenta
-            } else {
-                color = glm::vec3(0.2f, 0.8f, 0.8f); // Cyan
+    // Starts building a variant; the program is usable once finish() returns
+    GLuint request(const char* defines) {
+        Pending request = { glCreateProgram(), { 0, 0 }, defines, keyFor(defines), false };
+        if (!binaries || !loadBinary(request))
+            compile(request);
+        pending.push_back(request);
+        return request.program;
+    }
+    
+    // Waits for everything requested, recompiling refused binaries and storing new ones
+    void finish() {
+        for (Pending& request : pending) {
+            GLint linked = GL_FALSE;
+            glGetProgramiv(request.program, GL_LINK_STATUS, &linked);
+            if (request.fromBinary) {
+                if (linked) {
+                    stats.loaded++;
+                    continue;
+                }
+                stats.rejected++;
+                compile(request);
             }
             
-            float emission = (height > 20.0f) ? 0.3f : 0.1f;
-            buildings.push_back(Building(pos, scale, color, emission, color * 0.5f));
-        }
-        
-        // Generate flying vehicles
-        for (int i = 0; i < 8; i++) {
-            float height = 15.0f + i * 3.0f;
-            float radius = 20.0f + i * 5.0f;
-            float speed = 0.5f + (i % 3) * 0.3f;
-            
-            glm::vec3 pos(radius, height, 0.0f);
-            glm::vec3 dir(0.0f, 0.0f, 1.0f);
-            glm::vec3 color(1.0f, 0.8f, 0.2f); // Golden headlights
-            
-            Vehicle vehicle(pos, dir, speed, color, radius);
-            vehicle.pathAngle = i * (2.0f * M_PI / 8.0f); // Distribute evenly
-            vehicles.push_back(vehicle);
-        }
-        
-        // Generate holographic billboards
-        for (int i = 0; i < 15; i++) {
-            float x = posDist(gen);
-            float z = posDist(gen);
-            float y = 20.0f + i * 2.0f;
-            
-            glm::vec3 pos(x, y, z);
-            float rotSpeed = 30.0f + (i % 3) * 20.0f;
-            glm::vec3 color(0.0f, 1.0f, 0.5f); // Holographic green
-            
-            billboards.push_back(Billboard(pos, rotSpeed, color));
+            stats.compiled++;
+            checkShader(request.shaders[0], request.defines);
+            checkShader(request.shaders[1], request.defines);
+            bool ok = checkProgram(request.program, request.defines);
+            for (GLuint shader : request.shaders) {
+                glDetachShader(request.program, shader);
+                glDeleteShader(shader);
+            }
+            if (ok && binaries)
+                saveBinary(request);
         }
+        pending.clear();
+        stats.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
     }
     
-    void update(float deltaTime) {
-        animationTime += deltaTime;
-        
-        // Update vehicles
-        for (auto& vehicle : vehicles) {
-            vehicle.update(deltaTime);
-        }
-        
-        // Update billboards
-        for (auto& billboard : billboards) {
-            billboard.update(deltaTime);
-        }
+    // Drops a variant's cached binary (for cold-start measurements)
+    void forget(const char* defines) const {
+        std::remove(pathFor(keyFor(defines)).c_str());
     }
     
-    void render(glm::mat4 view, glm::mat4 projection) {
-        glUseProgram(shaderProgram);
-        glBindVertexArray(VAO);
-        
-        // Set uniforms
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-        glUniform3fv(glGetUniformLocation(shaderProgram, "viewPos"), 1, glm::value_ptr(cameraPos));
-        glUniform3f(glGetUniformLocation(shaderProgram, "lightPos"), 0.0f, 50.0f, 0.0f);
-        glUniform3f(glGetUniformLocation(shaderProgram, "lightColor"), 0.3f, 0.3f, 0.7f);
+    bool storesBinaries() const { return binaries; }
+    const ShaderCacheStats& getStats() const { return stats; }
+};
+
+// Builds every SHADER_VARIANTS entry through the cache at the given directory
+ShaderCacheStats buildShaderVariants(const std::string& cacheDirectory, std::vector<GLuint>& programs) {
+    ShaderCache cache(cacheDirectory);
+    programs.clear();
+    for (int i = 0; i < SHADER_VARIANT_COUNT; i++)
+        programs.push_back(cache.request(SHADER_VARIANTS[i]));
+    cache.finish();
+    return cache.getStats();
+}
+
+// Binding point shared by every program for the per-frame uniform block
+const GLuint FRAME_UNIFORMS_BINDING = 0;
+// First of the three texture units holding the light cluster buffers (see LightClusters)
+const GLint LIGHT_TEXTURE_UNIT = 1;
+// First of the four texture units holding the shadow maps and their lookup (see ShadowMaps)
+const GLint SHADOW_TEXTURE_UNIT = 4;
+
+// CPU mirror of the std140 FrameUniforms block; vec3 members are padded to 16 bytes
+struct FrameUniforms {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec3 viewPos;
+    float pad0;
+    glm::vec3 lightDir;
+    float pad1;
+    glm::vec3 lightColor;
+    float pad2;
+    glm::vec4 clusterScale;
+    uint32_t clusterCounts[4];
+    glm::mat4 dynamicShadow;
+    glm::vec4 shadowGrid;
+    uint32_t shadowCounts[4];
+};
+
+// Owns a linked program and resolves all of its uniform locations once at link time
+class ShaderProgram {
+private:
+    GLuint id;
+    std::unordered_map<std::string, GLint> locations;
+    
+    void cacheLocations() {
+        GLint uniformCount = 0, maxNameLength = 0;
+        glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &uniformCount);
+        glGetProgramiv(id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
         
-        // Render buildings
-        for (const auto& building : buildings) {
-            glm::mat4 model = glm::mat4(1.0f);
-            model = glm::translate(model, building.position);
-            model = glm::scale(model, building.scale);
+        std::vector<char> name(maxNameLength + 1);
+        for (GLint i = 0; i < uniformCount; i++) {
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(id, i, (GLsizei)name.size(), NULL, &size, &type, name.data());
             
-            glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
-            glUniform3fv(glGetUniformLocation(shaderProgram, "objectColor"), 1, glm::value_ptr(building.color));
-            glUniform1f(glGetUniformLocation(shaderProgram, "emissionStrength"), building.emissionStrength);
-            glUniform3fv(glGetUniformLocation(shaderProgram, "emissionColor"), 1, glm::value_ptr(building.emissionColor));
-            
-            glDrawArrays(GL_TRIANGLES, 0, 36);
+            // Block members have no location; arrays are reported as "name[0]"
+            GLint location = glGetUniformLocation(id, name.data());
+            if (location < 0)
+                continue;
+            std::string key(name.data());
+            size_t bracket = key.find('[');
+            if (bracket != std::string::npos)
+                key.erase(bracket);
+            locations[key] = location;
         }
         
-        // Render vehicles
-        for (const auto& vehicle : vehicles) {
-            glm::mat4 model = glm::mat4(1.0f);
-            model = glm::translate(model, vehicle.position);
-            model = glm::scale(model, glm::vec3(1.5f, 0.5f, 3.0f));
-            
-            glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
-            glUniform3fv(glGetUniformLocation(shaderProgram, "objectColor"), 1, glm::value_ptr(vehicle.color));
-            glUniform1f(glGetUniformLocation(shaderProgram, "emissionStrength"), 0.8f);
-            glUniform3fv(glGetUniformLocation(shaderProgram, "emissionColor"), 1, glm::value_ptr(vehicle.color));
-            
-            glDrawArrays(GL_TRIANGLES, 0, 36);
-        }
+        GLuint blockIndex = glGetUniformBlockIndex(id, "FrameUniforms");
+        if (blockIndex != GL_INVALID_INDEX)
+            glUniformBlockBinding(id, blockIndex, FRAME_UNIFORMS_BINDING);
         
-        // Render billboards
-        for (const auto& billboard : billboards) {
-            glm::mat4 model = glm::mat4(1.0f);
-            model = glm::translate(model, billboard.position);
-            model = glm::rotate(model, glm::radians(billboard.rotation), glm::vec3(0.0f, 1.0f, 0.0f));
-            model = glm::scale(model, glm::vec3(3.0f, 2.0f, 0.1f));
-            
-            glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
-            glUniform3fv(glGetUniformLocation(shaderProgram, "objectColor"), 1, glm::value_ptr(billboard.color));
-            glUniform1f(glGetUniformLocation(shaderProgram, "emissionStrength"), 0.9f);
-            glUniform3fv(glGetUniformLocation(shaderProgram, "emissionColor"), 1, glm::value_ptr(billboard.color));
-            
-            glDrawArrays(GL_TRIANGLES, 0, 36);
+        // Light cluster buffers and shadow maps stay on fixed texture units, like the block's binding point
+        const char* const samplers[] = { "lightData", "clusterRanges", "lightIndices",
+                                         "tileShadows", "dynamicShadows", "shadowTiles", "shadowLayers" };
+        glUseProgram(id);
+        for (int i = 0; i < 7; i++) {
+            GLint location = glGetUniformLocation(id, samplers[i]);
+            if (location >= 0)
+                glUniform1i(location, i < 3 ? LIGHT_TEXTURE_UNIT + i : SHADOW_TEXTURE_UNIT + i - 3);
         }
+        glUseProgram(0);
     }
     
-    ~FuturisticCity() {
-        glDeleteVertexArrays(1, &VAO);
-        glDeleteBuffers(1, &VBO);
-        glDeleteProgram(shaderProgram);
+public:
+    ShaderProgram() : id(0) {}
+    
+    // Takes ownership of an already linked program (see ShaderCache)
+    explicit ShaderProgram(GLuint linkedProgram) : id(linkedProgram) {
+        cacheLocations();
+    }
+    
+    ShaderProgram(const ShaderProgram&) = delete;
+    ShaderProgram& operator=(const ShaderProgram&) = delete;
+    
+    ShaderProgram& operator=(ShaderProgram&& other) {
+        std::swap(id, other.id);
+        std::swap(locations, other.locations);
+        return *this;
+    }
+    
+    ~ShaderProgram() {
+        if (id != 0)
+            glDeleteProgram(id);
+    }
+    
+    GLuint program() const { return id; }
+    
+    // Returns -1 (ignored by glUniform*) for names the linker optimised away
+    GLint location(const std::string& name) const {
+        auto it = locations.find(name);
+        return it == locations.end() ? -1 : it->second;
     }
+    
+    void use() const { glUseProgram(id); }
 };
 
-// Global city instance
-FuturisticCity* city = nullptr;
+// Counters of the streaming ring; waits are frames whose region the GPU was still reading
+struct StreamStats {
+    bool persistent;
+    long long frames;
+    long long waits;
+    double waitMs;
+    long long grows;
+    size_t frameBytes;
+    size_t regionBytes;
+};
 
-int main() {
-    // Initialize GLFW
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+// Ring buffer for data rewritten every frame. With buffer storage it is mapped once, persistently
+// and coherently, and split into REGIONS per-frame regions: the CPU fills region N while the GPU
+// still reads N-1 and N-2, and a fence per region says when it may be reused. Without it (GL 3.3)
+// the buffer holds one region that is orphaned each frame and written with glBufferSubData, so the
+// driver does the renaming. Reserve the frame's size up front; allocations never straddle frames.
+class StreamBuffer {
+public:
+    static const int REGIONS = 3;
     
-    // Create window
-    GLFWwindow* window = glfwCreateWindow(WIDTH, HEIGHT, "Futuristic City at Night", NULL, NULL);
-    if (window == NULL) {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return -1;
+private:
+    GLuint id;
+    bool persistent;
+    char* mapped;
+    std::vector<char> staging;
+    GLsync fences[REGIONS];
+    int region;
+    size_t regionSize;
+    size_t alignment;
+    size_t head, flushed;
+    StreamStats stats;
+    
+    size_t alignUp(size_t value) const { return (value + alignment - 1) / alignment * alignment; }
+    
+    void create(size_t bytes) {
+        regionSize = alignUp(bytes);
+        glGenBuffers(1, &id);
+        glBindBuffer(GL_ARRAY_BUFFER, id);
+        if (persistent) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_ARRAY_BUFFER, regionSize * REGIONS, NULL, flags);
+            mapped = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, regionSize * REGIONS, flags);
+        } else {
+            glBufferData(GL_ARRAY_BUFFER, regionSize, NULL, GL_STREAM_DRAW);
+            staging.resize(regionSize);
+        }
+        stats.regionBytes = regionSize;
     }
-    glfwMakeContextCurrent(window);
     
-    // Set callbacks
-    glfwSetKeyCallback(window, key_callback);
-    glfwSetCursorPosCallback(window, mouse_callback);
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    void destroy() {
+        for (int i = 0; i < REGIONS; i++) {
+            if (fences[i])
+                glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+        if (mapped) {
+            glBindBuffer(GL_ARRAY_BUFFER, id);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+            mapped = nullptr;
+        }
+        glDeleteBuffers(1, &id);
+        id = 0;
+    }
     
-    // Initialize GLEW
-    if (glewInit() != GLEW_OK) {
-        std::cout << "Failed to initialize GLEW" << std::endl;
-        return -1;
+    // Blocks until the GPU has finished with a region, counting the time if it had not already
+    void waitFor(int index) {
+        if (!fences[index])
+            return;
+        GLenum status = glClientWaitSync(fences[index], 0, 0);
+        if (status == GL_TIMEOUT_EXPIRED) {
+            stats.waits++;
+            auto start = std::chrono::steady_clock::now();
+            do {
+                status = glClientWaitSync(fences[index], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+            } while (status == GL_TIMEOUT_EXPIRED);
+            stats.waitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        glDeleteSync(fences[index]);
+        fences[index] = 0;
     }
     
-    // Configure OpenGL
-    glViewport(0, 0, WIDTH, HEIGHT);
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+public:
+    StreamBuffer() : id(0), persistent(false), mapped(nullptr), region(0), regionSize(0), alignment(16), head(0), flushed(0) {
+        for (int i = 0; i < REGIONS; i++)
+            fences[i] = 0;
+        stats = StreamStats();
+    }
     
-    // Create city
-    city = new FuturisticCity();
+    StreamBuffer(const StreamBuffer&) = delete;
+    StreamBuffer& operator=(const StreamBuffer&) = delete;
     
-    // Render loop
-    while (!glfwWindowShouldClose(window)) {
-        // Calculate deltaTime
+    ~StreamBuffer() {
+        if (id)
+            destroy();
+    }
+    
+    void init(size_t bytes, bool allowPersistent) {
+        // Uniform blocks are bound out of the ring too, so every allocation honours their alignment
+        GLint uniformAlignment = 0;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+        alignment = std::max<size_t>(16, (size_t)uniformAlignment);
+        persistent = allowPersistent && (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage);
+        stats.persistent = persistent;
+        create(bytes);
+    }
+    
+    // Starts a frame that will allocate at most `bytes` in at most `allocations` pieces
+    void beginFrame(size_t bytes, int allocations) {
+        size_t needed = bytes + allocations * alignment;
+        if (needed > regionSize) {
+            // Outgrown: let the GPU drain every region, then re-create at twice the need
+            for (int i = 0; i < REGIONS; i++)
+                waitFor(i);
+            destroy();
+            create(needed * 2);
+            stats.grows++;
+        }
+        
+        if (persistent) {
+            region = (region + 1) % REGIONS;
+            waitFor(region);
+            head = region * regionSize;
+        } else {
+            glBindBuffer(GL_ARRAY_BUFFER, id);
+            glBufferData(GL_ARRAY_BUFFER, regionSize, NULL, GL_STREAM_DRAW);
+            head = 0;
+        }
+        flushed = head;
+        stats.frames++;
+        stats.frameBytes = 0;
+    }
+    
+    // Space for `bytes` in the current region; `offset` is where it sits in buffer()
+    void* allocate(size_t bytes, size_t& offset) {
+        offset = head;
+        head = alignUp(head + bytes);
+        stats.frameBytes += bytes;
+        return persistent ? (void*)(mapped + offset) : (void*)(staging.data() + offset);
+    }
+    
+    // Makes everything allocated so far visible to GL. Coherent mappings need nothing.
+    void flush() {
+        if (!persistent && head > flushed) {
+            glBindBuffer(GL_ARRAY_BUFFER, id);
+            glBufferSubData(GL_ARRAY_BUFFER, flushed, head - flushed, staging.data() + flushed);
+        }
+        flushed = head;
+    }
+    
+    // Fences the region once every draw reading it has been issued
+    void endFrame() {
+        if (persistent)
+            fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    
+    GLuint buffer() const { return id; }
+    const StreamStats& getStats() const { return stats; }
+};
+
+// Deterministic generator (SplitMix64). Its output is fully specified, unlike the
+// std:: distributions, so the same seed gives the same city on every platform.
+class CityRandom {
+private:
+    uint64_t state;
+    
+public:
+    explicit CityRandom(uint64_t seed) : state(seed) {}
+    
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    
+    // Uniform in [lo, hi) from the top 24 bits
+    float range(float lo, float hi) {
+        return lo + (hi - lo) * ((float)(next() >> 40) * (1.0f / 16777216.0f));
+    }
+    
+    // Seed for a sub-stream such as one tile, independent of generation order
+    static uint64_t mix(uint64_t seed, int64_t a, int64_t b) {
+        CityRandom random(seed ^ ((uint64_t)a * 0xD1B54A32D192ED03ull) ^ ((uint64_t)b * 0xABC98388FB8FAC03ull));
+        return random.next();
+    }
+    
+    // Seed for a stream that is not a tile. The salt goes through the generator before any
+    // tile-style mixing, so no tile coordinate can land on the same stream.
+    static uint64_t domain(uint64_t seed, uint64_t salt) {
+        CityRandom random(seed ^ (salt * 0x9FB21C651E98DF25ull));
+        random.next();
+        return random.next();
+    }
+};
+
+// Salts for CityRandom::domain
+enum RandomDomain : uint64_t {
+    RANDOM_TRAFFIC = 1,      // generateTraffic
+    RANDOM_LANES = 2,        // TrafficSimulation lanes, one sub-stream each
+    RANDOM_LANE_VEHICLES = 3 // TrafficSimulation vehicle speeds
+};
+
+// Packs two signed cell/tile coordinates into one hash key
+inline int64_t packCoords(int64_t x, int64_t z) {
+    return (int64_t)(((uint64_t)x << 32) | (uint32_t)z);
+}
+
+// Fixed set of worker threads fed from a FIFO job queue
+class WorkerPool {
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    int active;
+    bool stopping;
+    
+    void run() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+                active++;
+            }
+            job();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                active--;
+                if (jobs.empty() && active == 0)
+                    idle.notify_all();
+            }
+        }
+    }
+    
+public:
+    explicit WorkerPool(int count) : active(0), stopping(false) {
+        if (count <= 0)
+            count = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+        for (int i = 0; i < count; i++)
+            threads.emplace_back(&WorkerPool::run, this);
+    }
+    
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads)
+            thread.join();
+    }
+    
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        wake.notify_one();
+    }
+    
+    // Blocks until every submitted job has finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return jobs.empty() && active == 0; });
+    }
+    
+    int size() const { return (int)threads.size(); }
+    
+    // Runs body(begin, end) over [0, count) in chunks of about grain items. The caller works
+    // through chunks too and only waits for chunks already started, so unrelated queued
+    // jobs (e.g. tile generation) can never hold it up.
+    void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body) {
+        size_t chunks = (count + grain - 1) / grain;
+        if (chunks <= 1 || threads.empty()) {
+            if (count > 0)
+                body(0, count);
+            return;
+        }
+        
+        struct Shared {
+            std::atomic<size_t> next;
+            std::atomic<size_t> done;
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+        std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+        shared->next = 0;
+        shared->done = 0;
+        
+        // Helpers hold their own reference: they may only get to run after the caller has returned
+        auto work = [shared, chunks, grain, count, &body]() {
+            for (size_t chunk; (chunk = shared->next.fetch_add(1)) < chunks;) {
+                body(chunk * grain, std::min(count, (chunk + 1) * grain));
+                if (shared->done.fetch_add(1) + 1 == chunks) {
+                    std::lock_guard<std::mutex> lock(shared->mutex);
+                    shared->finished.notify_all();
+                }
+            }
+        };
+        size_t helpers = std::min(chunks - 1, threads.size());
+        for (size_t i = 0; i < helpers; i++) {
+            submit([shared, chunks, work]() {
+                if (shared->next.load() < chunks)
+                    work();
+            });
+        }
+        work();
+        
+        std::unique_lock<std::mutex> lock(shared->mutex);
+        shared->finished.wait(lock, [&] { return shared->done.load() == chunks; });
+    }
+};
+
+// Frame profiler: RAII CPU scopes, GL_TIME_ELAPSED query rings and per-frame counters, with a
+// rolling summary and Chrome trace-event export (chrome://tracing, Perfetto). Build with
+// NIGHTCITY_NO_PROFILE and the PROFILE_* macros expand to nothing.
+#ifndef NIGHTCITY_NO_PROFILE
+#define NIGHTCITY_PROFILE 1
+#endif
+
+enum ProfileCounter {
+    COUNTER_DRAW_CALLS,
+    COUNTER_TRIANGLES,
+    COUNTER_UNIFORM_UPLOADS, // glUniform* calls; the per-frame uniform block is one buffer write
+    COUNTER_COUNT
+};
+const char* const COUNTER_NAMES[COUNTER_COUNT] = { "draw_calls", "triangles", "uniform_uploads" };
+
+#ifdef NIGHTCITY_PROFILE
+struct ProfileEvent {
+    const char* name; // scope names are string literals
+    double startUs;   // since the profiler was created
+    double durationUs;
+    int thread;       // 0 is the main thread, workers count up; GPU_THREAD, COUNTER_THREAD
+    long long value;  // counter samples only
+};
+
+struct ProfileTotals {
+    double totalMs;
+    double maxMs;
+    int calls;
+};
+
+class Profiler {
+public:
+    static const int GPU_LATENCY = 4; // frames a timer query gets before its slot is reused
+    static const int GPU_PASSES = 16; // timed passes per frame
+    static const int GPU_THREAD = 1000;
+    static const int COUNTER_THREAD = -1;
+    
+private:
+    struct GpuFrame {
+        GLuint queries[GPU_PASSES];
+        const char* names[GPU_PASSES];
+        double issuedUs[GPU_PASSES];
+        int count;
+    };
+    
+    std::chrono::steady_clock::time_point origin;
+    std::mutex mutex; // guards cpu and events; scopes may close on worker threads
+    std::map<std::string, ProfileTotals, std::less<>> cpu, gpu;
+    std::vector<ProfileEvent> events;
+    std::atomic<int> nextThread;
+    
+    long long counters[COUNTER_COUNT];      // this frame
+    long long counterTotals[COUNTER_COUNT]; // since the last report
+    int frames;
+    double frameStartUs;
+    
+    bool gpuTiming;
+    bool gpuReady;
+    GpuFrame gpuFrames[GPU_LATENCY];
+    int gpuSlot;
+    bool gpuActive;
+    int gpuDropped;
+    
+    bool tracing;
+    int traceFramesLeft;
+    std::string tracePath;
+    
+    static void accumulate(std::map<std::string, ProfileTotals, std::less<>>& totals, const char* name, double ms) {
+        auto it = totals.find(name);
+        if (it == totals.end())
+            it = totals.emplace(name, ProfileTotals()).first;
+        it->second.totalMs += ms;
+        it->second.maxMs = std::max(it->second.maxMs, ms);
+        it->second.calls++;
+    }
+    
+    // Reads one ring slot. Results still in flight are dropped unless wait is set.
+    void collectGpu(GpuFrame& frame, bool wait) {
+        for (int i = 0; i < frame.count; i++) {
+            GLint available = GL_TRUE;
+            if (!wait)
+                glGetQueryObjectiv(frame.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) {
+                gpuDropped++;
+                continue;
+            }
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(frame.queries[i], GL_QUERY_RESULT, &ns);
+            double ms = ns / 1.0e6;
+            std::lock_guard<std::mutex> lock(mutex);
+            accumulate(gpu, frame.names[i], ms);
+            // GL_TIME_ELAPSED only gives durations, so passes are placed where they were issued
+            if (tracing)
+                events.push_back({ frame.names[i], frame.issuedUs[i], ms * 1000.0, GPU_THREAD, 0 });
+        }
+        frame.count = 0;
+    }
+    
+    void writeTrace() {
+        for (int i = 0; i < GPU_LATENCY; i++)
+            collectGpu(gpuFrames[(gpuSlot + i) % GPU_LATENCY], true);
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream json(tracePath);
+        json << "{\"traceEvents\":[\n";
+        json << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}},\n";
+        json << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << GPU_THREAD << ",\"args\":{\"name\":\"GPU\"}}";
+        json << std::fixed << std::setprecision(3);
+        for (const ProfileEvent& event : events) {
+            if (event.thread == COUNTER_THREAD)
+                json << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"C\",\"pid\":1,\"ts\":" << event.startUs
+                     << ",\"args\":{\"value\":" << event.value << "}}";
+            else
+                json << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+                     << ",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs << "}";
+        }
+        json << "\n]}\n";
+        std::cout << "Trace: " << events.size() << " events written to " << tracePath << std::endl;
+        events.clear();
+    }
+    
+public:
+    Profiler() : nextThread(0), frames(0), frameStartUs(0.0), gpuTiming(true), gpuReady(false), gpuSlot(0),
+                 gpuActive(false), gpuDropped(0), tracing(false), traceFramesLeft(0) {
+        origin = std::chrono::steady_clock::now();
+        memset(counters, 0, sizeof(counters));
+        memset(counterTotals, 0, sizeof(counterTotals));
+        threadIndex(); // the global is built on the main thread, which becomes thread 0
+    }
+    
+    int threadIndex() {
+        thread_local int index = -1;
+        if (index < 0)
+            index = nextThread++;
+        return index;
+    }
+    
+    double nowUs() const {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+    }
+    
+    void recordCpu(const char* name, double startUs, double endUs) {
+        int thread = threadIndex();
+        std::lock_guard<std::mutex> lock(mutex);
+        accumulate(cpu, name, (endUs - startUs) / 1000.0);
+        if (tracing)
+            events.push_back({ name, startUs, endUs - startUs, thread, 0 });
+    }
+    
+    // Counters and GPU passes belong to the GL thread
+    void count(ProfileCounter counter, long long n) { counters[counter] += n; }
+    
+    // GL_TIME_ELAPSED queries cannot nest; a pass begun inside another is not timed
+    bool beginGpu(const char* name) {
+        GpuFrame& frame = gpuFrames[gpuSlot];
+        if (!gpuTiming || !gpuReady || gpuActive || frame.count == GPU_PASSES)
+            return false;
+        frame.names[frame.count] = name;
+        frame.issuedUs[frame.count] = nowUs();
+        glBeginQuery(GL_TIME_ELAPSED, frame.queries[frame.count]);
+        frame.count++;
+        gpuActive = true;
+        return true;
+    }
+    
+    void endGpu() {
+        glEndQuery(GL_TIME_ELAPSED);
+        gpuActive = false;
+    }
+    
+    // Off when something else times the whole frame with its own GL_TIME_ELAPSED query
+    void setGpuTiming(bool enabled) { gpuTiming = enabled; }
+    
+    void beginFrame() {
+        if (!gpuReady) {
+            for (GpuFrame& frame : gpuFrames) {
+                glGenQueries(GPU_PASSES, frame.queries);
+                frame.count = 0;
+            }
+            gpuReady = true;
+        }
+        // The slot about to be reused was issued GPU_LATENCY frames ago
+        collectGpu(gpuFrames[gpuSlot], false);
+        frameStartUs = nowUs();
+    }
+    
+    void endFrame() {
+        double endUs = nowUs();
+        recordCpu("frame", frameStartUs, endUs);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int i = 0; i < COUNTER_COUNT; i++) {
+                if (tracing)
+                    events.push_back({ COUNTER_NAMES[i], endUs, 0.0, COUNTER_THREAD, counters[i] });
+                counterTotals[i] += counters[i];
+                counters[i] = 0;
+            }
+        }
+        frames++;
+        gpuSlot = (gpuSlot + 1) % GPU_LATENCY;
+        
+        if (tracing && --traceFramesLeft == 0) {
+            writeTrace();
+            tracing = false;
+        }
+    }
+    
+    void startTrace(const std::string& path, int frameCount) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tracePath = path;
+        traceFramesLeft = std::max(1, frameCount);
+        tracing = true;
+        events.clear();
+    }
+    
+    bool isTracing() const { return tracing; }
+    
+    // Per-frame averages since the last report, then starts a new window
+    void report(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (frames == 0)
+            return;
+        out << "Profile (" << frames << " frames, ms/frame avg/max):" << std::fixed << std::setprecision(2);
+        for (const auto& entry : cpu)
+            out << "  " << entry.first << " " << entry.second.totalMs / frames << "/" << entry.second.maxMs;
+        if (!gpu.empty()) {
+            out << "\n  GPU:";
+            for (const auto& entry : gpu)
+                out << "  " << entry.first << " " << entry.second.totalMs / frames << "/" << entry.second.maxMs;
+            if (gpuDropped > 0)
+                out << "  (" << gpuDropped << " late queries dropped)";
+        }
+        out << "\n  per frame:";
+        for (int i = 0; i < COUNTER_COUNT; i++)
+            out << "  " << COUNTER_NAMES[i] << " " << counterTotals[i] / frames;
+        out << std::defaultfloat << std::setprecision(6) << std::endl;
+        
+        cpu.clear();
+        gpu.clear();
+        memset(counterTotals, 0, sizeof(counterTotals));
+        frames = 0;
+        gpuDropped = 0;
+    }
+    
+    // Short form for the window title
+    std::string headline() {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto frame = cpu.find("frame");
+        double frameMs = frame == cpu.end() || frames == 0 ? 0.0 : frame->second.totalMs / frames;
+        double gpuMs = 0.0;
+        for (const auto& entry : gpu)
+            gpuMs += entry.second.totalMs;
+        char text[128];
+        snprintf(text, sizeof(text), "%.2f ms CPU frame, %.2f ms GPU, %lld draws", frameMs,
+                 frames ? gpuMs / frames : 0.0, frames ? counterTotals[COUNTER_DRAW_CALLS] / frames : 0);
+        return text;
+    }
+};
+// The queries are left to the context: the global outlives it
+Profiler profiler;
+
+class CpuScope {
+private:
+    const char* name;
+    double startUs;
+    
+public:
+    explicit CpuScope(const char* scopeName) : name(scopeName), startUs(profiler.nowUs()) {}
+    ~CpuScope() { profiler.recordCpu(name, startUs, profiler.nowUs()); }
+};
+
+class GpuScope {
+private:
+    bool timed;
+    
+public:
+    explicit GpuScope(const char* name) : timed(profiler.beginGpu(name)) {}
+    ~GpuScope() {
+        if (timed)
+            profiler.endGpu();
+    }
+};
+
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+#define PROFILE_SCOPE(name) CpuScope PROFILE_JOIN(profileScope, __LINE__)(name)
+#define PROFILE_GPU(name) GpuScope PROFILE_JOIN(gpuScope, __LINE__)(name)
+#define PROFILE_COUNT(counter, n) profiler.count(counter, n)
+#define PROFILE_BEGIN_FRAME() profiler.beginFrame()
+#define PROFILE_END_FRAME() profiler.endFrame()
+#else
+#define PROFILE_SCOPE(name) ((void)0)
+#define PROFILE_GPU(name) ((void)0)
+#define PROFILE_COUNT(counter, n) ((void)0)
+#define PROFILE_BEGIN_FRAME() ((void)0)
+#define PROFILE_END_FRAME() ((void)0)
+#endif
+
+// 3D Object classes
+const glm::vec3 VEHICLE_SCALE(1.5f, 0.5f, 3.0f);
+const glm::vec3 BILLBOARD_SCALE(3.0f, 2.0f, 0.1f);
+// Reach and strength of the point lights vehicles and billboards become with clustered lighting
+const float VEHICLE_LIGHT_RADIUS = 15.0f, VEHICLE_LIGHT_INTENSITY = 1.5f;
+const float BILLBOARD_LIGHT_RADIUS = 25.0f, BILLBOARD_LIGHT_INTENSITY = 1.0f;
+
+struct Building {
+    glm::vec3 position;
+    glm::vec3 scale;
+    glm::vec3 color;
+    float emissionStrength;
+    glm::vec3 emissionColor;
+    
+    Building() {} // filled in by bulk loads
+    Building(glm::vec3 pos, glm::vec3 sc, glm::vec3 col, float emission = 0.0f, glm::vec3 emCol = glm::vec3(0.0f)) 
+        : position(pos), scale(sc), color(col), emissionStrength(emission), emissionColor(emCol) {}
+    
+    glm::mat4 modelMatrix() const {
+        glm::mat4 model = glm::mat4(1.0f);
+        model = glm::translate(model, position);
+        model = glm::scale(model, scale);
+        return model;
+    }
+};
+
+struct Vehicle {
+    glm::vec3 position;
+    glm::vec3 direction;
+    float speed;
+    glm::vec3 color;
+    float pathRadius;
+    float pathAngle;
+    
+    Vehicle(glm::vec3 pos, glm::vec3 dir, float sp, glm::vec3 col, float radius = 30.0f) 
+        : position(pos), direction(dir), speed(sp), color(col), pathRadius(radius), pathAngle(0.0f) {}
+    
+    void update(float deltaTime) {
+        pathAngle += speed * deltaTime;
+        position.x = pathRadius * cos(pathAngle);
+        position.z = pathRadius * sin(pathAngle);
+    }
+    
+    glm::mat4 modelMatrix() const {
+        glm::mat4 model = glm::mat4(1.0f);
+        model = glm::translate(model, position);
+        model = glm::scale(model, VEHICLE_SCALE);
+        return model;
+    }
+};
+
+struct Billboard {
+    glm::vec3 position;
+    float rotation;
+    float rotationSpeed;
+    glm::vec3 color;
+    
+    Billboard(glm::vec3 pos, float rotSpeed, glm::vec3 col) 
+        : position(pos), rotation(0.0f), rotationSpeed(rotSpeed), color(col) {}
+    
+    void update(float deltaTime) {
+        rotation += rotationSpeed * deltaTime;
+    }
+    
+    glm::mat4 modelMatrix() const {
+        glm::mat4 model = glm::mat4(1.0f);
+        model = glm::translate(model, position);
+        model = glm::rotate(model, glm::radians(rotation), glm::vec3(0.0f, 1.0f, 0.0f));
+        model = glm::scale(model, BILLBOARD_SCALE);
+        return model;
+    }
+};
+
+// Batched sine and cosine. The SSE2 path is the Cephes single-precision approximation
+// (range reduction by pi/4, degree 6/7 polynomials), accurate to about 1e-7 for the angles used here.
+void sincosBatch(const float* angles, float* sines, float* cosines, size_t count) {
+    size_t i = 0;
+#ifdef NIGHTCITY_SSE
+    const __m128 signMask = _mm_castsi128_ps(_mm_set1_epi32((int)0x80000000));
+    const __m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2), four = _mm_set1_epi32(4);
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(angles + i);
+        __m128 sinSign = _mm_and_ps(x, signMask);
+        x = _mm_andnot_ps(signMask, x);
+        
+        // Octant index rounded up to even
+        __m128i octant = _mm_cvttps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.27323954473516f)));
+        octant = _mm_and_si128(_mm_add_epi32(octant, one), _mm_set1_epi32(~1));
+        __m128 y = _mm_cvtepi32_ps(octant);
+        
+        __m128 swapSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(octant, four), 29));
+        __m128 polyMask = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(octant, two), _mm_setzero_si128()));
+        __m128 cosSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_andnot_si128(_mm_sub_epi32(octant, two), four), 29));
+        sinSign = _mm_xor_ps(sinSign, swapSign);
+        
+        // Extended-precision reduction x - y * pi/4
+        x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(0.78515625f)));
+        x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(2.4187564849853515625e-4f)));
+        x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(3.77489497744594108e-8f)));
+        __m128 z = _mm_mul_ps(x, x);
+        
+        __m128 cosPoly = _mm_set1_ps(2.443315711809948e-5f);
+        cosPoly = _mm_add_ps(_mm_mul_ps(cosPoly, z), _mm_set1_ps(-1.388731625493765e-3f));
+        cosPoly = _mm_add_ps(_mm_mul_ps(cosPoly, z), _mm_set1_ps(4.166664568298827e-2f));
+        cosPoly = _mm_mul_ps(_mm_mul_ps(cosPoly, z), z);
+        cosPoly = _mm_add_ps(_mm_sub_ps(cosPoly, _mm_mul_ps(z, _mm_set1_ps(0.5f))), _mm_set1_ps(1.0f));
+        
+        __m128 sinPoly = _mm_set1_ps(-1.9515295891e-4f);
+        sinPoly = _mm_add_ps(_mm_mul_ps(sinPoly, z), _mm_set1_ps(8.3321608736e-3f));
+        sinPoly = _mm_add_ps(_mm_mul_ps(sinPoly, z), _mm_set1_ps(-1.6666654611e-1f));
+        sinPoly = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(sinPoly, z), x), x);
+        
+        // Octants 1,2,5,6 swap the roles of the two polynomials
+        __m128 sinValue = _mm_or_ps(_mm_and_ps(polyMask, sinPoly), _mm_andnot_ps(polyMask, cosPoly));
+        __m128 cosValue = _mm_or_ps(_mm_and_ps(polyMask, cosPoly), _mm_andnot_ps(polyMask, sinPoly));
+        _mm_storeu_ps(sines + i, _mm_xor_ps(sinValue, sinSign));
+        _mm_storeu_ps(cosines + i, _mm_xor_ps(cosValue, cosSign));
+    }
+#endif
+    for (; i < count; i++) {
+        sines[i] = std::sin(angles[i]);
+        cosines[i] = std::cos(angles[i]);
+    }
+}
+
+// Simulation state of all vehicles as structure-of-arrays, so the update kernel
+// streams through exactly the fields it needs
+struct VehicleArrays {
+    std::vector<float> pathAngle, pathRadius, speed;
+    std::vector<float> positionX, positionY, positionZ;
+    std::vector<glm::vec3> color;
+    
+    size_t size() const { return pathAngle.size(); }
+    
+    void push(const Vehicle& vehicle) {
+        pathAngle.push_back(vehicle.pathAngle);
+        pathRadius.push_back(vehicle.pathRadius);
+        speed.push_back(vehicle.speed);
+        positionX.push_back(vehicle.position.x);
+        positionY.push_back(vehicle.position.y);
+        positionZ.push_back(vehicle.position.z);
+        color.push_back(vehicle.color);
+    }
+    
+    glm::vec3 position(size_t i) const { return glm::vec3(positionX[i], positionY[i], positionZ[i]); }
+    
+    glm::mat4 modelMatrix(size_t i) const {
+        glm::mat4 model = glm::mat4(1.0f);
+        model = glm::translate(model, position(i));
+        model = glm::scale(model, VEHICLE_SCALE);
+        return model;
+    }
+    
+    // Same integration as Vehicle::update for [begin, end)
+    void update(size_t begin, size_t end, float deltaTime) {
+        float* angle = pathAngle.data();
+        const float* rate = speed.data();
+        for (size_t i = begin; i < end; i++)
+            angle[i] += rate[i] * deltaTime;
+        
+        // Sines land in Z and cosines in X, then both are scaled by the radius in place
+        sincosBatch(angle + begin, positionZ.data() + begin, positionX.data() + begin, end - begin);
+        float* x = positionX.data();
+        float* z = positionZ.data();
+        const float* radius = pathRadius.data();
+        for (size_t i = begin; i < end; i++) {
+            x[i] *= radius[i];
+            z[i] *= radius[i];
+        }
+    }
+};
+
+struct BillboardArrays {
+    std::vector<float> rotation, rotationSpeed;
+    std::vector<glm::vec3> position;
+    std::vector<glm::vec3> color;
+    
+    size_t size() const { return rotation.size(); }
+    
+    void push(const Billboard& billboard) {
+        rotation.push_back(billboard.rotation);
+        rotationSpeed.push_back(billboard.rotationSpeed);
+        position.push_back(billboard.position);
+        color.push_back(billboard.color);
+    }
+    
+    // The spinning panel relative to its fixed anchor at position[i]
+    glm::mat4 panelMatrix(size_t i) const {
+        glm::mat4 model = glm::rotate(glm::mat4(1.0f), glm::radians(rotation[i]), glm::vec3(0.0f, 1.0f, 0.0f));
+        return glm::scale(model, BILLBOARD_SCALE);
+    }
+    
+    void update(size_t begin, size_t end, float deltaTime) {
+        float* angle = rotation.data();
+        const float* rate = rotationSpeed.data();
+        for (size_t i = begin; i < end; i++)
+            angle[i] += rate[i] * deltaTime;
+    }
+};
+
+// Objects per worker chunk in the simulation update; smaller counts stay on the calling thread
+const size_t SIMULATION_GRAIN = 16384;
+
+// Single-producer, single-consumer triple buffer. The writer fills its back slot and swaps it
+// into the middle; the reader swaps the middle into front only when it holds something newer.
+// Neither side ever waits, and the slot the reader holds is never written.
+template <typename T>
+class TripleBuffer {
+private:
+    static const int FRESH = 4; // set on the middle index when it has not been read yet
+    
+    T slots[3];
+    std::atomic<int> middle;
+    int back;  // writer only
+    int front; // reader only
+    
+public:
+    TripleBuffer() : middle(1), back(0), front(2) {}
+    
+    T& writeSlot() { return slots[back]; }
+    
+    void publish() {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+    }
+    
+    // Takes the newest published value if there is one; returns false when front is current
+    bool acquire() {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH))
+            return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+    
+    const T& readSlot() const { return slots[front]; }
+};
+
+// State published after each batch of ticks. It carries the tick before as well, so the
+// renderer can interpolate from one snapshot without holding on to the previous one.
+struct SimulationSnapshot {
+    uint64_t tick;
+    double time;                                // simulation time at this tick
+    std::chrono::steady_clock::time_point due;  // wall-clock time the tick stands for
+    std::vector<float> vehicleAngle[2];         // [0] previous tick, [1] this tick
+    std::vector<float> billboardRotation[2];
+};
+
+struct SimulationStats {
+    uint64_t ticks;
+    uint64_t dropped; // ticks skipped after a stall longer than the catch-up limit
+    double tickMs;    // average cost of one tick
+};
+
+// Runs the vehicle and billboard update at a fixed rate on its own thread, on private copies
+// of their arrays, so frame time and simulation cost no longer feed into each other.
+class SimulationThread {
+private:
+    static const int MAX_CATCH_UP = 5; // ticks run back to back before the backlog is dropped
+    
+    VehicleArrays vehicles;
+    BillboardArrays billboards;
+    WorkerPool& workers;
+    std::chrono::steady_clock::duration tickDuration;
+    double tickSeconds;
+    uint64_t tick;
+    double time;
+    std::vector<float> previousAngle, previousRotation;
+    
+    TripleBuffer<SimulationSnapshot> snapshots;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> ticks, dropped;
+    std::atomic<long long> tickNanoseconds;
+    std::thread thread;
+    
+    void step() {
+        PROFILE_SCOPE("simulation tick");
+        auto start = std::chrono::steady_clock::now();
+        previousAngle = vehicles.pathAngle;
+        previousRotation = billboards.rotation;
+        workers.parallelFor(vehicles.size(), SIMULATION_GRAIN, [&](size_t begin, size_t end) {
+            vehicles.update(begin, end, (float)tickSeconds);
+        });
+        workers.parallelFor(billboards.size(), SIMULATION_GRAIN, [&](size_t begin, size_t end) {
+            billboards.update(begin, end, (float)tickSeconds);
+        });
+        tick++;
+        time += tickSeconds;
+        ticks++;
+        tickNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+    
+    void publish(std::chrono::steady_clock::time_point due) {
+        SimulationSnapshot& snapshot = snapshots.writeSlot();
+        snapshot.tick = tick;
+        snapshot.time = time;
+        snapshot.due = due;
+        snapshot.vehicleAngle[0] = previousAngle;
+        snapshot.vehicleAngle[1] = vehicles.pathAngle;
+        snapshot.billboardRotation[0] = previousRotation;
+        snapshot.billboardRotation[1] = billboards.rotation;
+        snapshots.publish();
+    }
+    
+    void run() {
+        auto next = std::chrono::steady_clock::now() + tickDuration;
+        while (running) {
+            std::this_thread::sleep_until(next);
+            
+            int steps = 0;
+            auto now = std::chrono::steady_clock::now();
+            for (; next <= now && steps < MAX_CATCH_UP; steps++) {
+                step();
+                next += tickDuration;
+            }
+            // After a long stall, give up on the lost time rather than spiral
+            if (next <= now) {
+                dropped += (uint64_t)((now - next) / tickDuration) + 1;
+                next = now + tickDuration;
+            }
+            if (steps > 0)
+                publish(next - tickDuration);
+        }
+    }
+    
+public:
+    // Starts from the given state at simulation time startTime
+    SimulationThread(const VehicleArrays& vehicleState, const BillboardArrays& billboardState, double startTime,
+                     int tickRate, WorkerPool& pool)
+        : vehicles(vehicleState), billboards(billboardState), workers(pool), tick(0), time(startTime),
+          running(true), ticks(0), dropped(0), tickNanoseconds(0) {
+        tickSeconds = 1.0 / tickRate;
+        tickDuration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(tickSeconds));
+        previousAngle = vehicles.pathAngle;
+        previousRotation = billboards.rotation;
+        publish(std::chrono::steady_clock::now());
+        thread = std::thread(&SimulationThread::run, this);
+    }
+    
+    ~SimulationThread() {
+        running = false;
+        thread.join();
+    }
+    
+    // Render thread: the newest snapshot, valid until the next call
+    const SimulationSnapshot& latest() {
+        snapshots.acquire();
+        return snapshots.readSlot();
+    }
+    
+    double getTickSeconds() const { return tickSeconds; }
+    
+    SimulationStats getStats() const {
+        SimulationStats stats;
+        stats.ticks = ticks;
+        stats.dropped = dropped;
+        stats.tickMs = stats.ticks ? tickNanoseconds / 1.0e6 / stats.ticks : 0.0;
+        return stats;
+    }
+};
+
+// Per-instance attributes for the instanced path (locations 3-9 in the vertex shader)
+struct InstanceData {
+    glm::mat4 model;
+    glm::vec3 color;
+    float emissionStrength;
+    glm::vec3 emissionColor;
+    
+    InstanceData() {} // filled in by bulk loads
+    InstanceData(const glm::mat4& m, glm::vec3 col, float emission, glm::vec3 emCol)
+        : model(m), color(col), emissionStrength(emission), emissionColor(emCol) {}
+};
+
+// Inverse transpose of the upper 3x3, computed once per object rather than per vertex
+glm::mat3 normalMatrix(const glm::mat4& model) {
+    return glm::transpose(glm::inverse(glm::mat3(model)));
+}
+
+// Instances that rotate need their own normal matrix (locations 10-12); translate+scale
+// instances get by with InstanceData and the AXIS_ALIGNED shader
+struct OrientedInstanceData {
+    InstanceData instance;
+    glm::mat3 normalMatrix;
+    
+    OrientedInstanceData(const glm::mat4& m, glm::vec3 col, float emission, glm::vec3 emCol)
+        : instance(m, col, emission, emCol), normalMatrix(::normalMatrix(m)) {}
+};
+
+// Static per-instance parameters for the GPU-animated path (locations 3, 4 and 7-9).
+// Vehicles orbit origin at radius; billboards sit at origin and spin.
+struct AnimatedInstance {
+    glm::vec3 origin;
+    glm::vec4 animation; // radius, start angle, rate (rad/s), spin
+    glm::vec3 color;
+    float emissionStrength;
+    glm::vec3 emissionColor;
+    
+    AnimatedInstance(glm::vec3 org, glm::vec4 anim, glm::vec3 col, float emission, glm::vec3 emCol)
+        : origin(org), animation(anim), color(col), emissionStrength(emission), emissionColor(emCol) {}
+};
+
+enum ObjectCategory {
+    CATEGORY_BUILDINGS,
+    CATEGORY_VEHICLES,
+    CATEGORY_BILLBOARDS,
+    CATEGORY_COUNT
+};
+
+// View frustum as six inward-facing planes (Gribb/Hartmann extraction from projection * view)
+struct Frustum {
+    glm::vec4 planes[6];
+    glm::vec3 absNormals[6];
+    glm::vec3 boundsMin, boundsMax; // world-space box around the frustum corners
+    
+    explicit Frustum(const glm::mat4& viewProjection) {
+        for (int i = 0; i < 3; i++) {
+            for (int side = 0; side < 2; side++) {
+                float sign = side == 0 ? 1.0f : -1.0f;
+                glm::vec4& plane = planes[i * 2 + side];
+                for (int c = 0; c < 4; c++)
+                    plane[c] = viewProjection[c][3] + sign * viewProjection[c][i];
+                plane = plane / glm::length(glm::vec3(plane));
+                absNormals[i * 2 + side] = glm::abs(glm::vec3(plane));
+            }
+        }
+        
+        glm::mat4 inverse = glm::inverse(viewProjection);
+        boundsMin = glm::vec3(1e30f);
+        boundsMax = glm::vec3(-1e30f);
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec4 ndc((corner & 1) ? 1.0f : -1.0f, (corner & 2) ? 1.0f : -1.0f, (corner & 4) ? 1.0f : -1.0f, 1.0f);
+            glm::vec4 world = inverse * ndc;
+            glm::vec3 point = glm::vec3(world) / world.w;
+            boundsMin = glm::min(boundsMin, point);
+            boundsMax = glm::max(boundsMax, point);
+        }
+    }
+    
+    enum Result { OUTSIDE, INTERSECTS, INSIDE };
+    
+    Result classify(const glm::vec3& center, const glm::vec3& extent) const {
+        Result result = INSIDE;
+        for (int p = 0; p < 6; p++) {
+            float distance = glm::dot(glm::vec3(planes[p]), center) + planes[p].w;
+            float radius = glm::dot(absNormals[p], extent);
+            if (distance + radius < 0.0f)
+                return OUTSIDE;
+            if (distance - radius < 0.0f)
+                result = INTERSECTS;
+        }
+        return result;
+    }
+};
+
+// Axis-aligned boxes (center and half-extent) stored as structure-of-arrays so they can be tested four at a time
+// Flat byte images for scene files: raw arrays back to back, read back with memcpy
+template <typename T>
+void appendArray(std::vector<char>& out, const T* data, size_t count) {
+    const char* bytes = (const char*)data;
+    out.insert(out.end(), bytes, bytes + count * sizeof(T));
+}
+
+// Reads count elements and advances the cursor; false if the image is too short
+template <typename T>
+bool readArray(const char*& cursor, const char* end, std::vector<T>& out, size_t count) {
+    if (count > (size_t)(end - cursor) / sizeof(T)) // count * sizeof(T) could overflow
+        return false;
+    out.resize(count);
+    if (count > 0)
+        memcpy(out.data(), cursor, count * sizeof(T));
+    cursor += count * sizeof(T);
+    return true;
+}
+
+struct BoxArray {
+    std::vector<float> centerX, centerY, centerZ;
+    std::vector<float> extentX, extentY, extentZ;
+    
+    void push(const glm::vec3& center, const glm::vec3& extent) {
+        centerX.push_back(center.x);
+        centerY.push_back(center.y);
+        centerZ.push_back(center.z);
+        extentX.push_back(extent.x);
+        extentY.push_back(extent.y);
+        extentZ.push_back(extent.z);
+    }
+    
+    void set(size_t i, const glm::vec3& center) {
+        centerX[i] = center.x;
+        centerY[i] = center.y;
+        centerZ[i] = center.z;
+    }
+    
+    void clear() {
+        centerX.clear(); centerY.clear(); centerZ.clear();
+        extentX.clear(); extentY.clear(); extentZ.clear();
+    }
+    
+    size_t size() const { return centerX.size(); }
+};
+
+// Appends ids[i] for every box i in [begin, end) that is not completely outside the frustum
+void cullBoxes(const BoxArray& boxes, size_t begin, size_t end, const uint32_t* ids,
+               const Frustum& frustum, std::vector<uint32_t>& visible) {
+    size_t i = begin;
+#ifdef NIGHTCITY_SSE
+    const __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= end; i += 4) {
+        __m128 cx = _mm_loadu_ps(&boxes.centerX[i]);
+        __m128 cy = _mm_loadu_ps(&boxes.centerY[i]);
+        __m128 cz = _mm_loadu_ps(&boxes.centerZ[i]);
+        __m128 ex = _mm_loadu_ps(&boxes.extentX[i]);
+        __m128 ey = _mm_loadu_ps(&boxes.extentY[i]);
+        __m128 ez = _mm_loadu_ps(&boxes.extentZ[i]);
+        
+        __m128 inside = _mm_cmpeq_ps(zero, zero);
+        for (int p = 0; p < 6; p++) {
+            const glm::vec4& plane = frustum.planes[p];
+            const glm::vec3& absNormal = frustum.absNormals[p];
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(plane.x)), _mm_mul_ps(cy, _mm_set1_ps(plane.y))),
+                                         _mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+            __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, _mm_set1_ps(absNormal.x)), _mm_mul_ps(ey, _mm_set1_ps(absNormal.y))),
+                                       _mm_mul_ps(ez, _mm_set1_ps(absNormal.z)));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(distance, radius), zero));
+        }
+        
+        int mask = _mm_movemask_ps(inside);
+        for (int lane = 0; lane < 4; lane++) {
+            if (mask & (1 << lane))
+                visible.push_back(ids[i + lane]);
+        }
+    }
+#endif
+    for (; i < end; i++) {
+        glm::vec3 center(boxes.centerX[i], boxes.centerY[i], boxes.centerZ[i]);
+        glm::vec3 extent(boxes.extentX[i], boxes.extentY[i], boxes.extentZ[i]);
+        if (frustum.classify(center, extent) != Frustum::OUTSIDE)
+            visible.push_back(ids[i]);
+    }
+}
+
+// Uniform XZ grid over the static buildings, built once after generation.
+// Buildings are filed by center and stored cell by cell, so each cell is one contiguous SIMD batch.
+class BuildingGrid {
+private:
+    float cellSize;
+    glm::vec2 origin;
+    int cellsX, cellsZ;
+    float maxHalfWidth;
+    std::vector<uint32_t> cellStart; // cellsX * cellsZ + 1 offsets into boxes/ids
+    std::vector<glm::vec3> cellMin, cellMax;
+    BoxArray boxes;
+    std::vector<uint32_t> ids;
+    
+    int cellIndex(int x, int z) const { return z * cellsX + x; }
+    
+    int cellCoord(float value, float base, int count) const {
+        return glm::clamp((int)std::floor((value - base) / cellSize), 0, count - 1);
+    }
+    
+public:
+    BuildingGrid() : cellSize(1.0f), origin(0.0f), cellsX(0), cellsZ(0), maxHalfWidth(0.0f) {}
+    
+    void build(const std::vector<Building>& buildings, float size) {
+        cellSize = size;
+        boxes.clear();
+        ids.clear();
+        if (buildings.empty()) {
+            cellsX = cellsZ = 0;
+            cellStart.assign(1, 0);
+            return;
+        }
+        
+        glm::vec2 lo(1e30f), hi(-1e30f);
+        maxHalfWidth = 0.0f;
+        for (const auto& building : buildings) {
+            lo = glm::vec2(std::min(lo.x, building.position.x), std::min(lo.y, building.position.z));
+            hi = glm::vec2(std::max(hi.x, building.position.x), std::max(hi.y, building.position.z));
+            maxHalfWidth = std::max(maxHalfWidth, 0.5f * std::max(building.scale.x, building.scale.z));
+        }
+        origin = lo;
+        cellsX = (int)((hi.x - lo.x) / cellSize) + 1;
+        cellsZ = (int)((hi.y - lo.y) / cellSize) + 1;
+        
+        // Counting sort of buildings into cells
+        std::vector<int> cellOf(buildings.size());
+        cellStart.assign(cellsX * cellsZ + 1, 0);
+        for (size_t i = 0; i < buildings.size(); i++) {
+            int x = cellCoord(buildings[i].position.x, origin.x, cellsX);
+            int z = cellCoord(buildings[i].position.z, origin.y, cellsZ);
+            cellOf[i] = cellIndex(x, z);
+            cellStart[cellOf[i] + 1]++;
+        }
+        for (int c = 0; c < cellsX * cellsZ; c++)
+            cellStart[c + 1] += cellStart[c];
+        
+        std::vector<uint32_t> cursor(cellStart.begin(), cellStart.end() - 1);
+        ids.resize(buildings.size());
+        for (size_t i = 0; i < buildings.size(); i++)
+            ids[cursor[cellOf[i]]++] = (uint32_t)i;
+        
+        cellMin.assign(cellsX * cellsZ, glm::vec3(1e30f));
+        cellMax.assign(cellsX * cellsZ, glm::vec3(-1e30f));
+        for (int c = 0; c < cellsX * cellsZ; c++) {
+            for (uint32_t k = cellStart[c]; k < cellStart[c + 1]; k++) {
+                const Building& building = buildings[ids[k]];
+                glm::vec3 extent = building.scale * 0.5f;
+                boxes.push(building.position, extent);
+                cellMin[c] = glm::min(cellMin[c], building.position - extent);
+                cellMax[c] = glm::max(cellMax[c], building.position + extent);
+            }
+        }
+    }
+    
+    // Scene file image: a small header, then every array as stored in memory
+    void save(std::vector<char>& out) const {
+        float header[] = { cellSize, origin.x, origin.y, maxHalfWidth };
+        int32_t cells[] = { cellsX, cellsZ, (int32_t)boxes.size() };
+        size_t cellCount = (size_t)cellsX * cellsZ;
+        appendArray(out, header, 4);
+        appendArray(out, cells, 3);
+        appendArray(out, cellStart.data(), cellCount + 1);
+        appendArray(out, cellMin.data(), cellCount);
+        appendArray(out, cellMax.data(), cellCount);
+        const std::vector<float>* columns[] = { &boxes.centerX, &boxes.centerY, &boxes.centerZ,
+                                                &boxes.extentX, &boxes.extentY, &boxes.extentZ };
+        for (const std::vector<float>* column : columns)
+            appendArray(out, column->data(), column->size());
+        appendArray(out, ids.data(), ids.size());
+    }
+    
+    // False for a short or inconsistent image, which would otherwise index out of bounds in cull
+    bool load(const char* data, size_t size) {
+        const char* cursor = data;
+        const char* end = data + size;
+        std::vector<float> header;
+        std::vector<int32_t> cells;
+        if (!readArray(cursor, end, header, 4) || !readArray(cursor, end, cells, 3))
+            return false;
+        if (cells[0] < 0 || cells[1] < 0 || cells[2] < 0 || (cells[0] == 0) != (cells[1] == 0) ||
+            !(header[0] > 0.0f && header[0] < 1e30f) || !(std::fabs(header[3]) < 1e30f))
+            return false;
+        cellSize = header[0];
+        origin = glm::vec2(header[1], header[2]);
+        maxHalfWidth = header[3];
+        cellsX = cells[0];
+        cellsZ = cells[1];
+        size_t cellCount = (size_t)cellsX * cellsZ, boxCount = (size_t)cells[2];
+        
+        std::vector<float>* columns[] = { &boxes.centerX, &boxes.centerY, &boxes.centerZ,
+                                          &boxes.extentX, &boxes.extentY, &boxes.extentZ };
+        if (!readArray(cursor, end, cellStart, cellCount + 1) || !readArray(cursor, end, cellMin, cellCount) ||
+            !readArray(cursor, end, cellMax, cellCount))
+            return false;
+        for (std::vector<float>* column : columns) {
+            if (!readArray(cursor, end, *column, boxCount))
+                return false;
+        }
+        if (!readArray(cursor, end, ids, boxCount))
+            return false;
+        
+        // Cell ranges run in order from 0 to boxCount and ids stay within the boxes
+        if (cellStart[0] != 0 || cellStart[cellCount] != boxCount)
+            return false;
+        for (size_t c = 0; c < cellCount; c++) {
+            if (cellStart[c] > cellStart[c + 1])
+                return false;
+        }
+        for (uint32_t id : ids) {
+            if (id >= boxCount)
+                return false;
+        }
+        return true;
+    }
+    
+    size_t size() const { return ids.size(); }
+    
+    // Only cells under the frustum's bounding box are visited, so cost follows what is in view
+    void cull(const Frustum& frustum, std::vector<uint32_t>& visible) const {
+        if (cellsX == 0)
+            return;
+        
+        int x0 = cellCoord(frustum.boundsMin.x - maxHalfWidth, origin.x, cellsX);
+        int x1 = cellCoord(frustum.boundsMax.x + maxHalfWidth, origin.x, cellsX);
+        int z0 = cellCoord(frustum.boundsMin.z - maxHalfWidth, origin.y, cellsZ);
+        int z1 = cellCoord(frustum.boundsMax.z + maxHalfWidth, origin.y, cellsZ);
+        
+        for (int z = z0; z <= z1; z++) {
+            for (int x = x0; x <= x1; x++) {
+                int c = cellIndex(x, z);
+                uint32_t begin = cellStart[c], end = cellStart[c + 1];
+                if (begin == end)
+                    continue;
+                
+                glm::vec3 center = (cellMin[c] + cellMax[c]) * 0.5f;
+                glm::vec3 extent = (cellMax[c] - cellMin[c]) * 0.5f;
+                Frustum::Result result = frustum.classify(center, extent);
+                if (result == Frustum::INSIDE)
+                    visible.insert(visible.end(), ids.begin() + begin, ids.begin() + end);
+                else if (result == Frustum::INTERSECTS)
+                    cullBoxes(boxes, begin, end, ids.data(), frustum, visible);
+            }
+        }
+    }
+};
+
+// Loose hash grid for moving objects. Each object remembers its cell and is only
+// re-filed when it crosses into another one (or leaves the cell's height range), so
+// keeping the grid current costs a parallel scan plus work proportional to the movers.
+// Positions are not copied: callers pass their own coordinate arrays.
+class DynamicGrid {
+private:
+    struct Cell {
+        std::vector<uint32_t> objects;
+        float minY, maxY;
+    };
+    
+    float cellSize;
+    glm::vec3 objectExtent;
+    std::unordered_map<int64_t, Cell> cells;
+    std::vector<int64_t> objectCell;
+    std::vector<uint32_t> objectSlot;
+    std::vector<std::vector<uint32_t>> moved;
+    
+    int64_t cellKey(float x, float z) const {
+        return packCoords((int64_t)std::floor(x / cellSize), (int64_t)std::floor(z / cellSize));
+    }
+    
+    void insert(uint32_t id, int64_t key, float y) {
+        Cell& cell = cells[key];
+        if (cell.objects.empty()) {
+            cell.minY = y;
+            cell.maxY = y;
+        }
+        cell.minY = std::min(cell.minY, y);
+        cell.maxY = std::max(cell.maxY, y);
+        objectCell[id] = key;
+        objectSlot[id] = (uint32_t)cell.objects.size();
+        cell.objects.push_back(id);
+    }
+    
+    void remove(uint32_t id) {
+        auto it = cells.find(objectCell[id]);
+        std::vector<uint32_t>& objects = it->second.objects;
+        uint32_t last = objects.back();
+        objects[objectSlot[id]] = last;
+        objectSlot[last] = objectSlot[id];
+        objects.pop_back();
+        if (objects.empty())
+            cells.erase(it);
+    }
+    
+public:
+    DynamicGrid() : cellSize(16.0f), objectExtent(0.0f) {}
+    
+    void reset(float size, const glm::vec3& extent) {
+        cellSize = size;
+        objectExtent = extent;
+        cells.clear();
+        objectCell.clear();
+        objectSlot.clear();
+    }
+    
+    const glm::vec3& extent() const { return objectExtent; }
+    
+    void add(const glm::vec3& position) {
+        uint32_t id = (uint32_t)objectCell.size();
+        objectCell.push_back(0);
+        objectSlot.push_back(0);
+        insert(id, cellKey(position.x, position.z), position.y);
+    }
+    
+    // Finds the objects that left their cell in parallel (read-only), then re-files just those
+    void update(const float* x, const float* y, const float* z, WorkerPool& workers) {
+        size_t count = objectCell.size();
+        size_t chunks = (count + SIMULATION_GRAIN - 1) / SIMULATION_GRAIN;
+        moved.resize(std::max(chunks, moved.size()));
+        for (auto& list : moved)
+            list.clear();
+        workers.parallelFor(count, SIMULATION_GRAIN, [&](size_t begin, size_t end) {
+            std::vector<uint32_t>& out = moved[begin / SIMULATION_GRAIN];
+            for (size_t i = begin; i < end; i++) {
+                if (cellKey(x[i], z[i]) != objectCell[i]) {
+                    out.push_back((uint32_t)i);
+                    continue;
+                }
+                const Cell& cell = cells.find(objectCell[i])->second;
+                if (y[i] < cell.minY || y[i] > cell.maxY)
+                    out.push_back((uint32_t)i);
+            }
+        });
+        
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            for (uint32_t id : moved[chunk]) {
+                remove(id);
+                insert(id, cellKey(x[id], z[id]), y[id]);
+            }
+        }
+    }
+    
+    void cull(const Frustum& frustum, const float* x, const float* y, const float* z,
+              std::vector<uint32_t>& visible) const {
+        for (const auto& entry : cells) {
+            const Cell& cell = entry.second;
+            float cellX = (float)(entry.first >> 32) * cellSize;
+            float cellZ = (float)(int32_t)(entry.first & 0xffffffff) * cellSize;
+            glm::vec3 lo = glm::vec3(cellX, cell.minY, cellZ) - objectExtent;
+            glm::vec3 hi = glm::vec3(cellX + cellSize, cell.maxY, cellZ + cellSize) + objectExtent;
+            
+            Frustum::Result result = frustum.classify((lo + hi) * 0.5f, (hi - lo) * 0.5f);
+            if (result == Frustum::INSIDE) {
+                visible.insert(visible.end(), cell.objects.begin(), cell.objects.end());
+            } else if (result == Frustum::INTERSECTS) {
+                for (uint32_t id : cell.objects) {
+                    if (frustum.classify(glm::vec3(x[id], y[id], z[id]), objectExtent) != Frustum::OUTSIDE)
+                        visible.push_back(id);
+                }
+            }
+        }
+    }
+};
+
+// GL work submitted during the last render() call
+struct DrawStats {
+    int drawCalls;
+    long long triangles;
+};
+
+// Static batches against what the instanced path keeps for the same buildings
+struct BatchStats {
+    int batches;
+    int drawn;
+    size_t batchBytes;    // GPU vertex + index storage of all batches
+    size_t instanceBytes; // InstanceData for every resident building plus the shared cube
+    size_t patchedBytes;  // uploaded by glBufferSubData for edits
+};
+
+// Per-frame culling results
+struct CullStats {
+    int visible[CATEGORY_COUNT];
+    int culled[CATEGORY_COUNT];
+    
+    int totalVisible() const { return visible[CATEGORY_BUILDINGS] + visible[CATEGORY_VEHICLES] + visible[CATEGORY_BILLBOARDS]; }
+    int totalCulled() const { return culled[CATEGORY_BUILDINGS] + culled[CATEGORY_VEHICLES] + culled[CATEGORY_BILLBOARDS]; }
+};
+
+// Per-frame level-of-detail results for buildings
+struct LodStats {
+    int full;       // drawn with the whole cube
+    int simplified; // drawn with the distant mesh
+    int proxies;    // merged boxes drawn for collapsed blocks
+    int merged;     // buildings those boxes stand in for
+    int blocks;     // collapsed blocks
+};
+
+// Hands out CityTile::generation; tiles are created on the worker threads
+std::atomic<uint64_t> tileGenerations(0);
+
+// One square of the procedurally generated world. Everything in it is a pure function
+// of (seed, x, z), so tiles can be built on any thread in any order.
+struct CityTile {
+    int x, z;
+    std::vector<Building> buildings;
+    std::vector<InstanceData> instances;
+    BuildingGrid grid;
+    glm::vec3 boundsMin, boundsMax;
+    uint32_t revision = 0; // bumped by every indexTile, so caches can tell an edited tile apart
+    uint64_t generation = ++tileGenerations; // never reused, unlike the tile's address after it is freed
+};
+
+// Derives instances, bounds and the culling grid from the tile's buildings
+void indexTile(CityTile& tile, const CityConfig& config) {
+    tile.revision++;
+    float x0 = tile.x * config.tileSize, z0 = tile.z * config.tileSize;
+    tile.instances.clear();
+    tile.instances.reserve(tile.buildings.size());
+    tile.boundsMin = glm::vec3(x0, 0.0f, z0);
+    tile.boundsMax = glm::vec3(x0 + config.tileSize, 0.0f, z0 + config.tileSize);
+    for (const auto& building : tile.buildings) {
+        tile.instances.push_back(InstanceData(building.modelMatrix(), building.color,
+                                              building.emissionStrength, building.emissionColor));
+        tile.boundsMin = glm::min(tile.boundsMin, building.position - building.scale * 0.5f);
+        tile.boundsMax = glm::max(tile.boundsMax, building.position + building.scale * 0.5f);
+    }
+    tile.grid.build(tile.buildings, 16.0f);
+}
+
+CityTile* generateTile(const CityConfig& config, int tileX, int tileZ) {
+    CityTile* tile = new CityTile();
+    tile->x = tileX;
+    tile->z = tileZ;
+    
+    CityRandom random(CityRandom::mix(config.seed, tileX, tileZ));
+    float x0 = tileX * config.tileSize, z0 = tileZ * config.tileSize;
+    int count = (int)(config.buildingDensity * config.tileSize * config.tileSize + 0.5f);
+    
+    tile->buildings.reserve(count);
+    for (int i = 0; i < count; i++) {
+        float x = random.range(x0, x0 + config.tileSize);
+        float z = random.range(z0, z0 + config.tileSize);
+        float height = random.range(5.0f, 40.0f);
+        float width = random.range(2.0f, 8.0f);
+        
+        glm::vec3 pos(x, height / 2.0f, z);
+        glm::vec3 scale(width, height, width);
+        
+        // Cyberpunk color palette
+        glm::vec3 color;
+        float colorChoice = random.range(0.1f, 0.9f);
+        if (colorChoice < 0.3f) {
+            color = glm::vec3(0.2f, 0.2f, 0.8f); // Blue
+        } else if (colorChoice < 0.6f) {
+            color = glm::vec3(0.8f, 0.2f, 0.8f); // Magenta
+        } else {
+            color = glm::vec3(0.2f, 0.8f, 0.8f); // Cyan
+        }
+        
+        float emission = (height > 20.0f) ? 0.3f : 0.1f;
+        tile->buildings.push_back(Building(pos, scale, color, emission, color * 0.5f));
+    }
+    
+    indexTile(*tile, config);
+    return tile;
+}
+
+// Vehicles and billboards of a fresh city; they are few and global, so not tiled
+void generateTraffic(const CityConfig& config, VehicleArrays& vehicles, BillboardArrays& billboards) {
+    CityRandom random(CityRandom::domain(config.seed, RANDOM_TRAFFIC));
+    
+    // Generate flying vehicles
+    for (int i = 0; i < config.vehicleCount; i++) {
+        float height = 15.0f + (i % 16) * 3.0f;
+        float radius = 20.0f + (i % 64) * 5.0f;
+        float speed = 0.5f + (i % 3) * 0.3f;
+        
+        glm::vec3 pos(radius, height, 0.0f);
+        glm::vec3 dir(0.0f, 0.0f, 1.0f);
+        glm::vec3 color(1.0f, 0.8f, 0.2f); // Golden headlights
+        
+        Vehicle vehicle(pos, dir, speed, color, radius);
+        vehicle.pathAngle = i * (2.0f * M_PI / config.vehicleCount); // Distribute evenly
+        vehicles.push(vehicle);
+    }
+    
+    // Generate holographic billboards, spreading them out as their number grows
+    float spread = 50.0f * std::max(1.0f, std::sqrt(config.billboardCount / 15.0f));
+    for (int i = 0; i < config.billboardCount; i++) {
+        float x = random.range(-spread, spread);
+        float z = random.range(-spread, spread);
+        float y = 20.0f + (i % 15) * 2.0f;
+        
+        glm::vec3 pos(x, y, z);
+        float rotSpeed = 30.0f + (i % 3) * 20.0f;
+        glm::vec3 color(0.0f, 1.0f, 0.5f); // Holographic green
+        
+        billboards.push(Billboard(pos, rotSpeed, color));
+    }
+}
+
+// Scene file layout (native endianness, every block 16-byte aligned):
+//   SceneHeader | SceneTileEntry[tileCount] sorted by key | tile payloads | traffic
+// A tile payload is Building[n], InstanceData[n] and the grid image, exactly as held in memory,
+// so loading a tile is a checksum and one memcpy per array. The header checksum covers the
+// header and directory; each tile and the traffic block carry their own, checked on load.
+const char SCENE_MAGIC[8] = { 'N', 'C', 'S', 'C', 'E', 'N', 'E', 0 };
+const uint32_t SCENE_VERSION = 1;
+
+struct SceneHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t layout;          // see sceneLayout()
+    uint64_t seed;
+    float tileSize;
+    float buildingDensity;
+    uint32_t tileCount;
+    uint32_t vehicleCount;
+    uint32_t billboardCount;
+    uint32_t reserved;
+    uint64_t directoryOffset;
+    uint64_t trafficOffset;   // vehicle arrays, then billboard arrays
+    uint64_t trafficBytes;
+    uint64_t trafficChecksum;
+    uint64_t fileSize;
+    uint64_t checksum;        // header with this field zeroed, then the directory
+};
+
+struct SceneTileEntry {
+    int64_t key;              // packCoords(x, z)
+    int32_t x, z;
+    uint32_t buildingCount;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t bytes;
+    uint64_t checksum;
+    float boundsMin[3], boundsMax[3];
+};
+
+// Raw structs go to disk as-is, so a build with different layouts must not read the file
+uint32_t sceneLayout() {
+    uint64_t sizes[] = { sizeof(Building), sizeof(InstanceData), sizeof(SceneHeader), sizeof(SceneTileEntry),
+                         sizeof(glm::vec3), sizeof(glm::mat4) };
+    return (uint32_t)checksum64(sizes, sizeof(sizes));
+}
+
+inline uint64_t alignScene(uint64_t offset) { return (offset + 15) & ~(uint64_t)15; }
+
+// Writes the tiles and traffic. Payloads are streamed out one tile at a time; the header and
+// directory are filled in last.
+bool saveScene(const std::string& path, const CityConfig& config, std::vector<const CityTile*> tiles,
+               const VehicleArrays& vehicles, const BillboardArrays& billboards) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+    std::sort(tiles.begin(), tiles.end(), [](const CityTile* a, const CityTile* b) {
+        return packCoords(a->x, a->z) < packCoords(b->x, b->z);
+    });
+    
+    SceneHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+    header.version = SCENE_VERSION;
+    header.layout = sceneLayout();
+    header.seed = config.seed;
+    header.tileSize = config.tileSize;
+    header.buildingDensity = config.buildingDensity;
+    header.tileCount = (uint32_t)tiles.size();
+    header.vehicleCount = (uint32_t)vehicles.size();
+    header.billboardCount = (uint32_t)billboards.size();
+    header.directoryOffset = alignScene(sizeof(SceneHeader));
+    
+    std::vector<SceneTileEntry> directory(tiles.size());
+    uint64_t offset = alignScene(header.directoryOffset + directory.size() * sizeof(SceneTileEntry));
+    std::vector<char> payload;
+    const char padding[16] = {};
+    file.seekp(offset);
+    for (size_t i = 0; i < tiles.size(); i++) {
+        const CityTile& tile = *tiles[i];
+        payload.clear();
+        appendArray(payload, tile.buildings.data(), tile.buildings.size());
+        appendArray(payload, tile.instances.data(), tile.instances.size());
+        tile.grid.save(payload);
+        
+        SceneTileEntry& entry = directory[i];
+        memset(&entry, 0, sizeof(entry));
+        entry.key = packCoords(tile.x, tile.z);
+        entry.x = tile.x;
+        entry.z = tile.z;
+        entry.buildingCount = (uint32_t)tile.buildings.size();
+        entry.offset = offset;
+        entry.bytes = payload.size();
+        entry.checksum = checksum64(payload.data(), payload.size());
+        for (int k = 0; k < 3; k++) {
+            entry.boundsMin[k] = tile.boundsMin[k];
+            entry.boundsMax[k] = tile.boundsMax[k];
+        }
+        file.write(payload.data(), payload.size());
+        file.write(padding, alignScene(offset + payload.size()) - (offset + payload.size()));
+        offset = alignScene(offset + payload.size());
+    }
+    
+    payload.clear();
+    size_t vehicleCount = vehicles.size(), billboardCount = billboards.size();
+    appendArray(payload, vehicles.pathAngle.data(), vehicleCount);
+    appendArray(payload, vehicles.pathRadius.data(), vehicleCount);
+    appendArray(payload, vehicles.speed.data(), vehicleCount);
+    appendArray(payload, vehicles.positionX.data(), vehicleCount);
+    appendArray(payload, vehicles.positionY.data(), vehicleCount);
+    appendArray(payload, vehicles.positionZ.data(), vehicleCount);
+    appendArray(payload, vehicles.color.data(), vehicleCount);
+    appendArray(payload, billboards.rotation.data(), billboardCount);
+    appendArray(payload, billboards.rotationSpeed.data(), billboardCount);
+    appendArray(payload, billboards.position.data(), billboardCount);
+    appendArray(payload, billboards.color.data(), billboardCount);
+    header.trafficOffset = offset;
+    header.trafficBytes = payload.size();
+    header.trafficChecksum = checksum64(payload.data(), payload.size());
+    header.fileSize = offset + payload.size();
+    file.write(payload.data(), payload.size());
+    
+    header.checksum = checksum64(&header, sizeof(header));
+    header.checksum = checksum64(directory.data(), directory.size() * sizeof(SceneTileEntry), header.checksum);
+    file.seekp(0);
+    file.write((const char*)&header, sizeof(header));
+    file.seekp(header.directoryOffset);
+    file.write((const char*)directory.data(), directory.size() * sizeof(SceneTileEntry));
+    return (bool)file;
+}
+
+// Read side of a scene file. The whole file is mapped once; the header and directory are used
+// in place, and tiles are copied out on demand (from any thread) as the streamer asks for them.
+class SceneFile {
+private:
+    const char* data;
+    size_t size;
+#ifdef NIGHTCITY_MMAP
+    void* mapping;
+#else
+    std::vector<char> contents;
+#endif
+    const SceneHeader* header;
+    const SceneTileEntry* directory;
+    
+public:
+    SceneFile() : data(nullptr), size(0),
+#ifdef NIGHTCITY_MMAP
+        mapping(nullptr),
+#endif
+        header(nullptr), directory(nullptr) {}
+    
+    SceneFile(const SceneFile&) = delete;
+    SceneFile& operator=(const SceneFile&) = delete;
+    
+    ~SceneFile() { close(); }
+    
+    bool open(const std::string& path, std::string& error) {
+        close();
+#ifdef NIGHTCITY_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error = "cannot open file";
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            error = "cannot read file size";
+            return false;
+        }
+        size = (size_t)info.st_size;
+        mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            mapping = nullptr;
+            error = "mmap failed";
+            return false;
+        }
+        data = (const char*)mapping;
+#else
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) {
+            error = "cannot open file";
+            return false;
+        }
+        contents.resize((size_t)file.tellg());
+        file.seekg(0);
+        file.read(contents.data(), contents.size());
+        data = contents.data();
+        size = contents.size();
+#endif
+        
+        const SceneHeader* candidate = (const SceneHeader*)data;
+        if (size < sizeof(SceneHeader) || memcmp(candidate->magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)) != 0)
+            error = "not a scene file";
+        else if (candidate->version != SCENE_VERSION)
+            error = "version " + std::to_string(candidate->version) + ", expected " + std::to_string(SCENE_VERSION);
+        else if (candidate->layout != sceneLayout())
+            error = "written by a build with different struct layouts";
+        else if (candidate->fileSize != size ||
+                 candidate->directoryOffset + (uint64_t)candidate->tileCount * sizeof(SceneTileEntry) > size ||
+                 candidate->trafficOffset + candidate->trafficBytes > size)
+            error = "truncated";
+        else {
+            SceneHeader copy = *candidate;
+            copy.checksum = 0;
+            uint64_t checksum = checksum64(&copy, sizeof(copy));
+            checksum = checksum64(data + copy.directoryOffset, copy.tileCount * sizeof(SceneTileEntry), checksum);
+            if (checksum != candidate->checksum)
+                error = "header checksum mismatch";
+        }
+        if (!error.empty()) {
+            close();
+            return false;
+        }
+        header = candidate;
+        directory = (const SceneTileEntry*)(data + header->directoryOffset);
+        return true;
+    }
+    
+    void close() {
+#ifdef NIGHTCITY_MMAP
+        if (mapping)
+            munmap(mapping, size);
+        mapping = nullptr;
+#else
+        contents.clear();
+#endif
+        data = nullptr;
+        size = 0;
+        header = nullptr;
+        directory = nullptr;
+    }
+    
+    bool isOpen() const { return header != nullptr; }
+    const SceneHeader& info() const { return *header; }
+    
+    const SceneTileEntry* find(int tileX, int tileZ) const {
+        if (!header)
+            return nullptr;
+        int64_t key = packCoords(tileX, tileZ);
+        const SceneTileEntry* end = directory + header->tileCount;
+        const SceneTileEntry* entry = std::lower_bound(directory, end, key, [](const SceneTileEntry& e, int64_t k) {
+            return e.key < k;
+        });
+        return entry != end && entry->key == key ? entry : nullptr;
+    }
+    
+    // A fresh tile, or nullptr if the file does not have it or its checksum fails. Thread-safe.
+    CityTile* loadTile(int tileX, int tileZ) const {
+        const SceneTileEntry* entry = find(tileX, tileZ);
+        if (!entry || entry->offset + entry->bytes > size)
+            return nullptr;
+        const char* cursor = data + entry->offset;
+        const char* end = cursor + entry->bytes;
+        if (checksum64(cursor, entry->bytes) != entry->checksum) {
+            std::cout << "Scene tile (" << tileX << ", " << tileZ << ") is damaged; regenerating it" << std::endl;
+            return nullptr;
+        }
+        
+        std::unique_ptr<CityTile> tile(new CityTile());
+        tile->x = entry->x;
+        tile->z = entry->z;
+        tile->boundsMin = glm::vec3(entry->boundsMin[0], entry->boundsMin[1], entry->boundsMin[2]);
+        tile->boundsMax = glm::vec3(entry->boundsMax[0], entry->boundsMax[1], entry->boundsMax[2]);
+        if (!readArray(cursor, end, tile->buildings, entry->buildingCount) ||
+            !readArray(cursor, end, tile->instances, entry->buildingCount) ||
+            !tile->grid.load(cursor, end - cursor) || tile->grid.size() != entry->buildingCount)
+            return nullptr;
+        return tile.release();
+    }
+    
+    bool loadTraffic(VehicleArrays& vehicles, BillboardArrays& billboards) const {
+        const char* cursor = data + header->trafficOffset;
+        const char* end = cursor + header->trafficBytes;
+        if (checksum64(cursor, header->trafficBytes) != header->trafficChecksum)
+            return false;
+        VehicleArrays loadedVehicles;
+        BillboardArrays loadedBillboards;
+        size_t vehicleCount = header->vehicleCount, billboardCount = header->billboardCount;
+        bool complete = readArray(cursor, end, loadedVehicles.pathAngle, vehicleCount) &&
+                        readArray(cursor, end, loadedVehicles.pathRadius, vehicleCount) &&
+                        readArray(cursor, end, loadedVehicles.speed, vehicleCount) &&
+                        readArray(cursor, end, loadedVehicles.positionX, vehicleCount) &&
+                        readArray(cursor, end, loadedVehicles.positionY, vehicleCount) &&
+                        readArray(cursor, end, loadedVehicles.positionZ, vehicleCount) &&
+                        readArray(cursor, end, loadedVehicles.color, vehicleCount) &&
+                        readArray(cursor, end, loadedBillboards.rotation, billboardCount) &&
+                        readArray(cursor, end, loadedBillboards.rotationSpeed, billboardCount) &&
+                        readArray(cursor, end, loadedBillboards.position, billboardCount) &&
+                        readArray(cursor, end, loadedBillboards.color, billboardCount);
+        if (!complete)
+            return false;
+        vehicles = std::move(loadedVehicles);
+        billboards = std::move(loadedBillboards);
+        return true;
+    }
+    
+    size_t fileSize() const { return size; }
+};
+
+// All tiles within a square of the given radius (in tiles) around the origin, built on the pool
+std::vector<std::unique_ptr<CityTile>> generateRegion(const CityConfig& config, int radius, WorkerPool& workers) {
+    int side = 2 * radius + 1;
+    std::vector<std::unique_ptr<CityTile>> region(side * side);
+    workers.parallelFor(region.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            region[i].reset(generateTile(config, (int)(i % side) - radius, (int)(i / side) - radius));
+    });
+    return region;
+}
+
+// Lane-following air traffic (--traffic in the window, --traffic-benchmark headless)
+const float TRAFFIC_REACH = 10.0f;        // radius of every neighbour query
+const float TRAFFIC_CELL = 2.0f * TRAFFIC_REACH; // spatial hash cell edge, so a query spans 2x2x2 cells
+const float TRAFFIC_LANE_STEP = 2.0f;     // arc length between lane table samples
+const float TRAFFIC_SPACING = 20.0f;      // lane length generated per vehicle
+const float TRAFFIC_MIN_ALTITUDE = 12.0f, TRAFFIC_MAX_ALTITUDE = 70.0f;
+const float TRAFFIC_CLEARANCE = 3.0f;     // kept from tower walls and roofs
+const float TRAFFIC_MAX_OFFSET = 6.0f;    // how far other traffic may push a vehicle off its lane centre
+const float TRAFFIC_MAX_CLIMB = 0.5f;     // height gained per unit of lane length on the way over a roof
+const float TRAFFIC_LANE_MARGIN = 3.0f;   // room lanes leave past a tower's clearance for vehicles pushed off them
+const float TRAFFIC_CLOSE_PASS = 2.0f;    // centres nearer than this count as a close pass
+// Intelligent driver model: standstill gap, time headway, comfortable acceleration and braking
+const float TRAFFIC_STANDSTILL_GAP = 3.0f, TRAFFIC_HEADWAY = 0.6f;
+const float TRAFFIC_ACCELERATION = 4.0f, TRAFFIC_BRAKING = 8.0f;
+// Vehicles per worker chunk; the neighbour queries make a vehicle far dearer than an orbit step
+const size_t TRAFFIC_GRAIN = 2048;
+
+// Building footprints grown by the flight clearance, filed in a uniform XZ grid so a point
+// query reads one cell
+class ObstacleGrid {
+public:
+    struct Box {
+        float minX, minZ, maxX, maxZ, top;
+    };
+    
+private:
+    static constexpr float CELL = 16.0f;
+    std::vector<Box> boxes;
+    std::vector<uint32_t> cellStart, entries;
+    int originX, originZ, columns, rows;
+    
+public:
+    ObstacleGrid() : originX(0), originZ(0), columns(0), rows(0) {}
+    
+    void build(const std::vector<const CityTile*>& tiles) {
+        boxes.clear();
+        glm::vec2 lo(1e30f), hi(-1e30f);
+        for (const CityTile* tile : tiles) {
+            for (const auto& building : tile->buildings) {
+                glm::vec3 half = building.scale * 0.5f + TRAFFIC_CLEARANCE;
+                Box box = { building.position.x - half.x, building.position.z - half.z, building.position.x + half.x,
+                            building.position.z + half.z, building.position.y + half.y };
+                boxes.push_back(box);
+                lo = glm::vec2(std::min(lo.x, box.minX), std::min(lo.y, box.minZ));
+                hi = glm::vec2(std::max(hi.x, box.maxX), std::max(hi.y, box.maxZ));
+            }
+        }
+        if (boxes.empty()) {
+            columns = rows = 0;
+            cellStart.assign(1, 0);
+            entries.clear();
+            return;
+        }
+        originX = (int)std::floor(lo.x / CELL);
+        originZ = (int)std::floor(lo.y / CELL);
+        columns = (int)std::floor(hi.x / CELL) - originX + 1;
+        rows = (int)std::floor(hi.y / CELL) - originZ + 1;
+    
+        // Count, prefix sum, fill
+        cellStart.assign((size_t)columns * rows + 1, 0);
+        auto each = [&](const Box& box, const std::function<void(size_t)>& visit) {
+            int cx0 = (int)std::floor(box.minX / CELL) - originX, cx1 = (int)std::floor(box.maxX / CELL) - originX;
+            int cz0 = (int)std::floor(box.minZ / CELL) - originZ, cz1 = (int)std::floor(box.maxZ / CELL) - originZ;
+            for (int z = cz0; z <= cz1; z++)
+                for (int x = cx0; x <= cx1; x++)
+                    visit((size_t)z * columns + x);
+        };
+        for (const Box& box : boxes)
+            each(box, [&](size_t cell) { cellStart[cell + 1]++; });
+        for (size_t i = 1; i < cellStart.size(); i++)
+            cellStart[i] += cellStart[i - 1];
+        entries.resize(cellStart.back());
+        std::vector<uint32_t> cursor(cellStart.begin(), cellStart.end() - 1);
+        for (size_t i = 0; i < boxes.size(); i++)
+            each(boxes[i], [&](size_t cell) { entries[cursor[cell]++] = (uint32_t)i; });
+    }
+    
+    // The grown box that contains p below its grown roof, if any
+    const Box* find(const glm::vec3& p) const {
+        int x = (int)std::floor(p.x / CELL) - originX, z = (int)std::floor(p.z / CELL) - originZ;
+        if (x < 0 || z < 0 || x >= columns || z >= rows)
+            return nullptr;
+        size_t cell = (size_t)z * columns + x;
+        for (uint32_t k = cellStart[cell]; k < cellStart[cell + 1]; k++) {
+            const Box& box = boxes[entries[k]];
+            if (p.x > box.minX && p.x < box.maxX && p.z > box.minZ && p.z < box.maxZ && p.y < box.top)
+                return &box;
+        }
+        return nullptr;
+    }
+    
+    // Way out through the walls along the horizontal direction (normalized), to margin past the wall
+    static glm::vec3 sidestep(const Box& box, const glm::vec3& p, const glm::vec3& direction, float margin) {
+        float exit = 1e30f;
+        if (direction.x != 0.0f)
+            exit = std::min(exit, ((direction.x > 0.0f ? box.maxX : box.minX) - p.x) / direction.x);
+        if (direction.z != 0.0f)
+            exit = std::min(exit, ((direction.z > 0.0f ? box.maxZ : box.minZ) - p.z) / direction.z);
+        return direction * (exit + margin);
+    }
+    
+    // Shortest way out of the box: over the roof or through the nearest wall
+    static glm::vec3 escape(const Box& box, const glm::vec3& p) {
+        glm::vec3 best(0.0f, box.top - p.y, 0.0f);
+        float depth = best.y;
+        float walls[4] = { p.x - box.minX, box.maxX - p.x, p.z - box.minZ, box.maxZ - p.z };
+        const glm::vec3 directions[4] = { glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(1.0f, 0.0f, 0.0f),
+                                          glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 0.0f, 1.0f) };
+        for (int i = 0; i < 4; i++) {
+            if (walls[i] < depth) {
+                depth = walls[i];
+                best = directions[i] * walls[i];
+            }
+        }
+        return best;
+    }
+    
+    size_t size() const { return boxes.size(); }
+};
+
+// One tick of the traffic simulator
+struct TrafficStats {
+    size_t vehicles;
+    size_t lanes;
+    long long bucketsProbed;  // hash buckets read by the neighbour queries (8 cells, duplicates dropped)
+    long long candidates;     // entries found in those buckets
+    long long neighbours;     // candidates within TRAFFIC_REACH
+    long long closePasses;    // neighbour pairs nearer than TRAFFIC_CLOSE_PASS
+    long long avoiding;       // vehicles pushed out of a tower's clearance, beyond the lane offset if need be
+    float minGap;             // smallest centre distance to a same-lane leader
+    float minSeparation;      // smallest distance between any two neighbours
+    double hashMs, updateMs;
+};
+
+// Dense air traffic on closed lane splines between the buildings. Every tick rebuilds a
+// uniform spatial hash over all vehicles in parallel (counting sort into a power-of-two
+// bucket table), then updates every vehicle in parallel from the 8 cells its reach overlaps:
+// the intelligent driver model keeps the spacing to the leader on its own lane and crossing
+// traffic pushes it sideways off the lane centre. Lanes are routed clear of the towers sample
+// by sample, and a vehicle that still ends a tick inside a tower's clearance (pushed there,
+// or a tile streamed in under its lane) is moved out of it. State is double-buffered,
+// so the update reads one tick and writes the next and the result does not depend on
+// how the work was split.
+class TrafficSimulation {
+private:
+    // Lanes, resampled to equal arc length and stored back to back
+    std::vector<glm::vec3> lanePoints;
+    std::vector<uint32_t> laneStart, laneSamples;
+    std::vector<float> laneLength;
+    ObstacleGrid obstacles;
+    
+    // Vehicles; [current] is the tick being read, the other one the tick being written
+    std::vector<uint32_t> lane;
+    std::vector<float> desiredSpeed;
+    std::vector<float> distance[2], speed[2];
+    std::vector<float> offsetX[2], offsetY[2], offsetZ[2];
+    std::vector<float> positionX[2], positionY[2], positionZ[2];
+    int current;
+    
+    // What a neighbour query reads of a vehicle, copied into bucket order so a bucket is one run of memory
+    struct HashEntry {
+        float x, y, z, distance, speed;
+        uint32_t lane, id;
+    };
+    
+    // Spatial hash: vehicles grouped by bucket, bucket b owning entries[bucketStart[b], bucketStart[b + 1])
+    uint32_t bucketMask;
+    std::vector<uint32_t> vehicleBucket, bucketStart, sorted, chunkTotals;
+    std::vector<HashEntry> entries;
+    std::unique_ptr<std::atomic<uint32_t>[]> bucketFill;
+    
+    TrafficStats stats;
+    std::mutex statsMutex;
+    
+    static int cellOf(float coordinate) { return (int)std::floor(coordinate / TRAFFIC_CELL); }
+    
+    uint32_t bucketOf(int x, int y, int z) const {
+        return (((uint32_t)x * 73856093u) ^ ((uint32_t)y * 19349663u) ^ ((uint32_t)z * 83492791u)) & bucketMask;
+    }
+    
+    glm::vec3 lanePosition(uint32_t l, float s) const {
+        float u = s / laneLength[l] * laneSamples[l];
+        uint32_t k = std::min((uint32_t)u, laneSamples[l] - 1);
+        const glm::vec3& a = lanePoints[laneStart[l] + k];
+        const glm::vec3& b = lanePoints[laneStart[l] + (k + 1) % laneSamples[l]];
+        return a + (b - a) * (u - (float)k);
+    }
+    
+    // Moves a lane control point out of towers, over the roof when that stays below the ceiling
+    void clearPoint(glm::vec3& p) const {
+        for (int attempt = 0; attempt < 4; attempt++) {
+            const ObstacleGrid::Box* box = obstacles.find(p);
+            if (!box)
+                return;
+            if (box->top + 1.0f <= TRAFFIC_MAX_ALTITUDE) {
+                p.y = box->top + 1.0f;
+            } else {
+                glm::vec3 out = ObstacleGrid::escape(*box, p);
+                out.y = 0.0f;
+                if (glm::length(out) == 0.0f)
+                    out = glm::vec3(p.x - box->minX < box->maxX - p.x ? box->minX - p.x : box->maxX - p.x, 0.0f, 0.0f);
+                p += out + glm::normalize(out) * 1.0f;
+            }
+        }
+    }
+    
+    // Points at equal arc length about TRAFFIC_LANE_STEP apart along a closed polyline
+    static std::vector<glm::vec3> resampleLoop(const std::vector<glm::vec3>& loop, float& length) {
+        std::vector<float> along(loop.size() + 1, 0.0f);
+        for (size_t i = 0; i < loop.size(); i++)
+            along[i + 1] = along[i] + glm::length(loop[(i + 1) % loop.size()] - loop[i]);
+        length = along.back();
+        uint32_t samples = std::max(8u, (uint32_t)std::round(length / TRAFFIC_LANE_STEP));
+        std::vector<glm::vec3> points;
+        points.reserve(samples);
+        size_t segment = 0;
+        for (uint32_t i = 0; i < samples; i++) {
+            float s = length * i / samples;
+            while (segment + 2 < along.size() && along[segment + 1] < s)
+                segment++;
+            float span = along[segment + 1] - along[segment];
+            float f = span > 0.0f ? (s - along[segment]) / span : 0.0f;
+            const glm::vec3& a = loop[segment];
+            const glm::vec3& b = loop[(segment + 1) % loop.size()];
+            points.push_back(a + (b - a) * f);
+        }
+        return points;
+    }
+    
+    // Moves every sample of a lane out of the towers. Roofs under the ceiling are flown over,
+    // with ramps so the climb stays gentle; taller towers are passed on the side away from their
+    // centre, which is the same side for every sample of a straight pass, and the detour is
+    // smoothed into the samples around it. Points are only ever raised in the end, and raising
+    // never moves a point into a tower, so no sample is left inside one.
+    void clearLane(std::vector<glm::vec3>& points) const {
+        size_t count = points.size();
+        auto wrap = [&](size_t i, int step) { return (i + count + step) % count; };
+        auto raise = [&]() {
+            float climb = TRAFFIC_MAX_CLIMB * TRAFFIC_LANE_STEP;
+            for (int round = 0; round < 2; round++) {
+                for (size_t i = 0; i < count; i++)
+                    points[i].y = std::max(points[i].y, points[wrap(i, -1)].y - climb);
+                for (size_t i = count; i-- > 0;)
+                    points[i].y = std::max(points[i].y, points[wrap(i, 1)].y - climb);
+            }
+        };
+        
+        const int ROUNDS = 8;
+        std::vector<glm::vec3> smoothed(count);
+        for (int round = 0; round <= ROUNDS; round++) {
+            bool last = round == ROUNDS;
+            for (size_t i = 0; i < count; i++) {
+                glm::vec3& p = points[i];
+                for (int attempt = 0; attempt < 4; attempt++) {
+                    const ObstacleGrid::Box* box = obstacles.find(p);
+                    if (!box)
+                        break;
+                    if (last || attempt == 3 || box->top + TRAFFIC_LANE_MARGIN <= TRAFFIC_MAX_ALTITUDE) {
+                        p.y = box->top + TRAFFIC_LANE_MARGIN;
+                        continue;
+                    }
+                    glm::vec3 along = points[wrap(i, 1)] - points[wrap(i, -1)];
+                    glm::vec3 across(-along.z, 0.0f, along.x);
+                    if (glm::length(across) == 0.0f)
+                        across = glm::vec3(1.0f, 0.0f, 0.0f);
+                    across = glm::normalize(across);
+                    glm::vec3 centre(0.5f * (box->minX + box->maxX), p.y, 0.5f * (box->minZ + box->maxZ));
+                    if (glm::dot(across, p - centre) < 0.0f)
+                        across = -across;
+                    p += ObstacleGrid::sidestep(*box, p, across, TRAFFIC_LANE_MARGIN);
+                }
+            }
+            raise();
+            if (last)
+                break;
+            for (size_t i = 0; i < count; i++) {
+                const glm::vec3& before = points[wrap(i, -1)];
+                const glm::vec3& after = points[wrap(i, 1)];
+                smoothed[i] = glm::vec3(0.5f * points[i].x + 0.25f * (before.x + after.x), points[i].y,
+                                        0.5f * points[i].z + 0.25f * (before.z + after.z));
+            }
+            points.swap(smoothed);
+        }
+    }
+    
+    // A closed Catmull-Rom loop through the control points, resampled by arc length and routed
+    // clear of the towers
+    void addLane(const std::vector<glm::vec3>& control) {
+        const int SUBSTEPS = 16;
+        size_t count = control.size();
+        std::vector<glm::vec3> dense;
+        dense.reserve(count * SUBSTEPS + 1);
+        for (size_t k = 0; k < count; k++) {
+            const glm::vec3& p0 = control[(k + count - 1) % count];
+            const glm::vec3& p1 = control[k];
+            const glm::vec3& p2 = control[(k + 1) % count];
+            const glm::vec3& p3 = control[(k + 2) % count];
+            for (int j = 0; j < SUBSTEPS; j++) {
+                float t = (float)j / SUBSTEPS, t2 = t * t, t3 = t2 * t;
+                dense.push_back(0.5f * (2.0f * p1 + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 +
+                                        (3.0f * p1 - p0 - 3.0f * p2 + p3) * t3));
+            }
+        }
+    
+        // Clearing stretches the lane, so it is measured and resampled again afterwards; the
+        // new samples lie on the cleared polyline and only go through clearLane's final raise
+        float length;
+        std::vector<glm::vec3> points = resampleLoop(dense, length);
+        clearLane(points);
+        points = resampleLoop(points, length);
+        for (glm::vec3& p : points) {
+            while (const ObstacleGrid::Box* box = obstacles.find(p))
+                p.y = box->top + 1.0f;
+        }
+    
+        laneStart.push_back((uint32_t)lanePoints.size());
+        laneSamples.push_back((uint32_t)points.size());
+        laneLength.push_back(length);
+        lanePoints.insert(lanePoints.end(), points.begin(), points.end());
+    }
+    
+    void generateLanes(uint64_t seed, float extent, size_t vehicles) {
+        float target = vehicles * TRAFFIC_SPACING, total = 0.0f;
+        float maxRadius = std::max(30.0f, std::min(200.0f, extent));
+        for (int64_t l = 0; total < target || l == 0; l++) {
+            CityRandom random(CityRandom::mix(CityRandom::domain(seed, RANDOM_LANES), l, 0));
+            glm::vec2 centre(random.range(-extent, extent), random.range(-extent, extent));
+            float radius = random.range(30.0f, maxRadius);
+            float altitude = random.range(TRAFFIC_MIN_ALTITUDE + 4.0f, TRAFFIC_MAX_ALTITUDE - 10.0f);
+            bool clockwise = (l & 1) != 0;
+    
+            const int CONTROL_POINTS = 8;
+            std::vector<glm::vec3> control;
+            for (int k = 0; k < CONTROL_POINTS; k++) {
+                float angle = (clockwise ? -k : k) * (6.2831853f / CONTROL_POINTS) + random.range(-0.2f, 0.2f);
+                float r = radius * random.range(0.7f, 1.3f);
+                glm::vec3 p(glm::clamp(centre.x + r * std::cos(angle), -extent, extent),
+                            glm::clamp(altitude + random.range(-4.0f, 4.0f), TRAFFIC_MIN_ALTITUDE, TRAFFIC_MAX_ALTITUDE),
+                            glm::clamp(centre.y + r * std::sin(angle), -extent, extent));
+                clearPoint(p);
+                control.push_back(p);
+            }
+            addLane(control);
+            total += laneLength.back();
+        }
+    }
+    
+    // Cells are twice the reach, so along each axis the query overlaps its own cell and the
+    // neighbour on the nearer side
+    static int firstCell(float coordinate) {
+        float u = coordinate / TRAFFIC_CELL;
+        int cell = (int)std::floor(u);
+        return u - (float)cell < 0.5f ? cell - 1 : cell;
+    }
+    
+    // Visits each distinct bucket the reach around p overlaps once; two cells may share a bucket
+    template <typename Visit>
+    int forEachCandidate(float x, float y, float z, Visit visit) const {
+        int cx = firstCell(x), cy = firstCell(y), cz = firstCell(z);
+        uint32_t seen[8];
+        int probed = 0;
+        for (int dz = 0; dz <= 1; dz++) {
+            for (int dy = 0; dy <= 1; dy++) {
+                for (int dx = 0; dx <= 1; dx++) {
+                    uint32_t bucket = bucketOf(cx + dx, cy + dy, cz + dz);
+                    if (std::find(seen, seen + probed, bucket) != seen + probed)
+                        continue;
+                    seen[probed++] = bucket;
+                    for (uint32_t k = bucketStart[bucket]; k < bucketStart[bucket + 1]; k++)
+                        visit(entries[k]);
+                }
+            }
+        }
+        return probed;
+    }
+    
+    // Steps the vehicles at entries[begin, end)
+    void update(size_t begin, size_t end, float deltaTime) {
+        const int from = current, to = 1 - current;
+        const float brakeTerm = 2.0f * std::sqrt(TRAFFIC_ACCELERATION * TRAFFIC_BRAKING);
+    
+        long long probed = 0, candidates = 0, neighbours = 0, closePasses = 0, avoiding = 0;
+        float minGap = 1e30f, minSeparation = 1e30f;
+        // Walks the vehicles in bucket order, so neighbouring queries read the same buckets
+        for (size_t k = begin; k < end; k++) {
+            const HashEntry& self = entries[k];
+            uint32_t i = self.id, l = self.lane;
+            float length = laneLength[l];
+            float gap = 1e30f, leaderSpeed = 0.0f;
+            glm::vec3 separation(0.0f);
+    
+            probed += forEachCandidate(self.x, self.y, self.z, [&](const HashEntry& other) {
+                candidates++;
+                if (other.id == i)
+                    return;
+                glm::vec3 d(other.x - self.x, other.y - self.y, other.z - self.z);
+                float distanceSquared = glm::dot(d, d);
+                if (distanceSquared > TRAFFIC_REACH * TRAFFIC_REACH)
+                    return;
+                neighbours++;
+                float dist = std::sqrt(distanceSquared);
+                minSeparation = std::min(minSeparation, dist);
+                if (dist < TRAFFIC_CLOSE_PASS)
+                    closePasses++;
+                if (other.lane == l) {
+                    float ahead = other.distance - self.distance;
+                    if (ahead < -0.5f * length)
+                        ahead += length;
+                    else if (ahead > 0.5f * length)
+                        ahead -= length;
+                    if (ahead > 0.0f && ahead < gap) {
+                        gap = ahead;
+                        leaderSpeed = other.speed;
+                    }
+                } else if (dist > 0.0f) {
+                    separation -= d * ((1.0f - dist / TRAFFIC_REACH) / dist);
+                }
+            });
+    
+            // Intelligent driver model towards the desired speed, braking for the leader
+            float vi = self.speed, ratio = vi / desiredSpeed[i];
+            float acceleration = 1.0f - ratio * ratio * ratio * ratio;
+            if (gap < 1e30f) {
+                minGap = std::min(minGap, gap);
+                float wanted = TRAFFIC_STANDSTILL_GAP + std::max(0.0f, vi * TRAFFIC_HEADWAY + vi * (vi - leaderSpeed) / brakeTerm);
+                float clear = std::max(gap - VEHICLE_SCALE.z, 0.1f);
+                acceleration -= (wanted / clear) * (wanted / clear);
+            }
+            float nextSpeed = std::max(0.0f, vi + TRAFFIC_ACCELERATION * acceleration * deltaTime);
+            float nextDistance = self.distance + nextSpeed * deltaTime;
+            if (nextDistance >= length)
+                nextDistance -= length;
+    
+            // The offset from the lane centre follows the pushes and otherwise eases back to zero
+            glm::vec3 offset(offsetX[from][i], offsetY[from][i], offsetZ[from][i]);
+            glm::vec3 push = separation * 4.0f - offset * 0.5f;
+            offset += push * deltaTime;
+            float stray = glm::length(offset);
+            if (stray > TRAFFIC_MAX_OFFSET)
+                offset *= TRAFFIC_MAX_OFFSET / stray;
+            
+            // Towers are a hard limit past the offset cap: the vehicle leaves the clearance this tick
+            glm::vec3 centre = lanePosition(l, nextDistance);
+            glm::vec3 position = centre + offset;
+            if (obstacles.find(position)) {
+                avoiding++;
+                for (int attempt = 0; attempt < 4; attempt++) {
+                    const ObstacleGrid::Box* box = obstacles.find(position);
+                    if (!box)
+                        break;
+                    position += attempt < 3 ? ObstacleGrid::escape(*box, position) : glm::vec3(0.0f, box->top - position.y, 0.0f);
+                }
+                offset = position - centre;
+            }
+    
+            distance[to][i] = nextDistance;
+            speed[to][i] = nextSpeed;
+            offsetX[to][i] = offset.x;
+            offsetY[to][i] = offset.y;
+            offsetZ[to][i] = offset.z;
+            positionX[to][i] = position.x;
+            positionY[to][i] = position.y;
+            positionZ[to][i] = position.z;
+        }
+    
+        std::lock_guard<std::mutex> lock(statsMutex);
+        stats.bucketsProbed += probed;
+        stats.candidates += candidates;
+        stats.neighbours += neighbours;
+        stats.closePasses += closePasses; // each pair is seen from both sides; halved once in step
+        stats.avoiding += avoiding;
+        stats.minGap = std::min(stats.minGap, minGap);
+        stats.minSeparation = std::min(stats.minSeparation, minSeparation);
+    }
+    
+public:
+    // count vehicles on lanes within [-extent, extent] around the origin, routed around the
+    // buildings of the given tiles
+    TrafficSimulation(const std::vector<const CityTile*>& tiles, float extent, size_t count, uint64_t seed)
+        : current(0), bucketMask(0) {
+        obstacles.build(tiles);
+        generateLanes(seed, extent, count);
+    
+        // Vehicles evenly spaced along all lanes laid end to end
+        double total = 0.0;
+        for (float length : laneLength)
+            total += length;
+        double spacing = total / std::max<size_t>(count, 1);
+        CityRandom random(CityRandom::domain(seed, RANDOM_LANE_VEHICLES));
+        uint32_t l = 0;
+        double laneBegin = 0.0;
+        for (size_t i = 0; i < count; i++) {
+            double along = (i + 0.5) * spacing;
+            while (l + 1 < laneLength.size() && along >= laneBegin + laneLength[l])
+                laneBegin += laneLength[l++];
+            float s = std::min((float)(along - laneBegin), laneLength[l] * 0.999f);
+            glm::vec3 p = lanePosition(l, s);
+            float cruise = random.range(8.0f, 16.0f);
+            lane.push_back(l);
+            desiredSpeed.push_back(cruise);
+            distance[0].push_back(s);
+            speed[0].push_back(cruise);
+            positionX[0].push_back(p.x);
+            positionY[0].push_back(p.y);
+            positionZ[0].push_back(p.z);
+        }
+        offsetX[0].assign(count, 0.0f);
+        offsetY[0].assign(count, 0.0f);
+        offsetZ[0].assign(count, 0.0f);
+        for (auto* arrays : { distance, speed, offsetX, offsetY, offsetZ, positionX, positionY, positionZ })
+            arrays[1] = arrays[0];
+    
+        // At least two buckets per vehicle keeps chains short
+        uint32_t buckets = 1024;
+        while (buckets < 2 * count)
+            buckets *= 2;
+        bucketMask = buckets - 1;
+        bucketStart.assign(buckets + 1, 0);
+        bucketFill.reset(new std::atomic<uint32_t>[buckets]);
+        vehicleBucket.resize(count);
+        sorted.resize(count);
+        entries.resize(count);
+        stats = TrafficStats();
+        stats.vehicles = count;
+        stats.lanes = laneLength.size();
+    }
+    
+    // Buildings changed (tiles streamed in or out, or edited)
+    void setObstacles(const std::vector<const CityTile*>& tiles) { obstacles.build(tiles); }
+    
+    // Files every vehicle under the bucket of its current cell
+    void rebuildHash(WorkerPool& workers) {
+        size_t count = size(), buckets = bucketMask + 1;
+        const float* px = positionX[current].data();
+        const float* py = positionY[current].data();
+        const float* pz = positionZ[current].data();
+    
+        workers.parallelFor(buckets, SIMULATION_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t b = begin; b < end; b++)
+                bucketFill[b].store(0, std::memory_order_relaxed);
+        });
+        workers.parallelFor(count, TRAFFIC_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                uint32_t bucket = bucketOf(cellOf(px[i]), cellOf(py[i]), cellOf(pz[i]));
+                vehicleBucket[i] = bucket;
+                bucketFill[bucket].fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    
+        // Exclusive prefix sum over the buckets: chunk totals, a scan of those, then each chunk
+        // writes its starts and turns the counts into scatter cursors
+        size_t chunks = (buckets + SIMULATION_GRAIN - 1) / SIMULATION_GRAIN;
+        chunkTotals.assign(chunks + 1, 0);
+        workers.parallelFor(buckets, SIMULATION_GRAIN, [&](size_t begin, size_t end) {
+            uint32_t sum = 0;
+            for (size_t b = begin; b < end; b++)
+                sum += bucketFill[b].load(std::memory_order_relaxed);
+            chunkTotals[begin / SIMULATION_GRAIN + 1] = sum;
+        });
+        for (size_t c = 1; c <= chunks; c++)
+            chunkTotals[c] += chunkTotals[c - 1];
+        workers.parallelFor(buckets, SIMULATION_GRAIN, [&](size_t begin, size_t end) {
+            uint32_t offset = chunkTotals[begin / SIMULATION_GRAIN];
+            for (size_t b = begin; b < end; b++) {
+                uint32_t entries = bucketFill[b].load(std::memory_order_relaxed);
+                bucketStart[b] = offset;
+                bucketFill[b].store(offset, std::memory_order_relaxed);
+                offset += entries;
+            }
+        });
+        bucketStart[buckets] = (uint32_t)count;
+    
+        workers.parallelFor(count, TRAFFIC_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                sorted[bucketFill[vehicleBucket[i]].fetch_add(1, std::memory_order_relaxed)] = (uint32_t)i;
+        });
+    
+        // The scatter order within a bucket depends on thread timing; sorting it makes the
+        // neighbour order, and with it every floating-point sum, the same on each run
+        workers.parallelFor(buckets, SIMULATION_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t b = begin; b < end; b++) {
+                if (bucketStart[b + 1] - bucketStart[b] > 1)
+                    std::sort(sorted.begin() + bucketStart[b], sorted.begin() + bucketStart[b + 1]);
+            }
+        });
+    
+        const float* s = distance[current].data();
+        const float* v = speed[current].data();
+        workers.parallelFor(count, TRAFFIC_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; k++) {
+                uint32_t i = sorted[k];
+                entries[k] = { px[i], py[i], pz[i], s[i], v[i], lane[i], i };
+            }
+        });
+    }
+    
+    void step(float deltaTime, WorkerPool& workers) {
+        PROFILE_SCOPE("traffic tick");
+        auto start = std::chrono::steady_clock::now();
+        stats.bucketsProbed = stats.candidates = stats.neighbours = stats.closePasses = stats.avoiding = 0;
+        stats.minGap = stats.minSeparation = 1e30f;
+        rebuildHash(workers);
+        auto hashed = std::chrono::steady_clock::now();
+        workers.parallelFor(size(), TRAFFIC_GRAIN, [&](size_t begin, size_t end) {
+            update(begin, end, deltaTime);
+        });
+        stats.closePasses /= 2;
+        current = 1 - current;
+        auto done = std::chrono::steady_clock::now();
+        stats.hashMs = std::chrono::duration<double, std::milli>(hashed - start).count();
+        stats.updateMs = std::chrono::duration<double, std::milli>(done - hashed).count();
+    }
+    
+    // Vehicles within TRAFFIC_REACH of vehicle i, through the hash as of the last rebuildHash
+    void neighbours(size_t i, std::vector<uint32_t>& out) const {
+        glm::vec3 p(positionX[current][i], positionY[current][i], positionZ[current][i]);
+        out.clear();
+        forEachCandidate(p.x, p.y, p.z, [&](const HashEntry& other) {
+            glm::vec3 d = glm::vec3(other.x, other.y, other.z) - p;
+            if (other.id != i && glm::dot(d, d) <= TRAFFIC_REACH * TRAFFIC_REACH)
+                out.push_back(other.id);
+        });
+    }
+    
+    size_t size() const { return lane.size(); }
+    size_t obstacleCount() const { return obstacles.size(); }
+    
+    // Vehicles whose centre is inside a tower's clearance as of the last step; should be none
+    size_t insideObstacles() const {
+        size_t inside = 0;
+        for (size_t i = 0; i < size(); i++)
+            inside += obstacles.find(glm::vec3(positionX[current][i], positionY[current][i], positionZ[current][i])) != nullptr;
+        return inside;
+    }
+    const float* x() const { return positionX[current].data(); }
+    const float* y() const { return positionY[current].data(); }
+    const float* z() const { return positionZ[current].data(); }
+    const TrafficStats& getStats() const { return stats; }
+};
+
+// Keeps the tiles around the camera resident. Missing tiles are generated on the worker
+// pool, nearest first; the render thread only swaps finished tiles in and hands evicted
+// ones back to the pool to free, so streaming never stalls a frame.
+class TileStreamer {
+private:
+    const CityConfig& config;
+    WorkerPool& workers;
+    std::unordered_map<int64_t, std::unique_ptr<CityTile>> tiles;
+    std::unordered_map<int64_t, bool> pending;
+    std::vector<CityTile*> finished;
+    std::mutex finishedMutex;
+    size_t buildingCount;
+    const SceneFile* scene;
+    std::vector<int64_t> changed; // tiles that arrived, left or were edited since takeChanged()
+    
+public:
+    TileStreamer(const CityConfig& cfg, WorkerPool& pool) : config(cfg), workers(pool), buildingCount(0), scene(nullptr) {}
+    
+    // Tiles the file has are loaded from it; the rest are still generated
+    void setScene(const SceneFile* file) { scene = file; }
+    
+    ~TileStreamer() {
+        workers.wait();
+        for (CityTile* tile : finished)
+            delete tile;
+    }
+    
+    void update(const glm::vec3& cameraPosition) {
+        int cameraX = (int)std::floor(cameraPosition.x / config.tileSize);
+        int cameraZ = (int)std::floor(cameraPosition.z / config.tileSize);
+        
+        // Swap in finished tiles, dropping any the camera has already left behind
+        std::vector<CityTile*> arrived;
+        {
+            std::lock_guard<std::mutex> lock(finishedMutex);
+            arrived.swap(finished);
+        }
+        for (CityTile* tile : arrived) {
+            int64_t key = packCoords(tile->x, tile->z);
+            pending.erase(key);
+            int dx = tile->x - cameraX, dz = tile->z - cameraZ;
+            if (dx * dx + dz * dz > config.evictRadius * config.evictRadius) {
+                workers.submit([tile] { delete tile; });
+                continue;
+            }
+            buildingCount += tile->buildings.size();
+            tiles[key].reset(tile);
+            changed.push_back(key);
+        }
+        
+        // Evict beyond the outer radius; the gap to loadRadius stops tiles thrashing at the edge
+        for (auto it = tiles.begin(); it != tiles.end();) {
+            int dx = it->second->x - cameraX, dz = it->second->z - cameraZ;
+            if (dx * dx + dz * dz > config.evictRadius * config.evictRadius) {
+                CityTile* tile = it->second.release();
+                buildingCount -= tile->buildings.size();
+                workers.submit([tile] { delete tile; });
+                changed.push_back(it->first);
+                it = tiles.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        
+        // Request missing tiles nearest first, keeping only a few jobs in flight
+        std::vector<std::pair<int, int64_t>> wanted;
+        for (int dz = -config.loadRadius; dz <= config.loadRadius; dz++) {
+            for (int dx = -config.loadRadius; dx <= config.loadRadius; dx++) {
+                int distance = dx * dx + dz * dz;
+                int64_t key = packCoords(cameraX + dx, cameraZ + dz);
+                if (distance <= config.loadRadius * config.loadRadius && !tiles.count(key) && !pending.count(key))
+                    wanted.push_back(std::make_pair(distance, key));
+            }
+        }
+        std::sort(wanted.begin(), wanted.end());
+        
+        size_t budget = (size_t)workers.size() * 2;
+        for (size_t i = 0; i < wanted.size() && pending.size() < budget; i++) {
+            int64_t key = wanted[i].second;
+            int tileX = (int)(key >> 32), tileZ = (int32_t)(key & 0xffffffff);
+            pending[key] = true;
+            workers.submit([this, tileX, tileZ] {
+                PROFILE_SCOPE("tile job");
+                CityTile* tile = scene ? scene->loadTile(tileX, tileZ) : nullptr;
+                if (!tile)
+                    tile = generateTile(config, tileX, tileZ);
+                std::lock_guard<std::mutex> lock(finishedMutex);
+                finished.push_back(tile);
+            });
+        }
+    }
+    
+    // Loads everything in range before returning (used for the first frame)
+    void prime(const glm::vec3& cameraPosition) {
+        do {
+            update(cameraPosition);
+            workers.wait();
+            update(cameraPosition);
+        } while (!pending.empty());
+    }
+    
+    const std::unordered_map<int64_t, std::unique_ptr<CityTile>>& residentTiles() const { return tiles; }
+    size_t residentBuildings() const { return buildingCount; }
+    
+    // Render-thread edits: resident tiles are never touched by the workers
+    CityTile* find(int tileX, int tileZ) {
+        auto it = tiles.find(packCoords(tileX, tileZ));
+        return it == tiles.end() ? nullptr : it->second.get();
+    }
+    
+    void buildingsChanged(CityTile& tile, long delta) {
+        indexTile(tile, config);
+        buildingCount += delta;
+        changed.push_back(packCoords(tile.x, tile.z));
+    }
+    
+    // Hands over the keys of tiles changed since the last call, for caches derived from them
+    void takeChanged(std::vector<int64_t>& out) {
+        out.clear();
+        out.swap(changed);
+    }
+};
+
+// Cube vertices with normals and texture coordinates
+float cubeVertices[] = {
+    // positions          // normals           // texture coords
+    -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+     0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
+     0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+     0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+    -0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
+    -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+
+    -0.5f, -0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   0.0f, 0.0f,
+     0.5f, -0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   1.0f, 0.0f,
+     0.5f,  0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   1.0f, 1.0f,
+     0.5f,  0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   1.0f, 1.0f,
+    -0.5f,  0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   0.0f, 1.0f,
+    -0.5f, -0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   0.0f, 0.0f,
+
+    -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+    -0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
+    -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+    -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+    -0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+    -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+
+     0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+     0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
+     0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+     0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+     0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+     0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+
+    -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+     0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
+     0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+     0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+    -0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
+    -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+
+    -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
+     0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
+     0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+     0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+    -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
+    -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
+};
+
+// Indexed triangle mesh on the CPU, one array per attribute
+struct MeshData {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> texCoords;
+    std::vector<uint16_t> indices;
+    size_t simplifiedIndices; // the leading indices that make up the distant-LOD mesh
+};
+
+// Welds identical vertices of an interleaved position/normal/uv triangle list (8 floats each)
+MeshData buildIndexedMesh(const float* vertices, int vertexCount) {
+    MeshData mesh;
+    std::map<std::vector<float>, uint16_t> unique;
+    for (int i = 0; i < vertexCount; i++) {
+        const float* v = vertices + i * 8;
+        std::vector<float> key(v, v + 8);
+        auto it = unique.find(key);
+        if (it == unique.end()) {
+            it = unique.insert(std::make_pair(key, (uint16_t)mesh.positions.size())).first;
+            mesh.positions.push_back(glm::vec3(v[0], v[1], v[2]));
+            mesh.normals.push_back(glm::vec3(v[3], v[4], v[5]));
+            mesh.texCoords.push_back(glm::vec2(v[6], v[7]));
+        }
+        mesh.indices.push_back(it->second);
+    }
+    mesh.simplifiedIndices = mesh.indices.size();
+    return mesh;
+}
+
+// The shared cube: 24 unique vertices (4 per face) and 36 indices. Its underside is moved
+// to the end, and the 30 indices before it are the distant-LOD mesh: buildings stand on the
+// ground, so the bottom face is hidden from anywhere above it.
+MeshData makeCubeMesh() {
+    MeshData mesh = buildIndexedMesh(cubeVertices, sizeof(cubeVertices) / (8 * sizeof(float)));
+    std::vector<uint16_t> sides, bottom;
+    for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+        std::vector<uint16_t>& out = mesh.normals[mesh.indices[i]].y < -0.5f ? bottom : sides;
+        out.insert(out.end(), mesh.indices.begin() + i, mesh.indices.begin() + i + 3);
+    }
+    mesh.simplifiedIndices = sides.size();
+    mesh.indices = sides;
+    mesh.indices.insert(mesh.indices.end(), bottom.begin(), bottom.end());
+    return mesh;
+}
+
+// IEEE half from float (round to nearest even, denormals flushed); enough for UVs
+uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+    if (exponent <= 0)
+        return sign;
+    if (exponent >= 31)
+        return (uint16_t)(sign | 0x7c00);
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return (uint16_t)(sign | half);
+}
+
+// Signed normalized 10:10:10:2 layout read by GL_INT_2_10_10_10_REV
+uint32_t packNormal(const glm::vec3& normal) {
+    uint32_t packed = 0;
+    for (int i = 0; i < 3; i++) {
+        int value = (int)std::lround(glm::clamp(normal[i], -1.0f, 1.0f) * 511.0f);
+        packed |= ((uint32_t)value & 0x3ff) << (10 * i);
+    }
+    return packed;
+}
+
+enum VertexFormat {
+    VERTEX_FORMAT_FLOAT,  // position 3f, normal 3f, uv 2f: 32 bytes
+    VERTEX_FORMAT_PACKED  // position 3f, normal 2_10_10_10, uv 2h: 20 bytes
+};
+
+struct PackedVertex {
+    glm::vec3 position;
+    uint32_t normal;
+    uint16_t texCoord[2];
+};
+
+// GPU copy of a MeshData in one of the vertex formats, with an index buffer
+class Mesh {
+private:
+    GLuint vertexBuffer;
+    GLuint indexBuffer;
+    VertexFormat format;
+    GLsizei vertexCount;
+    GLsizei indices;
+    GLsizei simplifiedIndices;
+    
+public:
+    Mesh() : vertexBuffer(0), indexBuffer(0), format(VERTEX_FORMAT_FLOAT), vertexCount(0), indices(0), simplifiedIndices(0) {}
+    
+    Mesh(const Mesh&) = delete;
+    Mesh& operator=(const Mesh&) = delete;
+    
+    ~Mesh() {
+        if (vertexBuffer) {
+            glDeleteBuffers(1, &vertexBuffer);
+            glDeleteBuffers(1, &indexBuffer);
+        }
+    }
+    
+    void upload(const MeshData& data, VertexFormat vertexFormat) {
+        format = vertexFormat;
+        vertexCount = (GLsizei)data.positions.size();
+        indices = (GLsizei)data.indices.size();
+        simplifiedIndices = (GLsizei)data.simplifiedIndices;
+        if (vertexBuffer == 0) {
+            glGenBuffers(1, &vertexBuffer);
+            glGenBuffers(1, &indexBuffer);
+        }
+        
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+        if (format == VERTEX_FORMAT_PACKED) {
+            std::vector<PackedVertex> vertices(vertexCount);
+            for (GLsizei i = 0; i < vertexCount; i++) {
+                vertices[i].position = data.positions[i];
+                vertices[i].normal = packNormal(data.normals[i]);
+                vertices[i].texCoord[0] = floatToHalf(data.texCoords[i].x);
+                vertices[i].texCoord[1] = floatToHalf(data.texCoords[i].y);
+            }
+            glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(PackedVertex), vertices.data(), GL_STATIC_DRAW);
+        } else {
+            std::vector<float> vertices;
+            for (GLsizei i = 0; i < vertexCount; i++) {
+                const glm::vec3& p = data.positions[i];
+                const glm::vec3& n = data.normals[i];
+                const glm::vec2& t = data.texCoords[i];
+                float vertex[] = { p.x, p.y, p.z, n.x, n.y, n.z, t.x, t.y };
+                vertices.insert(vertices.end(), vertex, vertex + 8);
+            }
+            glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+        }
+        
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, data.indices.size() * sizeof(uint16_t), data.indices.data(), GL_STATIC_DRAW);
+    }
+    
+    // Binds the buffers and sets up attributes 0-2 on the currently bound VAO
+    void bindAttributes() const {
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+        if (format == VERTEX_FORMAT_PACKED) {
+            GLsizei stride = sizeof(PackedVertex);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(PackedVertex, position));
+            glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*)offsetof(PackedVertex, normal));
+            glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*)offsetof(PackedVertex, texCoord));
+        } else {
+            GLsizei stride = 8 * sizeof(float);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(float)));
+            glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (void*)(6 * sizeof(float)));
+        }
+        glEnableVertexAttribArray(0);
+        glEnableVertexAttribArray(1);
+        glEnableVertexAttribArray(2);
+    }
+    
+    GLsizei indexCount(bool simplified = false) const { return simplified ? simplifiedIndices : indices; }
+    GLsizei triangleCount(bool simplified = false) const { return indexCount(simplified) / 3; }
+    size_t vertexBytes() const { return vertexCount * (format == VERTEX_FORMAT_PACKED ? sizeof(PackedVertex) : 8 * sizeof(float)); }
+    size_t indexBytes() const { return indices * sizeof(uint16_t); }
+    
+    // The simplified mesh is a prefix of the index buffer, so both levels share one VAO
+    void draw(bool simplified = false) const {
+        glDrawElements(GL_TRIANGLES, indexCount(simplified), GL_UNSIGNED_SHORT, (void*)0);
+    }
+    
+    void drawInstanced(GLsizei instances, bool simplified = false) const {
+        glDrawElementsInstanced(GL_TRIANGLES, indexCount(simplified), GL_UNSIGNED_SHORT, (void*)0, instances);
+    }
+};
+
+// Pre-transformed building vertex: world-space position and normal, half UVs, and the
+// object's colours as unorm8 (emission strength rides in the alpha of color)
+struct BatchVertex {
+    glm::vec3 position;
+    uint32_t normal;
+    uint16_t texCoord[2];
+    uint8_t color[4];
+    uint8_t emissionColor[4];
+};
+
+uint8_t packUnorm8(float value) {
+    return (uint8_t)std::lround(glm::clamp(value, 0.0f, 1.0f) * 255.0f);
+}
+
+// Every building of one tile baked into a single vertex/index buffer and drawn with one call.
+// Slot i owns a fixed run of vertices, so an edit rewrites one slot of the CPU copy and flush()
+// uploads only the dirty byte range; removal moves the last slot into the hole. The buffers are
+// only re-specified when adding outgrows the capacity, which doubles.
+class StaticBatch {
+private:
+    const MeshData& mesh;
+    GLuint vao, vertexBuffer, indexBuffer;
+    std::vector<BatchVertex> vertices;
+    size_t slots, capacity;
+    size_t dirtyBegin, dirtyEnd; // slot range not yet uploaded
+    bool reallocate;
+    size_t patched;
+    
+    size_t slotVertices() const { return mesh.positions.size(); }
+    size_t slotBytes() const { return slotVertices() * sizeof(BatchVertex); }
+    
+    void markDirty(size_t slot) {
+        dirtyBegin = std::min(dirtyBegin, slot);
+        dirtyEnd = std::max(dirtyEnd, slot + 1);
+    }
+    
+    void bake(size_t slot, const Building& building) {
+        glm::mat4 model = building.modelMatrix();
+        glm::mat3 normal = normalMatrix(model);
+        BatchVertex* out = &vertices[slot * slotVertices()];
+        for (size_t i = 0; i < slotVertices(); i++) {
+            out[i].position = glm::vec3(model * glm::vec4(mesh.positions[i], 1.0f));
+            out[i].normal = packNormal(glm::normalize(normal * mesh.normals[i]));
+            out[i].texCoord[0] = floatToHalf(mesh.texCoords[i].x);
+            out[i].texCoord[1] = floatToHalf(mesh.texCoords[i].y);
+            for (int c = 0; c < 3; c++) {
+                out[i].color[c] = packUnorm8(building.color[c]);
+                out[i].emissionColor[c] = packUnorm8(building.emissionColor[c]);
+            }
+            out[i].color[3] = packUnorm8(building.emissionStrength);
+            out[i].emissionColor[3] = 0;
+        }
+        markDirty(slot);
+    }
+    
+public:
+    const CityTile* source; // tile the batch was baked from
+    
+    StaticBatch(const MeshData& cube, const CityTile* tile)
+        : mesh(cube), slots(0), capacity(0), dirtyBegin(SIZE_MAX), dirtyEnd(0), reallocate(false), patched(0), source(tile) {
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vertexBuffer);
+        glGenBuffers(1, &indexBuffer);
+        
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+        GLsizei stride = sizeof(BatchVertex);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(BatchVertex, position));
+        glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*)offsetof(BatchVertex, normal));
+        glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*)offsetof(BatchVertex, texCoord));
+        glVertexAttribPointer(7, 3, GL_UNSIGNED_BYTE, GL_TRUE, stride, (void*)offsetof(BatchVertex, color));
+        glVertexAttribPointer(8, 1, GL_UNSIGNED_BYTE, GL_TRUE, stride, (void*)(offsetof(BatchVertex, color) + 3));
+        glVertexAttribPointer(9, 3, GL_UNSIGNED_BYTE, GL_TRUE, stride, (void*)offsetof(BatchVertex, emissionColor));
+        GLuint locations[] = { 0, 1, 2, 7, 8, 9 };
+        for (GLuint location : locations)
+            glEnableVertexAttribArray(location);
+        glBindVertexArray(0);
+    }
+    
+    StaticBatch(const StaticBatch&) = delete;
+    StaticBatch& operator=(const StaticBatch&) = delete;
+    
+    ~StaticBatch() {
+        glDeleteVertexArrays(1, &vao);
+        glDeleteBuffers(1, &vertexBuffer);
+        glDeleteBuffers(1, &indexBuffer);
+    }
+    
+    void build(const std::vector<Building>& buildings) {
+        slots = buildings.size();
+        capacity = std::max<size_t>(slots, 1);
+        vertices.resize(capacity * slotVertices());
+        for (size_t i = 0; i < slots; i++)
+            bake(i, buildings[i]);
+        reallocate = true;
+    }
+    
+    void set(size_t slot, const Building& building) {
+        bake(slot, building);
+    }
+    
+    void add(const Building& building) {
+        if (slots == capacity) {
+            capacity *= 2;
+            vertices.resize(capacity * slotVertices());
+            reallocate = true;
+        }
+        bake(slots++, building);
+    }
+    
+    void remove(size_t slot) {
+        slots--;
+        if (slot == slots)
+            return;
+        std::copy(vertices.begin() + slots * slotVertices(), vertices.begin() + (slots + 1) * slotVertices(),
+                  vertices.begin() + slot * slotVertices());
+        markDirty(slot);
+    }
+    
+    // Uploads pending edits: the dirty slot range, or everything after a capacity change
+    void flush() {
+        if (reallocate) {
+            // Every slot uses the mesh's index pattern offset by its first vertex
+            std::vector<uint32_t> indices;
+            indices.reserve(capacity * mesh.indices.size());
+            for (size_t slot = 0; slot < capacity; slot++) {
+                for (uint16_t index : mesh.indices)
+                    indices.push_back((uint32_t)(slot * slotVertices() + index));
+            }
+            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+            glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(BatchVertex), vertices.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+            reallocate = false;
+        } else if (dirtyBegin < dirtyEnd) {
+            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+            glBufferSubData(GL_ARRAY_BUFFER, dirtyBegin * slotBytes(), (dirtyEnd - dirtyBegin) * slotBytes(),
+                            &vertices[dirtyBegin * slotVertices()]);
+            patched += (dirtyEnd - dirtyBegin) * slotBytes();
+        }
+        dirtyBegin = SIZE_MAX;
+        dirtyEnd = 0;
+    }
+    
+    void draw() const {
+        glBindVertexArray(vao);
+        glDrawElements(GL_TRIANGLES, (GLsizei)(slots * mesh.indices.size()), GL_UNSIGNED_INT, (void*)0);
+    }
+    
+    size_t buildingCount() const { return slots; }
+    long long triangleCount() const { return (long long)(slots * mesh.indices.size() / 3); }
+    size_t gpuBytes() const { return capacity * (slotBytes() + mesh.indices.size() * sizeof(uint32_t)); }
+    size_t patchedBytes() const { return patched; }
+};
+
+// Level-of-detail thresholds in pixels of projected size
+const float LOD_SIMPLIFY_PIXELS = 96.0f; // smaller buildings use the simplified mesh
+const float LOD_BLOCK_PIXELS = 320.0f;   // narrower tiles and blocks collapse into merged boxes
+const float LOD_HYSTERESIS = 1.25f;      // a level only changes this far past its threshold
+const int PROXY_GRID = 4;                // merged boxes per block side
+
+// Keeps the current side of a threshold until the size is clearly past it, so objects
+// sitting near the switch distance do not flicker between levels
+bool lodAbove(bool above, float pixels, float threshold) {
+    return above ? pixels > threshold / LOD_HYSTERESIS : pixels > threshold * LOD_HYSTERESIS;
+}
+
+// Footprint totals of a group of buildings. They only ever add up, so a block is merged
+// from its children without revisiting any building.
+struct ProxyCell {
+    int buildings = 0;
+    float area = 0.0f;                     // footprint
+    float volume = 0.0f;
+    glm::vec2 center = glm::vec2(0.0f);    // sum of positions weighted by footprint
+    glm::vec3 color = glm::vec3(0.0f);     // sums weighted by volume
+    glm::vec3 emissionColor = glm::vec3(0.0f);
+    float emission = 0.0f;
+    
+    void add(const Building& building) {
+        float footprint = building.scale.x * building.scale.z;
+        float size = footprint * building.scale.y;
+        buildings++;
+        area += footprint;
+        volume += size;
+        center += glm::vec2(building.position.x, building.position.z) * footprint;
+        color += building.color * size;
+        emissionColor += building.emissionColor * size;
+        emission += building.emissionStrength * size;
+    }
+    
+    void add(const ProxyCell& other) {
+        buildings += other.buildings;
+        area += other.area;
+        volume += other.volume;
+        center += other.center;
+        color += other.color;
+        emissionColor += other.emissionColor;
+        emission += other.emission;
+    }
+    
+    // A single box with the group's footprint area and volume, at its centroid, in its mean colours
+    InstanceData box() const {
+        float side = std::sqrt(area), height = volume / area;
+        glm::vec2 middle = center / area;
+        glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(middle.x, height * 0.5f, middle.y));
+        model = glm::scale(model, glm::vec3(side, height, side));
+        return InstanceData(model, color / volume, emission / volume, emissionColor / volume);
+    }
+};
+
+// Node of the LOD quadtree over tiles: level 0 is one tile, level n a square of 2^n tiles
+// a side. A collapsed node draws one merged box per non-empty cell instead of its contents.
+struct BlockProxy {
+    ProxyCell cells[PROXY_GRID * PROXY_GRID];
+    std::vector<InstanceData> boxes;
+    glm::vec3 boundsMin, boundsMax;
+    int tiles = 0;                   // resident tiles below
+    bool stale = true;               // a tile below changed; rebuilt on next use
+    bool refined = true;             // opened up into its children last time it was seen
+    std::vector<uint8_t> simplified; // level 0: per-building mesh choice, kept for hysteresis
+};
+
+// Point light as stored in the lightData buffer texture
+struct PointLight {
+    glm::vec4 positionRadius; // world space; the light reaches zero at the radius
+    glm::vec4 color;
+    
+    PointLight(const glm::vec3& position, float radius, const glm::vec3& col)
+        : positionRadius(position, radius), color(col, 0.0f) {}
+};
+
+// Per-frame clustered lighting results
+struct LightStats {
+    int lights;          // lights reaching into the view frustum
+    int usedClusters;    // clusters with at least one light
+    int maxPerCluster;
+    size_t indices;      // entries in all cluster lists
+    double buildMs;
+};
+
+// Clustered forward lighting. The view frustum is cut into CLUSTER_X x CLUSTER_Y screen tiles
+// and CLUSTER_Z slices spaced exponentially in depth, and each cluster gets the list of lights
+// whose sphere touches its view-space box. Slices are built in parallel, each into its own
+// list, and stitched into one index buffer; fragments then only loop over their cluster's list.
+class LightClusters {
+public:
+    static const int CLUSTER_X = 16, CLUSTER_Y = 10, CLUSTER_Z = 24;
+    static const int CLUSTERS_PER_SLICE = CLUSTER_X * CLUSTER_Y;
+    
+private:
+    // lightData, clusterRanges and lightIndices, in LIGHT_TEXTURE_UNIT order
+    GLuint buffers[3], textures[3];
+    
+    // Cluster boxes in view space, rebuilt when the projection changes
+    glm::mat4 boxProjection;
+    std::vector<glm::vec3> boxMin, boxMax;
+    float nearPlane, farPlane, sliceScale, sliceBias;
+    
+    // View-space spheres and their slice and tile ranges
+    struct LightBounds {
+        glm::vec3 center;
+        float radius;
+        uint32_t light; // index into the caller's lights, as stored in the lists
+        int slices[2], tilesX[2], tilesY[2];
+    };
+    std::vector<LightBounds> bounds;
+    
+    // Each slice's (cluster, light) pairs, then its counting-sorted list and per-cluster counts
+    struct Slice {
+        std::vector<std::pair<uint16_t, uint32_t>> pairs;
+        std::vector<uint32_t> indices;
+        uint32_t counts[CLUSTERS_PER_SLICE];
+        size_t base;
+    };
+    std::vector<Slice> slices;
+    std::vector<uint32_t> ranges;  // offset and count per cluster
+    std::vector<uint32_t> indices; // all lists back to back
+    LightStats stats;
+    
+    int slice(float depth) const {
+        return glm::clamp((int)(std::log(std::max(depth, 1e-4f)) * sliceScale + sliceBias), 0, CLUSTER_Z - 1);
+    }
+    
+    int tile(float ndc, int count) const {
+        return glm::clamp((int)((ndc * 0.5f + 0.5f) * count), 0, count - 1);
+    }
+    
+    void buildBoxes(const glm::mat4& projection) {
+        boxProjection = projection;
+        nearPlane = projection[3][2] / (projection[2][2] - 1.0f);
+        farPlane = projection[3][2] / (projection[2][2] + 1.0f);
+        sliceScale = CLUSTER_Z / std::log(farPlane / nearPlane);
+        sliceBias = -std::log(nearPlane) * sliceScale;
+        
+        // A symmetric perspective maps view x to ndc as x * p00 / depth, so a tile's sides are
+        // straight lines through the eye and its box spans both ends of the slice
+        boxMin.resize(CLUSTER_X * CLUSTER_Y * CLUSTER_Z);
+        boxMax.resize(boxMin.size());
+        for (int z = 0; z < CLUSTER_Z; z++) {
+            float depth0 = nearPlane * std::pow(farPlane / nearPlane, (float)z / CLUSTER_Z);
+            float depth1 = nearPlane * std::pow(farPlane / nearPlane, (float)(z + 1) / CLUSTER_Z);
+            for (int y = 0; y < CLUSTER_Y; y++) {
+                float y0 = (2.0f * y / CLUSTER_Y - 1.0f) / projection[1][1];
+                float y1 = (2.0f * (y + 1) / CLUSTER_Y - 1.0f) / projection[1][1];
+                for (int x = 0; x < CLUSTER_X; x++) {
+                    float x0 = (2.0f * x / CLUSTER_X - 1.0f) / projection[0][0];
+                    float x1 = (2.0f * (x + 1) / CLUSTER_X - 1.0f) / projection[0][0];
+                    int cluster = (z * CLUSTER_Y + y) * CLUSTER_X + x;
+                    boxMin[cluster] = glm::vec3(std::min(x0 * depth0, x0 * depth1), std::min(y0 * depth0, y0 * depth1), -depth1);
+                    boxMax[cluster] = glm::vec3(std::max(x1 * depth0, x1 * depth1), std::max(y1 * depth0, y1 * depth1), -depth0);
+                }
+            }
+        }
+    }
+    
+    // Conservative ndc interval of [low, high] seen between the two depths
+    static void ndcRange(float low, float high, float nearDepth, float farDepth, float scale, float& ndcLow, float& ndcHigh) {
+        ndcLow = scale * low / (low < 0.0f ? nearDepth : farDepth);
+        ndcHigh = scale * high / (high > 0.0f ? nearDepth : farDepth);
+    }
+    
+    void buildSlice(int z) {
+        Slice& out = slices[z];
+        out.pairs.clear();
+        for (const LightBounds& light : bounds) {
+            if (z < light.slices[0] || z > light.slices[1])
+                continue;
+            for (int y = light.tilesY[0]; y <= light.tilesY[1]; y++) {
+                for (int x = light.tilesX[0]; x <= light.tilesX[1]; x++) {
+                    int local = y * CLUSTER_X + x;
+                    int cluster = z * CLUSTERS_PER_SLICE + local;
+                    glm::vec3 nearest = glm::clamp(light.center, boxMin[cluster], boxMax[cluster]);
+                    glm::vec3 offset = nearest - light.center;
+                    if (glm::dot(offset, offset) <= light.radius * light.radius)
+                        out.pairs.push_back(std::make_pair((uint16_t)local, light.light));
+                }
+            }
+        }
+        
+        std::fill(out.counts, out.counts + CLUSTERS_PER_SLICE, 0u);
+        for (const auto& pair : out.pairs)
+            out.counts[pair.first]++;
+        uint32_t offsets[CLUSTERS_PER_SLICE];
+        uint32_t total = 0;
+        for (int c = 0; c < CLUSTERS_PER_SLICE; c++) {
+            offsets[c] = total;
+            total += out.counts[c];
+        }
+        out.indices.resize(total);
+        for (const auto& pair : out.pairs)
+            out.indices[offsets[pair.first]++] = pair.second;
+    }
+    
+public:
+    LightClusters() : nearPlane(0.1f), farPlane(200.0f), sliceScale(1.0f), sliceBias(0.0f), slices(CLUSTER_Z) {
+        stats = LightStats();
+        glGenBuffers(3, buffers);
+        glGenTextures(3, textures);
+        const GLenum formats[] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+        for (int i = 0; i < 3; i++) {
+            glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+            glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+            glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+        }
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+    
+    LightClusters(const LightClusters&) = delete;
+    LightClusters& operator=(const LightClusters&) = delete;
+    
+    ~LightClusters() {
+        glDeleteTextures(3, textures);
+        glDeleteBuffers(3, buffers);
+    }
+    
+    // Bins the lights for this view and uploads lights, ranges and lists
+    void build(const std::vector<PointLight>& lights, const glm::mat4& view, const glm::mat4& projection, WorkerPool& workers) {
+        PROFILE_SCOPE("light clusters");
+        auto start = std::chrono::steady_clock::now();
+        if (boxMin.empty() || projection != boxProjection)
+            buildBoxes(projection);
+        
+        // Spheres to view space, with the slices and tiles they can reach; lights wholly
+        // outside the depth range or the screen are dropped here
+        bounds.clear();
+        for (size_t i = 0; i < lights.size(); i++) {
+            LightBounds b;
+            b.center = glm::vec3(view * glm::vec4(glm::vec3(lights[i].positionRadius), 1.0f));
+            b.radius = lights[i].positionRadius.w;
+            b.light = (uint32_t)i;
+            float depth = -b.center.z;
+            if (depth + b.radius < nearPlane || depth - b.radius > farPlane)
+                continue;
+            float nearDepth = std::max(depth - b.radius, nearPlane), farDepth = depth + b.radius;
+            float x0, x1, y0, y1;
+            ndcRange(b.center.x - b.radius, b.center.x + b.radius, nearDepth, farDepth, projection[0][0], x0, x1);
+            ndcRange(b.center.y - b.radius, b.center.y + b.radius, nearDepth, farDepth, projection[1][1], y0, y1);
+            if (x0 > 1.0f || x1 < -1.0f || y0 > 1.0f || y1 < -1.0f)
+                continue;
+            b.slices[0] = slice(nearDepth);
+            b.slices[1] = slice(farDepth);
+            b.tilesX[0] = tile(x0, CLUSTER_X);
+            b.tilesX[1] = tile(x1, CLUSTER_X);
+            b.tilesY[0] = tile(y0, CLUSTER_Y);
+            b.tilesY[1] = tile(y1, CLUSTER_Y);
+            bounds.push_back(b);
+        }
+        
+        workers.parallelFor(CLUSTER_Z, 1, [&](size_t begin, size_t end) {
+            for (size_t z = begin; z < end; z++)
+                buildSlice((int)z);
+        });
+        
+        // Stitch the slices together: each one's lists start where the previous one's end
+        size_t total = 0;
+        for (Slice& s : slices) {
+            s.base = total;
+            total += s.indices.size();
+        }
+        ranges.resize(2 * CLUSTER_X * CLUSTER_Y * CLUSTER_Z);
+        indices.resize(std::max<size_t>(total, 1));
+        stats = LightStats();
+        for (int z = 0; z < CLUSTER_Z; z++) {
+            const Slice& s = slices[z];
+            uint32_t offset = (uint32_t)s.base;
+            for (int c = 0; c < CLUSTERS_PER_SLICE; c++) {
+                int cluster = z * CLUSTERS_PER_SLICE + c;
+                ranges[2 * cluster] = offset;
+                ranges[2 * cluster + 1] = s.counts[c];
+                offset += s.counts[c];
+                stats.usedClusters += s.counts[c] > 0;
+                stats.maxPerCluster = std::max(stats.maxPerCluster, (int)s.counts[c]);
+            }
+            std::copy(s.indices.begin(), s.indices.end(), indices.begin() + s.base);
+        }
+        
+        stats.lights = (int)bounds.size();
+        stats.indices = total;
+        
+        // Orphaned and refilled every frame, like the GL 3.3 path of the streaming ring
+        const void* data[] = { lights.data(), ranges.data(), indices.data() };
+        size_t sizes[] = { std::max<size_t>(lights.size(), 1) * sizeof(PointLight), ranges.size() * sizeof(uint32_t),
+                           indices.size() * sizeof(uint32_t) };
+        for (int i = 0; i < 3; i++) {
+            glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+            glBufferData(GL_TEXTURE_BUFFER, sizes[i], NULL, GL_STREAM_DRAW);
+            if (i > 0 || !lights.empty())
+                glBufferSubData(GL_TEXTURE_BUFFER, 0, sizes[i], data[i]);
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        stats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    
+    void bind() const {
+        for (int i = 0; i < 3; i++) {
+            glActiveTexture(GL_TEXTURE0 + LIGHT_TEXTURE_UNIT + i);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+        }
+        glActiveTexture(GL_TEXTURE0);
+    }
+    
+    // FrameUniforms values that let fragments find their cluster in a width x height target
+    void frameUniforms(FrameUniforms& frame, GLsizei width, GLsizei height, uint32_t lightCount) const {
+        frame.clusterScale = glm::vec4((float)CLUSTER_X / width, (float)CLUSTER_Y / height, sliceScale, sliceBias);
+        frame.clusterCounts[0] = CLUSTER_X;
+        frame.clusterCounts[1] = CLUSTER_Y;
+        frame.clusterCounts[2] = CLUSTER_Z;
+        frame.clusterCounts[3] = lightCount;
+    }
+    
+    const LightStats& getStats() const { return stats; }
+};
+
+const int SHADOW_TILE_RESOLUTION = 512;       // texels per side of each tile's cached map
+const float SHADOW_TILE_DISTANCE = 400.0f;    // tiles up to this far from the camera's tile keep a cached map
+const int SHADOW_MAX_LAYERS = 128;            // cached maps at most (64 MB), however small the tiles
+const int SHADOW_DYNAMIC_RESOLUTION = 1024;   // texels per side of the moving objects' map
+const float SHADOW_DYNAMIC_DISTANCE = 150.0f; // view distance the moving objects' map covers
+const float SHADOW_CASTER_HEIGHT = 100.0f;    // tallest caster whose shadow is carried into other tiles
+const float SHADOW_RECEIVER_TOP = 64.0f;      // above the highest vehicle and billboard
+const float SHADOW_NORMAL_OFFSET = 0.3f;      // receivers look up this far out along their normal
+const glm::vec3 MOONLIGHT_DIRECTION = glm::normalize(glm::vec3(-0.4f, -1.0f, -0.3f)); // the way the light travels
+
+// Per-frame shadow results
+struct ShadowStats {
+    int tiles;                // tiles within SHADOW_TILE_DISTANCE with a cached map
+    int rendered;             // cached maps re-rendered this frame
+    long long renders;        // since start
+    int staticDraws, dynamicDraws;
+    long long staticTriangles, dynamicTriangles;
+    long long rebuildTriangles; // every cached map drawn again, as without the cache
+    double ms;                  // CPU time of planning and submitting both passes
+};
+
+// Shadows of the directional moonlight. Buildings only change when tiles arrive, leave or are
+// edited, so every resident tile near the camera keeps a depth map of the buildings that shade it in one layer
+// of a texture array, drawn again only when those buildings change. Vehicles and billboards get
+// one map around the camera that is redrawn every frame; the shader takes the darker of the two.
+class ShadowMaps {
+public:
+    // A tile map to draw this frame, with the tiles whose buildings fall into it
+    struct TileRender {
+        int layer;
+        glm::mat4 lightProjection;
+        std::vector<const CityTile*> casters;
+    };
+    
+private:
+    GLuint tileDepth, dynamicDepth, framebuffer;
+    GLuint buffers[2], textures[2]; // shadowTiles and shadowLayers, in SHADOW_TEXTURE_UNIT order after the maps
+    int layerCount, radius; // the tiles within radius of the camera's tile, one layer each
+    bool ready;
+    std::vector<int> freeLayers;
+    
+    // A cached map is valid while the tiles around it are the ones it was drawn from
+    struct CachedTile {
+        int layer;
+        uint64_t signature;
+        size_t casterBuildings;
+        bool resident; // and within radius
+    };
+    std::unordered_map<int64_t, CachedTile> cached;
+    std::vector<TileRender> renders;
+    std::vector<const CityTile*> around;
+    std::vector<glm::vec4> layerRows; // per layer, world to texture coordinates (x, y) and depth (z)
+    std::vector<uint32_t> lookup;     // per tile around the camera, its layer + 1, or 0
+    int side, originX, originZ;
+    float tileSize;
+    
+    glm::mat4 lightView;
+    glm::mat4 dynamicProjection;
+    ShadowStats stats;
+    
+    // Light-space box around a world-space box
+    void lightBounds(const glm::vec3& boxMin, const glm::vec3& boxMax, glm::vec3& low, glm::vec3& high) const {
+        low = glm::vec3(1e30f);
+        high = glm::vec3(-1e30f);
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec3 point((corner & 1) ? boxMax.x : boxMin.x, (corner & 2) ? boxMax.y : boxMin.y,
+                            (corner & 4) ? boxMax.z : boxMin.z);
+            glm::vec3 light = glm::vec3(lightView * glm::vec4(point, 1.0f));
+            low = glm::min(low, light);
+            high = glm::max(high, light);
+        }
+    }
+    
+    // Clip space to texture coordinates and depth
+    static glm::mat4 textureMatrix(const glm::mat4& lightProjection) {
+        glm::mat4 bias = glm::translate(glm::mat4(1.0f), glm::vec3(0.5f)) * glm::scale(glm::mat4(1.0f), glm::vec3(0.5f));
+        return bias * lightProjection;
+    }
+    
+    // Receivers are the tile's square up to the tallest building next to it or the traffic;
+    // casters are the tiles around it whose buildings cover any of that in the light's view
+    TileRender planTile(const CityTile& tile, int layer) const {
+        float top = SHADOW_RECEIVER_TOP;
+        for (const CityTile* other : around) {
+            if (std::abs(other->x - tile.x) <= 1 && std::abs(other->z - tile.z) <= 1)
+                top = std::max(top, other->boundsMax.y);
+        }
+        glm::vec3 low, high;
+        lightBounds(glm::vec3(tile.x * tileSize, 0.0f, tile.z * tileSize),
+                    glm::vec3((tile.x + 1) * tileSize, top, (tile.z + 1) * tileSize), low, high);
+        
+        TileRender render;
+        render.layer = layer;
+        float nearest = high.z; // the light looks down -z
+        for (const CityTile* other : around) {
+            glm::vec3 casterLow, casterHigh;
+            lightBounds(other->boundsMin, other->boundsMax, casterLow, casterHigh);
+            if (casterHigh.x < low.x || casterLow.x > high.x || casterHigh.y < low.y || casterLow.y > high.y)
+                continue;
+            render.casters.push_back(other);
+            nearest = std::max(nearest, casterHigh.z);
+        }
+        render.lightProjection = glm::ortho(low.x, high.x, low.y, high.y, -nearest - 1.0f, -low.z + 1.0f) * lightView;
+        return render;
+    }
+    
+    // The sphere around the view up to SHADOW_DYNAMIC_DISTANCE, so the map keeps its size as the
+    // camera turns, with its centre snapped to whole texels so shadow edges do not crawl
+    void fitDynamic(const glm::mat4& view, const glm::mat4& projection) {
+        float distance = std::min(SHADOW_DYNAMIC_DISTANCE, farPlane);
+        float spread = 1.0f / (projection[0][0] * projection[0][0]) + 1.0f / (projection[1][1] * projection[1][1]);
+        float along = std::min(distance * (1.0f + spread) * 0.5f, distance);
+        float radius = std::sqrt((distance - along) * (distance - along) + distance * distance * spread);
+        glm::vec3 center = glm::vec3(glm::inverse(view) * glm::vec4(0.0f, 0.0f, -along, 1.0f));
+        
+        glm::vec3 light = glm::vec3(lightView * glm::vec4(center, 1.0f));
+        glm::vec2 extent(radius * std::sqrt(1.0f + lightView[1][0] * lightView[1][0]),
+                         radius * std::sqrt(1.0f + lightView[1][1] * lightView[1][1]));
+        glm::vec2 texel = 2.0f * extent / (float)SHADOW_DYNAMIC_RESOLUTION;
+        light.x = std::floor(light.x / texel.x) * texel.x;
+        light.y = std::floor(light.y / texel.y) * texel.y;
+        dynamicProjection = glm::ortho(light.x - extent.x, light.x + extent.x, light.y - extent.y, light.y + extent.y,
+                                       -light.z - radius - SHADOW_CASTER_HEIGHT, -light.z + radius) * lightView;
+    }
+    
+    static int tilesWithin(int reach) {
+        int count = 0;
+        for (int dz = -reach; dz <= reach; dz++) {
+            for (int dx = -reach; dx <= reach; dx++)
+                count += dx * dx + dz * dz <= reach * reach;
+        }
+        return count;
+    }
+    
+public:
+    // Tiles out to SHADOW_TILE_DISTANCE get a layer each, as far as SHADOW_MAX_LAYERS and the
+    // driver's array size allow; the far plane does not change the pool. Check valid() after.
+    explicit ShadowMaps(const CityConfig& config) : originX(0), originZ(0), tileSize(config.tileSize) {
+        GLint maxLayers = 0;
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+        int limit = std::min(SHADOW_MAX_LAYERS, (int)maxLayers);
+        radius = std::min(config.evictRadius, (int)std::ceil(SHADOW_TILE_DISTANCE / tileSize));
+        while (radius > 0 && tilesWithin(radius) > limit)
+            radius--;
+        layerCount = tilesWithin(radius);
+        side = 2 * radius + 1;
+        for (int layer = layerCount - 1; layer >= 0; layer--)
+            freeLayers.push_back(layer);
+        layerRows.resize(3 * layerCount, glm::vec4(0.0f));
+        lookup.resize(side * side);
+        // Sheared along the light onto the ground, with height as depth: texels line up with the
+        // tile grid, so a tile's map covers its square and little else
+        lightView = glm::mat4(1.0f);
+        lightView[1][0] = -MOONLIGHT_DIRECTION.x / MOONLIGHT_DIRECTION.y;
+        lightView[1][1] = -MOONLIGHT_DIRECTION.z / MOONLIGHT_DIRECTION.y;
+        lightView[1][2] = 1.0f;
+        lightView[2][1] = 1.0f;
+        lightView[2][2] = 0.0f;
+        dynamicProjection = glm::mat4(1.0f);
+        stats = ShadowStats();
+        
+        // Depth compared in the lookup; everything outside a map reads as unshadowed
+        const float border[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+        while (glGetError() != GL_NO_ERROR)
+            continue; // earlier errors are not the allocation's
+        glGenTextures(1, &tileDepth);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, tileDepth);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT16, SHADOW_TILE_RESOLUTION, SHADOW_TILE_RESOLUTION,
+                     layerCount, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_SHORT, NULL);
+        glGenTextures(1, &dynamicDepth);
+        glBindTexture(GL_TEXTURE_2D, dynamicDepth);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SHADOW_DYNAMIC_RESOLUTION, SHADOW_DYNAMIC_RESOLUTION, 0,
+                     GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+        const GLenum targets[] = { GL_TEXTURE_2D_ARRAY, GL_TEXTURE_2D };
+        const GLuint maps[] = { tileDepth, dynamicDepth };
+        for (int i = 0; i < 2; i++) {
+            glBindTexture(targets[i], maps[i]);
+            glTexParameteri(targets[i], GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(targets[i], GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(targets[i], GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+            glTexParameteri(targets[i], GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+            glTexParameterfv(targets[i], GL_TEXTURE_BORDER_COLOR, border);
+            glTexParameteri(targets[i], GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+            glTexParameteri(targets[i], GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+            glBindTexture(targets[i], 0);
+        }
+        
+        GLint bound = 0;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &bound);
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        
+        // Both kinds of target must be drawable, or every shadow pass would fail
+        ready = glGetError() == GL_NO_ERROR;
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, tileDepth, 0, 0);
+        ready = ready && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, dynamicDepth, 0);
+        ready = ready && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        glBindFramebuffer(GL_FRAMEBUFFER, bound);
+        
+        const GLenum formats[] = { GL_R32UI, GL_RGBA32F };
+        glGenBuffers(2, buffers);
+        glGenTextures(2, textures);
+        for (int i = 0; i < 2; i++) {
+            glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+            glBufferData(GL_TEXTURE_BUFFER, i == 0 ? lookup.size() * sizeof(uint32_t) : layerRows.size() * sizeof(glm::vec4),
+                         NULL, GL_DYNAMIC_DRAW);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+            glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+    
+    ShadowMaps(const ShadowMaps&) = delete;
+    ShadowMaps& operator=(const ShadowMaps&) = delete;
+    
+    // False when the maps could not be allocated or attached
+    bool valid() const { return ready; }
+    int layers() const { return layerCount; }
+    
+    ~ShadowMaps() {
+        glDeleteFramebuffers(1, &framebuffer);
+        glDeleteTextures(1, &tileDepth);
+        glDeleteTextures(1, &dynamicDepth);
+        glDeleteTextures(2, textures);
+        glDeleteBuffers(2, buffers);
+    }
+    
+    // Finds the tile maps to draw this frame (all of them with rebuild), frees the layers of
+    // tiles that left or fell out of reach, and fits the moving objects' map to the view
+    void plan(const std::unordered_map<int64_t, std::unique_ptr<CityTile>>& resident, const glm::vec3& eye,
+              const glm::mat4& view, const glm::mat4& projection, bool rebuild) {
+        renders.clear();
+        stats.rendered = 0;
+        for (auto& entry : cached)
+            entry.second.resident = false;
+        
+        // Shadows fall away from the light, so casters come from the neighbours on its side and,
+        // for buildings overhanging their square, the adjacent ones
+        int reachX = (int)std::ceil(SHADOW_CASTER_HEIGHT * std::abs(lightView[1][0]) / tileSize);
+        int reachZ = (int)std::ceil(SHADOW_CASTER_HEIGHT * std::abs(lightView[1][1]) / tileSize);
+        int fromX = MOONLIGHT_DIRECTION.x < 0.0f ? -1 : -reachX, toX = MOONLIGHT_DIRECTION.x < 0.0f ? reachX : 1;
+        int fromZ = MOONLIGHT_DIRECTION.z < 0.0f ? -1 : -reachZ, toZ = MOONLIGHT_DIRECTION.z < 0.0f ? reachZ : 1;
+        int cameraX = (int)std::floor(eye.x / tileSize), cameraZ = (int)std::floor(eye.z / tileSize);
+        bool layersChanged = false;
+        for (const auto& entry : resident) {
+            const CityTile& tile = *entry.second;
+            int offsetX = tile.x - cameraX, offsetZ = tile.z - cameraZ;
+            if (offsetX * offsetX + offsetZ * offsetZ > radius * radius)
+                continue;
+            around.clear();
+            uint64_t signature = checksum64(&entry.first, sizeof(entry.first));
+            for (int dz = std::min(fromZ, -1); dz <= std::max(toZ, 1); dz++) {
+                for (int dx = std::min(fromX, -1); dx <= std::max(toX, 1); dx++) {
+                    auto other = resident.find(packCoords(tile.x + dx, tile.z + dz));
+                    const CityTile* neighbour = other == resident.end() ? nullptr : other->second.get();
+                    uint64_t identity[2] = { neighbour ? neighbour->generation : 0u, neighbour ? neighbour->revision : 0u };
+                    signature = checksum64(identity, sizeof(identity), signature);
+                    if (neighbour)
+                        around.push_back(neighbour);
+                }
+            }
+            
+            auto it = cached.find(entry.first);
+            if (it == cached.end()) {
+                if (freeLayers.empty())
+                    continue;
+                CachedTile fresh = { freeLayers.back(), ~signature, 0, false };
+                freeLayers.pop_back();
+                it = cached.insert(std::make_pair(entry.first, fresh)).first;
+            }
+            CachedTile& cache = it->second;
+            cache.resident = true;
+            if (cache.signature == signature && !rebuild)
+                continue;
+            
+            renders.push_back(planTile(tile, cache.layer));
+            cache.signature = signature;
+            cache.casterBuildings = 0;
+            for (const CityTile* caster : renders.back().casters)
+                cache.casterBuildings += caster->buildings.size();
+            glm::mat4 toTexture = textureMatrix(renders.back().lightProjection);
+            for (int row = 0; row < 3; row++)
+                layerRows[3 * cache.layer + row] = glm::vec4(toTexture[0][row], toTexture[1][row], toTexture[2][row], toTexture[3][row]);
+            layersChanged = true;
+        }
+        
+        stats.rebuildTriangles = 0;
+        for (auto it = cached.begin(); it != cached.end();) {
+            if (!it->second.resident) {
+                freeLayers.push_back(it->second.layer);
+                it = cached.erase(it);
+            } else {
+                stats.rebuildTriangles += it->second.casterBuildings;
+                ++it;
+            }
+        }
+        stats.tiles = (int)cached.size();
+        stats.rendered = (int)renders.size();
+        stats.renders += renders.size();
+        
+        // Which layer each tile around the camera uses
+        originX = cameraX - side / 2;
+        originZ = cameraZ - side / 2;
+        for (int z = 0; z < side; z++) {
+            for (int x = 0; x < side; x++) {
+                auto it = cached.find(packCoords(originX + x, originZ + z));
+                lookup[z * side + x] = it == cached.end() ? 0 : it->second.layer + 1;
+            }
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, buffers[0]);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, lookup.size() * sizeof(uint32_t), lookup.data());
+        if (layersChanged) {
+            glBindBuffer(GL_TEXTURE_BUFFER, buffers[1]);
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, layerRows.size() * sizeof(glm::vec4), layerRows.data());
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        
+        fitDynamic(view, projection);
+    }
+    
+    const std::vector<TileRender>& tileRenders() const { return renders; }
+    const glm::mat4& dynamicMatrix() const { return dynamicProjection; }
+    
+    // Binds a cleared depth target: a tile's layer, or the moving objects' map with layer -1
+    void begin(int layer) {
+        int size = layer < 0 ? SHADOW_DYNAMIC_RESOLUTION : SHADOW_TILE_RESOLUTION;
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        if (layer < 0)
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, dynamicDepth, 0);
+        else
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, tileDepth, 0, layer);
+        glViewport(0, 0, size, size);
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
+    
+    void bind() const {
+        const GLenum targets[] = { GL_TEXTURE_2D_ARRAY, GL_TEXTURE_2D, GL_TEXTURE_BUFFER, GL_TEXTURE_BUFFER };
+        const GLuint names[] = { tileDepth, dynamicDepth, textures[0], textures[1] };
+        for (int i = 0; i < 4; i++) {
+            glActiveTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT + i);
+            glBindTexture(targets[i], names[i]);
+        }
+        glActiveTexture(GL_TEXTURE0);
+    }
+    
+    // FrameUniforms values that let fragments find their tile's map and the moving objects' map
+    void frameUniforms(FrameUniforms& frame) const {
+        frame.dynamicShadow = textureMatrix(dynamicProjection);
+        frame.shadowGrid = glm::vec4((float)originX, (float)originZ, 1.0f / tileSize, SHADOW_NORMAL_OFFSET);
+        frame.shadowCounts[0] = side;
+        frame.shadowCounts[1] = 1;
+        frame.shadowCounts[2] = 0;
+        frame.shadowCounts[3] = 0;
+    }
+    
+    // Filled in by the drawing code
+    void drawn(int staticDraws, long long staticTriangles, int dynamicDraws, long long dynamicTriangles,
+               long long trianglesPerBuilding, double ms) {
+        stats.staticDraws = staticDraws;
+        stats.staticTriangles = staticTriangles;
+        stats.dynamicDraws = dynamicDraws;
+        stats.dynamicTriangles = dynamicTriangles;
+        stats.rebuildTriangles *= trianglesPerBuilding;
+        stats.ms = ms;
+    }
+    
+    const ShadowStats& getStats() const { return stats; }
+};
+
+const int OCCLUDER_LIMIT = 64;      // largest nearby buildings rasterized as occluders per frame
+const float OCCLUDER_NEAR = 1.0f;   // boxes reaching closer to the eye plane are skipped (not clipped)
+const size_t OCCLUSION_GRAIN = 256; // candidates per worker job
+
+// Per-frame occlusion culling results, counted in instances
+struct OcclusionStats {
+    int occluders;
+    int triangles; // occluder triangles left after back-face culling
+    int tested;
+    int occluded;
+    double rasterMs; // occluder selection, rasterization and pyramid
+    double testMs;
+};
+
+// Software occlusion culling. A few large occluders are rasterized as boxes into a small depth
+// buffer, split into tiles that are filled in parallel four pixels at a time. From it a pyramid
+// of the nearest and farthest depth under each texel is built, and candidates are tested from a
+// coarse level down: hidden where their nearest depth is behind the farthest occluder depth,
+// visible as soon as they are in front of the nearest one.
+class OcclusionBuffer {
+public:
+    static const int BUFFER_WIDTH = 256, BUFFER_HEIGHT = 160;
+    static const int TILE_WIDTH = 64, TILE_HEIGHT = 32; // TILE_WIDTH is a multiple of 4
+    static const int TILES_X = BUFFER_WIDTH / TILE_WIDTH, TILES_Y = BUFFER_HEIGHT / TILE_HEIGHT;
+    static const int LEVELS = 5; // 256x160 down to 16x10
+    
+private:
+    // Screen-space triangle: edge functions A*x + B*y + C, positive inside, and a depth plane
+    struct Triangle {
+        float edgeA[3], edgeB[3], edgeC[3];
+        float depth0, depthX, depthY; // depth at pixel (0, 0) and its slopes
+        int minX, maxX, minY, maxY;   // pixels whose centers may be covered
+    };
+    std::vector<Triangle> triangles;
+    std::vector<uint32_t> bins[TILES_X * TILES_Y];
+    
+    // Level 0 is the depth buffer itself (depth in [0, 1], 1 = far); nearest[0] is not kept
+    std::vector<float> nearest[LEVELS], farthest[LEVELS];
+    glm::mat4 viewProjection;
+    
+    static int levelWidth(int level) { return BUFFER_WIDTH >> level; }
+    static int levelHeight(int level) { return BUFFER_HEIGHT >> level; }
+    
+    // Edges on the box's outline only cover pixels lying wholly inside them, so a gap between
+    // occluders narrower than a pixel here is never filled in; edges shared with another drawn
+    // face use the pixel center, so the box has no cracks. outline[i] is the edge from vi.
+    void setupTriangle(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, const bool outline[3]) {
+        glm::vec3 v[3] = { v0, v1, v2 };
+        bool outer[3] = { outline[0], outline[1], outline[2] };
+        float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[2].x - v[0].x) * (v[1].y - v[0].y);
+        if (std::abs(area) < 1e-6f)
+            return;
+        if (area < 0.0f) {
+            std::swap(v[1], v[2]);
+            std::swap(outer[0], outer[2]);
+            area = -area;
+        }
+        
+        Triangle t;
+        float minX = std::min(v[0].x, std::min(v[1].x, v[2].x)), maxX = std::max(v[0].x, std::max(v[1].x, v[2].x));
+        float minY = std::min(v[0].y, std::min(v[1].y, v[2].y)), maxY = std::max(v[0].y, std::max(v[1].y, v[2].y));
+        t.minX = std::max((int)std::ceil(minX - 0.5f), 0);
+        t.maxX = std::min((int)std::floor(maxX - 0.5f), BUFFER_WIDTH - 1);
+        t.minY = std::max((int)std::ceil(minY - 0.5f), 0);
+        t.maxY = std::min((int)std::floor(maxY - 0.5f), BUFFER_HEIGHT - 1);
+        if (t.minX > t.maxX || t.minY > t.maxY)
+            return;
+        
+        for (int i = 0; i < 3; i++) {
+            const glm::vec3& a = v[i];
+            const glm::vec3& b = v[(i + 1) % 3];
+            t.edgeA[i] = a.y - b.y;
+            t.edgeB[i] = b.x - a.x;
+            t.edgeC[i] = a.x * b.y - a.y * b.x;
+            if (outer[i])
+                t.edgeC[i] -= 0.5f * (std::abs(t.edgeA[i]) + std::abs(t.edgeB[i]));
+        }
+        
+        // Depth at a pixel center, raised to the farthest the plane gets within the pixel
+        t.depthX = ((v[1].z - v[0].z) * (v[2].y - v[0].y) - (v[2].z - v[0].z) * (v[1].y - v[0].y)) / area;
+        t.depthY = ((v[1].x - v[0].x) * (v[2].z - v[0].z) - (v[1].z - v[0].z) * (v[2].x - v[0].x)) / area;
+        t.depth0 = v[0].z - t.depthX * v[0].x - t.depthY * v[0].y + 0.5f * (std::abs(t.depthX) + std::abs(t.depthY));
+        
+        uint32_t index = (uint32_t)triangles.size();
+        triangles.push_back(t);
+        for (int y = t.minY / TILE_HEIGHT; y <= t.maxY / TILE_HEIGHT; y++) {
+            for (int x = t.minX / TILE_WIDTH; x <= t.maxX / TILE_WIDTH; x++)
+                bins[y * TILES_X + x].push_back(index);
+        }
+    }
+    
+    // Clears one tile and keeps the nearest depth of every binned triangle at each pixel center
+    void rasterizeTile(int tile) {
+        int tileX = tile % TILES_X * TILE_WIDTH, tileY = tile / TILES_X * TILE_HEIGHT;
+        float* depth = farthest[0].data();
+        for (int y = tileY; y < tileY + TILE_HEIGHT; y++)
+            std::fill(depth + y * BUFFER_WIDTH + tileX, depth + y * BUFFER_WIDTH + tileX + TILE_WIDTH, 1.0f);
+        
+        for (uint32_t index : bins[tile]) {
+            const Triangle& t = triangles[index];
+            int x0 = std::max(t.minX, tileX) & ~3, x1 = std::min(t.maxX, tileX + TILE_WIDTH - 1);
+            int y0 = std::max(t.minY, tileY), y1 = std::min(t.maxY, tileY + TILE_HEIGHT - 1);
+            for (int y = y0; y <= y1; y++) {
+                float py = y + 0.5f;
+                float* row = depth + y * BUFFER_WIDTH;
+                int x = x0;
+#ifdef NIGHTCITY_SSE
+                __m128 px = _mm_add_ps(_mm_set1_ps(x + 0.5f), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+                __m128 step = _mm_set1_ps(4.0f);
+                __m128 zero = _mm_setzero_ps();
+                __m128 edgeA[3], edgeRow[3];
+                for (int i = 0; i < 3; i++) {
+                    edgeA[i] = _mm_set1_ps(t.edgeA[i]);
+                    edgeRow[i] = _mm_set1_ps(t.edgeB[i] * py + t.edgeC[i]);
+                }
+                __m128 depthX = _mm_set1_ps(t.depthX);
+                __m128 depthRow = _mm_set1_ps(t.depth0 + t.depthY * py);
+                for (; x <= x1; x += 4) {
+                    __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeA[0], px), edgeRow[0]), zero);
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeA[1], px), edgeRow[1]), zero));
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeA[2], px), edgeRow[2]), zero));
+                    __m128 old = _mm_loadu_ps(row + x);
+                    __m128 nearer = _mm_min_ps(old, _mm_add_ps(_mm_mul_ps(depthX, px), depthRow));
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+                    px = _mm_add_ps(px, step);
+                }
+#endif
+                for (; x <= x1; x++) {
+                    float px = x + 0.5f;
+                    bool inside = true;
+                    for (int i = 0; i < 3; i++)
+                        inside = inside && t.edgeA[i] * px + t.edgeB[i] * py + t.edgeC[i] >= 0.0f;
+                    if (inside)
+                        row[x] = std::min(row[x], t.depth0 + t.depthX * px + t.depthY * py);
+                }
+            }
+        }
+    }
+    
+    // Whether anything of depth `depth` in level-0 pixels [x0, x1] x [y0, y1] can show through
+    // the texels of `level` that cover them
+    bool visibleIn(int level, int x0, int y0, int x1, int y1, float depth) const {
+        int width = levelWidth(level);
+        for (int ty = y0 >> level; ty <= y1 >> level; ty++) {
+            for (int tx = x0 >> level; tx <= x1 >> level; tx++) {
+                int texel = ty * width + tx;
+                if (depth > farthest[level][texel])
+                    continue;
+                if (level == 0 || depth <= nearest[level][texel])
+                    return true;
+                
+                // Partly in front: look at the part of the rectangle under this texel one level down
+                int span = 1 << level;
+                if (visibleIn(level - 1, std::max(x0, tx * span), std::max(y0, ty * span),
+                              std::min(x1, (tx + 1) * span - 1), std::min(y1, (ty + 1) * span - 1), depth))
+                    return true;
+            }
+        }
+        return false;
+    }
+    
+public:
+    OcclusionBuffer() : viewProjection(1.0f) {
+        for (int level = 0; level < LEVELS; level++) {
+            size_t texels = (size_t)levelWidth(level) * levelHeight(level);
+            farthest[level].assign(texels, 1.0f);
+            if (level > 0)
+                nearest[level].assign(texels, 1.0f);
+        }
+    }
+    
+    // Rasterizes the camera-facing sides of the boxes and rebuilds the pyramid; returns the
+    // number of triangles drawn
+    int rasterize(const BoxArray& occluders, const glm::vec3& eye, const glm::mat4& matrix, WorkerPool& workers) {
+        viewProjection = matrix;
+        triangles.clear();
+        for (auto& bin : bins)
+            bin.clear();
+        
+        for (size_t i = 0; i < occluders.size(); i++) {
+            glm::vec3 center(occluders.centerX[i], occluders.centerY[i], occluders.centerZ[i]);
+            glm::vec3 extent(occluders.extentX[i], occluders.extentY[i], occluders.extentZ[i]);
+            
+            // Corner c has +extent on axis a where bit a of c is set
+            glm::vec3 screen[8];
+            bool clipped = false;
+            for (int c = 0; c < 8; c++) {
+                glm::vec3 sign((c & 1) ? 1.0f : -1.0f, (c & 2) ? 1.0f : -1.0f, (c & 4) ? 1.0f : -1.0f);
+                glm::vec4 clip = viewProjection * glm::vec4(center + sign * extent, 1.0f);
+                if (clip.w < OCCLUDER_NEAR) {
+                    clipped = true;
+                    break;
+                }
+                glm::vec3 ndc = glm::vec3(clip) / clip.w;
+                screen[c] = glm::vec3((ndc.x * 0.5f + 0.5f) * BUFFER_WIDTH, (ndc.y * 0.5f + 0.5f) * BUFFER_HEIGHT,
+                                      ndc.z * 0.5f + 0.5f);
+            }
+            if (clipped)
+                continue;
+            
+            // Only faces the eye is outside of; the others are hidden behind them
+            bool facing[3][2];
+            for (int axis = 0; axis < 3; axis++) {
+                float offset = eye[axis] - center[axis];
+                facing[axis][0] = offset < -extent[axis];
+                facing[axis][1] = offset > extent[axis];
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                for (int side = 0; side < 2; side++) {
+                    if (!facing[axis][side])
+                        continue;
+                    // Quad base, base+u, base+u+v, base+v; each side borders the face across it
+                    int axisU = (axis + 1) % 3, axisV = (axis + 2) % 3;
+                    int u = 1 << axisU, v = 1 << axisV, base = side << axis;
+                    bool first[3] = { !facing[axisV][0], !facing[axisU][1], false };
+                    bool second[3] = { false, !facing[axisV][1], !facing[axisU][0] };
+                    setupTriangle(screen[base], screen[base | u], screen[base | u | v], first);
+                    setupTriangle(screen[base], screen[base | u | v], screen[base | v], second);
+                }
+            }
+        }
+        
+        workers.parallelFor(TILES_X * TILES_Y, 1, [&](size_t begin, size_t end) {
+            for (size_t tile = begin; tile < end; tile++)
+                rasterizeTile((int)tile);
+        });
+        
+        for (int level = 1; level < LEVELS; level++) {
+            int width = levelWidth(level);
+            const std::vector<float>& fine = level == 1 ? farthest[0] : nearest[level - 1];
+            const std::vector<float>& fineFar = farthest[level - 1];
+            workers.parallelFor(levelHeight(level), 16, [&](size_t begin, size_t end) {
+                for (size_t y = begin; y < end; y++) {
+                    for (int x = 0; x < width; x++) {
+                        size_t a = (2 * y) * (2 * width) + 2 * x, b = a + 2 * width;
+                        nearest[level][y * width + x] = std::min(std::min(fine[a], fine[a + 1]), std::min(fine[b], fine[b + 1]));
+                        farthest[level][y * width + x] = std::max(std::max(fineFar[a], fineFar[a + 1]),
+                                                                  std::max(fineFar[b], fineFar[b + 1]));
+                    }
+                }
+            });
+        }
+        return (int)triangles.size();
+    }
+    
+    // False only if the box is certainly hidden behind the rasterized occluders. Safe to call
+    // from several threads once rasterize() has returned.
+    bool visible(const glm::vec3& center, const glm::vec3& extent) const {
+        float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f, minDepth = 1.0f;
+        for (int c = 0; c < 8; c++) {
+            glm::vec3 sign((c & 1) ? 1.0f : -1.0f, (c & 2) ? 1.0f : -1.0f, (c & 4) ? 1.0f : -1.0f);
+            glm::vec4 clip = viewProjection * glm::vec4(center + sign * extent, 1.0f);
+            if (clip.w <= 1e-3f)
+                return true; // reaches behind the eye
+            glm::vec3 ndc = glm::vec3(clip) / clip.w;
+            minX = std::min(minX, ndc.x);
+            maxX = std::max(maxX, ndc.x);
+            minY = std::min(minY, ndc.y);
+            maxY = std::max(maxY, ndc.y);
+            minDepth = std::min(minDepth, ndc.z * 0.5f + 0.5f);
+        }
+        
+        // Every pixel the rectangle touches, clamped to the buffer
+        int x0 = glm::clamp((int)std::floor((minX * 0.5f + 0.5f) * BUFFER_WIDTH), 0, BUFFER_WIDTH - 1);
+        int x1 = glm::clamp((int)std::floor((maxX * 0.5f + 0.5f) * BUFFER_WIDTH), 0, BUFFER_WIDTH - 1);
+        int y0 = glm::clamp((int)std::floor((minY * 0.5f + 0.5f) * BUFFER_HEIGHT), 0, BUFFER_HEIGHT - 1);
+        int y1 = glm::clamp((int)std::floor((maxY * 0.5f + 0.5f) * BUFFER_HEIGHT), 0, BUFFER_HEIGHT - 1);
+        
+        // Start where the rectangle covers at most 2x2 texels
+        int level = 0;
+        while (level < LEVELS - 1 && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+            level++;
+        return visibleIn(level, x0, y0, x1, y1, minDepth);
+    }
+};
+
+// Programs in submission order; the top bits of a packet's sort key
+enum QueueProgram {
+    QUEUE_AXIS_ALIGNED,
+    QUEUE_GENERAL,
+    QUEUE_AXIS_ALIGNED_INSTANCED,
+    QUEUE_INSTANCED,
+    QUEUE_BATCHED,
+    QUEUE_ANIMATED,
+    QUEUE_PROGRAM_COUNT
+};
+
+// The list a packet's instance range indexes
+enum PacketList {
+    LIST_BUILDINGS,  // visibleBuildings
+    LIST_DISTANT,    // distantBuildings, simplified mesh
+    LIST_VEHICLES,   // visible[CATEGORY_VEHICLES]
+    LIST_BILLBOARDS, // visible[CATEGORY_BILLBOARDS]
+    LIST_BATCHES,    // visibleBatches
+    LIST_ANIMATED,   // animated[first], all of them
+    LIST_COUNT
+};
+
+const size_t QUEUE_GRAIN = 512; // objects per recording job
+
+// One recorded draw. Per-object packets cover a single instance; the instanced path draws
+// runs of adjacent packets with the same program, mesh and list as one instance range.
+struct DrawPacket {
+    uint64_t key; // program (3 bits) | mesh (1) | material (16) | depth (24) | sequence (20)
+    uint32_t first;
+    uint16_t count;
+    uint8_t list;
+    uint8_t mesh; // 1: simplified
+};
+
+// Sort key: program first, then mesh and material so state changes group together, then
+// depth so each group is drawn front to back, then the recording index to break ties
+uint64_t packetKey(int program, int mesh, uint32_t material, float depth, uint32_t sequence) {
+    uint64_t quantized = (uint64_t)(glm::clamp(depth / farPlane, 0.0f, 1.0f) * 16777215.0f);
+    return ((uint64_t)program << 61) | ((uint64_t)mesh << 60) | ((uint64_t)(material & 0xffff) << 44) |
+           (quantized << 20) | (sequence & 0xfffff);
+}
+
+// 16-bit identity of a set of per-object material uniforms; equal values give equal keys
+uint32_t materialKey(const glm::vec3& color, float emission, const glm::vec3& emissionColor) {
+    uint64_t bits = 0;
+    const float values[] = { color.r, color.g, color.b, emission, emissionColor.r, emissionColor.g, emissionColor.b };
+    for (float value : values)
+        bits = (bits << 8 | (uint64_t)(glm::clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f)) * 0x9e3779b97f4a7c15ull;
+    return (uint32_t)(bits >> 48);
+}
+
+// Per-frame render queue results
+struct QueueStats {
+    int packets;
+    int draws;
+    int stateChanges;    // program, mesh, list or material switches in submission order
+    int unsortedChanges; // the same packets in recording order
+    int skippedUploads;  // material uniforms left alone because they already held the value
+    double sortMs, submitMs;
+    std::vector<double> recordMs; // per recording thread
+    std::vector<int> recorded;    // packets per recording thread
+};
+
+// Render queue: draw packets recorded in parallel, radix-sorted by key and handed back for
+// submission on the GL thread. Every object records exactly one packet at its own slot, so
+// the order before sorting does not depend on which thread got which chunk.
+class RenderQueue {
+private:
+    std::vector<DrawPacket> packets, scratch;
+    
+    // Recording time per thread; padded so threads do not share cache lines
+    struct alignas(64) ThreadTotals {
+        double ms;
+        int packets;
+    };
+    std::vector<ThreadTotals> threads;
+    std::atomic<int> nextThread;
+    QueueStats stats;
+    
+    // Threads are numbered in the order they first record for this queue
+    int threadSlot() {
+        thread_local const RenderQueue* owner = nullptr;
+        thread_local int slot = 0;
+        if (owner != this) {
+            owner = this;
+            slot = nextThread++;
+        }
+        return slot;
+    }
+    
+    // Switches between consecutive packets of the same kind the submission counts
+    static int changes(const std::vector<DrawPacket>& order) {
+        int count = 0;
+        uint64_t state = ~0ull;
+        for (const DrawPacket& packet : order) {
+            uint64_t next = (packet.key >> 44) << 8 | packet.list;
+            count += next != state;
+            state = next;
+        }
+        return count;
+    }
+    
+public:
+    // threadCount: every thread that may record (pool workers plus the caller)
+    explicit RenderQueue(int threadCount) : threads(threadCount), nextThread(0) {
+        stats = QueueStats();
+    }
+    
+    // Records one packet per object: packets[i] = record(i) for i in [0, count)
+    template <typename Record>
+    void record(size_t count, WorkerPool& workers, const Record& record) {
+        PROFILE_SCOPE("queue record");
+        packets.resize(count);
+        for (ThreadTotals& totals : threads)
+            totals = ThreadTotals();
+        workers.parallelFor(count, QUEUE_GRAIN, [&](size_t begin, size_t end) {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = begin; i < end; i++)
+                packets[i] = record(i);
+            int slot = threadSlot();
+            if (slot < (int)threads.size()) {
+                threads[slot].ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                threads[slot].packets += (int)(end - begin);
+            }
+        });
+        
+        stats.packets = (int)count;
+        stats.recordMs.clear();
+        stats.recorded.clear();
+        for (const ThreadTotals& totals : threads) {
+            if (totals.packets == 0)
+                continue;
+            stats.recordMs.push_back(totals.ms);
+            stats.recorded.push_back(totals.packets);
+        }
+    }
+    
+    // LSD radix sort on the key, one byte per pass; bytes that are equal in every key are skipped
+    void sort() {
+        PROFILE_SCOPE("queue sort");
+        auto start = std::chrono::steady_clock::now();
+        stats.unsortedChanges = changes(packets);
+        scratch.resize(packets.size());
+        for (int shift = 0; shift < 64; shift += 8) {
+            size_t counts[256] = {};
+            for (const DrawPacket& packet : packets)
+                counts[(packet.key >> shift) & 0xff]++;
+            if (counts[(packets.empty() ? 0 : packets[0].key >> shift) & 0xff] == packets.size())
+                continue;
+            size_t offset = 0;
+            for (size_t& bucket : counts) {
+                size_t size = bucket;
+                bucket = offset;
+                offset += size;
+            }
+            for (const DrawPacket& packet : packets)
+                scratch[counts[(packet.key >> shift) & 0xff]++] = packet;
+            packets.swap(scratch);
+        }
+        stats.stateChanges = changes(packets);
+        stats.sortMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    
+    const std::vector<DrawPacket>& sorted() const { return packets; }
+    
+    // Filled in by the submitting code
+    void submitted(int draws, int skippedUploads, double ms) {
+        stats.draws = draws;
+        stats.skippedUploads = skippedUploads;
+        stats.submitMs = ms;
+    }
+    
+    const QueueStats& getStats() const { return stats; }
+};
+
+// Image files for headless output, rows top to bottom, RGB8. PNG uses stored (uncompressed)
+// deflate blocks: every viewer reads it and it needs no zlib.
+bool writePPM(const std::string& path, int width, int height, const std::vector<uint8_t>& rgb) {
+    std::ofstream out(path, std::ios::binary);
+    out << "P6\n" << width << " " << height << "\n255\n";
+    out.write((const char*)rgb.data(), rgb.size());
+    return (bool)out;
+}
+
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> entries(256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            entries[i] = c;
+        }
+        return entries;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+bool writePNG(const std::string& path, int width, int height, const std::vector<uint8_t>& rgb) {
+    auto bigEndian = [](std::vector<uint8_t>& out, uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            out.push_back((uint8_t)(value >> shift));
+    };
+    
+    // Scanlines, each behind filter type 0
+    std::vector<uint8_t> raw;
+    size_t stride = (size_t)width * 3;
+    raw.reserve((stride + 1) * height);
+    for (int y = 0; y < height; y++) {
+        raw.push_back(0);
+        raw.insert(raw.end(), rgb.begin() + y * stride, rgb.begin() + (y + 1) * stride);
+    }
+    
+    // zlib stream: header, stored blocks of at most 65535 bytes, Adler-32
+    std::vector<uint8_t> deflated = { 0x78, 0x01 };
+    for (size_t pos = 0; pos < raw.size();) {
+        size_t length = std::min<size_t>(65535, raw.size() - pos);
+        deflated.push_back(pos + length == raw.size() ? 1 : 0);
+        deflated.push_back((uint8_t)length);
+        deflated.push_back((uint8_t)(length >> 8));
+        deflated.push_back((uint8_t)~length);
+        deflated.push_back((uint8_t)(~length >> 8));
+        deflated.insert(deflated.end(), raw.begin() + pos, raw.begin() + pos + length);
+        pos += length;
+    }
+    uint32_t a = 1, b = 0;
+    for (uint8_t value : raw) {
+        a = (a + value) % 65521;
+        b = (b + a) % 65521;
+    }
+    bigEndian(deflated, b << 16 | a);
+    
+    std::ofstream out(path, std::ios::binary);
+    auto chunk = [&](const char* type, const std::vector<uint8_t>& data) {
+        std::vector<uint8_t> body(type, type + 4);
+        body.insert(body.end(), data.begin(), data.end());
+        std::vector<uint8_t> framing;
+        bigEndian(framing, (uint32_t)data.size());
+        out.write((const char*)framing.data(), 4);
+        out.write((const char*)body.data(), body.size());
+        framing.clear();
+        bigEndian(framing, crc32(body.data(), body.size()));
+        out.write((const char*)framing.data(), 4);
+    };
+    std::vector<uint8_t> header;
+    bigEndian(header, (uint32_t)width);
+    bigEndian(header, (uint32_t)height);
+    header.insert(header.end(), { 8, 2, 0, 0, 0 }); // 8-bit RGB, no interlace
+    out.write("\x89PNG\r\n\x1a\n", 8);
+    chunk("IHDR", header);
+    chunk("IDAT", deflated);
+    chunk("IEND", std::vector<uint8_t>());
+    return (bool)out;
+}
+
+// Screen tiles of the software rasterizer are this many pixels square
+const int RASTER_TILE = 32;
+// Instances per transform-and-bin job
+const size_t RASTER_GRAIN = 256;
+
+// One frame of the software rasterizer
+struct SoftwareStats {
+    long long triangles; // set up and binned
+    long long culled;    // facing away, outside the frustum or covering no pixel centre
+    long long clipped;   // crossing the near plane
+    long long binned;    // tile bin entries
+    long long fragments; // depth test passes, overdraw included
+    long long shaded;    // pixels shaded, each once
+    int tiles;
+    int steals;          // tile ranges taken from another thread's queue
+    std::vector<int> tilesPerThread;
+    double transformMs, rasterMs;
+};
+
+// CPU stand-in for the instanced main pass, for machines without a GPU: same FrameUniforms,
+// same InstanceData runs drawn over a MeshData, same Phong + emission as fragmentShaderSource
+// (shadows and clustered point lights are left out). Instances are transformed four vertices
+// at a time with SSE and their triangles binned into screen tiles, per job, on the pool.
+// Tiles are then rasterized and shaded in parallel: every thread starts on its own share
+// of the tiles and steals from the others when it runs dry. Each tile first resolves depth
+// and the nearest triangle per pixel, then shades every covered pixel once. Bins are read
+// in job order, so the image does not depend on the number of threads.
+class SoftwareRasterizer {
+private:
+    static const uint32_t NO_TRIANGLE = 0xffffffffu;
+    
+    // A value that is affine in screen space, relative to the triangle's first corner
+    template <typename T>
+    struct Plane {
+        T value, dx, dy;
+        
+        T at(float x, float y) const { return value + dx * x + dy * y; }
+    };
+    
+    // Shading attributes are divided by w, which makes them affine on screen; dividing by the
+    // interpolated 1 / w brings back the perspective-correct value
+    struct Triangle {
+        glm::vec2 screen[3]; // pixel coordinates, y down
+        float depth[3];      // window depth, [0, 1]
+        float invArea;
+        Plane<float> invW;
+        Plane<glm::vec3> world, normal;
+        const InstanceData* instance;
+    };
+    
+    // One transform job's triangles and, per screen tile, the ones overlapping it
+    struct Job {
+        std::vector<Triangle> triangles;
+        std::vector<std::vector<uint32_t>> bins;
+        std::vector<float> clip[4], world[3]; // transformed mesh vertices of the current instance
+        std::vector<glm::vec3> normals;
+        long long culled, clipped, binned;
+    };
+    
+    struct ClipVertex {
+        glm::vec4 clip;
+        glm::vec3 world;
+        glm::vec3 normal;
+    };
+    
+    int width, height, tilesX, tilesY;
+    WorkerPool& workers;
+    std::vector<std::unique_ptr<Job>> jobs;
+    size_t jobCount;
+    std::vector<uint32_t> jobStart; // first global triangle index of each job
+    std::vector<uint8_t> color;
+    
+    glm::mat4 viewProjection;
+    glm::vec3 viewPos, lightDir, lightColor;
+    uint8_t clearColor[3];
+    
+    // Work stealing: per thread the remaining part [begin, end) of the tile order, packed as
+    // end << 32 | begin in one word that both the owner and thieves change by CAS
+    std::unique_ptr<std::atomic<uint64_t>[]> ranges;
+    int threadCount;
+    std::atomic<int> steals;
+    std::atomic<long long> fragments, shaded;
+    struct TileScratch {
+        std::vector<float> depth;  // RASTER_TILE rows of RASTER_TILE + 4: SIMD loads may run past a row
+        std::vector<uint32_t> ids;
+        int tiles;
+    };
+    std::vector<TileScratch> scratch;
+    
+    SoftwareStats stats;
+    
+    static uint64_t packRange(uint32_t begin, uint32_t end) { return (uint64_t)end << 32 | begin; }
+    
+    // rows of m applied to (x, y, z, 1), four points at a time
+    static void transformPoints(const glm::mat4& m, int rows, const float* x, const float* y, const float* z, size_t count,
+                                std::vector<float>* out) {
+        size_t i = 0;
+#ifdef NIGHTCITY_SSE
+        for (; i + 4 <= count; i += 4) {
+            __m128 px = _mm_loadu_ps(x + i), py = _mm_loadu_ps(y + i), pz = _mm_loadu_ps(z + i);
+            for (int r = 0; r < rows; r++) {
+                __m128 value = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(m[0][r])), _mm_mul_ps(py, _mm_set1_ps(m[1][r]))),
+                                          _mm_add_ps(_mm_mul_ps(pz, _mm_set1_ps(m[2][r])), _mm_set1_ps(m[3][r])));
+                _mm_storeu_ps(out[r].data() + i, value);
+            }
+        }
+#endif
+        for (; i < count; i++) {
+            for (int r = 0; r < rows; r++)
+                out[r][i] = (m[0][r] * x[i] + m[1][r] * y[i]) + (m[2][r] * z[i] + m[3][r]); // summed as the SIMD path does
+        }
+    }
+    
+    // Projects a clipped triangle, orders it counter-clockwise on screen and bins it
+    void setup(const ClipVertex* v, const InstanceData* instance, Job& job) {
+        Triangle t;
+        float invW[3];
+        glm::vec3 world[3], normal[3];
+        for (int i = 0; i < 3; i++) {
+            invW[i] = 1.0f / v[i].clip.w;
+            t.screen[i] = glm::vec2((v[i].clip.x * invW[i] * 0.5f + 0.5f) * width,
+                                    (0.5f - v[i].clip.y * invW[i] * 0.5f) * height);
+            t.depth[i] = v[i].clip.z * invW[i] * 0.5f + 0.5f;
+            world[i] = v[i].world * invW[i];
+            normal[i] = v[i].normal * invW[i];
+        }
+        float area = edgeFunction(t.screen[0], t.screen[1], t.screen[2]);
+        if (area == 0.0f || !std::isfinite(area)) {
+            job.culled++;
+            return;
+        }
+        if (area < 0.0f) {
+            std::swap(t.screen[1], t.screen[2]);
+            std::swap(t.depth[1], t.depth[2]);
+            std::swap(invW[1], invW[2]);
+            std::swap(world[1], world[2]);
+            std::swap(normal[1], normal[2]);
+            area = -area;
+        }
+        t.invArea = 1.0f / area;
+        t.instance = instance;
+        t.invW = plane(t, invW);
+        t.world = plane(t, world);
+        t.normal = plane(t, normal);
+        
+        // Pixel centres inside the bounds
+        float minX = std::min(t.screen[0].x, std::min(t.screen[1].x, t.screen[2].x));
+        float maxX = std::max(t.screen[0].x, std::max(t.screen[1].x, t.screen[2].x));
+        float minY = std::min(t.screen[0].y, std::min(t.screen[1].y, t.screen[2].y));
+        float maxY = std::max(t.screen[0].y, std::max(t.screen[1].y, t.screen[2].y));
+        int x0 = std::max(0, (int)std::ceil(minX - 0.5f)), x1 = std::min(width - 1, (int)std::floor(maxX - 0.5f));
+        int y0 = std::max(0, (int)std::ceil(minY - 0.5f)), y1 = std::min(height - 1, (int)std::floor(maxY - 0.5f));
+        if (x0 > x1 || y0 > y1) {
+            job.culled++;
+            return;
+        }
+        
+        uint32_t index = (uint32_t)job.triangles.size();
+        job.triangles.push_back(t);
+        for (int ty = y0 / RASTER_TILE; ty <= y1 / RASTER_TILE; ty++) {
+            for (int tx = x0 / RASTER_TILE; tx <= x1 / RASTER_TILE; tx++) {
+                job.bins[ty * tilesX + tx].push_back(index);
+                job.binned++;
+            }
+        }
+    }
+    
+    static float edgeFunction(const glm::vec2& a, const glm::vec2& b, const glm::vec2& p) {
+        return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+    }
+    
+    // Screen gradients of a value given at the three corners
+    template <typename T>
+    static Plane<T> plane(const Triangle& t, const T* corner) {
+        glm::vec2 u = t.screen[1] - t.screen[0], v = t.screen[2] - t.screen[0];
+        T du = corner[1] - corner[0], dv = corner[2] - corner[0];
+        Plane<T> result;
+        result.value = corner[0];
+        result.dx = (du * v.y - dv * u.y) * t.invArea;
+        result.dy = (dv * u.x - du * v.x) * t.invArea;
+        return result;
+    }
+    
+    // Clips against the near plane (z >= -w); the other planes are left to the screen bounds
+    // and the depth test against the cleared 1.0
+    void assemble(const ClipVertex* v, const InstanceData* instance, Job& job) {
+        bool inside[3];
+        int count = 0;
+        for (int i = 0; i < 3; i++) {
+            inside[i] = v[i].clip.z >= -v[i].clip.w;
+            count += inside[i];
+        }
+        if (count == 3) {
+            setup(v, instance, job);
+            return;
+        }
+        if (count == 0) {
+            job.culled++;
+            return;
+        }
+        job.clipped++;
+        ClipVertex polygon[4];
+        int corners = 0;
+        for (int i = 0; i < 3; i++) {
+            const ClipVertex& a = v[i];
+            const ClipVertex& b = v[(i + 1) % 3];
+            if (inside[i])
+                polygon[corners++] = a;
+            if (inside[i] != inside[(i + 1) % 3]) {
+                float da = a.clip.z + a.clip.w, db = b.clip.z + b.clip.w;
+                float t = da / (da - db);
+                ClipVertex& out = polygon[corners++];
+                out.clip = a.clip + (b.clip - a.clip) * t;
+                out.world = a.world + (b.world - a.world) * t;
+                out.normal = a.normal + (b.normal - a.normal) * t;
+            }
+        }
+        for (int i = 1; i + 1 < corners; i++) {
+            ClipVertex fan[3] = { polygon[0], polygon[i], polygon[i + 1] };
+            setup(fan, instance, job);
+        }
+    }
+    
+    void transformInstances(const MeshData& mesh, const std::vector<float>* positions, const InstanceData* instances,
+                            size_t begin, size_t end, Job& job) {
+        size_t vertexCount = mesh.positions.size();
+        for (int r = 0; r < 4; r++)
+            job.clip[r].resize(vertexCount);
+        for (int r = 0; r < 3; r++)
+            job.world[r].resize(vertexCount);
+        job.normals.resize(vertexCount);
+        
+        for (size_t k = begin; k < end; k++) {
+            const InstanceData& instance = instances[k];
+            transformPoints(viewProjection * instance.model, 4, positions[0].data(), positions[1].data(), positions[2].data(),
+                            vertexCount, job.clip);
+            transformPoints(instance.model, 3, positions[0].data(), positions[1].data(), positions[2].data(), vertexCount,
+                            job.world);
+            glm::mat3 normals = normalMatrix(instance.model);
+            for (size_t i = 0; i < vertexCount; i++)
+                job.normals[i] = normals * mesh.normals[i];
+            
+            for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+                ClipVertex v[3];
+                bool outside[5] = { true, true, true, true, true }; // +x, -x, +y, -y, beyond far
+                for (int c = 0; c < 3; c++) {
+                    uint16_t index = mesh.indices[i + c];
+                    v[c].clip = glm::vec4(job.clip[0][index], job.clip[1][index], job.clip[2][index], job.clip[3][index]);
+                    v[c].world = glm::vec3(job.world[0][index], job.world[1][index], job.world[2][index]);
+                    v[c].normal = job.normals[index];
+                    outside[0] = outside[0] && v[c].clip.x > v[c].clip.w;
+                    outside[1] = outside[1] && v[c].clip.x < -v[c].clip.w;
+                    outside[2] = outside[2] && v[c].clip.y > v[c].clip.w;
+                    outside[3] = outside[3] && v[c].clip.y < -v[c].clip.w;
+                    outside[4] = outside[4] && v[c].clip.z > v[c].clip.w;
+                }
+                // Faces turned away from the eye are hidden behind the front of their box
+                bool away = glm::dot(v[0].normal, viewPos - v[0].world) <= 0.0f;
+                if (away || outside[0] || outside[1] || outside[2] || outside[3] || outside[4]) {
+                    job.culled++;
+                    continue;
+                }
+                assemble(v, &instance, job);
+            }
+        }
+    }
+    
+    // Depth and nearest triangle per pixel of one tile, then one shading pass over it
+    void rasterTile(int tile, TileScratch& local) {
+        int tx0 = (tile % tilesX) * RASTER_TILE, ty0 = (tile / tilesX) * RASTER_TILE;
+        int tx1 = std::min(tx0 + RASTER_TILE, width) - 1, ty1 = std::min(ty0 + RASTER_TILE, height) - 1;
+        const int stride = RASTER_TILE + 4;
+        std::fill(local.depth.begin(), local.depth.end(), 1.0f);
+        std::fill(local.ids.begin(), local.ids.end(), NO_TRIANGLE);
+        
+        long long passed = 0;
+        for (size_t j = 0; j < jobCount; j++) {
+            const Job& job = *jobs[j];
+            for (uint32_t index : job.bins[tile])
+                passed += rasterTriangle(job.triangles[index], jobStart[j] + index, tx0, ty0, tx1, ty1, local);
+        }
+        fragments += passed;
+        
+        // Shading; the job owning a triangle is found from the previous pixel's, mostly the same one
+        long long pixels = 0;
+        size_t job = 0;
+        for (int y = ty0; y <= ty1; y++) {
+            uint8_t* out = color.data() + ((size_t)y * width + tx0) * 3;
+            for (int x = tx0; x <= tx1; x++, out += 3) {
+                uint32_t id = local.ids[(y - ty0) * stride + (x - tx0)];
+                if (id == NO_TRIANGLE) {
+                    out[0] = clearColor[0];
+                    out[1] = clearColor[1];
+                    out[2] = clearColor[2];
+                    continue;
+                }
+                if (id < jobStart[job] || id >= jobStart[job + 1])
+                    job = std::upper_bound(jobStart.begin(), jobStart.begin() + jobCount + 1, id) - jobStart.begin() - 1;
+                glm::vec3 result = shade(jobs[job]->triangles[id - jobStart[job]], glm::vec2(x + 0.5f, y + 0.5f));
+                for (int c = 0; c < 3; c++)
+                    out[c] = (uint8_t)(glm::clamp(result[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+                pixels++;
+            }
+        }
+        shaded += pixels;
+    }
+    
+    // Edge functions are evaluated from the edge's endpoints in a fixed order, so the two
+    // triangles sharing an edge get exactly opposite values, and pixel centres on an edge
+    // belong to one side only: no cracks and no double hits along shared edges
+    struct Edge {
+        float x, y, dx, dy, sign;
+        bool inclusive;
+        
+        Edge(const glm::vec2& a, const glm::vec2& b) {
+            bool forward = a.x < b.x || (a.x == b.x && a.y < b.y);
+            const glm::vec2& from = forward ? a : b;
+            const glm::vec2& to = forward ? b : a;
+            x = from.x;
+            y = from.y;
+            dx = to.x - from.x;
+            dy = to.y - from.y;
+            sign = forward ? 1.0f : -1.0f;
+            glm::vec2 direction = b - a;
+            inclusive = direction.y > 0.0f || (direction.y == 0.0f && direction.x < 0.0f);
+        }
+        
+        float at(float px, float py) const { return sign * (dx * (py - y) - dy * (px - x)); }
+    };
+    
+    // Returns the pixels that passed the depth test
+    int rasterTriangle(const Triangle& t, uint32_t id, int tx0, int ty0, int tx1, int ty1, TileScratch& local) const {
+        const Edge edges[3] = { Edge(t.screen[1], t.screen[2]), Edge(t.screen[2], t.screen[0]), Edge(t.screen[0], t.screen[1]) };
+        float minX = std::min(t.screen[0].x, std::min(t.screen[1].x, t.screen[2].x));
+        float maxX = std::max(t.screen[0].x, std::max(t.screen[1].x, t.screen[2].x));
+        float minY = std::min(t.screen[0].y, std::min(t.screen[1].y, t.screen[2].y));
+        float maxY = std::max(t.screen[0].y, std::max(t.screen[1].y, t.screen[2].y));
+        int x0 = std::max(tx0, (int)std::ceil(minX - 0.5f)), x1 = std::min(tx1, (int)std::floor(maxX - 0.5f));
+        int y0 = std::max(ty0, (int)std::ceil(minY - 0.5f)), y1 = std::min(ty1, (int)std::floor(maxY - 0.5f));
+        const int stride = RASTER_TILE + 4;
+        int passed = 0;
+        
+#ifdef NIGHTCITY_SSE
+        __m128 ex[3], ey[3], edx[3], edy[3], esign[3], inclusive[3];
+        for (int e = 0; e < 3; e++) {
+            ex[e] = _mm_set1_ps(edges[e].x);
+            ey[e] = _mm_set1_ps(edges[e].y);
+            edx[e] = _mm_set1_ps(edges[e].dx);
+            edy[e] = _mm_set1_ps(edges[e].dy);
+            esign[e] = _mm_set1_ps(edges[e].sign);
+            inclusive[e] = _mm_castsi128_ps(_mm_set1_epi32(edges[e].inclusive ? -1 : 0));
+        }
+        const __m128 zero = _mm_setzero_ps(), invArea = _mm_set1_ps(t.invArea);
+        const __m128 depth0 = _mm_set1_ps(t.depth[0]), depth1 = _mm_set1_ps(t.depth[1]), depth2 = _mm_set1_ps(t.depth[2]);
+        const __m128i triangle = _mm_set1_epi32((int)id);
+        for (int y = y0; y <= y1; y++) {
+            __m128 py = _mm_set1_ps(y + 0.5f);
+            float* depthRow = local.depth.data() + (y - ty0) * stride - tx0;
+            uint32_t* idRow = local.ids.data() + (y - ty0) * stride - tx0;
+            for (int x = x0; x <= x1; x += 4) {
+                __m128 px = _mm_add_ps(_mm_set1_ps((float)x), _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f));
+                __m128 mask = _mm_castsi128_ps(_mm_cmplt_epi32(_mm_set_epi32(3, 2, 1, 0), _mm_set1_epi32(x1 - x + 1)));
+                __m128 weight[3];
+                for (int e = 0; e < 3; e++) {
+                    __m128 value = _mm_sub_ps(_mm_mul_ps(edx[e], _mm_sub_ps(py, ey[e])), _mm_mul_ps(edy[e], _mm_sub_ps(px, ex[e])));
+                    value = _mm_mul_ps(value, esign[e]);
+                    __m128 in = _mm_or_ps(_mm_cmpgt_ps(value, zero), _mm_and_ps(inclusive[e], _mm_cmpeq_ps(value, zero)));
+                    mask = _mm_and_ps(mask, in);
+                    weight[e] = value;
+                }
+                if (_mm_movemask_ps(mask) == 0)
+                    continue;
+                __m128 depth = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(weight[0], depth0), _mm_mul_ps(weight[1], depth1)),
+                                                     _mm_mul_ps(weight[2], depth2)), invArea);
+                __m128 old = _mm_loadu_ps(depthRow + x);
+                __m128 pass = _mm_and_ps(mask, _mm_cmplt_ps(depth, old));
+                int bits = _mm_movemask_ps(pass);
+                if (bits == 0)
+                    continue;
+                _mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(pass, depth), _mm_andnot_ps(pass, old)));
+                __m128i oldIds = _mm_loadu_si128((const __m128i*)(idRow + x));
+                __m128i passBits = _mm_castps_si128(pass);
+                _mm_storeu_si128((__m128i*)(idRow + x),
+                                 _mm_or_si128(_mm_and_si128(passBits, triangle), _mm_andnot_si128(passBits, oldIds)));
+                passed += (bits & 1) + ((bits >> 1) & 1) + ((bits >> 2) & 1) + ((bits >> 3) & 1);
+            }
+        }
+#else
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                float weight[3];
+                bool in = true;
+                for (int e = 0; e < 3; e++) {
+                    weight[e] = edges[e].at(x + 0.5f, y + 0.5f);
+                    in = in && (weight[e] > 0.0f || (weight[e] == 0.0f && edges[e].inclusive));
+                }
+                if (!in)
+                    continue;
+                float depth = (weight[0] * t.depth[0] + weight[1] * t.depth[1] + weight[2] * t.depth[2]) * t.invArea;
+                int slot = (y - ty0) * stride + (x - tx0);
+                if (depth < local.depth[slot]) {
+                    local.depth[slot] = depth;
+                    local.ids[slot] = id;
+                    passed++;
+                }
+            }
+        }
+#endif
+        return passed;
+    }
+    
+    // The main pass's lighting with shadows and point lights off
+    glm::vec3 shade(const Triangle& t, const glm::vec2& pixel) const {
+        float x = pixel.x - t.screen[0].x, y = pixel.y - t.screen[0].y;
+        glm::vec3 fragPos = t.world.at(x, y) / t.invW.at(x, y);
+        
+        const InstanceData& instance = *t.instance;
+        glm::vec3 ambient = 0.2f * lightColor;
+        glm::vec3 norm = glm::normalize(t.normal.at(x, y)); // the scale by 1 / w does not matter here
+        float diff = std::max(glm::dot(norm, lightDir), 0.0f);
+        glm::vec3 diffuse = diff * lightColor;
+        glm::vec3 viewDir = glm::normalize(viewPos - fragPos);
+        glm::vec3 reflectDir = 2.0f * glm::dot(norm, lightDir) * norm - lightDir; // reflect(-lightDir, norm)
+        float spec = std::max(glm::dot(viewDir, reflectDir), 0.0f);
+        for (int i = 0; i < 5; i++)
+            spec *= spec; // to the 32nd power
+        glm::vec3 specular = 0.5f * spec * lightColor;
+        return (ambient + diffuse + specular) * instance.color + instance.emissionStrength * instance.emissionColor;
+    }
+    
+    // Owner side: the next tile from the front of its own range
+    bool takeTile(int thread, uint32_t& position) {
+        uint64_t range = ranges[thread].load();
+        for (;;) {
+            uint32_t begin = (uint32_t)range, end = (uint32_t)(range >> 32);
+            if (begin >= end)
+                return false;
+            if (ranges[thread].compare_exchange_weak(range, packRange(begin + 1, end))) {
+                position = begin;
+                return true;
+            }
+        }
+    }
+    
+    // Thief side: the back half of the fullest other range becomes this thread's range
+    bool stealTiles(int thread) {
+        for (;;) {
+            int victim = -1;
+            uint64_t range = 0;
+            uint32_t most = 0;
+            for (int other = 0; other < threadCount; other++) {
+                uint64_t value = ranges[other].load();
+                uint32_t left = (uint32_t)(value >> 32) - std::min((uint32_t)value, (uint32_t)(value >> 32));
+                if (other != thread && left > most) {
+                    most = left;
+                    victim = other;
+                    range = value;
+                }
+            }
+            if (victim < 0)
+                return false;
+            uint32_t begin = (uint32_t)range, end = (uint32_t)(range >> 32);
+            uint32_t split = end - (end - begin + 1) / 2;
+            if (ranges[victim].compare_exchange_strong(range, packRange(begin, split))) {
+                ranges[thread].store(packRange(split, end));
+                steals++;
+                return true;
+            }
+        }
+    }
+    
+public:
+    SoftwareRasterizer(int w, int h, WorkerPool& pool)
+        : width(w), height(h), workers(pool), jobCount(0), threadCount(pool.size() + 1), steals(0), fragments(0), shaded(0) {
+        tilesX = (width + RASTER_TILE - 1) / RASTER_TILE;
+        tilesY = (height + RASTER_TILE - 1) / RASTER_TILE;
+        color.assign((size_t)width * height * 3, 0);
+        ranges.reset(new std::atomic<uint64_t>[threadCount]);
+        scratch.resize(threadCount);
+        for (TileScratch& local : scratch) {
+            local.depth.resize(RASTER_TILE * (RASTER_TILE + 4));
+            local.ids.resize(RASTER_TILE * (RASTER_TILE + 4));
+        }
+        stats = SoftwareStats();
+    }
+    
+    // Starts a frame cleared to the given colour
+    void begin(const FrameUniforms& frame, const glm::vec3& clear) {
+        viewProjection = frame.projection * frame.view;
+        viewPos = frame.viewPos;
+        lightDir = frame.lightDir;
+        lightColor = frame.lightColor;
+        for (int c = 0; c < 3; c++)
+            clearColor[c] = (uint8_t)(glm::clamp(clear[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+        jobCount = 0;
+        stats = SoftwareStats();
+    }
+    
+    // Transforms and bins count instances of mesh; instances must stay alive until finish()
+    void drawInstanced(const MeshData& mesh, const InstanceData* instances, size_t count) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<float> positions[3];
+        for (const glm::vec3& position : mesh.positions) {
+            positions[0].push_back(position.x);
+            positions[1].push_back(position.y);
+            positions[2].push_back(position.z);
+        }
+        
+        size_t chunks = (count + RASTER_GRAIN - 1) / RASTER_GRAIN;
+        while (jobs.size() < jobCount + chunks) {
+            jobs.emplace_back(new Job());
+            jobs.back()->bins.resize(tilesX * tilesY);
+        }
+        size_t first = jobCount;
+        workers.parallelFor(count, RASTER_GRAIN, [&](size_t begin, size_t end) {
+            Job& job = *jobs[first + begin / RASTER_GRAIN];
+            job.triangles.clear();
+            for (auto& bin : job.bins)
+                bin.clear();
+            job.culled = job.clipped = job.binned = 0;
+            transformInstances(mesh, positions, instances, begin, end, job);
+        });
+        jobCount += chunks;
+        stats.transformMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    
+    // Rasterizes and shades every tile
+    void finish() {
+        auto start = std::chrono::steady_clock::now();
+        jobStart.assign(jobCount + 1, 0);
+        for (size_t j = 0; j < jobCount; j++) {
+            const Job& job = *jobs[j];
+            jobStart[j + 1] = jobStart[j] + (uint32_t)job.triangles.size();
+            stats.triangles += job.triangles.size();
+            stats.culled += job.culled;
+            stats.clipped += job.clipped;
+            stats.binned += job.binned;
+        }
+        
+        // Each thread starts on an equal run of rows of tiles
+        uint32_t tiles = (uint32_t)(tilesX * tilesY);
+        for (int thread = 0; thread < threadCount; thread++)
+            ranges[thread].store(packRange(tiles * thread / threadCount, tiles * (thread + 1) / threadCount));
+        steals = 0;
+        fragments = 0;
+        shaded = 0;
+        for (TileScratch& local : scratch)
+            local.tiles = 0;
+        workers.parallelFor(threadCount, 1, [&](size_t begin, size_t end) {
+            for (size_t thread = begin; thread < end; thread++) {
+                TileScratch& local = scratch[thread];
+                uint32_t tile;
+                do {
+                    while (takeTile((int)thread, tile)) {
+                        rasterTile((int)tile, local);
+                        local.tiles++;
+                    }
+                } while (stealTiles((int)thread));
+            }
+        });
+        
+        stats.tiles = (int)tiles;
+        stats.steals = steals;
+        stats.fragments = fragments;
+        stats.shaded = shaded;
+        for (const TileScratch& local : scratch)
+            stats.tilesPerThread.push_back(local.tiles);
+        stats.rasterMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    
+    const std::vector<uint8_t>& image() const { return color; }
+    const SoftwareStats& getStats() const { return stats; }
+};
+
+class FuturisticCity {
+private:
+    // False for the software renderer: no GL object exists and frames go through renderSoftware
+    bool gpu;
+    GLuint VAO;
+    Mesh cubeMesh;
+    // Rotated objects use the general programs, translate+scale objects the AXIS_ALIGNED ones
+    ShaderProgram shader;
+    ShaderProgram axisAlignedShader;
+    ShaderProgram instancedShader;
+    ShaderProgram axisAlignedInstancedShader;
+    ShaderProgram batchedShader;
+    
+    // Frame uniforms and instance data are written into the ring each frame
+    StreamBuffer stream;
+    size_t instanceOffset[CATEGORY_COUNT];
+    
+    // Per-object uniforms of the fallback path, resolved once after linking
+    struct ObjectUniforms {
+        GLint model, normalMatrix, objectColor, emissionStrength, emissionColor;
+        
+        ObjectUniforms() : model(-1), normalMatrix(-1), objectColor(-1), emissionStrength(-1), emissionColor(-1) {}
+        explicit ObjectUniforms(const ShaderProgram& program)
+            : model(program.location("model")), normalMatrix(program.location("normalMatrix")),
+              objectColor(program.location("objectColor")), emissionStrength(program.location("emissionStrength")),
+              emissionColor(program.location("emissionColor")) {}
+    };
+    ObjectUniforms objectUniforms, axisAlignedUniforms;
+    
+    GLuint instanceVAO[CATEGORY_COUNT];
+    GLsizei instanceCount[CATEGORY_COUNT];
+    
+    // GPU-animated vehicles and billboards: parameters uploaded once, CPU copy kept to resync the simulation
+    ShaderProgram animatedShader;
+    GLint timeLoc, animatedScaleLoc;
+    GLuint animatedVAO[CATEGORY_COUNT];
+    GLuint animatedVBO[CATEGORY_COUNT];
+    std::vector<AnimatedInstance> animated[CATEGORY_COUNT];
+    bool simulationOnGpu;
+    
+    // Static batches per resident tile, created the first time a tile is drawn batched
+    MeshData cubeData;
+    std::unordered_map<int64_t, std::unique_ptr<StaticBatch>> batches;
+    std::vector<StaticBatch*> visibleBatches;
+    CityRandom editRandom;
+    
+    // Spatial index and per-frame visibility
+    DynamicGrid vehicleGrid;
+    DynamicGrid billboardGrid;
+    std::vector<uint32_t> visible[CATEGORY_COUNT];
+    std::vector<uint32_t> visibleInTile;
+    std::vector<InstanceData> visibleBuildings;
+    CullStats cullStats;
+    DrawStats drawStats;
+    
+    // Block quadtree per level, rebuilt lazily below changed tiles. Buildings drawn with the
+    // simplified mesh and the merged boxes of collapsed blocks go to distantBuildings.
+    std::vector<std::unordered_map<int64_t, BlockProxy>> blockLevels;
+    std::vector<int64_t> changedTiles;
+    std::vector<InstanceData> distantBuildings;
+    float lodPixelScale; // projected pixels per unit of size at distance 1
+    LodStats lodStats;
+    
+    // Buildings live in streamed tiles; vehicles and billboards are global
+    WorkerPool workers;
+    TileStreamer tiles;
+    VehicleArrays vehicles;
+    BillboardArrays billboards;
+    std::vector<float> billboardX, billboardY, billboardZ;
+    SceneFile scene;
+    
+    // Point lights of the clustered lighting mode, gathered each frame it is on; the clusters'
+    // buffers are created the first time it is
+    std::vector<PointLight> pointLights;
+    std::unique_ptr<LightClusters> lightClusters;
+    
+    // Moonlight shadows: cached maps per tile for buildings, one per frame for moving objects.
+    // Their casters go through the ring at casterOffsets (per tile map) and movingOffset.
+    // Allocated the first time shadows are on (see prepareShadows).
+    std::unique_ptr<ShadowMaps> shadowMaps;
+    ShaderProgram shadowShader, shadowOrientedShader, shadowAnimatedShader;
+    GLint shadowMatrixLoc[3], shadowTimeLoc, shadowScaleLoc;
+    std::vector<uint32_t> shadowCasters[CATEGORY_COUNT];
+    std::vector<size_t> casterOffsets;
+    size_t movingOffset[CATEGORY_COUNT];
+    
+    // Occlusion pass after frustum culling: occluders picked from the visible buildings
+    OcclusionBuffer occlusion;
+    BoxArray occluders;
+    std::vector<std::pair<float, uint32_t>> occluderScores;
+    std::vector<uint8_t> keep;
+    OcclusionStats occlusionStats;
+    
+    // Render queue: a packet per visible object, static batch and animated category, sorted
+    // before submission. listStart[l] is the recording index of list l's first object.
+    RenderQueue queue;
+    size_t listStart[LIST_COUNT + 1];
+    const ShaderProgram* queuePrograms[QUEUE_PROGRAM_COUNT];
+    struct InstanceRun {
+        size_t offset; // of its first instance in the ring
+        GLsizei count;
+    };
+    std::vector<InstanceRun> instanceRuns; // instanced path: one per run of packets, in order
+    std::vector<int64_t> tileKeys;         // resident tiles in key order, so recording order is the same every run
+    
+    // Software renderer: instances in packet order (its triangles point into them until finish),
+    // and the cube with only the distant-LOD indices
+    std::vector<InstanceData> softwareInstances;
+    MeshData distantCubeData;
+    
+    // Only the static billboard anchors live in the graph. Vehicles and the spinning panels change
+    // every frame, so their world matrices are built on demand, for the objects that are drawn
+    // (vehicleWorld, billboardWorld). Buildings keep their model matrices cached in their tiles.
+    SceneGraph dynamicGraph;
+    std::vector<SceneGraph::Node> billboardAnchors;
+    std::unique_ptr<SimulationThread> simulation; // when set, vehicles and billboards follow its snapshots
+    std::unique_ptr<TrafficSimulation> traffic;   // when set, vehicles follow its lanes
+    uint64_t obstacleSignature;                   // resident tiles and revisions the traffic last avoided
+    
+public:
+    // With gpu false no GL call is made, for rendering through SoftwareRasterizer; shadows,
+    // clustered lights, static batches and GPU animation have to be off then
+    explicit FuturisticCity(bool gpu = true)
+        : gpu(gpu), VAO(0), simulationOnGpu(false), editRandom(cityConfig.seed), lodPixelScale(1.0f), workers(cityConfig.threads),
+          tiles(cityConfig, workers), queue(workers.size() + 1), obstacleSignature(0) {
+        if (gpu) {
+            setupBuffers();
+            setupPrograms();
+        } else {
+            cubeData = makeCubeMesh();
+            distantCubeData = cubeData;
+            distantCubeData.indices.resize(cubeData.simplifiedIndices);
+        }
+        if (!sceneConfig.loadPath.empty())
+            openScene(sceneConfig.loadPath);
+        generateCity();
+    }
+    
+    void setupPrograms() {
+        std::vector<GLuint> programs;
+        ShaderCacheStats shaderStats = buildShaderVariants(shaderCacheDirectory, programs);
+        std::cout << "Shaders: " << SHADER_VARIANT_COUNT << " programs in " << shaderStats.ms << " ms ("
+                  << shaderStats.loaded << " cached, " << shaderStats.compiled << " compiled, "
+                  << shaderStats.rejected << " rejected)" << std::endl;
+        shader = ShaderProgram(programs[0]);
+        axisAlignedShader = ShaderProgram(programs[1]);
+        instancedShader = ShaderProgram(programs[2]);
+        axisAlignedInstancedShader = ShaderProgram(programs[3]);
+        batchedShader = ShaderProgram(programs[4]);
+        animatedShader = ShaderProgram(programs[5]);
+        shadowShader = ShaderProgram(programs[6]);
+        shadowOrientedShader = ShaderProgram(programs[7]);
+        shadowAnimatedShader = ShaderProgram(programs[8]);
+        objectUniforms = ObjectUniforms(shader);
+        axisAlignedUniforms = ObjectUniforms(axisAlignedShader);
+        timeLoc = animatedShader.location("time");
+        animatedScaleLoc = animatedShader.location("animatedScale");
+        const ShaderProgram* casterPrograms[] = { &shadowShader, &shadowOrientedShader, &shadowAnimatedShader };
+        for (int i = 0; i < 3; i++)
+            shadowMatrixLoc[i] = casterPrograms[i]->location("shadowMatrix");
+        shadowTimeLoc = shadowAnimatedShader.location("time");
+        shadowScaleLoc = shadowAnimatedShader.location("animatedScale");
+        const ShaderProgram* queueOrder[QUEUE_PROGRAM_COUNT] = { &axisAlignedShader, &shader, &axisAlignedInstancedShader,
+                                                                  &instancedShader, &batchedShader, &animatedShader };
+        std::copy(queueOrder, queueOrder + QUEUE_PROGRAM_COUNT, queuePrograms);
+    }
+    
+    // Generation parameters come from the file, so tiles beyond its extent still match it
+    void openScene(const std::string& path) {
+        std::string error;
+        if (!scene.open(path, error)) {
+            std::cout << "Ignoring scene " << path << " (" << error << "); generating instead" << std::endl;
+            return;
+        }
+        const SceneHeader& info = scene.info();
+        cityConfig.seed = info.seed;
+        cityConfig.tileSize = info.tileSize;
+        cityConfig.buildingDensity = info.buildingDensity;
+        tiles.setScene(&scene);
+        std::cout << "Scene " << path << ": " << info.tileCount << " tiles, " << scene.fileSize() / 1024
+                  << " KB mapped" << std::endl;
+    }
+    
+    void setupBuffers() {
+        // Indexed cube; position, normal and texture coordinate attributes depend on the vertex format
+        cubeData = makeCubeMesh();
+        cubeMesh.upload(cubeData, useCompactVertices ? VERTEX_FORMAT_PACKED : VERTEX_FORMAT_FLOAT);
+        std::cout << "Cube mesh: " << cubeMesh.vertexBytes() << " bytes of vertices + " << cubeMesh.indexBytes()
+                  << " bytes of indices (" << sizeof(cubeVertices) << " bytes unindexed)" << std::endl;
+        
+        glGenVertexArrays(1, &VAO);
+        glBindVertexArray(VAO);
+        cubeMesh.bindAttributes();
+        
+        // One VAO per category: shared cube attributes plus instance attributes that are pointed
+        // into the streaming ring every frame (see pointInstanceAttributes)
+        glGenVertexArrays(CATEGORY_COUNT, instanceVAO);
+        for (int i = 0; i < CATEGORY_COUNT; i++) {
+            instanceCount[i] = 0;
+            instanceOffset[i] = 0;
+            
+            glBindVertexArray(instanceVAO[i]);
+            cubeMesh.bindAttributes();
+            
+            // Model matrix (3-6), colour and emission (7-9); billboards add a normal matrix (10-12)
+            int lastLocation = i == CATEGORY_BILLBOARDS ? 12 : 9;
+            for (int location = 3; location <= lastLocation; location++) {
+                glEnableVertexAttribArray(location);
+                glVertexAttribDivisor(location, 1);
+            }
+        }
+        
+        // Animated VAOs exist for vehicles and billboards only
+        glGenVertexArrays(CATEGORY_COUNT, animatedVAO);
+        glGenBuffers(CATEGORY_COUNT, animatedVBO);
+        for (int i = CATEGORY_VEHICLES; i < CATEGORY_COUNT; i++) {
+            glBindVertexArray(animatedVAO[i]);
+            cubeMesh.bindAttributes();
+            
+            glBindBuffer(GL_ARRAY_BUFFER, animatedVBO[i]);
+            glBufferData(GL_ARRAY_BUFFER, 0, NULL, GL_STATIC_DRAW);
+            GLsizei stride = sizeof(AnimatedInstance);
+            glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(AnimatedInstance, origin));
+            glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(AnimatedInstance, animation));
+            glVertexAttribPointer(7, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(AnimatedInstance, color));
+            glVertexAttribPointer(8, 1, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(AnimatedInstance, emissionStrength));
+            glVertexAttribPointer(9, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(AnimatedInstance, emissionColor));
+            GLuint locations[] = { 3, 4, 7, 8, 9 };
+            for (GLuint location : locations) {
+                glEnableVertexAttribArray(location);
+                glVertexAttribDivisor(location, 1);
+            }
+        }
+        glBindVertexArray(0);
+        
+        // Grows on demand; 256 KB per region covers a few thousand instances
+        stream.init(256 * 1024, usePersistentMapping);
+    }
+    
+    // Points the bound VAO's instance attributes at one category's data in the ring
+    void pointInstanceAttributes(int category, size_t offset) {
+        glBindBuffer(GL_ARRAY_BUFFER, stream.buffer());
+        GLsizei stride = category == CATEGORY_BILLBOARDS ? sizeof(OrientedInstanceData) : sizeof(InstanceData);
+        for (int column = 0; column < 4; column++)
+            glVertexAttribPointer(3 + column, 4, GL_FLOAT, GL_FALSE, stride,
+                                  (void*)(offset + offsetof(InstanceData, model) + column * sizeof(glm::vec4)));
+        glVertexAttribPointer(7, 3, GL_FLOAT, GL_FALSE, stride, (void*)(offset + offsetof(InstanceData, color)));
+        glVertexAttribPointer(8, 1, GL_FLOAT, GL_FALSE, stride, (void*)(offset + offsetof(InstanceData, emissionStrength)));
+        glVertexAttribPointer(9, 3, GL_FLOAT, GL_FALSE, stride, (void*)(offset + offsetof(InstanceData, emissionColor)));
+        if (category == CATEGORY_BILLBOARDS) {
+            for (int column = 0; column < 3; column++)
+                glVertexAttribPointer(10 + column, 3, GL_FLOAT, GL_FALSE, stride,
+                                      (void*)(offset + offsetof(OrientedInstanceData, normalMatrix) + column * sizeof(glm::vec3)));
+        }
+    }
+    
+    // Uploads the motion parameters of the GPU-animated path. Start angles are taken back to
+    // animationTime 0, so the shader needs nothing per frame except the time uniform.
+    void uploadAnimatedInstances() {
+        animated[CATEGORY_VEHICLES].clear();
+        for (size_t i = 0; i < vehicles.size(); i++) {
+            float startAngle = vehicles.pathAngle[i] - vehicles.speed[i] * animationTime;
+            glm::vec3 origin(0.0f, vehicles.positionY[i], 0.0f);
+            glm::vec4 motion(vehicles.pathRadius[i], startAngle, vehicles.speed[i], 0.0f);
+            animated[CATEGORY_VEHICLES].push_back(AnimatedInstance(origin, motion, vehicles.color[i], 0.8f, vehicles.color[i]));
+        }
+        
+        animated[CATEGORY_BILLBOARDS].clear();
+        for (size_t i = 0; i < billboards.size(); i++) {
+            float rate = glm::radians(billboards.rotationSpeed[i]);
+            float startAngle = glm::radians(billboards.rotation[i]) - rate * animationTime;
+            glm::vec4 motion(0.0f, startAngle, rate, 1.0f);
+            animated[CATEGORY_BILLBOARDS].push_back(AnimatedInstance(billboards.position[i], motion, billboards.color[i], 0.9f, billboards.color[i]));
+        }
+        
+        if (!gpu)
+            return;
+        for (int i = CATEGORY_VEHICLES; i < CATEGORY_COUNT; i++) {
+            glBindBuffer(GL_ARRAY_BUFFER, animatedVBO[i]);
+            glBufferData(GL_ARRAY_BUFFER, animated[i].size() * sizeof(AnimatedInstance), animated[i].data(), GL_STATIC_DRAW);
+        }
+    }
+    
+    // Every vehicle and billboard as a point light, wherever the simulation currently keeps them
+    void gatherLights() {
+        pointLights.clear();
+        for (size_t i = 0; i < vehicles.size(); i++) {
+            glm::vec3 position;
+            if (useGpuAnimation) {
+                const AnimatedInstance& instance = animated[CATEGORY_VEHICLES][i];
+                float angle = instance.animation.y + instance.animation.z * animationTime;
+                position = instance.origin + instance.animation.x * glm::vec3(cos(angle), 0.0f, sin(angle));
+            } else {
+                position = vehicles.position(i);
+            }
+            pointLights.push_back(PointLight(position, VEHICLE_LIGHT_RADIUS, vehicles.color[i] * VEHICLE_LIGHT_INTENSITY));
+        }
+        for (size_t i = 0; i < billboards.size(); i++)
+            pointLights.push_back(PointLight(billboards.position[i], BILLBOARD_LIGHT_RADIUS,
+                                             billboards.color[i] * BILLBOARD_LIGHT_INTENSITY));
+    }
+    
+    // Brings the CPU simulation back to where the shader had animated it
+    void resyncSimulation() {
+        for (size_t i = 0; i < vehicles.size(); i++) {
+            const glm::vec4& motion = animated[CATEGORY_VEHICLES][i].animation;
+            vehicles.pathAngle[i] = motion.y + motion.z * animationTime;
+        }
+        vehicles.update(0, vehicles.size(), 0.0f);
+        vehicleGrid.update(vehicles.positionX.data(), vehicles.positionY.data(), vehicles.positionZ.data(), workers);
+        
+        for (size_t i = 0; i < billboards.size(); i++) {
+            const glm::vec4& motion = animated[CATEGORY_BILLBOARDS][i].animation;
+            billboards.rotation[i] = glm::degrees(motion.y + motion.z * animationTime);
+        }
+    }
+    
+    void buildDynamicIndex() {
+        vehicleGrid.reset(16.0f, VEHICLE_SCALE * 0.5f);
+        for (size_t i = 0; i < vehicles.size(); i++)
+            vehicleGrid.add(vehicles.position(i));
+        
+        // Billboards spin about Y, so their box must cover every rotation
+        float billboardRadius = glm::length(glm::vec2(BILLBOARD_SCALE.x, BILLBOARD_SCALE.z)) * 0.5f;
+        billboardGrid.reset(16.0f, glm::vec3(billboardRadius, BILLBOARD_SCALE.y * 0.5f, billboardRadius));
+        billboardX.clear();
+        billboardY.clear();
+        billboardZ.clear();
+        for (const auto& position : billboards.position) {
+            billboardGrid.add(position);
+            billboardX.push_back(position.x);
+            billboardY.push_back(position.y);
+            billboardZ.push_back(position.z);
+        }
+        
+        dynamicGraph.clear();
+        billboardAnchors.clear();
+        dynamicGraph.reserve(billboards.size());
+        for (size_t i = 0; i < billboards.size(); i++)
+            billboardAnchors.push_back(dynamicGraph.add(glm::translate(glm::mat4(1.0f), billboards.position[i])));
+        dynamicGraph.update();
+    }
+    
+    glm::mat4 vehicleWorld(uint32_t i) const { return vehicles.modelMatrix(i); }
+    
+    // The panel at its current rotation below its anchor
+    glm::mat4 billboardWorld(uint32_t i) const { return dynamicGraph.world(billboardAnchors[i]) * billboards.panelMatrix(i); }
+    
+    // Fills visibleBuildings (and distantBuildings with LOD on) with the instance data of every
+    // building that survives culling, and visible[] with vehicle and billboard indices
+    void cull(const glm::mat4& viewProjection) {
+        PROFILE_SCOPE("cull");
+        for (int i = 0; i < CATEGORY_COUNT; i++)
+            visible[i].clear();
+        visibleBuildings.clear();
+        distantBuildings.clear();
+        lodStats = LodStats();
+        
+        visibleBatches.clear();
+        size_t batchedBuildings = 0;
+        
+        Frustum frustum(viewProjection);
+        if (useLod) {
+            cullBlocks(frustum, batchedBuildings);
+        } else {
+            // Nothing consumes the changes without LOD; the blocks they would have refreshed are
+            // dropped instead and rebuilt when LOD comes back on
+            tiles.takeChanged(changedTiles);
+            if (!changedTiles.empty())
+                blockLevels.clear();
+            
+            tileKeys.clear();
+            for (const auto& entry : tiles.residentTiles())
+                tileKeys.push_back(entry.first);
+            std::sort(tileKeys.begin(), tileKeys.end());
+            for (int64_t key : tileKeys) {
+                const CityTile& tile = *tiles.residentTiles().at(key);
+                if (useCulling) {
+                    glm::vec3 center = (tile.boundsMin + tile.boundsMax) * 0.5f;
+                    glm::vec3 extent = (tile.boundsMax - tile.boundsMin) * 0.5f;
+                    if (frustum.classify(center, extent) == Frustum::OUTSIDE)
+                        continue;
+                }
+                cullTile(key, tile, frustum, nullptr, batchedBuildings);
+            }
+        }
+        lodStats.full = (int)visibleBuildings.size();
+        lodStats.simplified = (int)distantBuildings.size() - lodStats.proxies;
+        
+        size_t counts[CATEGORY_COUNT] = { tiles.residentBuildings(), vehicles.size(), billboards.size() };
+        if (useGpuAnimation) {
+            // Positions only exist on the GPU; every animated object is submitted
+            for (int i = CATEGORY_VEHICLES; i < CATEGORY_COUNT; i++) {
+                visible[i].resize(counts[i]);
+                for (size_t k = 0; k < counts[i]; k++)
+                    visible[i][k] = (uint32_t)k;
+            }
+        } else if (useCulling) {
+            vehicleGrid.cull(frustum, vehicles.positionX.data(), vehicles.positionY.data(), vehicles.positionZ.data(),
+                             visible[CATEGORY_VEHICLES]);
+            billboardGrid.cull(frustum, billboardX.data(), billboardY.data(), billboardZ.data(),
+                               visible[CATEGORY_BILLBOARDS]);
+        } else {
+            for (int i = CATEGORY_VEHICLES; i < CATEGORY_COUNT; i++) {
+                for (size_t k = 0; k < counts[i]; k++)
+                    visible[i].push_back((uint32_t)k);
+            }
+        }
+        
+        cullStats.visible[CATEGORY_BUILDINGS] = lodStats.full + lodStats.simplified + lodStats.merged + (int)batchedBuildings;
+        cullStats.visible[CATEGORY_VEHICLES] = (int)visible[CATEGORY_VEHICLES].size();
+        cullStats.visible[CATEGORY_BILLBOARDS] = (int)visible[CATEGORY_BILLBOARDS].size();
+        for (int i = 0; i < CATEGORY_COUNT; i++)
+            cullStats.culled[i] = (int)(counts[i] - cullStats.visible[i]);
+        
+        occlusionStats = OcclusionStats();
+        if (useOcclusion)
+            cullOccluded(viewProjection);
+    }
+    
+    // Drops the instances in the frustum that nearer buildings hide. Static batches are drawn
+    // whole and GPU-animated objects have no CPU positions, so those are left alone.
+    void cullOccluded(const glm::mat4& viewProjection) {
+        PROFILE_SCOPE("occlusion");
+        auto start = std::chrono::steady_clock::now();
+        
+        // Occluders: the full-detail buildings covering the most of the screen, roughly by
+        // front area over squared distance
+        occluderScores.clear();
+        for (size_t i = 0; i < visibleBuildings.size(); i++) {
+            const glm::mat4& model = visibleBuildings[i].model;
+            glm::vec3 offset = glm::vec3(model[3]) - cameraPos;
+            float area = std::max(model[0][0], model[2][2]) * model[1][1];
+            occluderScores.push_back(std::make_pair(-area / std::max(glm::dot(offset, offset), 1e-3f), (uint32_t)i));
+        }
+        size_t count = std::min(occluderScores.size(), (size_t)OCCLUDER_LIMIT);
+        std::partial_sort(occluderScores.begin(), occluderScores.begin() + count, occluderScores.end());
+        occluders.clear();
+        for (size_t i = 0; i < count; i++) {
+            const glm::mat4& model = visibleBuildings[occluderScores[i].second].model;
+            occluders.push(glm::vec3(model[3]), glm::vec3(model[0][0], model[1][1], model[2][2]) * 0.5f);
+        }
+        occlusionStats.occluders = (int)count;
+        occlusionStats.triangles = occlusion.rasterize(occluders, cameraPos, viewProjection, workers);
+        auto rasterized = std::chrono::steady_clock::now();
+        
+        auto boxOf = [](const InstanceData& instance, glm::vec3& center, glm::vec3& extent) {
+            center = glm::vec3(instance.model[3]);
+            extent = glm::vec3(instance.model[0][0], instance.model[1][1], instance.model[2][2]) * 0.5f;
+        };
+        removeOccluded(visibleBuildings, boxOf);
+        removeOccluded(distantBuildings, boxOf);
+        if (!useGpuAnimation) {
+            glm::vec3 vehicleExtent = vehicleGrid.extent(), billboardExtent = billboardGrid.extent();
+            removeOccluded(visible[CATEGORY_VEHICLES], [&](uint32_t i, glm::vec3& center, glm::vec3& extent) {
+                center = vehicles.position(i);
+                extent = vehicleExtent;
+            });
+            removeOccluded(visible[CATEGORY_BILLBOARDS], [&](uint32_t i, glm::vec3& center, glm::vec3& extent) {
+                center = glm::vec3(billboardX[i], billboardY[i], billboardZ[i]);
+                extent = billboardExtent;
+            });
+        }
+        
+        auto tested = std::chrono::steady_clock::now();
+        occlusionStats.rasterMs = std::chrono::duration<double, std::milli>(rasterized - start).count();
+        occlusionStats.testMs = std::chrono::duration<double, std::milli>(tested - rasterized).count();
+    }
+    
+    // Tests the items in parallel and keeps the visible ones in order
+    template <typename T, typename BoxOf>
+    void removeOccluded(std::vector<T>& items, BoxOf boxOf) {
+        keep.resize(items.size());
+        workers.parallelFor(items.size(), OCCLUSION_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                glm::vec3 center, extent;
+                boxOf(items[i], center, extent);
+                keep[i] = occlusion.visible(center, extent);
+            }
+        });
+        size_t kept = 0;
+        for (size_t i = 0; i < items.size(); i++) {
+            if (keep[i])
+                items[kept++] = items[i];
+        }
+        occlusionStats.tested += (int)items.size();
+        occlusionStats.occluded += (int)(items.size() - kept);
+        items.resize(kept);
+    }
+    
+    // Buildings of one tile that is in view. With a block, each is given the full or the
+    // simplified mesh by its projected size.
+    void cullTile(int64_t key, const CityTile& tile, const Frustum& frustum, BlockProxy* block, size_t& batchedBuildings) {
+        // A batch is all or nothing, so batched tiles are culled as a whole
+        if (useStaticBatches) {
+            visibleBatches.push_back(batchFor(key, tile));
+            batchedBuildings += tile.buildings.size();
+            return;
+        }
+        if (!useCulling && !block) {
+            visibleBuildings.insert(visibleBuildings.end(), tile.instances.begin(), tile.instances.end());
+            return;
+        }
+        
+        visibleInTile.clear();
+        if (useCulling) {
+            tile.grid.cull(frustum, visibleInTile);
+        } else {
+            for (size_t i = 0; i < tile.instances.size(); i++)
+                visibleInTile.push_back((uint32_t)i);
+        }
+        if (!block) {
+            for (uint32_t i : visibleInTile)
+                visibleBuildings.push_back(tile.instances[i]);
+            return;
+        }
+        
+        for (uint32_t i : visibleInTile) {
+            const InstanceData& instance = tile.instances[i];
+            float size = std::max(instance.model[0][0], std::max(instance.model[1][1], instance.model[2][2]));
+            float distance = std::max(glm::length(glm::vec3(instance.model[3]) - cameraPos), 1e-3f);
+            bool full = lodAbove(!block->simplified[i], size / distance * lodPixelScale, LOD_SIMPLIFY_PIXELS);
+            block->simplified[i] = !full;
+            (full ? visibleBuildings : distantBuildings).push_back(instance);
+        }
+    }
+    
+    // Walks the block quadtree from the top levels covering every resident tile
+    void cullBlocks(const Frustum& frustum, size_t& batchedBuildings) {
+        int radius = cityConfig.evictRadius;
+        int top = 0;
+        while ((1 << top) < 2 * radius + 1)
+            top++;
+        if ((int)blockLevels.size() < top + 1)
+            blockLevels.resize(top + 1);
+        
+        // Blocks above tiles that arrived, left or were edited are rebuilt, or dropped once
+        // every tile they span is out of range
+        tiles.takeChanged(changedTiles);
+        for (int64_t key : changedTiles) {
+            int tileX = (int)(key >> 32), tileZ = (int32_t)(key & 0xffffffff);
+            for (int level = 0; level < (int)blockLevels.size(); level++) {
+                int x = tileX >> level, z = tileZ >> level;
+                auto block = blockLevels[level].find(packCoords(x, z));
+                if (block == blockLevels[level].end())
+                    continue;
+                if (blockInRange(level, x, z))
+                    block->second.stale = true;
+                else
+                    blockLevels[level].erase(block);
+            }
+        }
+        
+        int cameraX = (int)std::floor(cameraPos.x / cityConfig.tileSize);
+        int cameraZ = (int)std::floor(cameraPos.z / cityConfig.tileSize);
+        for (int z = (cameraZ - radius) >> top; z <= (cameraZ + radius) >> top; z++) {
+            for (int x = (cameraX - radius) >> top; x <= (cameraX + radius) >> top; x++)
+                cullBlock(top, x, z, frustum, batchedBuildings);
+        }
+    }
+    
+    // Whether any tile of the block is within the eviction radius, i.e. may be resident
+    bool blockInRange(int level, int x, int z) const {
+        int cameraX = (int)std::floor(cameraPos.x / cityConfig.tileSize);
+        int cameraZ = (int)std::floor(cameraPos.z / cityConfig.tileSize);
+        int span = 1 << level, radius = cityConfig.evictRadius;
+        int dx = glm::clamp(cameraX, x * span, (x + 1) * span - 1) - cameraX;
+        int dz = glm::clamp(cameraZ, z * span, (z + 1) * span - 1) - cameraZ;
+        return dx * dx + dz * dz <= radius * radius;
+    }
+    
+    // Blocks that are small on screen draw their merged boxes; larger ones open up into their
+    // four children, down to single tiles and their buildings
+    void cullBlock(int level, int x, int z, const Frustum& frustum, size_t& batchedBuildings) {
+        if (!blockInRange(level, x, z))
+            return;
+        BlockProxy& block = blockFor(level, x, z);
+        if (block.tiles == 0)
+            return;
+        if (useCulling) {
+            glm::vec3 center = (block.boundsMin + block.boundsMax) * 0.5f;
+            glm::vec3 extent = (block.boundsMax - block.boundsMin) * 0.5f;
+            if (frustum.classify(center, extent) == Frustum::OUTSIDE)
+                return;
+        }
+        
+        glm::vec3 nearest = glm::clamp(cameraPos, block.boundsMin, block.boundsMax);
+        float distance = std::max(glm::length(nearest - cameraPos), 1e-3f);
+        float width = std::max(block.boundsMax.x - block.boundsMin.x, block.boundsMax.z - block.boundsMin.z);
+        block.refined = lodAbove(block.refined, width / distance * lodPixelScale, LOD_BLOCK_PIXELS);
+        if (!block.refined) {
+            distantBuildings.insert(distantBuildings.end(), block.boxes.begin(), block.boxes.end());
+            lodStats.proxies += (int)block.boxes.size();
+            for (const ProxyCell& cell : block.cells)
+                lodStats.merged += cell.buildings;
+            lodStats.blocks++;
+            return;
+        }
+        
+        if (level == 0) {
+            cullTile(packCoords(x, z), *tiles.find(x, z), frustum, &block, batchedBuildings);
+            return;
+        }
+        for (int dz = 0; dz < 2; dz++) {
+            for (int dx = 0; dx < 2; dx++)
+                cullBlock(level - 1, x * 2 + dx, z * 2 + dz, frustum, batchedBuildings);
+        }
+    }
+    
+    // Tiles fill their cells from their buildings; larger blocks add up their children's cells
+    BlockProxy& blockFor(int level, int x, int z) {
+        BlockProxy& block = blockLevels[level][packCoords(x, z)];
+        if (!block.stale)
+            return block;
+        
+        for (ProxyCell& cell : block.cells)
+            cell = ProxyCell();
+        block.tiles = 0;
+        block.boundsMin = glm::vec3(1e30f);
+        block.boundsMax = glm::vec3(-1e30f);
+        if (level == 0) {
+            if (const CityTile* tile = tiles.find(x, z)) {
+                glm::vec2 origin = glm::vec2(x, z) * cityConfig.tileSize;
+                float cellSize = cityConfig.tileSize / PROXY_GRID;
+                for (const Building& building : tile->buildings) {
+                    int cellX = glm::clamp((int)((building.position.x - origin.x) / cellSize), 0, PROXY_GRID - 1);
+                    int cellZ = glm::clamp((int)((building.position.z - origin.y) / cellSize), 0, PROXY_GRID - 1);
+                    block.cells[cellZ * PROXY_GRID + cellX].add(building);
+                }
+                block.tiles = 1;
+                block.boundsMin = tile->boundsMin;
+                block.boundsMax = tile->boundsMax;
+                block.simplified.resize(tile->buildings.size(), 0);
+            }
+        } else {
+            // Child cell (cx, cz) lands in cell ((dx * PROXY_GRID + cx) / 2, ...) of the parent
+            for (int dz = 0; dz < 2; dz++) {
+                for (int dx = 0; dx < 2; dx++) {
+                    if (!blockInRange(level - 1, x * 2 + dx, z * 2 + dz))
+                        continue;
+                    const BlockProxy& child = blockFor(level - 1, x * 2 + dx, z * 2 + dz);
+                    if (child.tiles == 0)
+                        continue;
+                    for (int cz = 0; cz < PROXY_GRID; cz++) {
+                        for (int cx = 0; cx < PROXY_GRID; cx++) {
+                            int cell = (dz * PROXY_GRID + cz) / 2 * PROXY_GRID + (dx * PROXY_GRID + cx) / 2;
+                            block.cells[cell].add(child.cells[cz * PROXY_GRID + cx]);
+                        }
+                    }
+                    block.tiles += child.tiles;
+                    block.boundsMin = glm::min(block.boundsMin, child.boundsMin);
+                    block.boundsMax = glm::max(block.boundsMax, child.boundsMax);
+                }
+            }
+        }
+        
+        block.boxes.clear();
+        for (const ProxyCell& cell : block.cells) {
+            if (cell.buildings > 0)
+                block.boxes.push_back(cell.box());
+        }
+        block.stale = false;
+        return block;
+    }
+    
+    StaticBatch* batchFor(int64_t key, const CityTile& tile) {
+        std::unique_ptr<StaticBatch>& batch = batches[key];
+        if (!batch || batch->source != &tile) {
+            batch.reset(new StaticBatch(cubeData, &tile));
+            batch->build(tile.buildings);
+        }
+        return batch.get();
+    }
+    
+    const CullStats& getCullStats() const { return cullStats; }
+    const LodStats& getLodStats() const { return lodStats; }
+    const LightStats& getLightStats() const {
+        static const LightStats none = LightStats();
+        return lightClusters ? lightClusters->getStats() : none;
+    }
+    const OcclusionStats& getOcclusionStats() const { return occlusionStats; }
+    const QueueStats& getQueueStats() const { return queue.getStats(); }
+    const ShadowStats& getShadowStats() const {
+        static const ShadowStats none = ShadowStats();
+        return shadowMaps ? shadowMaps->getStats() : none;
+    }
+    const StreamStats& getStreamStats() const { return stream.getStats(); }
+    const SimulationThread* getSimulation() const { return simulation.get(); }
+    const TrafficSimulation* getTraffic() const { return traffic.get(); }
+    WorkerPool& getWorkers() { return workers; }
+    
+    // Hands the vehicle and billboard simulation to a fixed-rate thread from here on
+    void startSimulation(int tickRate) {
+        simulation.reset(new SimulationThread(vehicles, billboards, animationTime, tickRate, workers));
+    }
+    
+    BatchStats getBatchStats() const {
+        BatchStats stats = { (int)batches.size(), (int)visibleBatches.size(), 0, 0, 0 };
+        for (const auto& entry : batches) {
+            stats.batchBytes += entry.second->gpuBytes();
+            stats.patchedBytes += entry.second->patchedBytes();
+        }
+        stats.instanceBytes = tiles.residentBuildings() * sizeof(InstanceData) + cubeMesh.vertexBytes() + cubeMesh.indexBytes();
+        return stats;
+    }
+    const DrawStats& getDrawStats() const { return drawStats; }
+    size_t residentTiles() const { return tiles.residentTiles().size(); }
+    
+    void generateCity() {
+        // Buildings are streamed in tiles; load the ones around the camera up front
+        tiles.prime(cameraPos);
+        
+        if (!scene.isOpen() || !scene.loadTraffic(vehicles, billboards))
+            generateTraffic(cityConfig, vehicles, billboards);
+        
+        // Lanes cover the tiles loaded around the origin; the vehicles start on them
+        if (useTraffic) {
+            traffic.reset(new TrafficSimulation(residentTileList(), cityConfig.loadRadius * cityConfig.tileSize,
+                                                vehicles.size(), cityConfig.seed));
+            obstacleSignature = tileSignature();
+            std::copy(traffic->x(), traffic->x() + vehicles.size(), vehicles.positionX.begin());
+            std::copy(traffic->y(), traffic->y() + vehicles.size(), vehicles.positionY.begin());
+            std::copy(traffic->z(), traffic->z() + vehicles.size(), vehicles.positionZ.begin());
+        }
+        
+        buildDynamicIndex();
+        uploadAnimatedInstances();
+    }
+    
+    // Brings the tiles around the camera up to date. With wait set, blocks until all of
+    // them are resident, which makes the scene a pure function of camera position.
+    void streamTiles(bool wait) {
+        PROFILE_SCOPE("stream tiles");
+        if (wait)
+            tiles.prime(cameraPos);
+        else
+            tiles.update(cameraPos);
+        
+        // Batches of evicted tiles go with them
+        const auto& resident = tiles.residentTiles();
+        for (auto it = batches.begin(); it != batches.end();) {
+            auto tile = resident.find(it->first);
+            if (tile == resident.end() || tile->second.get() != it->second->source)
+                it = batches.erase(it);
+            else
+                ++it;
+        }
+    }
+    
+    // Building edits on resident tiles. The tile's instances and grid are rebuilt on the CPU;
+    // its static batch, if it has one, re-uploads only the bytes of the touched slots.
+    bool setBuilding(int tileX, int tileZ, size_t index, const Building& building) {
+        CityTile* tile = tiles.find(tileX, tileZ);
+        if (!tile || index >= tile->buildings.size())
+            return false;
+        tile->buildings[index] = building;
+        tiles.buildingsChanged(*tile, 0);
+        if (StaticBatch* batch = existingBatch(tile))
+            batch->set(index, building);
+        return true;
+    }
+    
+    bool addBuilding(int tileX, int tileZ, const Building& building) {
+        CityTile* tile = tiles.find(tileX, tileZ);
+        if (!tile)
+            return false;
+        tile->buildings.push_back(building);
+        tiles.buildingsChanged(*tile, 1);
+        if (StaticBatch* batch = existingBatch(tile))
+            batch->add(building);
+        return true;
+    }
+    
+    // Swaps the last building into the hole, matching the batch's slot order
+    bool removeBuilding(int tileX, int tileZ, size_t index) {
+        CityTile* tile = tiles.find(tileX, tileZ);
+        if (!tile || index >= tile->buildings.size())
+            return false;
+        tile->buildings[index] = tile->buildings.back();
+        tile->buildings.pop_back();
+        tiles.buildingsChanged(*tile, -1);
+        if (StaticBatch* batch = existingBatch(tile))
+            batch->remove(index);
+        return true;
+    }
+    
+    StaticBatch* existingBatch(const CityTile* tile) {
+        auto it = batches.find(packCoords(tile->x, tile->z));
+        return it != batches.end() && it->second->source == tile ? it->second.get() : nullptr;
+    }
+    
+    // Demo edit on the tile under the camera: raise, add or demolish a random building
+    void editRandomBuilding() {
+        int tileX = (int)std::floor(cameraPos.x / cityConfig.tileSize);
+        int tileZ = (int)std::floor(cameraPos.z / cityConfig.tileSize);
+        CityTile* tile = tiles.find(tileX, tileZ);
+        if (!tile)
+            return;
+        
+        uint64_t choice = editRandom.next() % 3;
+        if (choice == 0 && !tile->buildings.empty()) {
+            size_t index = editRandom.next() % tile->buildings.size();
+            Building building = tile->buildings[index];
+            building.scale.y *= 1.5f;
+            building.position.y = building.scale.y / 2.0f;
+            setBuilding(tileX, tileZ, index, building);
+            std::cout << "Raised building " << index;
+        } else if (choice == 1 || tile->buildings.empty()) {
+            float x = editRandom.range(0.0f, cityConfig.tileSize) + tileX * cityConfig.tileSize;
+            float z = editRandom.range(0.0f, cityConfig.tileSize) + tileZ * cityConfig.tileSize;
+            float height = editRandom.range(5.0f, 40.0f);
+            glm::vec3 color(0.8f, 0.2f, 0.8f);
+            addBuilding(tileX, tileZ, Building(glm::vec3(x, height / 2.0f, z), glm::vec3(4.0f, height, 4.0f), color, 0.3f, color * 0.5f));
+            std::cout << "Added building " << tile->buildings.size() - 1;
+        } else {
+            size_t index = editRandom.next() % tile->buildings.size();
+            removeBuilding(tileX, tileZ, index);
+            std::cout << "Removed building " << index;
+        }
+        std::cout << " in tile (" << tileX << ", " << tileZ << ")" << std::endl;
+    }
+    
+    std::vector<const CityTile*> residentTileList() const {
+        std::vector<const CityTile*> list;
+        for (const auto& entry : tiles.residentTiles())
+            list.push_back(entry.second.get());
+        return list;
+    }
+    
+    // Changes when a tile streams in or out or is edited; a sum, so map order does not matter
+    uint64_t tileSignature() const {
+        uint64_t signature = 0;
+        for (const auto& entry : tiles.residentTiles())
+            signature += CityRandom::mix(0, (int64_t)entry.second->generation, entry.second->revision);
+        return signature;
+    }
+    
+    void stepTraffic(float deltaTime) {
+        uint64_t signature = tileSignature();
+        if (signature != obstacleSignature) {
+            traffic->setObstacles(residentTileList());
+            obstacleSignature = signature;
+        }
+        
+        // A long stall is taken as one short step rather than a jump through the buildings
+        traffic->step(std::min(deltaTime, 0.05f), workers);
+        std::copy(traffic->x(), traffic->x() + vehicles.size(), vehicles.positionX.begin());
+        std::copy(traffic->y(), traffic->y() + vehicles.size(), vehicles.positionY.begin());
+        std::copy(traffic->z(), traffic->z() + vehicles.size(), vehicles.positionZ.begin());
+        vehicleGrid.update(vehicles.positionX.data(), vehicles.positionY.data(), vehicles.positionZ.data(), workers);
+        
+        workers.parallelFor(billboards.size(), SIMULATION_GRAIN, [&](size_t begin, size_t end) {
+            billboards.update(begin, end, deltaTime);
+        });
+    }
+    
+    void update(float deltaTime) {
+        PROFILE_SCOPE("update");
+        if (traffic) {
+            animationTime += deltaTime;
+            stepTraffic(deltaTime);
+            return;
+        }
+        if (simulation) {
+            interpolateSimulation();
+            return;
+        }
+        animationTime += deltaTime;
+        
+        // With GPU animation the shader derives everything from animationTime
+        if (useGpuAnimation) {
+            simulationOnGpu = true;
+            return;
+        }
+        if (simulationOnGpu) {
+            resyncSimulation();
+            simulationOnGpu = false;
+            return;
+        }
+        
+        // Update vehicles and billboards with the batched kernels, split across the pool when large
+        workers.parallelFor(vehicles.size(), SIMULATION_GRAIN, [&](size_t begin, size_t end) {
+            vehicles.update(begin, end, deltaTime);
+        });
+        vehicleGrid.update(vehicles.positionX.data(), vehicles.positionY.data(), vehicles.positionZ.data(), workers);
+        
+        workers.parallelFor(billboards.size(), SIMULATION_GRAIN, [&](size_t begin, size_t end) {
+            billboards.update(begin, end, deltaTime);
+        });
+    }
+    
+    // Blends the two ticks of the newest snapshot by how far the wall clock is past the later
+    // one, so motion is drawn one tick late but smooth at any frame rate
+    void interpolateSimulation() {
+        const SimulationSnapshot& snapshot = simulation->latest();
+        double tickSeconds = simulation->getTickSeconds();
+        double since = std::chrono::duration<double>(std::chrono::steady_clock::now() - snapshot.due).count();
+        float alpha = (float)std::min(1.0, std::max(0.0, since / tickSeconds));
+        animationTime = (float)(snapshot.time - tickSeconds * (1.0 - alpha));
+        
+        // The shader animates from animationTime alone; the CPU copy is refreshed on the way back
+        if (useGpuAnimation)
+            return;
+        
+        const float* fromAngle = snapshot.vehicleAngle[0].data();
+        const float* toAngle = snapshot.vehicleAngle[1].data();
+        workers.parallelFor(vehicles.size(), SIMULATION_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                vehicles.pathAngle[i] = fromAngle[i] + (toAngle[i] - fromAngle[i]) * alpha;
+            vehicles.update(begin, end, 0.0f);
+        });
+        vehicleGrid.update(vehicles.positionX.data(), vehicles.positionY.data(), vehicles.positionZ.data(), workers);
+        
+        const float* fromRotation = snapshot.billboardRotation[0].data();
+        const float* toRotation = snapshot.billboardRotation[1].data();
+        for (size_t i = 0; i < billboards.size(); i++)
+            billboards.rotation[i] = fromRotation[i] + (toRotation[i] - fromRotation[i]) * alpha;
+    }
+    
+    // Allocates the shadow maps when shadows are first turned on; if the driver cannot hold
+    // them, shadows are switched off rather than drawn into an incomplete target
+    void prepareShadows() {
+        if (!useShadows || shadowMaps)
+            return;
+        shadowMaps.reset(new ShadowMaps(cityConfig));
+        if (!shadowMaps->valid()) {
+            std::cout << "Shadow maps (" << shadowMaps->layers() << " layers) could not be allocated; shadows are off"
+                      << std::endl;
+            shadowMaps.reset();
+            useShadows = false;
+        }
+    }
+    
+    // The backend-neutral part of a frame: culling into the instance lists and, with the
+    // queue on, the sorted packets. Both render and renderSoftware draw from what it leaves.
+    void prepareFrame(const glm::mat4& view, const glm::mat4& projection, GLsizei height) {
+        lodPixelScale = projection[1][1] * height * 0.5f;
+        cull(projection * view);
+        if (useRenderQueue)
+            recordQueue();
+    }
+    
+    // Draws into the bound framebuffer, which is width x height pixels
+    void render(glm::mat4 view, glm::mat4 projection, GLsizei width, GLsizei height) {
+        prepareShadows();
+        prepareFrame(view, projection, height);
+        auto shadowStart = std::chrono::steady_clock::now();
+        if (useShadows)
+            planShadows(view, projection);
+        double shadowMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - shadowStart).count();
+        
+        // Everything rewritten per frame goes through the ring; culling fixed the sizes, so reserve once
+        bool streamMoving = useInstancing && !useGpuAnimation;
+        size_t bytes = sizeof(FrameUniforms);
+        if (useInstancing)
+            bytes += (visibleBuildings.size() + distantBuildings.size()) * sizeof(InstanceData);
+        if (streamMoving)
+            bytes += visible[CATEGORY_VEHICLES].size() * sizeof(InstanceData) +
+                     visible[CATEGORY_BILLBOARDS].size() * sizeof(OrientedInstanceData);
+        int allocations = 1 + CATEGORY_COUNT;
+        if (useShadows) {
+            for (const ShadowMaps::TileRender& render : shadowMaps->tileRenders()) {
+                for (const CityTile* caster : render.casters)
+                    bytes += caster->instances.size() * sizeof(InstanceData);
+            }
+            bytes += shadowCasters[CATEGORY_VEHICLES].size() * sizeof(InstanceData) +
+                     shadowCasters[CATEGORY_BILLBOARDS].size() * sizeof(OrientedInstanceData);
+            allocations += (int)shadowMaps->tileRenders().size() + CATEGORY_COUNT;
+        }
+        stream.beginFrame(bytes, allocations);
+        
+        // Frame-global values go up once in a single uniform block shared by every program
+        size_t frameOffset;
+        FrameUniforms* frame = (FrameUniforms*)stream.allocate(sizeof(FrameUniforms), frameOffset);
+        frame->view = view;
+        frame->projection = projection;
+        frame->viewPos = cameraPos;
+        frame->lightDir = -MOONLIGHT_DIRECTION;
+        frame->lightColor = glm::vec3(0.3f, 0.3f, 0.7f);
+        if (useClusteredLighting) {
+            if (!lightClusters)
+                lightClusters.reset(new LightClusters());
+            gatherLights();
+            lightClusters->build(pointLights, view, projection, workers);
+            lightClusters->bind();
+            lightClusters->frameUniforms(*frame, width, height, (uint32_t)pointLights.size());
+        } else {
+            frame->clusterScale = glm::vec4(0.0f);
+            std::fill(frame->clusterCounts, frame->clusterCounts + 4, 0u);
+        }
+        if (useShadows) {
+            shadowMaps->frameUniforms(*frame);
+        } else {
+            frame->dynamicShadow = glm::mat4(1.0f);
+            frame->shadowGrid = glm::vec4(0.0f);
+            std::fill(frame->shadowCounts, frame->shadowCounts + 4, 0u);
+        }
+        
+        instanceCount[CATEGORY_BUILDINGS] = 0;
+        instanceCount[CATEGORY_VEHICLES] = 0;
+        instanceCount[CATEGORY_BILLBOARDS] = 0;
+        if (useInstancing && useRenderQueue)
+            streamQueued();
+        else if (useInstancing)
+            streamInstances(streamMoving);
+        if (useShadows)
+            streamShadowCasters();
+        stream.flush();
+        glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, stream.buffer(), frameOffset, sizeof(FrameUniforms));
+        if (useShadows)
+            renderShadows(width, height, shadowMs);
+        
+        drawStats.drawCalls = 0;
+        drawStats.triangles = 0;
+        if (useRenderQueue) {
+            submitQueue();
+        } else {
+            if (useInstancing)
+                renderInstanced();
+            else
+                renderPerObject();
+            if (useStaticBatches)
+                renderBatches();
+            if (useGpuAnimation)
+                renderAnimated();
+        }
+        stream.endFrame();
+    }
+    
+    // Tile maps to redraw, and the moving objects inside the box of their map. With GPU
+    // animation positions only exist in the shader, so all of them are drawn.
+    void planShadows(const glm::mat4& view, const glm::mat4& projection) {
+        PROFILE_SCOPE("plan shadows");
+        shadowMaps->plan(tiles.residentTiles(), cameraPos, view, projection, rebuildShadows);
+        for (int i = 0; i < CATEGORY_COUNT; i++)
+            shadowCasters[i].clear();
+        if (useGpuAnimation)
+            return;
+        Frustum box(shadowMaps->dynamicMatrix());
+        vehicleGrid.cull(box, vehicles.positionX.data(), vehicles.positionY.data(), vehicles.positionZ.data(),
+                         shadowCasters[CATEGORY_VEHICLES]);
+        billboardGrid.cull(box, billboardX.data(), billboardY.data(), billboardZ.data(), shadowCasters[CATEGORY_BILLBOARDS]);
+    }
+    
+    // Building instances are copied from the caster tiles, one range per tile map
+    void streamShadowCasters() {
+        PROFILE_SCOPE("stream shadow casters");
+        casterOffsets.clear();
+        for (const ShadowMaps::TileRender& render : shadowMaps->tileRenders()) {
+            size_t count = 0;
+            for (const CityTile* caster : render.casters)
+                count += caster->instances.size();
+            size_t offset;
+            InstanceData* out = (InstanceData*)stream.allocate(count * sizeof(InstanceData), offset);
+            for (const CityTile* caster : render.casters)
+                out = std::copy(caster->instances.begin(), caster->instances.end(), out);
+            casterOffsets.push_back(offset);
+        }
+        
+        const std::vector<uint32_t>& casterVehicles = shadowCasters[CATEGORY_VEHICLES];
+        InstanceData* vehiclesOut = (InstanceData*)stream.allocate(casterVehicles.size() * sizeof(InstanceData),
+                                                                   movingOffset[CATEGORY_VEHICLES]);
+        for (size_t k = 0; k < casterVehicles.size(); k++) {
+            uint32_t i = casterVehicles[k];
+            vehiclesOut[k] = InstanceData(vehicleWorld(i), vehicles.color[i], 0.8f, vehicles.color[i]);
+        }
+        const std::vector<uint32_t>& casterBillboards = shadowCasters[CATEGORY_BILLBOARDS];
+        OrientedInstanceData* billboardsOut = (OrientedInstanceData*)stream.allocate(
+            casterBillboards.size() * sizeof(OrientedInstanceData), movingOffset[CATEGORY_BILLBOARDS]);
+        for (size_t k = 0; k < casterBillboards.size(); k++) {
+            uint32_t i = casterBillboards[k];
+            billboardsOut[k] = OrientedInstanceData(billboardWorld(i), billboards.color[i], 0.9f, billboards.color[i]);
+        }
+    }
+    
+    // Redraws the tile maps that changed and the moving objects' map, then puts the width x height
+    // target back and binds the maps for the main pass
+    void renderShadows(GLsizei width, GLsizei height, double planMs) {
+        PROFILE_GPU("shadows");
+        auto start = std::chrono::steady_clock::now();
+        GLint target = 0;
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(2.0f, 4.0f);
+        
+        int staticDraws = 0, dynamicDraws = 0;
+        long long staticTriangles = 0, dynamicTriangles = 0;
+        GLsizei cubeTriangles = cubeMesh.triangleCount();
+        const std::vector<ShadowMaps::TileRender>& renders = shadowMaps->tileRenders();
+        if (!renders.empty()) {
+            shadowShader.use();
+            glBindVertexArray(instanceVAO[CATEGORY_BUILDINGS]);
+        }
+        for (size_t r = 0; r < renders.size(); r++) {
+            GLsizei count = 0;
+            for (const CityTile* caster : renders[r].casters)
+                count += (GLsizei)caster->instances.size();
+            shadowMaps->begin(renders[r].layer);
+            glUniformMatrix4fv(shadowMatrixLoc[0], 1, GL_FALSE, glm::value_ptr(renders[r].lightProjection));
+            if (count == 0)
+                continue;
+            pointInstanceAttributes(CATEGORY_BUILDINGS, casterOffsets[r]);
+            cubeMesh.drawInstanced(count);
+            staticDraws++;
+            staticTriangles += (long long)cubeTriangles * count;
+        }
+        
+        shadowMaps->begin(-1);
+        const glm::mat4& dynamicMatrix = shadowMaps->dynamicMatrix();
+        if (useGpuAnimation) {
+            shadowAnimatedShader.use();
+            glUniformMatrix4fv(shadowMatrixLoc[2], 1, GL_FALSE, glm::value_ptr(dynamicMatrix));
+            glUniform1f(shadowTimeLoc, animationTime);
+            const glm::vec3 scales[CATEGORY_COUNT] = { glm::vec3(1.0f), VEHICLE_SCALE, BILLBOARD_SCALE };
+            for (int i = CATEGORY_VEHICLES; i < CATEGORY_COUNT; i++) {
+                if (animated[i].empty())
+                    continue;
+                glUniform3fv(shadowScaleLoc, 1, glm::value_ptr(scales[i]));
+                glBindVertexArray(animatedVAO[i]);
+                cubeMesh.drawInstanced((GLsizei)animated[i].size());
+                dynamicDraws++;
+                dynamicTriangles += (long long)cubeTriangles * animated[i].size();
+            }
+        } else {
+            for (int i = CATEGORY_VEHICLES; i < CATEGORY_COUNT; i++) {
+                if (shadowCasters[i].empty())
+                    continue;
+                int program = i == CATEGORY_BILLBOARDS ? 1 : 0;
+                (program ? shadowOrientedShader : shadowShader).use();
+                glUniformMatrix4fv(shadowMatrixLoc[program], 1, GL_FALSE, glm::value_ptr(dynamicMatrix));
+                glBindVertexArray(instanceVAO[i]);
+                pointInstanceAttributes(i, movingOffset[i]);
+                cubeMesh.drawInstanced((GLsizei)shadowCasters[i].size());
+                dynamicDraws++;
+                dynamicTriangles += (long long)cubeTriangles * shadowCasters[i].size();
+            }
+        }
+        PROFILE_COUNT(COUNTER_DRAW_CALLS, staticDraws + dynamicDraws);
+        PROFILE_COUNT(COUNTER_TRIANGLES, staticTriangles + dynamicTriangles);
+        
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        glBindFramebuffer(GL_FRAMEBUFFER, target);
+        glViewport(0, 0, width, height);
+        shadowMaps->bind();
+        double ms = planMs + std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        shadowMaps->drawn(staticDraws, staticTriangles, dynamicDraws, dynamicTriangles, cubeTriangles, ms);
+    }
+    
+    // Records a packet for every visible object, every visible static batch and each animated
+    // category, then sorts them. Instanced packets use the list as their material, so each
+    // list stays one run whose instances are in front-to-back order.
+    void recordQueue() {
+        bool moving = !useGpuAnimation;
+        size_t sizes[LIST_COUNT] = { visibleBuildings.size(), distantBuildings.size(),
+                                     moving ? visible[CATEGORY_VEHICLES].size() : 0,
+                                     moving ? visible[CATEGORY_BILLBOARDS].size() : 0, visibleBatches.size(),
+                                     moving ? 0 : (size_t)(CATEGORY_COUNT - CATEGORY_VEHICLES) };
+        listStart[0] = 0;
+        for (int list = 0; list < LIST_COUNT; list++)
+            listStart[list + 1] = listStart[list] + sizes[list];
+        
+        glm::vec3 eye = cameraPos, forward = cameraFront;
+        auto depthOf = [&](const glm::vec3& position) { return std::max(glm::dot(position - eye, forward), 0.0f); };
+        queue.record(listStart[LIST_COUNT], workers, [&](size_t i) {
+            int list = (int)(std::upper_bound(listStart, listStart + LIST_COUNT + 1, i) - listStart) - 1;
+            uint32_t index = (uint32_t)(i - listStart[list]);
+            DrawPacket packet;
+            packet.first = index;
+            packet.count = 1;
+            packet.list = (uint8_t)list;
+            packet.mesh = list == LIST_DISTANT;
+            
+            int program = useInstancing ? QUEUE_AXIS_ALIGNED_INSTANCED : QUEUE_AXIS_ALIGNED;
+            uint32_t material = list;
+            float depth = 0.0f;
+            if (list == LIST_BUILDINGS || list == LIST_DISTANT) {
+                const InstanceData& instance = (list == LIST_BUILDINGS ? visibleBuildings : distantBuildings)[index];
+                if (!useInstancing)
+                    material = materialKey(instance.color, instance.emissionStrength, instance.emissionColor);
+                depth = depthOf(glm::vec3(instance.model[3]));
+            } else if (list == LIST_VEHICLES) {
+                uint32_t id = visible[CATEGORY_VEHICLES][index];
+                if (!useInstancing)
+                    material = materialKey(vehicles.color[id], 0.8f, vehicles.color[id]);
+                depth = depthOf(vehicles.position(id));
+            } else if (list == LIST_BILLBOARDS) {
+                uint32_t id = visible[CATEGORY_BILLBOARDS][index];
+                program = useInstancing ? QUEUE_INSTANCED : QUEUE_GENERAL;
+                if (!useInstancing)
+                    material = materialKey(billboards.color[id], 0.9f, billboards.color[id]);
+                depth = depthOf(billboards.position[id]);
+            } else if (list == LIST_BATCHES) {
+                const CityTile& tile = *visibleBatches[index]->source;
+                program = QUEUE_BATCHED;
+                depth = depthOf(glm::clamp(eye, tile.boundsMin, tile.boundsMax));
+            } else {
+                program = QUEUE_ANIMATED;
+                packet.first = CATEGORY_VEHICLES + index;
+            }
+            packet.key = packetKey(program, packet.mesh, material, depth, (uint32_t)i);
+            return packet;
+        });
+        queue.sort();
+    }
+    
+    // Instanced path: writes instance data in submission order, one run per group of packets
+    // with the same program, mesh and list
+    void streamQueued() {
+        PROFILE_SCOPE("stream instances");
+        size_t plainCount = listStart[LIST_BILLBOARDS] - listStart[LIST_BUILDINGS];
+        size_t orientedCount = listStart[LIST_BATCHES] - listStart[LIST_BILLBOARDS];
+        size_t plainOffset, orientedOffset;
+        InstanceData* plain = (InstanceData*)stream.allocate(plainCount * sizeof(InstanceData), plainOffset);
+        OrientedInstanceData* oriented = (OrientedInstanceData*)stream.allocate(
+            orientedCount * sizeof(OrientedInstanceData), orientedOffset);
+        
+        const std::vector<DrawPacket>& packets = queue.sorted();
+        instanceRuns.clear();
+        size_t plainCursor = 0, orientedCursor = 0;
+        forEachRun([&](int list, size_t first, size_t end) {
+            InstanceRun run;
+            run.offset = list == LIST_BILLBOARDS ? orientedOffset + orientedCursor * sizeof(OrientedInstanceData)
+                                                 : plainOffset + plainCursor * sizeof(InstanceData);
+            for (size_t p = first; p < end; p++) {
+                if (list == LIST_BILLBOARDS) {
+                    uint32_t id = visible[CATEGORY_BILLBOARDS][packets[p].first];
+                    oriented[orientedCursor++] = OrientedInstanceData(billboardWorld(id), billboards.color[id], 0.9f,
+                                                                      billboards.color[id]);
+                } else {
+                    plain[plainCursor++] = queuedInstance(packets[p]);
+                }
+            }
+            run.count = (GLsizei)(end - first);
+            instanceRuns.push_back(run);
+        });
+    }
+    
+    // Calls run(list, first, end) for every range of sorted packets with the same program, mesh
+    // and list, which the instanced path draws in one call. Static batches and animated
+    // categories are a packet each and left out.
+    template <typename Run>
+    void forEachRun(Run run) const {
+        const std::vector<DrawPacket>& packets = queue.sorted();
+        for (size_t p = 0; p < packets.size();) {
+            int list = packets[p].list;
+            if (list >= LIST_BATCHES) {
+                p++;
+                continue;
+            }
+            uint64_t group = packets[p].key >> 44;
+            size_t q = p + 1;
+            while (q < packets.size() && packets[q].key >> 44 == group && packets[q].list == list)
+                q++;
+            run(list, p, q);
+            p = q;
+        }
+    }
+    
+    // Instance data of a building, vehicle or billboard packet
+    InstanceData queuedInstance(const DrawPacket& packet) const {
+        if (packet.list == LIST_BUILDINGS)
+            return visibleBuildings[packet.first];
+        if (packet.list == LIST_DISTANT)
+            return distantBuildings[packet.first];
+        if (packet.list == LIST_VEHICLES) {
+            uint32_t id = visible[CATEGORY_VEHICLES][packet.first];
+            return InstanceData(vehicleWorld(id), vehicles.color[id], 0.8f, vehicles.color[id]);
+        }
+        uint32_t id = visible[CATEGORY_BILLBOARDS][packet.first];
+        return InstanceData(billboardWorld(id), billboards.color[id], 0.9f, billboards.color[id]);
+    }
+    
+    // The frame through SoftwareRasterizer: the same culling and sorted queue as render (which
+    // has to be on), with each run of packets one drawInstanced. Moonlight only, like the
+    // rasterizer's shading.
+    void renderSoftware(SoftwareRasterizer& rasterizer, const glm::mat4& view, const glm::mat4& projection,
+                        GLsizei height, const glm::vec3& clearColor) {
+        prepareFrame(view, projection, height);
+        
+        FrameUniforms uniforms = FrameUniforms();
+        uniforms.view = view;
+        uniforms.projection = projection;
+        uniforms.viewPos = cameraPos;
+        uniforms.lightDir = -MOONLIGHT_DIRECTION;
+        uniforms.lightColor = glm::vec3(0.3f, 0.3f, 0.7f);
+        rasterizer.begin(uniforms, clearColor);
+        const std::vector<DrawPacket>& packets = queue.sorted();
+        softwareInstances.resize(packets.size());
+        forEachRun([&](int /*list*/, size_t first, size_t end) {
+            for (size_t p = first; p < end; p++)
+                softwareInstances[p] = queuedInstance(packets[p]);
+            rasterizer.drawInstanced(packets[first].mesh ? distantCubeData : cubeData, softwareInstances.data() + first,
+                                     end - first);
+        });
+        rasterizer.finish();
+    }
+    
+    // Submits the sorted packets on this thread. Programs and vertex arrays are only switched
+    // when they change, and per-object material uniforms only when their value does.
+    void submitQueue() {
+        PROFILE_GPU("queue");
+        auto start = std::chrono::steady_clock::now();
+        struct MaterialState {
+            glm::vec3 color, emissionColor;
+            float emission;
+            bool set;
+        };
+        MaterialState materials[2] = {}; // QUEUE_AXIS_ALIGNED, QUEUE_GENERAL
+        int program = -1, list = -1, skipped = 0;
+        size_t run = 0;
+        
+        const std::vector<DrawPacket>& packets = queue.sorted();
+        for (size_t p = 0; p < packets.size();) {
+            const DrawPacket& packet = packets[p];
+            int packetProgram = (int)(packet.key >> 61);
+            if (packetProgram != program) {
+                program = packetProgram;
+                queuePrograms[program]->use();
+                list = -1;
+                if (program == QUEUE_ANIMATED) {
+                    glUniform1f(timeLoc, animationTime);
+                    PROFILE_COUNT(COUNTER_UNIFORM_UPLOADS, 1);
+                }
+            }
+            
+            if (packet.list == LIST_BATCHES) {
+                StaticBatch* batch = visibleBatches[packet.first];
+                batch->flush();
+                if (batch->buildingCount() > 0) {
+                    batch->draw();
+                    drawStats.drawCalls++;
+                    drawStats.triangles += batch->triangleCount();
+                    PROFILE_COUNT(COUNTER_DRAW_CALLS, 1);
+                    PROFILE_COUNT(COUNTER_TRIANGLES, batch->triangleCount());
+                }
+                p++;
+                continue;
+            }
+            if (packet.list == LIST_ANIMATED) {
+                int category = (int)packet.first;
+                const glm::vec3 scale = category == CATEGORY_VEHICLES ? VEHICLE_SCALE : BILLBOARD_SCALE;
+                if (!animated[category].empty()) {
+                    glUniform3fv(animatedScaleLoc, 1, glm::value_ptr(scale));
+                    PROFILE_COUNT(COUNTER_UNIFORM_UPLOADS, 1);
+                    glBindVertexArray(animatedVAO[category]);
+                    cubeMesh.drawInstanced((GLsizei)animated[category].size());
+                    countDraw((int)animated[category].size());
+                }
+                p++;
+                continue;
+            }
+            
+            int category = packet.list == LIST_VEHICLES ? CATEGORY_VEHICLES
+                         : packet.list == LIST_BILLBOARDS ? CATEGORY_BILLBOARDS : CATEGORY_BUILDINGS;
+            if (useInstancing) {
+                const InstanceRun& instances = instanceRuns[run++];
+                if (packet.list != list) {
+                    glBindVertexArray(instanceVAO[category]);
+                    list = packet.list;
+                }
+                pointInstanceAttributes(category, instances.offset);
+                cubeMesh.drawInstanced(instances.count, packet.mesh != 0);
+                countDraw(instances.count, packet.mesh != 0);
+                p += instances.count;
+                continue;
+            }
+            
+            // Per-object: every list shares the plain cube vertex array
+            if (list < 0) {
+                glBindVertexArray(VAO);
+                list = packet.list;
+            }
+            glm::mat4 model;
+            glm::vec3 color, emissionColor;
+            float emission;
+            if (packet.list == LIST_BUILDINGS || packet.list == LIST_DISTANT) {
+                const InstanceData& instance = (packet.list == LIST_BUILDINGS ? visibleBuildings : distantBuildings)[packet.first];
+                model = instance.model;
+                color = instance.color;
+                emission = instance.emissionStrength;
+                emissionColor = instance.emissionColor;
+            } else if (packet.list == LIST_VEHICLES) {
+                uint32_t id = visible[CATEGORY_VEHICLES][packet.first];
+                model = vehicleWorld(id);
+                color = emissionColor = vehicles.color[id];
+                emission = 0.8f;
+            } else {
+                uint32_t id = visible[CATEGORY_BILLBOARDS][packet.first];
+                model = billboardWorld(id);
+                color = emissionColor = billboards.color[id];
+                emission = 0.9f;
+            }
+            
+            bool general = program == QUEUE_GENERAL;
+            const ObjectUniforms& uniforms = general ? objectUniforms : axisAlignedUniforms;
+            MaterialState& material = materials[general];
+            glUniformMatrix4fv(uniforms.model, 1, GL_FALSE, glm::value_ptr(model));
+            int uploads = 1;
+            if (general) {
+                glm::mat3 normal = normalMatrix(model);
+                glUniformMatrix3fv(uniforms.normalMatrix, 1, GL_FALSE, glm::value_ptr(normal));
+                uploads++;
+            }
+            if (!material.set || material.color != color) {
+                glUniform3fv(uniforms.objectColor, 1, glm::value_ptr(color));
+                uploads++;
+            } else {
+                skipped++;
+            }
+            if (!material.set || material.emission != emission) {
+                glUniform1f(uniforms.emissionStrength, emission);
+                uploads++;
+            } else {
+                skipped++;
+            }
+            if (!material.set || material.emissionColor != emissionColor) {
+                glUniform3fv(uniforms.emissionColor, 1, glm::value_ptr(emissionColor));
+                uploads++;
+            } else {
+                skipped++;
+            }
+            material.color = color;
+            material.emission = emission;
+            material.emissionColor = emissionColor;
+            material.set = true;
+            PROFILE_COUNT(COUNTER_UNIFORM_UPLOADS, uploads);
+            
+            cubeMesh.draw(packet.mesh != 0);
+            countDraw(1, packet.mesh != 0);
+            p++;
+        }
+        queue.submitted(drawStats.drawCalls, skipped,
+                        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    
+    // One draw per visible tile; pending edits are flushed as their batch comes into view
+    void renderBatches() {
+        PROFILE_GPU("batches");
+        batchedShader.use();
+        for (StaticBatch* batch : visibleBatches) {
+            batch->flush();
+            if (batch->buildingCount() == 0)
+                continue;
+            batch->draw();
+            drawStats.drawCalls++;
+            drawStats.triangles += batch->triangleCount();
+            PROFILE_COUNT(COUNTER_DRAW_CALLS, 1);
+            PROFILE_COUNT(COUNTER_TRIANGLES, batch->triangleCount());
+        }
+    }
+    
+    // Two draws and two uniforms per frame, whatever the number of animated objects
+    void renderAnimated() {
+        PROFILE_GPU("animated");
+        animatedShader.use();
+        glUniform1f(timeLoc, animationTime);
+        PROFILE_COUNT(COUNTER_UNIFORM_UPLOADS, 1);
+        
+        const glm::vec3 scales[CATEGORY_COUNT] = { glm::vec3(1.0f), VEHICLE_SCALE, BILLBOARD_SCALE };
+        for (int i = CATEGORY_VEHICLES; i < CATEGORY_COUNT; i++) {
+            if (animated[i].empty())
+                continue;
+            glUniform3fv(animatedScaleLoc, 1, glm::value_ptr(scales[i]));
+            PROFILE_COUNT(COUNTER_UNIFORM_UPLOADS, 1);
+            glBindVertexArray(animatedVAO[i]);
+            cubeMesh.drawInstanced((GLsizei)animated[i].size());
+            countDraw((int)animated[i].size());
+        }
+    }
+    
+    void renderInstanced() {
+        PROFILE_GPU("instanced");
+        for (int i = 0; i < CATEGORY_COUNT; i++) {
+            if (instanceCount[i] == 0)
+                continue;
+            if (i == CATEGORY_BILLBOARDS)
+                instancedShader.use();
+            else
+                axisAlignedInstancedShader.use();
+            glBindVertexArray(instanceVAO[i]);
+            
+            // Buildings are two runs: full meshes, then simplified meshes and merged boxes
+            GLsizei full = i == CATEGORY_BUILDINGS ? (GLsizei)visibleBuildings.size() : instanceCount[i];
+            if (full > 0) {
+                pointInstanceAttributes(i, instanceOffset[i]);
+                cubeMesh.drawInstanced(full);
+                countDraw(full);
+            }
+            if (full < instanceCount[i]) {
+                pointInstanceAttributes(i, instanceOffset[i] + full * sizeof(InstanceData));
+                cubeMesh.drawInstanced(instanceCount[i] - full, true);
+                countDraw(instanceCount[i] - full, true);
+            }
+        }
+    }
+    
+    // Writes the visible instances straight into this frame's ring region. Buildings are
+    // copied from their tiles; vehicles and billboards move, so theirs are rebuilt.
+    void streamInstances(bool moving) {
+        PROFILE_SCOPE("stream instances");
+        instanceCount[CATEGORY_BUILDINGS] = (GLsizei)(visibleBuildings.size() + distantBuildings.size());
+        InstanceData* buildingsOut = (InstanceData*)stream.allocate(instanceCount[CATEGORY_BUILDINGS] * sizeof(InstanceData),
+                                                                    instanceOffset[CATEGORY_BUILDINGS]);
+        buildingsOut = std::copy(visibleBuildings.begin(), visibleBuildings.end(), buildingsOut);
+        std::copy(distantBuildings.begin(), distantBuildings.end(), buildingsOut);
+        if (!moving)
+            return;
+        
+        const std::vector<uint32_t>& visibleVehicles = visible[CATEGORY_VEHICLES];
+        instanceCount[CATEGORY_VEHICLES] = (GLsizei)visibleVehicles.size();
+        InstanceData* vehiclesOut = (InstanceData*)stream.allocate(visibleVehicles.size() * sizeof(InstanceData),
+                                                                   instanceOffset[CATEGORY_VEHICLES]);
+        for (size_t k = 0; k < visibleVehicles.size(); k++) {
+            uint32_t i = visibleVehicles[k];
+            vehiclesOut[k] = InstanceData(vehicleWorld(i), vehicles.color[i], 0.8f, vehicles.color[i]);
+        }
+        
+        const std::vector<uint32_t>& visibleBillboards = visible[CATEGORY_BILLBOARDS];
+        instanceCount[CATEGORY_BILLBOARDS] = (GLsizei)visibleBillboards.size();
+        OrientedInstanceData* billboardsOut = (OrientedInstanceData*)stream.allocate(
+            visibleBillboards.size() * sizeof(OrientedInstanceData), instanceOffset[CATEGORY_BILLBOARDS]);
+        for (size_t k = 0; k < visibleBillboards.size(); k++) {
+            uint32_t i = visibleBillboards[k];
+            billboardsOut[k] = OrientedInstanceData(billboardWorld(i), billboards.color[i], 0.9f, billboards.color[i]);
+        }
+    }
+    
+    void countDraw(int instances, bool simplified = false) {
+        long long triangles = (long long)cubeMesh.triangleCount(simplified) * instances;
+        drawStats.drawCalls++;
+        drawStats.triangles += triangles;
+        PROFILE_COUNT(COUNTER_DRAW_CALLS, 1);
+        PROFILE_COUNT(COUNTER_TRIANGLES, triangles);
+    }
+    
+    // Fallback path: one set of uniforms and one draw call per object
+    void renderPerObject() {
+        PROFILE_GPU("per-object");
+        axisAlignedShader.use();
+        glBindVertexArray(VAO);
+        
+        // Render buildings, then the distant ones with the simplified mesh
+        const ObjectUniforms& uniforms = axisAlignedUniforms;
+        for (int simplified = 0; simplified < 2; simplified++) {
+            for (const auto& building : simplified ? distantBuildings : visibleBuildings) {
+                glUniformMatrix4fv(uniforms.model, 1, GL_FALSE, glm::value_ptr(building.model));
+                glUniform3fv(uniforms.objectColor, 1, glm::value_ptr(building.color));
+                glUniform1f(uniforms.emissionStrength, building.emissionStrength);
+                glUniform3fv(uniforms.emissionColor, 1, glm::value_ptr(building.emissionColor));
+                PROFILE_COUNT(COUNTER_UNIFORM_UPLOADS, 4);
+                
+                cubeMesh.draw(simplified != 0);
+                countDraw(1, simplified != 0);
+            }
+        }
+        
+        if (useGpuAnimation)
+            return;
+        
+        // Render vehicles (emission strength is the same for all of them)
+        glUniform1f(uniforms.emissionStrength, 0.8f);
+        PROFILE_COUNT(COUNTER_UNIFORM_UPLOADS, 1);
+        for (uint32_t i : visible[CATEGORY_VEHICLES]) {
+            glm::mat4 model = vehicleWorld(i);
+            
+            glUniformMatrix4fv(uniforms.model, 1, GL_FALSE, glm::value_ptr(model));
+            glUniform3fv(uniforms.objectColor, 1, glm::value_ptr(vehicles.color[i]));
+            glUniform3fv(uniforms.emissionColor, 1, glm::value_ptr(vehicles.color[i]));
+            PROFILE_COUNT(COUNTER_UNIFORM_UPLOADS, 3);
+            
+            cubeMesh.draw();
+            countDraw(1);
+        }
+        
+        // Render billboards; they rotate, so they get the general program and a CPU normal matrix
+        shader.use();
+        glUniform1f(objectUniforms.emissionStrength, 0.9f);
+        PROFILE_COUNT(COUNTER_UNIFORM_UPLOADS, 1);
+        for (uint32_t i : visible[CATEGORY_BILLBOARDS]) {
+            glm::mat4 model = billboardWorld(i);
+            glm::mat3 normal = normalMatrix(model);
+            
+            glUniformMatrix4fv(objectUniforms.model, 1, GL_FALSE, glm::value_ptr(model));
+            glUniformMatrix3fv(objectUniforms.normalMatrix, 1, GL_FALSE, glm::value_ptr(normal));
+            glUniform3fv(objectUniforms.objectColor, 1, glm::value_ptr(billboards.color[i]));
+            glUniform3fv(objectUniforms.emissionColor, 1, glm::value_ptr(billboards.color[i]));
+            PROFILE_COUNT(COUNTER_UNIFORM_UPLOADS, 4);
+            
+            cubeMesh.draw();
+            countDraw(1);
+        }
+    }
+    
+    ~FuturisticCity() {
+        simulation.reset(); // it uses the worker pool
+        if (!gpu)
+            return;
+        glDeleteVertexArrays(1, &VAO);
+        glDeleteVertexArrays(CATEGORY_COUNT, instanceVAO);
+        glDeleteVertexArrays(CATEGORY_COUNT, animatedVAO);
+        glDeleteBuffers(CATEGORY_COUNT, animatedVBO);
+    }
+};
+
+const int RESOLUTION_LATENCY = 4;       // frames before a timer result is read back
+const float RESOLUTION_MIN_SCALE = 0.5f;
+const float RESOLUTION_STEP = 0.05f;     // scales are multiples of this
+const float RESOLUTION_HEADROOM = 0.8f;  // scale up only below this fraction of the budget
+const int RESOLUTION_SETTLE_FRAMES = 8;  // measured frames at a scale before it may change again
+
+// Offscreen target for the window whose resolution follows the GPU frame time. Timestamps
+// around each frame are read back a few frames late; while the smoothed time is over budget
+// the scale drops, and it only rises again once the time is well under it. The storage is
+// kept at window size and a smaller scale just draws into a corner, which is then stretched
+// over the window.
+class DynamicResolution {
+private:
+    GLuint framebuffer, renderbuffers[2];
+    GLsizei storageWidth, storageHeight;
+    GLsizei windowWidth, windowHeight;
+    GLsizei targetWidth, targetHeight;
+    float scale;
+    bool scaled;
+    
+    GLuint queries[RESOLUTION_LATENCY][2];
+    float queryScale[RESOLUTION_LATENCY]; // scale each frame was drawn at; < 0 while unused
+    int frame;
+    double smoothedMs, lastMs;
+    int settledFrames;
+    
+    // A new size starts the controller over: frames still in flight were drawn at the old size,
+    // and the first one at the new size pays for this reallocation, so adjust() skips it
+    void allocate(GLsizei width, GLsizei height) {
+        storageWidth = width;
+        storageHeight = height;
+        settledFrames = 0;
+        std::fill(queryScale, queryScale + RESOLUTION_LATENCY, -1.0f);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    }
+    
+    // Frame cost scales roughly with pixels, i.e. with scale squared; aim just under the budget.
+    // Drops go straight there, rises are limited to two steps at a time.
+    void adjust(double ms) {
+        // The first frame at a new size also pays for the resize, so it is left out
+        if (settledFrames++ == 0)
+            return;
+        smoothedMs = settledFrames == 2 ? ms : smoothedMs * 0.8 + ms * 0.2;
+        if (settledFrames < RESOLUTION_SETTLE_FRAMES)
+            return;
+        
+        float ideal = scale * (float)std::sqrt(0.9 * frameBudgetMs / std::max(smoothedMs, 1e-3));
+        float next = scale;
+        if (smoothedMs > frameBudgetMs)
+            next = std::floor(ideal / RESOLUTION_STEP) * RESOLUTION_STEP;
+        else if (smoothedMs < frameBudgetMs * RESOLUTION_HEADROOM)
+            next = glm::clamp(std::round(ideal / RESOLUTION_STEP) * RESOLUTION_STEP, scale, scale + 2.0f * RESOLUTION_STEP);
+        next = glm::clamp(next, RESOLUTION_MIN_SCALE, 1.0f);
+        if (next != scale) {
+            scale = next;
+            settledFrames = 0;
+        }
+    }
+    
+public:
+    DynamicResolution() : storageWidth(0), storageHeight(0), windowWidth(WIDTH), windowHeight(HEIGHT),
+                          targetWidth(WIDTH), targetHeight(HEIGHT), scale(1.0f), scaled(false), frame(0),
+                          smoothedMs(0.0), lastMs(0.0), settledFrames(0) {
+        glGenFramebuffers(1, &framebuffer);
+        glGenRenderbuffers(2, renderbuffers);
+        glGenQueries(2 * RESOLUTION_LATENCY, &queries[0][0]);
+        std::fill(queryScale, queryScale + RESOLUTION_LATENCY, -1.0f);
+        allocate(WIDTH, HEIGHT);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "Dynamic resolution target is incomplete" << std::endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    
+    DynamicResolution(const DynamicResolution&) = delete;
+    DynamicResolution& operator=(const DynamicResolution&) = delete;
+    
+    ~DynamicResolution() {
+        glDeleteQueries(2 * RESOLUTION_LATENCY, &queries[0][0]);
+        glDeleteRenderbuffers(2, renderbuffers);
+        glDeleteFramebuffers(1, &framebuffer);
+    }
+    
+    // Binds the target at the current scale, or the window itself when scaling is off, sets the
+    // viewport and starts timing the frame
+    void begin(GLsizei width, GLsizei height, bool enabled) {
+        windowWidth = width;
+        windowHeight = height;
+        if (enabled && (width != storageWidth || height != storageHeight))
+            allocate(width, height);
+        
+        scaled = enabled;
+        float drawScale = scaled ? scale : 1.0f;
+        targetWidth = std::max((GLsizei)(width * drawScale), (GLsizei)1);
+        targetHeight = std::max((GLsizei)(height * drawScale), (GLsizei)1);
+        glBindFramebuffer(GL_FRAMEBUFFER, scaled ? framebuffer : 0);
+        glViewport(0, 0, targetWidth, targetHeight);
+        
+        int slot = frame % RESOLUTION_LATENCY;
+        queryScale[slot] = scaled ? scale : -1.0f;
+        glQueryCounter(queries[slot][0], GL_TIMESTAMP);
+    }
+    
+    // Stretches the target over the window, stops timing, and reads back the oldest frame's
+    // time if it is ready; only frames drawn at the current scale steer it
+    void end() {
+        if (scaled) {
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+            glBlitFramebuffer(0, 0, targetWidth, targetHeight, 0, 0, windowWidth, windowHeight,
+                              GL_COLOR_BUFFER_BIT, GL_LINEAR);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        }
+        glQueryCounter(queries[frame % RESOLUTION_LATENCY][1], GL_TIMESTAMP);
+        frame++;
+        
+        int oldest = frame % RESOLUTION_LATENCY;
+        if (frame < RESOLUTION_LATENCY)
+            return;
+        GLint available = 0;
+        glGetQueryObjectiv(queries[oldest][1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            return;
+        GLuint64 start = 0, finish = 0;
+        glGetQueryObjectui64v(queries[oldest][0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(queries[oldest][1], GL_QUERY_RESULT, &finish);
+        lastMs = (finish - start) / 1.0e6;
+        if (queryScale[oldest] == scale)
+            adjust(lastMs);
+    }
+    
+    GLsizei width() const { return targetWidth; }
+    GLsizei height() const { return targetHeight; }
+    float getScale() const { return scaled ? scale : 1.0f; }
+    double gpuMs() const { return lastMs; }
+    double smoothedGpuMs() const { return smoothedMs; }
+};
+
+// Global city instance
+FuturisticCity* city = nullptr;
+
+// Tiles streamed around the camera at most, by --view-tiles or --far
+const int MAX_VIEW_TILES = 256;
+
+// Option values have to be a number throughout and within [minimum, maximum]
+bool parseInt(const std::string& option, const char* text, long minimum, long maximum, int& out) {
+    char* end = nullptr;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || value < minimum || value > maximum) {
+        std::cout << option << " takes a whole number from " << minimum << " to " << maximum << ", not " << text << std::endl;
+        return false;
+    }
+    out = (int)value;
+    return true;
+}
+
+bool parseFloat(const std::string& option, const char* text, float minimum, float maximum, float& out) {
+    char* end = nullptr;
+    float value = strtof(text, &end);
+    if (end == text || *end != '\0' || !std::isfinite(value) || value < minimum || value > maximum) {
+        std::cout << option << " takes a number from " << minimum << " to " << maximum << ", not " << text << std::endl;
+        return false;
+    }
+    out = value;
+    return true;
+}
+
+// Command line:
+//   --seed N --density D --tile-size S --view-tiles R --vehicles N --billboards N --threads N
+//   --per-object --no-cull --float-vertices --gpu-animation --static-batches --no-persistent --no-lod --far DIST
+//   --clustered --occlusion --no-render-queue --no-shadows | --shadow-rebuild --budget MS | --fixed-resolution
+//   --benchmark [--frames N] [--warmup N] [--csv PATH] [--json PATH]
+//   --sim-benchmark N | --traffic-benchmark N | --tick-rate HZ | --traffic
+//   --scene PATH | --save-scene PATH [--scene-radius N] | --scene-benchmark
+//   --shader-cache DIR | --no-shader-cache | --shader-benchmark
+//   --trace PATH [--trace-frames N]
+//   --software PATH [--software-frames N]
+bool parseArguments(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        
+        // Switches
+        if (arg == "--benchmark") {
+            benchmarkConfig.enabled = true;
+            continue;
+        }
+        if (arg == "--per-object") {
+            useInstancing = false;
+            continue;
+        }
+        if (arg == "--no-cull") {
+            useCulling = false;
+            continue;
+        }
+        if (arg == "--float-vertices") {
+            useCompactVertices = false;
+            continue;
+        }
+        if (arg == "--gpu-animation") {
+            useGpuAnimation = true;
+            continue;
+        }
+        if (arg == "--traffic") {
+            useTraffic = true;
+            continue;
+        }
+        if (arg == "--static-batches") {
+            useStaticBatches = true;
+            continue;
+        }
+        if (arg == "--no-persistent") {
+            usePersistentMapping = false;
+            continue;
+        }
+        if (arg == "--scene-benchmark") {
+            sceneConfig.benchmark = true;
+            continue;
+        }
+        if (arg == "--shader-benchmark") {
+            benchmarkConfig.shaders = true;
+            continue;
+        }
+        if (arg == "--no-shader-cache") {
+            shaderCacheDirectory.clear();
+            continue;
+        }
+        if (arg == "--no-lod") {
+            useLod = false;
+            continue;
+        }
+        if (arg == "--clustered") {
+            useClusteredLighting = true;
+            continue;
+        }
+        if (arg == "--occlusion") {
+            useOcclusion = true;
+            continue;
+        }
+        if (arg == "--no-render-queue") {
+            useRenderQueue = false;
+            continue;
+        }
+        if (arg == "--no-shadows") {
+            useShadows = false;
+            continue;
+        }
+        if (arg == "--shadow-rebuild") {
+            rebuildShadows = true;
+            continue;
+        }
+        if (arg == "--fixed-resolution") {
+            useDynamicResolution = false;
+            continue;
+        }
+        
+        // Options with a value
+        if (i + 1 >= argc) {
+            std::cout << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        const char* value = argv[++i];
+        bool valid = true;
+        if (arg == "--seed") {
+            char* end = nullptr;
+            cityConfig.seed = strtoull(value, &end, 10);
+            if (end == value || *end != '\0') {
+                std::cout << "--seed takes a whole number, not " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--density")
+            valid = parseFloat(arg, value, 0.0f, 1.0f, cityConfig.buildingDensity);
+        else if (arg == "--tile-size")
+            valid = parseFloat(arg, value, 1.0f, 100000.0f, cityConfig.tileSize);
+        else if (arg == "--view-tiles") {
+            valid = parseInt(arg, value, 0, MAX_VIEW_TILES, cityConfig.loadRadius);
+            cityConfig.evictRadius = cityConfig.loadRadius + 1;
+        }
+        else if (arg == "--vehicles")
+            valid = parseInt(arg, value, 0, INT32_MAX, cityConfig.vehicleCount);
+        else if (arg == "--billboards")
+            valid = parseInt(arg, value, 0, INT32_MAX, cityConfig.billboardCount);
+        else if (arg == "--tick-rate")
+            valid = parseInt(arg, value, 0, 10000, cityConfig.tickRate);
+        else if (arg == "--threads")
+            valid = parseInt(arg, value, 0, 1024, cityConfig.threads);
+        else if (arg == "--frames")
+            valid = parseInt(arg, value, 1, INT32_MAX, benchmarkConfig.frames);
+        else if (arg == "--sim-benchmark")
+            valid = parseInt(arg, value, 0, INT32_MAX, benchmarkConfig.simulationObjects);
+        else if (arg == "--traffic-benchmark")
+            valid = parseInt(arg, value, 0, INT32_MAX, benchmarkConfig.trafficVehicles);
+        else if (arg == "--software")
+            benchmarkConfig.softwarePath = value;
+        else if (arg == "--software-frames")
+            valid = parseInt(arg, value, 1, INT32_MAX, benchmarkConfig.softwareFrames);
+        else if (arg == "--warmup")
+            valid = parseInt(arg, value, 0, INT32_MAX, benchmarkConfig.warmup);
+        else if (arg == "--csv")
+            benchmarkConfig.csvPath = value;
+        else if (arg == "--json")
+            benchmarkConfig.jsonPath = value;
+        else if (arg == "--scene")
+            sceneConfig.loadPath = value;
+        else if (arg == "--shader-cache")
+            shaderCacheDirectory = value;
+        else if (arg == "--trace")
+            profileConfig.tracePath = value;
+        else if (arg == "--trace-frames")
+            valid = parseInt(arg, value, 1, INT32_MAX, profileConfig.traceFrames);
+        else if (arg == "--save-scene")
+            sceneConfig.savePath = value;
+        else if (arg == "--scene-radius")
+            valid = parseInt(arg, value, 0, MAX_VIEW_TILES, sceneConfig.saveRadius);
+        else if (arg == "--far") {
+            farPlane = (float)atof(value);
+            if (!std::isfinite(farPlane) || farPlane <= 0.1f) {
+                std::cout << "--far has to be beyond the near plane (0.1)" << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--budget")
+            valid = parseFloat(arg, value, 0.1f, 1000.0f, frameBudgetMs);
+        else {
+            std::cout << "Unknown option " << arg << std::endl;
+            return false;
+        }
+        if (!valid)
+            return false;
+    }
+    
+    if (useTraffic)
+        useGpuAnimation = false;
+    
+    // Everything up to the far plane has to be resident to be drawn
+    if (farPlane / cityConfig.tileSize > MAX_VIEW_TILES) {
+        std::cout << "--far reaches beyond " << MAX_VIEW_TILES << " tiles of " << cityConfig.tileSize << std::endl;
+        return false;
+    }
+    int farTiles = (int)std::ceil(farPlane / cityConfig.tileSize);
+    if (farTiles > cityConfig.loadRadius) {
+        cityConfig.loadRadius = farTiles;
+        cityConfig.evictRadius = farTiles + 1;
+    }
+    return true;
+}
+
+// Headless benchmark
+#ifdef NIGHTCITY_EGL
+// Creates a GL 3.3 core context with no window or surface. Prefers Mesa's surfaceless
+// platform, which works on machines without a display or GPU (llvmpipe).
+bool createHeadlessContext() {
+    EGLDisplay display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+        std::cout << "Failed to initialize EGL" << std::endl;
+        return false;
+    }
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        std::cout << "EGL has no desktop OpenGL support" << std::endl;
+        return false;
+    }
+    
+    EGLint contextAttributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttributes);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        std::cout << "Failed to create headless GL context (0x" << std::hex << eglGetError() << std::dec << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Headless context plus GLEW entry points
+bool initHeadlessGL() {
+    if (!createHeadlessContext())
+        return false;
+    
+    // GLEW built for GLX reports a missing X display here, but has loaded the entry points by then
+    glewExperimental = GL_TRUE;
+    GLenum glewStatus = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    if (glewStatus == GLEW_ERROR_NO_GLX_DISPLAY)
+        glewStatus = GLEW_OK;
+#endif
+    if (glewStatus != GLEW_OK) {
+        std::cout << "Failed to initialize GLEW" << std::endl;
+        return false;
+    }
+    return true;
+}
+#endif
+
+// Deterministic fly-through: an outward spiral over the city with a gentle height bob
+void scriptedCamera(int frame) {
+    float t = frame / 60.0f;
+    float angle = 0.25f * t;
+    float radius = 40.0f + 8.0f * t;
+    cameraPos = glm::vec3(radius * cos(angle), 25.0f + 8.0f * sin(0.5f * t), radius * sin(angle));
+    
+    // Look along the path, turned slightly inwards and down
+    glm::vec3 tangent(-sin(angle + 0.3f), 0.0f, cos(angle + 0.3f));
+    cameraFront = glm::normalize(tangent + glm::vec3(0.0f, -0.15f, 0.0f));
+}
+
+// Nearest-rank percentile
+double percentile(std::vector<double> values, double p) {
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(p / 100.0 * values.size());
+    return values[std::min(values.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+struct BenchmarkFrame {
+    double cpuMs;   // update + cull + GL submission
+    double gpuMs;   // GL_TIME_ELAPSED around render()
+    double frameMs; // wall time including waiting for the frame to finish
+    int drawCalls;
+    long long triangles;
+    int visible;
+    int culled;
+    double occludedPercent; // of the instances tested by the occlusion pass
+    double occlusionMs;     // the pass itself
+    long long shadowTriangles; // drawn into shadow maps
+    double shadowMs;
+};
+
+// Contents of a JSON string literal: quotes, backslashes and control characters escaped
+std::string jsonEscape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char)c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+void writeMetric(std::ofstream& json, const char* name, const std::vector<double>& values, bool last) {
+    double sum = 0.0;
+    for (double v : values)
+        sum += v;
+    json << "    \"" << name << "\": { \"mean\": " << (values.empty() ? 0.0 : sum / values.size())
+         << ", \"p50\": " << percentile(values, 50.0) << ", \"p95\": " << percentile(values, 95.0)
+         << ", \"p99\": " << percentile(values, 99.0)
+         << ", \"max\": " << (values.empty() ? 0.0 : *std::max_element(values.begin(), values.end()))
+         << " }" << (last ? "\n" : ",\n");
+}
+
+// Times the vehicle update three ways (scalar AoS, batched SoA on one thread, batched SoA
+// on the pool) and checks that the batched kernel matches the scalar reference
+int runSimulationBenchmark() {
+    const int steps = 60;
+    const float fixedDelta = 1.0f / 60.0f;
+    int count = benchmarkConfig.simulationObjects;
+    
+    CityRandom random(cityConfig.seed);
+    std::vector<Vehicle> reference;
+    VehicleArrays batched;
+    for (int i = 0; i < count; i++) {
+        float radius = random.range(20.0f, 2000.0f);
+        Vehicle vehicle(glm::vec3(radius, random.range(15.0f, 60.0f), 0.0f), glm::vec3(0.0f, 0.0f, 1.0f),
+                        random.range(0.1f, 1.5f), glm::vec3(1.0f, 0.8f, 0.2f), radius);
+        vehicle.pathAngle = random.range(0.0f, 6.2831853f);
+        reference.push_back(vehicle);
+        batched.push(vehicle);
+    }
+    VehicleArrays threaded = batched;
+    WorkerPool workers(cityConfig.threads);
+    
+    auto time = [&](const std::function<void()>& step) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < steps; i++)
+            step();
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / steps;
+    };
+    double scalarMs = time([&] {
+        for (auto& vehicle : reference)
+            vehicle.update(fixedDelta);
+    });
+    double batchedMs = time([&] { batched.update(0, batched.size(), fixedDelta); });
+    double threadedMs = time([&] {
+        workers.parallelFor(threaded.size(), SIMULATION_GRAIN, [&](size_t begin, size_t end) {
+            threaded.update(begin, end, fixedDelta);
+        });
+    });
+    
+    // Relative to the path radius, since that is what bounds float precision here
+    double maxError = 0.0;
+    for (int i = 0; i < count; i++) {
+        glm::vec3 a = reference[i].position, b = threaded.position(i), c = batched.position(i);
+        double error = std::max(glm::length(a - b), glm::length(a - c)) / reference[i].pathRadius;
+        maxError = std::max(maxError, error);
+    }
+    
+    std::cout << std::fixed << std::setprecision(3)
+              << count << " vehicles, ms per update (mean of " << steps << "):\n"
+              << "  scalar AoS        " << scalarMs << "\n"
+              << "  batched SoA       " << batchedMs << "\n"
+              << "  batched SoA x" << workers.size() + 1 << "    " << threadedMs << "\n"
+              << std::scientific << "max relative error vs scalar: " << maxError << std::endl;
+    return maxError < 1e-4 ? 0 : 1;
+}
+
+// --traffic-benchmark: steps dense lane traffic over a square of tiles that grows with the
+// vehicle count, so density and with it the cost per query stay the same at any size. Checks
+// the hash against a brute-force neighbour search and the result against a repeat run.
+int runTrafficBenchmark() {
+    const int ticks = 240, warmup = 20;
+    const float fixedDelta = 1.0f / 60.0f;
+    const float groundPerVehicle = 30.0f; // square units
+    size_t count = benchmarkConfig.trafficVehicles;
+    WorkerPool workers(cityConfig.threads);
+    auto since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    
+    float side = std::sqrt(count * groundPerVehicle);
+    int radius = std::max(1, (int)std::ceil((side / cityConfig.tileSize - 1.0f) * 0.5f));
+    std::vector<std::unique_ptr<CityTile>> region = generateRegion(cityConfig, radius, workers);
+    std::vector<const CityTile*> tiles;
+    for (const auto& tile : region)
+        tiles.push_back(tile.get());
+    float extent = (radius + 0.5f) * cityConfig.tileSize;
+    
+    auto start = std::chrono::steady_clock::now();
+    TrafficSimulation traffic(tiles, extent, count, cityConfig.seed);
+    double setupMs = since(start);
+    
+    std::vector<double> hashMs, updateMs, tickMs;
+    double probed = 0.0, candidates = 0.0, neighbours = 0.0, closePasses = 0.0, avoiding = 0.0;
+    float minGap = 1e30f, minSeparation = 1e30f;
+    size_t inside = 0;
+    for (int tick = 0; tick < warmup + ticks; tick++) {
+        traffic.step(fixedDelta, workers);
+        inside += traffic.insideObstacles();
+        if (tick < warmup)
+            continue;
+        const TrafficStats& stats = traffic.getStats();
+        hashMs.push_back(stats.hashMs);
+        updateMs.push_back(stats.updateMs);
+        tickMs.push_back(stats.hashMs + stats.updateMs);
+        probed += stats.bucketsProbed;
+        candidates += stats.candidates;
+        neighbours += stats.neighbours;
+        closePasses += stats.closePasses;
+        avoiding += stats.avoiding;
+        minGap = std::min(minGap, stats.minGap);
+        minSeparation = std::min(minSeparation, stats.minSeparation);
+    }
+    double queries = (double)count * ticks;
+    
+    // The same run again has to land on the same bits, whatever the thread timing was
+    TrafficSimulation repeat(tiles, extent, count, cityConfig.seed);
+    for (int tick = 0; tick < warmup + ticks; tick++)
+        repeat.step(fixedDelta, workers);
+    bool identical = memcmp(traffic.x(), repeat.x(), count * sizeof(float)) == 0 &&
+                     memcmp(traffic.y(), repeat.y(), count * sizeof(float)) == 0 &&
+                     memcmp(traffic.z(), repeat.z(), count * sizeof(float)) == 0;
+    
+    // Hash queries against testing every vehicle, on a sample of the final positions
+    traffic.rebuildHash(workers);
+    size_t samples = std::min<size_t>(count, 1000);
+    std::vector<std::vector<uint32_t>> hashed(samples), brute(samples);
+    start = std::chrono::steady_clock::now();
+    for (size_t k = 0; k < samples; k++)
+        traffic.neighbours(k * count / samples, hashed[k]);
+    double hashQueryMs = since(start) / samples;
+    start = std::chrono::steady_clock::now();
+    for (size_t k = 0; k < samples; k++) {
+        size_t i = k * count / samples;
+        glm::vec3 p(traffic.x()[i], traffic.y()[i], traffic.z()[i]);
+        for (size_t j = 0; j < count; j++) {
+            glm::vec3 d = glm::vec3(traffic.x()[j], traffic.y()[j], traffic.z()[j]) - p;
+            if (j != i && glm::dot(d, d) <= TRAFFIC_REACH * TRAFFIC_REACH)
+                brute[k].push_back((uint32_t)j);
+        }
+    }
+    double bruteQueryMs = since(start) / samples;
+    bool matches = true;
+    for (size_t k = 0; k < samples; k++) {
+        std::sort(hashed[k].begin(), hashed[k].end());
+        matches = matches && hashed[k] == brute[k];
+    }
+    
+    const TrafficStats& stats = traffic.getStats();
+    std::cout << std::fixed << std::setprecision(3)
+              << count << " vehicles on " << stats.lanes << " lanes over " << 2 * radius + 1 << "x" << 2 * radius + 1
+              << " tiles (" << traffic.obstacleCount() << " towers), " << workers.size() + 1 << " threads, set up in "
+              << setupMs << " ms\n"
+              << "ms per tick (" << ticks << " ticks at 60 Hz):\n"
+              << "  hash rebuild  p50 " << percentile(hashMs, 50.0) << "  p95 " << percentile(hashMs, 95.0) << "\n"
+              << "  update        p50 " << percentile(updateMs, 50.0) << "  p95 " << percentile(updateMs, 95.0) << "\n"
+              << "  tick          p50 " << percentile(tickMs, 50.0) << "  p95 " << percentile(tickMs, 95.0)
+              << "  (" << percentile(tickMs, 50.0) * 1e6 / count << " ns per vehicle)\n"
+              << std::setprecision(2) << "per query: " << probed / queries << " buckets, " << candidates / queries
+              << " candidates, " << neighbours / queries << " neighbours (brute force tests " << count - 1 << ")\n"
+              << std::setprecision(4) << "query ms: hash " << hashQueryMs << ", brute force " << bruteQueryMs << "\n"
+              << std::setprecision(2) << "spacing: closest same-lane leader " << minGap << ", closest pass " << minSeparation
+              << ", " << closePasses / ticks << " pairs under " << TRAFFIC_CLOSE_PASS << " per tick, "
+              << avoiding / ticks << " vehicles pushed out of towers per tick\n"
+              << "vehicles left inside a tower's clearance over all ticks: " << inside << "\n"
+              << "hash matches brute force for " << samples << " vehicles: " << (matches ? "yes" : "NO") << "\n"
+              << "repeat run identical: " << (identical ? "yes" : "NO") << std::endl;
+    return matches && identical && inside == 0 ? 0 : 1;
+}
+
+// --software PATH: renders the scripted fly-through without a GPU and writes the last frame
+// (.png, anything else as .ppm). The city culls and sorts its queue as in the window and the
+// runs go to SoftwareRasterizer instead of GL, so it matches the window with --no-shadows and
+// no clustered lights; the culling, LOD, occlusion and traffic options apply as they do there.
+// The checksum is the same at any thread count.
+int runSoftwareRender() {
+    // The GPU-only features have no software counterpart
+    useShadows = false;
+    useClusteredLighting = false;
+    useStaticBatches = false;
+    useGpuAnimation = false;
+    useRenderQueue = true;
+    scriptedCamera(0);
+    FuturisticCity city(false);
+    WorkerPool& workers = city.getWorkers();
+    SoftwareRasterizer rasterizer(WIDTH, HEIGHT, workers);
+    
+    const float fixedDelta = 1.0f / 60.0f;
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)WIDTH / (float)HEIGHT, 0.1f, farPlane);
+    const glm::vec3 clearColor(0.05f, 0.05f, 0.15f);
+    
+    std::vector<double> frameMs, transformMs, rasterMs;
+    long long triangles = 0, fragments = 0, shaded = 0;
+    for (int frame = 0; frame < benchmarkConfig.softwareFrames; frame++) {
+        scriptedCamera(frame);
+        city.streamTiles(true); // outside the timed region, as in --benchmark
+        auto start = std::chrono::steady_clock::now();
+        
+        city.update(fixedDelta);
+        glm::mat4 view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
+        city.renderSoftware(rasterizer, view, projection, HEIGHT, clearColor);
+        
+        const SoftwareStats& stats = rasterizer.getStats();
+        frameMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        transformMs.push_back(stats.transformMs);
+        rasterMs.push_back(stats.rasterMs);
+        triangles += stats.triangles;
+        fragments += stats.fragments;
+        shaded += stats.shaded;
+    }
+    
+    const SoftwareStats& last = rasterizer.getStats();
+    const std::string& path = benchmarkConfig.softwarePath;
+    bool png = path.size() >= 4 && path.compare(path.size() - 4, 4, ".png") == 0;
+    bool written = png ? writePNG(path, WIDTH, HEIGHT, rasterizer.image()) : writePPM(path, WIDTH, HEIGHT, rasterizer.image());
+    if (!written) {
+        std::cout << "Failed to write " << path << std::endl;
+        return -1;
+    }
+    
+    int frames = benchmarkConfig.softwareFrames;
+    std::cout << std::fixed << std::setprecision(2)
+              << "Software: " << benchmarkConfig.softwareFrames << " frames at " << WIDTH << "x" << HEIGHT << " on "
+              << workers.size() + 1 << " threads, " << RASTER_TILE << " px tiles\n"
+              << "ms per frame:\n"
+              << "  transform + bin  p50 " << percentile(transformMs, 50.0) << "  p95 " << percentile(transformMs, 95.0) << "\n"
+              << "  raster + shade   p50 " << percentile(rasterMs, 50.0) << "  p95 " << percentile(rasterMs, 95.0) << "\n"
+              << "  frame            p50 " << percentile(frameMs, 50.0) << "  p95 " << percentile(frameMs, 95.0) << "\n"
+              << "per frame: " << triangles / frames << " triangles, " << fragments / frames << " depth passes, "
+              << shaded / frames << " pixels shaded\n"
+              << "last frame: " << last.culled << " triangles culled, " << last.clipped << " clipped, " << last.binned
+              << " bin entries, " << last.steals << " steals, tiles per thread";
+    for (int count : last.tilesPerThread)
+        std::cout << " " << count;
+    std::cout << "\nWrote " << path << ", checksum " << std::hex << std::setw(16) << std::setfill('0')
+              << checksum64(rasterizer.image().data(), rasterizer.image().size()) << std::dec << std::endl;
+    return 0;
+}
+
+// --save-scene: generates the square of tiles around the origin plus traffic and writes them
+int runSaveScene() {
+    WorkerPool workers(cityConfig.threads);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<CityTile>> region = generateRegion(cityConfig, sceneConfig.saveRadius, workers);
+    VehicleArrays vehicles;
+    BillboardArrays billboards;
+    generateTraffic(cityConfig, vehicles, billboards);
+    
+    std::vector<const CityTile*> tiles;
+    size_t buildings = 0;
+    for (const auto& tile : region) {
+        tiles.push_back(tile.get());
+        buildings += tile->buildings.size();
+    }
+    if (!saveScene(sceneConfig.savePath, cityConfig, tiles, vehicles, billboards)) {
+        std::cout << "Failed to write " << sceneConfig.savePath << std::endl;
+        return -1;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Wrote " << sceneConfig.savePath << ": " << tiles.size() << " tiles, " << buildings << " buildings in "
+              << std::fixed << std::setprecision(1) << ms << " ms" << std::endl;
+    return 0;
+}
+
+// --scene-benchmark: time to have every building of a city in memory, generated from scratch
+// versus loaded from a mapped scene file, at three sizes over the same 31x31 tiles
+int runSceneBenchmark() {
+    const int radius = 15;
+    const size_t targets[] = { 10000, 100000, 1000000 };
+    WorkerPool workers(cityConfig.threads);
+    auto since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    
+    std::cout << std::fixed << std::setprecision(2)
+              << "buildings    file MB   generate ms   save ms   open ms   first tile ms   load ms   speedup" << std::endl;
+    bool identical = true;
+    for (size_t target : targets) {
+        CityConfig config = cityConfig;
+        int side = 2 * radius + 1;
+        config.buildingDensity = (float)target / (side * side * config.tileSize * config.tileSize);
+        
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::unique_ptr<CityTile>> generated = generateRegion(config, radius, workers);
+        double generateMs = since(start);
+        
+        std::vector<const CityTile*> tiles;
+        size_t buildings = 0;
+        for (const auto& tile : generated) {
+            tiles.push_back(tile.get());
+            buildings += tile->buildings.size();
+        }
+        start = std::chrono::steady_clock::now();
+        if (!saveScene(sceneConfig.benchmarkPath, config, tiles, VehicleArrays(), BillboardArrays())) {
+            std::cout << "Failed to write " << sceneConfig.benchmarkPath << std::endl;
+            return -1;
+        }
+        double saveMs = since(start);
+        
+        // Open is all a lazy start pays up front; the first tile is what the camera needs next
+        SceneFile scene;
+        std::string error;
+        start = std::chrono::steady_clock::now();
+        if (!scene.open(sceneConfig.benchmarkPath, error)) {
+            std::cout << "Failed to open " << sceneConfig.benchmarkPath << ": " << error << std::endl;
+            return -1;
+        }
+        double openMs = since(start);
+        start = std::chrono::steady_clock::now();
+        std::unique_ptr<CityTile> first(scene.loadTile(0, 0));
+        double firstMs = since(start);
+        
+        std::vector<std::unique_ptr<CityTile>> loaded(generated.size());
+        start = std::chrono::steady_clock::now();
+        workers.parallelFor(loaded.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                loaded[i].reset(scene.loadTile(generated[i]->x, generated[i]->z));
+        });
+        double loadMs = since(start);
+        
+        for (size_t i = 0; i < loaded.size(); i++) {
+            const CityTile* a = generated[i].get();
+            const CityTile* b = loaded[i].get();
+            if (!b || a->buildings.size() != b->buildings.size() ||
+                memcmp(a->instances.data(), b->instances.data(), a->instances.size() * sizeof(InstanceData)) != 0)
+                identical = false;
+        }
+        
+        std::cout << std::setw(9) << buildings << std::setw(12) << scene.fileSize() / (1024.0 * 1024.0)
+                  << std::setw(14) << generateMs << std::setw(10) << saveMs << std::setw(10) << openMs
+                  << std::setw(16) << firstMs << std::setw(10) << loadMs << std::setw(9) << generateMs / loadMs << "x" << std::endl;
+        scene.close();
+        std::remove(sceneConfig.benchmarkPath.c_str());
+    }
+    std::cout << (identical ? "Loaded tiles match generated ones" : "Loaded tiles differ from generated ones") << std::endl;
+    return identical ? 0 : 1;
+}
+
+// Builds every program variant with the cache emptied (compile + store) and then again from
+// the stored binaries. Drivers with their own disk cache (Mesa's) make the cold numbers look
+// warmer than a first run really is; MESA_SHADER_CACHE_DISABLE=true takes that out.
+int runShaderBenchmark() {
+#ifndef NIGHTCITY_EGL
+    std::cout << "Shader benchmark needs EGL; rebuild on Linux without NIGHTCITY_NO_EGL" << std::endl;
+    return -1;
+#else
+    if (!initHeadlessGL())
+        return -1;
+    if (shaderCacheDirectory.empty()) {
+        std::cout << "Shader benchmark needs a cache directory (drop --no-shader-cache)" << std::endl;
+        return -1;
+    }
+    
+    std::cout << "Shader cache: " << SHADER_VARIANT_COUNT << " variants on " << (const char*)glGetString(GL_RENDERER)
+              << ", cache in " << shaderCacheDirectory << "/" << std::endl;
+    {
+        ShaderCache probe(shaderCacheDirectory);
+        if (!probe.storesBinaries()) {
+            std::cout << "Driver exposes no program binary formats (or the directory is not writable); nothing to cache" << std::endl;
+            return -1;
+        }
+    }
+    
+    std::vector<GLuint> programs;
+    const int runs = 5;
+    std::vector<double> cold, warm;
+    ShaderCacheStats coldStats = ShaderCacheStats(), warmStats = ShaderCacheStats();
+    for (int run = 0; run < runs; run++) {
+        {
+            ShaderCache cache(shaderCacheDirectory);
+            for (int i = 0; i < SHADER_VARIANT_COUNT; i++)
+                cache.forget(SHADER_VARIANTS[i]);
+        }
+        coldStats = buildShaderVariants(shaderCacheDirectory, programs);
+        cold.push_back(coldStats.ms);
+        for (GLuint program : programs)
+            glDeleteProgram(program);
+        
+        warmStats = buildShaderVariants(shaderCacheDirectory, programs);
+        warm.push_back(warmStats.ms);
+        for (GLuint program : programs)
+            glDeleteProgram(program);
+    }
+    
+    std::cout << "  cold: " << percentile(cold, 50.0) << " ms median (" << coldStats.compiled << " compiled, "
+              << coldStats.saved << " stored)" << std::endl;
+    std::cout << "  warm: " << percentile(warm, 50.0) << " ms median (" << warmStats.loaded << " cached, "
+              << warmStats.compiled << " compiled, " << warmStats.rejected << " rejected)" << std::endl;
+    return 0;
+#endif
+}
+
+int runBenchmark() {
+#ifndef NIGHTCITY_EGL
+    std::cout << "Benchmark mode needs EGL; rebuild on Linux without NIGHTCITY_NO_EGL" << std::endl;
+    return -1;
+#else
+    if (!initHeadlessGL())
+        return -1;
+    
+    std::string renderer = (const char*)glGetString(GL_RENDERER);
+    std::cout << "Benchmark: " << benchmarkConfig.frames << " frames on " << renderer << std::endl;
+    
+    // Offscreen framebuffer standing in for the window
+    GLuint framebuffer, renderbuffers[2];
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, WIDTH, HEIGHT);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, WIDTH, HEIGHT);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cout << "Offscreen framebuffer is incomplete" << std::endl;
+        return -1;
+    }
+    
+    glViewport(0, 0, WIDTH, HEIGHT);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    
+    scriptedCamera(0);
+    city = new FuturisticCity();
+#ifdef NIGHTCITY_PROFILE
+    profiler.setGpuTiming(false); // the benchmark's own query spans the whole frame
+#endif
+    
+    // Timer results are read a few frames late so the queries never stall the pipeline
+    const int QUERY_LATENCY = 4;
+    GLuint queries[QUERY_LATENCY];
+    glGenQueries(QUERY_LATENCY, queries);
+    
+    int totalFrames = benchmarkConfig.warmup + benchmarkConfig.frames;
+    std::vector<BenchmarkFrame> frames(totalFrames);
+    const float fixedDelta = 1.0f / 60.0f;
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)WIDTH / (float)HEIGHT, 0.1f, farPlane);
+    
+    for (int frame = 0; frame < totalFrames; frame++) {
+#ifdef NIGHTCITY_PROFILE
+        if (frame == benchmarkConfig.warmup && !profileConfig.tracePath.empty())
+            profiler.startTrace(profileConfig.tracePath, profileConfig.traceFrames);
+#endif
+        PROFILE_BEGIN_FRAME();
+        scriptedCamera(frame);
+        city->streamTiles(true); // outside the timed region so every run sees the same tiles
+        
+        if (frame >= QUERY_LATENCY) {
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v(queries[frame % QUERY_LATENCY], GL_QUERY_RESULT, &elapsed);
+            frames[frame - QUERY_LATENCY].gpuMs = elapsed / 1.0e6;
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        city->update(fixedDelta);
+        
+        glBeginQuery(GL_TIME_ELAPSED, queries[frame % QUERY_LATENCY]);
+        glClearColor(0.05f, 0.05f, 0.15f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glm::mat4 view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
+        city->render(view, projection, WIDTH, HEIGHT);
+        glEndQuery(GL_TIME_ELAPSED);
+        auto submitted = std::chrono::steady_clock::now();
+        
+        glFinish();
+        auto finished = std::chrono::steady_clock::now();
+        PROFILE_END_FRAME();
+        
+        BenchmarkFrame& result = frames[frame];
+        result.cpuMs = std::chrono::duration<double, std::milli>(submitted - start).count();
+        result.frameMs = std::chrono::duration<double, std::milli>(finished - start).count();
+        result.drawCalls = city->getDrawStats().drawCalls;
+        result.triangles = city->getDrawStats().triangles;
+        result.visible = city->getCullStats().totalVisible();
+        result.culled = city->getCullStats().totalCulled();
+        const OcclusionStats& occlusionStats = city->getOcclusionStats();
+        result.occludedPercent = occlusionStats.tested > 0 ? 100.0 * occlusionStats.occluded / occlusionStats.tested : 0.0;
+        result.occlusionMs = occlusionStats.rasterMs + occlusionStats.testMs;
+        const ShadowStats& shadowStats = city->getShadowStats();
+        result.shadowTriangles = shadowStats.staticTriangles + shadowStats.dynamicTriangles;
+        result.shadowMs = shadowStats.ms;
+    }
+    for (int frame = std::max(0, totalFrames - QUERY_LATENCY); frame < totalFrames; frame++) {
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(queries[frame % QUERY_LATENCY], GL_QUERY_RESULT, &elapsed);
+        frames[frame].gpuMs = elapsed / 1.0e6;
+    }
+#ifdef NIGHTCITY_PROFILE
+    profiler.report(std::cout);
+#endif
+    
+    // Per-frame CSV
+    std::ofstream csv(benchmarkConfig.csvPath);
+    csv << "frame,cpu_ms,gpu_ms,frame_ms,draw_calls,triangles,visible,culled\n";
+    std::vector<double> cpu, gpu, wall, draws, triangles, visible, occluded, occlusionMs, shadowTriangles, shadowMs;
+    for (int frame = benchmarkConfig.warmup; frame < totalFrames; frame++) {
+        const BenchmarkFrame& f = frames[frame];
+        csv << frame << "," << f.cpuMs << "," << f.gpuMs << "," << f.frameMs << "," << f.drawCalls << ","
+            << f.triangles << "," << f.visible << "," << f.culled << "\n";
+        cpu.push_back(f.cpuMs);
+        gpu.push_back(f.gpuMs);
+        wall.push_back(f.frameMs);
+        draws.push_back(f.drawCalls);
+        triangles.push_back((double)f.triangles);
+        visible.push_back(f.visible);
+        occluded.push_back(f.occludedPercent);
+        occlusionMs.push_back(f.occlusionMs);
+        shadowTriangles.push_back((double)f.shadowTriangles);
+        shadowMs.push_back(f.shadowMs);
+    }
+    
+    // Summary JSON
+    std::ofstream json(benchmarkConfig.jsonPath);
+    json << std::fixed << std::setprecision(4);
+    json << "{\n";
+    json << "  \"renderer\": \"" << jsonEscape(renderer) << "\",\n";
+    json << "  \"frames\": " << benchmarkConfig.frames << ",\n";
+    json << "  \"seed\": " << cityConfig.seed << ",\n";
+    json << "  \"density\": " << cityConfig.buildingDensity << ",\n";
+    json << "  \"mode\": \"" << (useInstancing ? "instanced" : "per-object") << (useCulling ? "" : "-nocull")
+         << (useStaticBatches ? "+batches" : "") << (useLod ? "" : "-nolod") << (useOcclusion ? "+occlusion" : "")
+         << (useRenderQueue ? "" : "-noqueue") << (useShadows ? (rebuildShadows ? "+shadowrebuild" : "") : "-noshadows")
+         << "\",\n";
+    json << "  \"far\": " << farPlane << ",\n";
+    const StreamStats& streamStats = city->getStreamStats();
+    json << "  \"stream\": { \"persistent\": " << (streamStats.persistent ? "true" : "false")
+         << ", \"region_bytes\": " << streamStats.regionBytes << ", \"waits\": " << streamStats.waits
+         << ", \"wait_ms\": " << streamStats.waitMs << ", \"grows\": " << streamStats.grows << " },\n";
+    if (useClusteredLighting) {
+        const LightStats& lightStats = city->getLightStats();
+        json << "  \"lights\": { \"in_view\": " << lightStats.lights << ", \"lit_clusters\": " << lightStats.usedClusters
+             << ", \"max_per_cluster\": " << lightStats.maxPerCluster << ", \"list_entries\": " << lightStats.indices
+             << ", \"build_ms\": " << lightStats.buildMs << " },\n";
+    }
+    if (useRenderQueue) {
+        const QueueStats& queueStats = city->getQueueStats();
+        json << "  \"queue\": { \"packets\": " << queueStats.packets << ", \"draws\": " << queueStats.draws
+             << ", \"state_changes\": " << queueStats.stateChanges << ", \"unsorted_changes\": "
+             << queueStats.unsortedChanges << ", \"skipped_uploads\": " << queueStats.skippedUploads
+             << ", \"sort_ms\": " << queueStats.sortMs << ", \"submit_ms\": " << queueStats.submitMs << " },\n";
+    }
+    const ShadowStats& shadowStats = city->getShadowStats();
+    if (useShadows) {
+        json << "  \"shadows\": { \"cached_tiles\": " << shadowStats.tiles << ", \"tile_renders\": " << shadowStats.renders
+             << ", \"rebuild_triangles\": " << shadowStats.rebuildTriangles << " },\n";
+    }
+    if (useStaticBatches) {
+        BatchStats batchStats = city->getBatchStats();
+        json << "  \"building_bytes\": { \"batched\": " << batchStats.batchBytes
+             << ", \"instanced\": " << batchStats.instanceBytes << " },\n";
+    }
+    json << "  \"metrics\": {\n";
+    writeMetric(json, "cpu_ms", cpu, false);
+    writeMetric(json, "gpu_ms", gpu, false);
+    writeMetric(json, "frame_ms", wall, false);
+    writeMetric(json, "draw_calls", draws, false);
+    writeMetric(json, "triangles", triangles, false);
+    if (useOcclusion) {
+        writeMetric(json, "occluded_percent", occluded, false);
+        writeMetric(json, "occlusion_ms", occlusionMs, false);
+    }
+    if (useShadows) {
+        writeMetric(json, "shadow_triangles", shadowTriangles, false);
+        writeMetric(json, "shadow_ms", shadowMs, false);
+    }
+    writeMetric(json, "visible", visible, true);
+    json << "  }\n";
+    json << "}\n";
+    
+    std::cout << std::fixed << std::setprecision(3)
+              << "cpu ms  p50 " << percentile(cpu, 50.0) << "  p95 " << percentile(cpu, 95.0) << "  p99 " << percentile(cpu, 99.0) << "\n"
+              << "gpu ms  p50 " << percentile(gpu, 50.0) << "  p95 " << percentile(gpu, 95.0) << "  p99 " << percentile(gpu, 99.0) << "\n"
+              << "frame   p50 " << percentile(wall, 50.0) << "  p95 " << percentile(wall, 95.0) << "  p99 " << percentile(wall, 99.0) << "\n"
+              << std::setprecision(0) << "draws   p50 " << percentile(draws, 50.0) << "  max " << *std::max_element(draws.begin(), draws.end())
+              << "  triangles p50 " << percentile(triangles, 50.0) << "  max " << *std::max_element(triangles.begin(), triangles.end()) << "\n";
+    if (useOcclusion)
+        std::cout << std::setprecision(3) << "occlusion p50 " << percentile(occlusionMs, 50.0) << " ms  p95 "
+                  << percentile(occlusionMs, 95.0) << " ms, hidden p50 " << percentile(occluded, 50.0) << "%\n";
+    if (useShadows)
+        std::cout << std::setprecision(3) << "shadows p50 " << percentile(shadowMs, 50.0) << " ms, "
+                  << std::setprecision(0) << percentile(shadowTriangles, 50.0) << " triangles (redrawing every cached map: "
+                  << shadowStats.rebuildTriangles << ")\n";
+    std::cout << "Wrote " << benchmarkConfig.csvPath << " and " << benchmarkConfig.jsonPath << std::endl;
+    
+    glDeleteQueries(QUERY_LATENCY, queries);
+    delete city;
+    glDeleteRenderbuffers(2, renderbuffers);
+    glDeleteFramebuffers(1, &framebuffer);
+    return 0;
+#endif
+}
+
+int main(int argc, char** argv) {
+    if (!parseArguments(argc, argv))
+        return -1;
+    if (benchmarkConfig.simulationObjects > 0)
+        return runSimulationBenchmark();
+    if (benchmarkConfig.trafficVehicles > 0)
+        return runTrafficBenchmark();
+    if (sceneConfig.benchmark)
+        return runSceneBenchmark();
+    if (benchmarkConfig.shaders)
+        return runShaderBenchmark();
+    if (!sceneConfig.savePath.empty())
+        return runSaveScene();
+    if (!benchmarkConfig.softwarePath.empty())
+        return runSoftwareRender();
+    if (benchmarkConfig.enabled)
+        return runBenchmark();
+    
+    // Initialize GLFW
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    
+    // Create window
+    GLFWwindow* window = glfwCreateWindow(WIDTH, HEIGHT, "Futuristic City at Night", NULL, NULL);
+    if (window == NULL) {
+        std::cout << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+    glfwMakeContextCurrent(window);
+    
+    // Set callbacks
+    glfwSetKeyCallback(window, key_callback);
+    glfwSetCursorPosCallback(window, mouse_callback);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    
+    // Initialize GLEW
+    if (glewInit() != GLEW_OK) {
+        std::cout << "Failed to initialize GLEW" << std::endl;
+        return -1;
+    }
+    
+    // Configure OpenGL; the viewport is set each frame by the render target
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    
+    // Create city
+    std::unique_ptr<DynamicResolution> resolution(new DynamicResolution());
+    city = new FuturisticCity();
+    if (cityConfig.tickRate > 0 && !useTraffic)
+        city->startSimulation(cityConfig.tickRate);
+#ifdef NIGHTCITY_PROFILE
+    if (!profileConfig.tracePath.empty())
+        profiler.startTrace(profileConfig.tracePath, profileConfig.traceFrames);
+#endif
+    
+    // Render loop
+    float lastStatsTime = 0.0f;
+    while (!glfwWindowShouldClose(window)) {
+        PROFILE_BEGIN_FRAME();
+        
+        // Calculate deltaTime
         float currentFrame = glfwGetTime();
         deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
         
         // Process input
-        processInput(window);
-        glfwPollEvents();
+        {
+            PROFILE_SCOPE("input");
+            processInput(window);
+            glfwPollEvents();
+        }
         
         // Update
+        city->streamTiles(false);
         city->update(deltaTime);
         
-        // Render
-        glClearColor(0.05f, 0.05f, 0.15f, 1.0f); // Dark night sky
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        
-        // Create matrices
-        glm::mat4 view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
-        glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)WIDTH / (float)HEIGHT, 0.1f, 200.0f);
+        // Render; a minimized window has no framebuffer to draw into
+        if (framebufferWidth > 0 && framebufferHeight > 0) {
+            PROFILE_SCOPE("render");
+            resolution->begin(framebufferWidth, framebufferHeight, useDynamicResolution);
+            glClearColor(0.05f, 0.05f, 0.15f, 1.0f); // Dark night sky
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            
+            // Create matrices
+            glm::mat4 view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
+            glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)framebufferWidth / (float)framebufferHeight,
+                                                    0.1f, farPlane);
+            
+            // Render city
+            city->render(view, projection, resolution->width(), resolution->height());
+            resolution->end();
+        }
         
-        // Render city
-        city->render(view, projection);
+        // Report culling once per second
+        if (currentFrame - lastStatsTime >= 1.0f) {
+            const CullStats& stats = city->getCullStats();
+            std::cout << "Visible: " << stats.totalVisible() << "  Culled: " << stats.totalCulled()
+                      << "  Tiles: " << city->residentTiles()
+                      << " (buildings " << stats.visible[CATEGORY_BUILDINGS] << "/" << stats.culled[CATEGORY_BUILDINGS]
+                      << ", vehicles " << stats.visible[CATEGORY_VEHICLES] << "/" << stats.culled[CATEGORY_VEHICLES]
+                      << ", billboards " << stats.visible[CATEGORY_BILLBOARDS] << "/" << stats.culled[CATEGORY_BILLBOARDS]
+                      << ")" << std::endl;
+            std::cout << "Resolution: " << resolution->width() << "x" << resolution->height() << " ("
+                      << (int)std::round(resolution->getScale() * 100.0f) << "% of " << framebufferWidth << "x"
+                      << framebufferHeight << "), GPU " << resolution->gpuMs() << " ms (smoothed "
+                      << resolution->smoothedGpuMs() << ") for a " << frameBudgetMs << " ms budget" << std::endl;
+            const StreamStats& streamStats = city->getStreamStats();
+            std::cout << "Stream: " << (streamStats.persistent ? "persistent" : "orphaned") << ", "
+                      << streamStats.frameBytes / 1024 << " KB/frame of " << streamStats.regionBytes / 1024
+                      << " KB region, " << streamStats.waits << " waits (" << streamStats.waitMs << " ms) in "
+                      << streamStats.frames << " frames" << std::endl;
+            if (const SimulationThread* simulation = city->getSimulation()) {
+                SimulationStats simulationStats = simulation->getStats();
+                std::cout << "Simulation: " << cityConfig.tickRate << " Hz, " << simulationStats.ticks << " ticks ("
+                          << simulationStats.tickMs << " ms each), " << simulationStats.dropped << " dropped" << std::endl;
+            }
+            if (const TrafficSimulation* traffic = city->getTraffic()) {
+                const TrafficStats& trafficStats = traffic->getStats();
+                std::cout << "Traffic: " << trafficStats.vehicles << " vehicles on " << trafficStats.lanes << " lanes, "
+                          << (double)trafficStats.candidates / std::max<size_t>(trafficStats.vehicles, 1)
+                          << " candidates per query, closest " << trafficStats.minSeparation << " m, "
+                          << trafficStats.avoiding << " avoiding towers; hash " << trafficStats.hashMs << " ms, update "
+                          << trafficStats.updateMs << " ms" << std::endl;
+            }
+            if (useLod) {
+                const LodStats& lodStats = city->getLodStats();
+                const DrawStats& drawStats = city->getDrawStats();
+                std::cout << "LOD: " << lodStats.full << " full, " << lodStats.simplified << " simplified, "
+                          << lodStats.proxies << " boxes for " << lodStats.merged << " buildings in " << lodStats.blocks
+                          << " blocks; " << drawStats.triangles << " triangles in " << drawStats.drawCalls << " draws"
+                          << std::endl;
+            }
+            if (useClusteredLighting) {
+                const LightStats& lightStats = city->getLightStats();
+                std::cout << "Lights: " << lightStats.lights << " in view, " << lightStats.usedClusters << "/"
+                          << LightClusters::CLUSTER_X * LightClusters::CLUSTER_Y * LightClusters::CLUSTER_Z
+                          << " clusters lit, up to " << lightStats.maxPerCluster << " per cluster, "
+                          << lightStats.indices << " list entries, built in " << lightStats.buildMs << " ms" << std::endl;
+            }
+            if (useOcclusion) {
+                const OcclusionStats& occlusionStats = city->getOcclusionStats();
+                std::cout << "Occlusion: " << occlusionStats.occluded << "/" << occlusionStats.tested << " hidden ("
+                          << (occlusionStats.tested > 0 ? 100.0 * occlusionStats.occluded / occlusionStats.tested : 0.0)
+                          << "%) by " << occlusionStats.occluders << " occluders (" << occlusionStats.triangles
+                          << " triangles); raster " << occlusionStats.rasterMs << " ms, tests " << occlusionStats.testMs
+                          << " ms" << std::endl;
+            }
+            if (useRenderQueue) {
+                const QueueStats& queueStats = city->getQueueStats();
+                std::cout << "Queue: " << queueStats.packets << " packets in " << queueStats.draws << " draws, "
+                          << queueStats.stateChanges << " state changes (" << queueStats.unsortedChanges
+                          << " unsorted), " << queueStats.skippedUploads << " uploads skipped; recorded in";
+                for (size_t t = 0; t < queueStats.recordMs.size(); t++)
+                    std::cout << (t ? "," : "") << " " << queueStats.recordMs[t] << " ms (" << queueStats.recorded[t] << ")";
+                std::cout << ", sort " << queueStats.sortMs << " ms, submit " << queueStats.submitMs << " ms" << std::endl;
+            }
+            if (useShadows) {
+                const ShadowStats& shadowStats = city->getShadowStats();
+                std::cout << "Shadows: " << shadowStats.tiles << " tile maps cached, " << shadowStats.rendered
+                          << " redrawn (" << shadowStats.renders << " since start); " << shadowStats.staticTriangles
+                          << " + " << shadowStats.dynamicTriangles << " moving triangles vs " << shadowStats.rebuildTriangles
+                          << " to redraw every map; " << shadowStats.ms << " ms" << std::endl;
+            }
+            if (useStaticBatches) {
+                BatchStats batchStats = city->getBatchStats();
+                std::cout << "Batches: " << batchStats.drawn << "/" << batchStats.batches << " drawn, "
+                          << batchStats.batchBytes / 1024 << " KB (instances: " << batchStats.instanceBytes / 1024
+                          << " KB in 1 draw), " << batchStats.patchedBytes << " bytes patched" << std::endl;
+            }
+#ifdef NIGHTCITY_PROFILE
+            glfwSetWindowTitle(window, ("Futuristic City at Night - " + profiler.headline()).c_str());
+            profiler.report(std::cout);
+#endif
+            lastStatsTime = currentFrame;
+        }
         
-        glfwSwapBuffers(window);
+        {
+            PROFILE_SCOPE("swap");
+            glfwSwapBuffers(window);
+        }
+        PROFILE_END_FRAME();
     }
     
     // Clean up
     delete city;
+    resolution.reset();
     glfwTerminate();
     return 0;
 }
@@ -474,6 +8455,71 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
         glfwSetWindowShouldClose(window, GL_TRUE);
     
+    if (key == GLFW_KEY_I && action == GLFW_PRESS) {
+        useInstancing = !useInstancing;
+        std::cout << "Rendering mode: " << (useInstancing ? "instanced" : "per-object") << std::endl;
+    }
+    
+    if (key == GLFW_KEY_G && action == GLFW_PRESS) {
+        if (useTraffic) {
+            std::cout << "Vehicle and billboard animation: CPU (lane traffic has no GPU path)" << std::endl;
+        } else {
+            useGpuAnimation = !useGpuAnimation;
+            std::cout << "Vehicle and billboard animation: " << (useGpuAnimation ? "GPU" : "CPU") << std::endl;
+        }
+    }
+    
+    if (key == GLFW_KEY_B && action == GLFW_PRESS) {
+        useStaticBatches = !useStaticBatches;
+        std::cout << "Buildings: " << (useStaticBatches ? "static batches" : "culled per building") << std::endl;
+    }
+    
+    if (key == GLFW_KEY_E && action == GLFW_PRESS)
+        city->editRandomBuilding();
+    
+#ifdef NIGHTCITY_PROFILE
+    if (key == GLFW_KEY_P && action == GLFW_PRESS && !profiler.isTracing()) {
+        std::string path = profileConfig.tracePath.empty() ? "trace.json" : profileConfig.tracePath;
+        profiler.startTrace(path, profileConfig.traceFrames);
+        std::cout << "Tracing the next " << profileConfig.traceFrames << " frames to " << path << std::endl;
+    }
+#endif
+    
+    if (key == GLFW_KEY_C && action == GLFW_PRESS) {
+        useCulling = !useCulling;
+        std::cout << "Frustum culling: " << (useCulling ? "on" : "off") << std::endl;
+    }
+    
+    if (key == GLFW_KEY_L && action == GLFW_PRESS) {
+        useLod = !useLod;
+        std::cout << "Building level of detail: " << (useLod ? "on" : "off") << std::endl;
+    }
+    
+    if (key == GLFW_KEY_K && action == GLFW_PRESS) {
+        useClusteredLighting = !useClusteredLighting;
+        std::cout << "Clustered lighting: " << (useClusteredLighting ? "on" : "off") << std::endl;
+    }
+    
+    if (key == GLFW_KEY_R && action == GLFW_PRESS) {
+        useDynamicResolution = !useDynamicResolution;
+        std::cout << "Dynamic resolution: " << (useDynamicResolution ? "on" : "off") << std::endl;
+    }
+    
+    if (key == GLFW_KEY_O && action == GLFW_PRESS) {
+        useOcclusion = !useOcclusion;
+        std::cout << "Occlusion culling: " << (useOcclusion ? "on" : "off") << std::endl;
+    }
+    
+    if (key == GLFW_KEY_H && action == GLFW_PRESS) {
+        useShadows = !useShadows;
+        std::cout << "Shadows: " << (useShadows ? "on" : "off") << std::endl;
+    }
+    
+    if (key == GLFW_KEY_Q && action == GLFW_PRESS) {
+        useRenderQueue = !useRenderQueue;
+        std::cout << "Render queue: " << (useRenderQueue ? "on" : "off") << std::endl;
+    }
+    
     if (key >= 0 && key < 1024) {
         if (action == GLFW_PRESS)
             keys[key] = true;
@@ -505,6 +8551,11 @@ void processInput(GLFWwindow* window) {
         cameraSpeed = 10.0f;
 }
 
+void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
+    framebufferWidth = width;
+    framebufferHeight = height;
+}
+
 void mouse_callback(GLFWwindow* window, double xpos, double ypos) {
     if (firstMouse) {
         lastX = xpos;
@@ -0,0 +1,94 @@
+#ifndef SCENE_GRAPH_H
+#define SCENE_GRAPH_H
+
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Transform hierarchy with cached world matrices, shared by nightcity.cpp and chair.cpp.
+// Nodes live in flat arrays in the order they were added, and a parent has to exist before
+// its children, so every parent precedes its children and an update is one forward pass.
+// Only nodes whose local transform changed, or one of whose ancestors' did, are recomputed.
+class SceneGraph {
+public:
+    typedef uint32_t Node;
+    static const Node NO_PARENT = 0xffffffff;
+
+private:
+    std::vector<Node> parents;
+    std::vector<glm::mat4> locals;
+    std::vector<glm::mat4> worlds;
+    std::vector<uint8_t> dirty;
+    size_t firstDirty; // lowest dirty node, size() when everything is current
+    size_t updated;    // world matrices rebuilt by the last update()
+
+public:
+    SceneGraph() : firstDirty(0), updated(0) {}
+
+    Node add(const glm::mat4& local, Node parent = NO_PARENT) {
+        Node node = (Node)parents.size();
+        if (parent >= node)
+            parent = NO_PARENT; // only existing nodes can be parents
+        parents.push_back(parent);
+        locals.push_back(local);
+        worlds.push_back(local);
+        dirty.push_back(1);
+        if (firstDirty > node)
+            firstDirty = node;
+        return node;
+    }
+
+    void setLocal(Node node, const glm::mat4& local) {
+        locals[node] = local;
+        dirty[node] = 1;
+        if (firstDirty > node)
+            firstDirty = node;
+    }
+
+    // Recomputes dirty nodes and everything below them; returns how many were rebuilt
+    size_t update() {
+        updated = 0;
+        size_t count = parents.size();
+        for (size_t i = firstDirty; i < count; i++) {
+            Node parent = parents[i];
+            if (parent != NO_PARENT && dirty[parent])
+                dirty[i] = 1;
+            if (!dirty[i])
+                continue;
+            worlds[i] = parent == NO_PARENT ? locals[i] : worlds[parent] * locals[i];
+            updated++;
+        }
+        // Flags are cleared afterwards, so children further on still see their parent's
+        for (size_t i = firstDirty; i < count; i++)
+            dirty[i] = 0;
+        firstDirty = count;
+        return updated;
+    }
+
+    void clear() {
+        parents.clear();
+        locals.clear();
+        worlds.clear();
+        dirty.clear();
+        firstDirty = 0;
+    }
+
+    void reserve(size_t count) {
+        parents.reserve(count);
+        locals.reserve(count);
+        worlds.reserve(count);
+        dirty.reserve(count);
+    }
+
+    size_t size() const { return parents.size(); }
+    Node parent(Node node) const { return parents[node]; }
+    const glm::mat4& local(Node node) const { return locals[node]; }
+
+    // Valid as of the last update()
+    const glm::mat4& world(Node node) const { return worlds[node]; }
+    const glm::mat4* worldMatrices() const { return worlds.data(); }
+    size_t lastUpdated() const { return updated; }
+};
+
+#endif